@@ -0,0 +1,215 @@
+/*
+	Asynchronous FT client API (c++): many job requests of a process in
+	flight on one thread.
+
+	tag_ft_job_begin blocks its thread in sem_wait until the FT manager
+	wakes the job, so a process with many camera pipelines needs a thread
+	per pending job. An ft_session instead submits the request and returns;
+	one reactor thread per session sleeps on the process' doorbell in
+	mid_bell (mid_bell.h), which mid rings whenever it posts a semaphore of
+	this process, and completes the requests whose semaphore was posted.
+	Without a doorbell (all slots taken) the reactor polls every
+	FT_ASYNC_NOBELL_MS instead.
+
+	Functions:
+	- ft_session::begin        --- tag_ft_job_begin_mode, done(res) runs on the reactor
+	- ft_session::begin_future --- same, as a std::future<int>
+	- ft_session::begin_co     --- same, co_await in a C++20 coroutine, which
+	                               resumes on the reactor
+	- ft_session::wait         --- any semaphore mid posts to this process,
+	                               e.g. client_wake of a tag job
+	Like ft_init_wait, start the heartbeat of a granted main or replica with
+	init_ft_hb(num). Callbacks must not block, they hold up every other
+	request of the session; they may submit new requests.
+
+	Destroying a session stops its reactor; requests still pending are
+	dropped without a callback.
+*/
+#ifndef FT_ASYNC
+#define FT_ASYNC
+
+#include <atomic>           // std::atomic
+#include <functional>       // std::function
+#include <memory>           // std::shared_ptr
+#include <future>           // std::promise, std::future
+#include <mutex>            // std::mutex
+#include <string>           // std::string
+#include <thread>           // std::thread
+#include <vector>           // std::vector
+#if defined(__cpp_impl_coroutine)
+#include <coroutine>        // std::coroutine_handle
+#endif
+#include "ft_utils_client.c" // submit_ft_request, finish_ft_request
+#include "mid_bell.h"       // mid_bell_t, mid_bell_claim, mid_bell_wait
+
+#define FT_ASYNC_POLL_MS 100    // the reactor looks at its semaphores at least this often
+#define FT_ASYNC_NOBELL_MS 1    // ... and this often without a doorbell
+
+class ft_session {
+public:
+	ft_session();
+	~ft_session();
+
+	int begin(const char *type, int num, enum ft_mode mode, std::function<void(int)> done);
+	std::future<int> begin_future(const char *type, int num, enum ft_mode mode = FT_PASSIVE);
+	void wait(sem_t *wake, std::function<void()> woken);
+	size_t pending() { return n_pending.load(); }
+
+#if defined(__cpp_impl_coroutine)
+	struct begin_awaiter {
+		ft_session *s;
+		const char *type;
+		int num;
+		enum ft_mode mode;
+		int res;
+
+		bool await_ready() { return false; }
+		bool await_suspend(std::coroutine_handle<> h) {
+			// The reactor may resume h before begin returns, don't touch this after
+			if (s->begin(type, num, mode, [this, h](int r) { res = r; h.resume(); }) < 0) {
+				res = -1;
+				return false;
+			}
+			return true;
+		}
+		int await_resume() { return res; }
+	};
+	begin_awaiter begin_co(const char *type, int num, enum ft_mode mode = FT_PASSIVE) {
+		return begin_awaiter{this, type, num, mode, 0};
+	}
+#endif
+
+private:
+	struct waiter {
+		sem_t *wake;
+		std::function<void()> woken;
+	};
+	void reactor();
+
+	pid_t pid;
+	int bell_fd;
+	mid_bell_t *bell;
+	mid_bell_slot_t *slot;          // doorbell of this process, NULL: poll
+	std::mutex incoming_lock;
+	std::vector<waiter> incoming;   // handed to the reactor on its next pass
+	std::atomic<size_t> n_pending;
+	std::atomic<bool> stop;
+	std::thread th;
+};
+
+/* submit_ft_request keeps process-wide state, submit one request at a time */
+static std::mutex ft_async_submit_lock;
+static std::atomic<unsigned int> ft_async_seq(0);
+
+ft_session::ft_session() : bell(NULL), slot(NULL), n_pending(0), stop(false)
+{
+	pid = getpid();
+	if (init_mid_bell(&bell_fd, &bell, false) == 0) {
+		close(bell_fd);
+		if ((slot = mid_bell_claim(bell, pid)) == NULL)
+			fprintf(stderr, "ft_session: no free doorbell, polling\n");
+	}
+	th = std::thread(&ft_session::reactor, this);
+}
+
+ft_session::~ft_session()
+{
+	stop = true;
+	if (slot) mid_bell_poke(slot);
+	th.join();
+	if (bell) munmap(bell, MID_BELL_SIZE);
+}
+
+/*
+ * Name: ft_session::wait
+ * Function: Call woken on the reactor once wake is posted (the reactor
+ *           takes the post)
+ */
+void ft_session::wait(sem_t *wake, std::function<void()> woken)
+{
+	{
+		std::lock_guard<std::mutex> g(incoming_lock);
+		incoming.push_back(waiter{wake, std::move(woken)});
+	}
+	n_pending++;
+	if (slot) mid_bell_poke(slot);
+}
+
+/*
+ * Name: ft_session::begin
+ * Function: Submit a main or replica request like tag_ft_job_begin_mode,
+ *           without waiting; done(res) runs on the reactor once the FT
+ *           manager woke the job, res as tag_ft_job_begin_mode returns it
+ * Return: 0 if the request was submitted, -1 otherwise (done is not called)
+ */
+int ft_session::begin(const char *type, int num, enum ft_mode mode, std::function<void(int)> done)
+{
+	char label[JOB_MEM_NAME_MAX_LEN];
+	pid_t tid = (pid_t)syscall(SYS_gettid);
+	ft_job_t *job;
+
+	// The shm object is <type>_<seq>_<tid>, one per request
+	snprintf(label, sizeof(label), "%s_%u", type, ft_async_seq++);
+	{
+		std::lock_guard<std::mutex> g(ft_async_submit_lock);
+		if (submit_ft_request(pid, tid, type, label, num, mode, &job) < 0) return -1;
+	}
+
+	std::string name(type);
+	wait(&(job->client_wake), [job, tid, name, done]() mutable {
+		done(finish_ft_request(&job, tid, name.c_str()));
+	});
+	return 0;
+}
+
+/*
+ * Name: ft_session::begin_future
+ * Function: begin, the result as a future; -1 right away if not submitted
+ */
+std::future<int> ft_session::begin_future(const char *type, int num, enum ft_mode mode)
+{
+	std::shared_ptr<std::promise<int>> p = std::make_shared<std::promise<int>>();
+	std::future<int> f = p->get_future();
+	if (begin(type, num, mode, [p](int res) { p->set_value(res); }) < 0)
+		p->set_value(-1);
+	return f;
+}
+
+/*
+ * Name: ft_session::reactor
+ * Function: The one thread of a session: sleep on the doorbell, then
+ *           complete every request whose semaphore was posted
+ */
+void ft_session::reactor()
+{
+	std::vector<waiter> pending, fresh;
+
+	while (!stop) {
+		// Read seq before looking, a post after the pass rings it again
+		unsigned int seq = slot ? __atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) : 0;
+		{
+			std::lock_guard<std::mutex> g(incoming_lock);
+			fresh.swap(incoming);
+		}
+		for (auto &w : fresh) pending.push_back(std::move(w));
+		fresh.clear();
+
+		size_t i = 0;
+		while (i < pending.size()) {
+			if (sem_trywait(pending[i].wake) != 0) {
+				i++;
+				continue;
+			}
+			waiter w = std::move(pending[i]);
+			if (i + 1 < pending.size()) pending[i] = std::move(pending.back());
+			pending.pop_back();
+			n_pending--;
+			w.woken();
+		}
+
+		if (slot) mid_bell_wait(slot, seq, FT_ASYNC_POLL_MS);
+		else usleep(FT_ASYNC_NOBELL_MS * 1000);
+	}
+}
+
+#endif
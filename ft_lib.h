@@ -6,11 +6,22 @@
 	- ft_data_t
 	- ft_job_t
 	- ft_jobs_t
+	- ft_results_t
 	
 	Functions:
 
 	- init_ft_jobs
 	- init_ft_data
+	- init_ft_results
+	- ft_result_digest
+	- ft_hb_missed / ft_progress_missed / ft_kill_hung
+	- init_robust_mutex
+	- robust_mutex_lock
+	- repair_ft_jobs
+	- ft_rt_parse / ft_rt_thread / ft_rt_mlock
+	- ft_numa_nodes / ft_numa_node / ft_numa_run_on
+	- init_ft_jobs_shard / init_ft_data_shard
+	- ft_jobs_slots / take_ft_jobs --- ft-jobs list and its overflow segments
 
 	Ruiying Wu (ECE)
 	5/2020
@@ -30,7 +41,13 @@
 #include <sys/types.h> 	  // off_t
 #include <sys/mman.h>
 #include "mid_common.h"
+#include "mid_shm.h"        // mid_shm_map_on, mid_shm_bind
 #include <unistd.h>       //usleep
+#include <stdlib.h>       // getenv, strtoul
+#include <string.h>
+#include <stdint.h>
+#include <sched.h>        // SCHED_FIFO, SCHED_RR
+#include <sys/syscall.h>  // SYS_sched_setattr, SYS_sched_setaffinity
 
 
 
@@ -43,17 +60,54 @@
 typedef struct ft_datas{
 
 	unsigned long long heart_beat[FT_HB_DATA_MAX_DATA];
+	// In active-active mode main and replica run at the same time, so the
+	// replica beats into its own array to keep the main's failure visible
+	unsigned long long replica_heart_beat[FT_HB_DATA_MAX_DATA];
+
+	// NUMA node of the shard each heartbeat is beaten in, written by the
+	// client before it beats; only used in shard 0 ("ft_data")
+	int hb_node[FT_HB_DATA_MAX_DATA];
+	int replica_hb_node[FT_HB_DATA_MAX_DATA];
+
+	// Frames done, bumped by the client's own threads (ft_progress), not by
+	// heartbeat_thread: a main whose threads hang keeps beating but stops
+	// here. Beaten in the same shard as the heartbeats.
+	unsigned long long progress[FT_HB_DATA_MAX_DATA];
+	unsigned long long replica_progress[FT_HB_DATA_MAX_DATA];
+
+	// ms a group may go without a frame before it counts as failed, 0: not
+	// watched; written by the client (ft_progress_deadline), only in shard 0
+	unsigned int progress_deadline_ms[FT_HB_DATA_MAX_DATA];
 
 }ft_data_t;
 
 #define FT_DATA_NAME "ft_data"  // name of the heartbeat data 
 #define FT_DATA_SIZE sizeof(ft_data_t)
 
+/* heartbeat monitor, one per watched heartbeat */
+#define FT_HB_MISS_LIMIT 50     // checks without a change before a failure
+typedef struct ft_hb_monitor {
+	unsigned long long pre_heart_beat;
+	int count;
+} ft_hb_monitor_t;
+
+/* progress monitor, one per watched frame counter */
+typedef struct ft_progress_monitor {
+	unsigned long long pre_progress;
+	unsigned long long since_ms;    // CLOCK_MONOTONIC when the counter changed
+} ft_progress_monitor_t;
+
 // -------------------------------------------------------------------
 
 /* ft job type */
 #define MAX_FT_NAME 100
 enum ft_job_type {MAIN, REPLICA};
+// FT_PASSIVE: replica sleeps until the main misses its heartbeats
+// FT_ACTIVE:  replica runs next to the main, results are voted per frame
+// FT_SPARE:   replica of no group yet, sleeps in a pool shared by all groups
+//             and takes over whichever main fails first (num is then set)
+enum ft_mode {FT_PASSIVE, FT_ACTIVE, FT_SPARE};
+#define FT_SPARE_ANY (-1)       // num of a spare until it is assigned
 typedef struct ft_job {
 
 	pid_t pid;						// process id of job
@@ -62,7 +116,9 @@ typedef struct ft_job {
 	char job_name[MAX_FT_NAME];     // name of the job, job_tid
 	enum ft_job_type req_type;	    // 'MAIN' or 'REPLICA'
 	int num;                        // used to store arg2 as index to heartbeat array
+	                                // (of a spare: set by the server on takeover)
 	int is_executed;                // indicate whether the job is executed 
+	enum ft_mode mode;              // FT_PASSIVE or FT_ACTIVE
 
 	// Client-side/server-side attrs - communication properties
 	sem_t client_wake;				// Semaphore controlling when client can continue within a tag
@@ -75,18 +131,71 @@ typedef struct ft_job {
 #define FT_JOBS_MAX_JOBS 100
 #define JOB_MEM_NAME_MAX_LEN 100
 #define JOB_MEM_TYPE_MAX_LEN 100
+// When job_names is full, submitters go on in overflow segments, separate
+// shm objects <seg_base>_seg<k> created by the first submitter that needs
+// them and mapped lazily by the server
+#define FT_JOBS_SEG_JOBS 1000   // names per overflow segment
+#define FT_JOBS_MAX_SEGS 64     // overflow segments per ft-jobs list
 
 typedef struct ft_jobs {
 	int is_active;        // Set to 1 after the server is started;
 	int total_count;      // Num of ft jobs
+	int n_shards;         // ft_jobs and ft_data shards, one per NUMA node;
+	                      // set by the server in shard 0 once they exist
 	char job_names[FT_JOBS_MAX_JOBS][JOB_MEM_NAME_MAX_LEN];
+	int node;             // NUMA node of this list
+	int fill_seg;         // part submitters fill, 0 is job_names, k >= 1
+	                      // overflow segment k; reset by the drain
+	int n_segs;           // overflow segments created so far
+	char seg_base[JOB_MEM_NAME_MAX_LEN]; // name prefix of the segments
 	pthread_mutex_t requests_q_lock; // ft_job_thread in server and 
 	                                 // main thread in client might access it
+	                                 // ROBUST: take it with robust_mutex_lock
 } ft_jobs_t;
 
 #define FT_JOBS_NAME "ft_jobs"
 #define FT_JOBS_SIZE sizeof(ft_jobs_t)
 
+typedef struct ft_jobs_seg {
+	int total_count;      // Num of ft jobs in this segment
+	char job_names[FT_JOBS_SEG_JOBS][JOB_MEM_NAME_MAX_LEN];
+} ft_jobs_seg_t;
+
+#define FT_JOBS_SEG_SIZE sizeof(ft_jobs_seg_t)
+
+
+// -------------------------------------------------------------------
+
+/* ft results type */
+// One result slot per in-flight frame of every FT group. Main and replica
+// both publish into the slot of a frame; the slot decides which output is
+// kept, either the first one written or the first one that reaches quorum.
+#define FT_RESULT_SLOTS 4          // frames in flight per group
+#define FT_RESULT_MAX_BYTES 4096   // max size of one published result
+#define FT_RESULT_MAX_VOTERS 3     // main, replica and one extra voter
+
+enum ft_vote_policy {FT_FIRST_WRITER, FT_MAJORITY};
+
+typedef struct ft_result_slot {
+	pthread_mutex_t lock;              // votes, or the FT_FIRST_WRITER copy
+	unsigned long long frame;          // frame id currently held by the slot
+	unsigned long long claimed;        // FT_FIRST_WRITER: frame+1 of the winner
+	unsigned long long decided;        // frame+1 once data[winner] is final
+	int winner;                        // voter whose data was accepted
+	int n_votes;
+	unsigned long long digest[FT_RESULT_MAX_VOTERS];
+	size_t len[FT_RESULT_MAX_VOTERS];
+	char data[FT_RESULT_MAX_VOTERS][FT_RESULT_MAX_BYTES];
+} ft_result_slot_t;
+
+typedef struct ft_results {
+	enum ft_vote_policy policy[FT_HB_DATA_MAX_DATA];
+	int quorum[FT_HB_DATA_MAX_DATA];   // matching votes needed under FT_MAJORITY
+	ft_result_slot_t slot[FT_HB_DATA_MAX_DATA][FT_RESULT_SLOTS];
+} ft_results_t;
+
+#define FT_RESULTS_NAME "ft_results"
+#define FT_RESULTS_SIZE sizeof(ft_results_t)
 
 #define FT_DEBUG_FN(fn, ...) \
 {\
@@ -97,29 +206,364 @@ typedef struct ft_jobs {
 	}\
 }
 
+// -------------------------------------------------------------------
+/*
+ * Name: init_robust_mutex
+ * Function: Init a PROCESS_SHARED mutex that can be recovered when a process
+ *           dies while holding it
+ */
+int init_robust_mutex(pthread_mutex_t *m)
+{
+	pthread_mutexattr_t mutex_attr;
+	(void) pthread_mutexattr_init(&mutex_attr);
+	(void) pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+	(void) pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+	int res = pthread_mutex_init(m, &mutex_attr);
+	(void) pthread_mutexattr_destroy(&mutex_attr);
+	return res;
+}
+
+/*
+ * Name: robust_mutex_lock
+ * Function: Lock a robust mutex. If its owner died holding it, repair(arg)
+ *           fixes the data it protects before it is marked consistent again.
+ * Input: owner, the caller created the region (the server); if a client left
+ *        the mutex unrecoverable the owner repairs and re-creates it
+ * Return: 0 once locked, an error number otherwise
+ */
+int robust_mutex_lock(pthread_mutex_t *m, void (*repair)(void *), void *arg,
+	bool owner)
+{
+	int res = pthread_mutex_lock(m);
+	if (res == EOWNERDEAD) {
+		fprintf(stderr, "Owner of a shared lock died, repairing...\n");
+		if (repair) repair(arg);
+		res = pthread_mutex_consistent(m);
+	}
+	else if (res == ENOTRECOVERABLE && owner) {
+		// Someone unlocked it after EOWNERDEAD without marking it consistent
+		fprintf(stderr, "Shared lock is not recoverable, re-creating it...\n");
+		if (repair) repair(arg);
+		(void) init_robust_mutex(m);
+		res = pthread_mutex_lock(m);
+	}
+	return res;
+}
+
+/*
+ * Name: repair_ft_jobs
+ * Function: Make the ft-jobs list consistent after a submitter died holding
+ *           requests_q_lock. A name is only counted once it is fully written,
+ *           so keep the counted, well formed names and clear the rest.
+ */
+void repair_ft_jobs(void *arg)
+{
+	ft_jobs_t *fj = (ft_jobs_t *)arg;
+	int i, n = 0;
+
+	if (fj->total_count < 0) fj->total_count = 0;
+	if (fj->total_count > FT_JOBS_MAX_JOBS) fj->total_count = FT_JOBS_MAX_JOBS;
+
+	for (i = 0; i < fj->total_count; i++) {
+		if (fj->job_names[i][0] == '\0' ||
+			memchr(fj->job_names[i], '\0', JOB_MEM_NAME_MAX_LEN) == NULL)
+			continue;
+		if (n != i) memcpy(fj->job_names[n], fj->job_names[i], JOB_MEM_NAME_MAX_LEN);
+		n++;
+	}
+	memset(fj->job_names[n], 0, (FT_JOBS_MAX_JOBS - n) * JOB_MEM_NAME_MAX_LEN);
+	fj->total_count = n;
+
+	// A segment name is also only counted once written, bound the indices
+	if (fj->n_segs < 0 || fj->n_segs > FT_JOBS_MAX_SEGS) fj->n_segs = FT_JOBS_MAX_SEGS;
+	if (fj->fill_seg < 0 || fj->fill_seg > fj->n_segs) fj->fill_seg = fj->n_segs;
+}
+
+// -------------------------------------------------------------------
+/* Real-time scheduling of the threads that keep heartbeats on time */
+// A heartbeat that is late by FT_HB_MISS_LIMIT ms is a failure, so when other
+// work saturates the CPUs the threads that beat (client heartbeat_thread)
+// and watch (ft_hb_thread, ft_jobs_thread, mid's loop) need the CPU first.
+// Every such thread reads FT_RT_<role> from the environment:
+//   <policy>[:<priority> | :<runtime_us>:<period_us>][@<cpu list>]
+// policy is other, fifo, rr or deadline, e.g. "fifo:80@2,3", "deadline:100:1000",
+// "@0-1" (pinning only). Roles: MID, FT_JOBS, HB (server heartbeat threads)
+// and CLIENT_HB. FT_RT_MLOCK=1 locks the shared regions in memory.
+// Failures are reported and the thread runs on as before.
+#ifndef SCHED_DEADLINE
+#define SCHED_DEADLINE 6
+#endif
+#ifndef SYS_sched_setattr
+#define SYS_sched_setattr 314
+#endif
+#define FT_RT_MAX_CPUS 1024
+
+typedef struct ft_rt {
+	int policy;                      // SCHED_OTHER, SCHED_FIFO, SCHED_RR, SCHED_DEADLINE
+	int priority;                    // SCHED_FIFO, SCHED_RR
+	unsigned long long runtime_us;   // SCHED_DEADLINE, per period_us
+	unsigned long long period_us;
+	bool pin;                        // cpus is set
+	unsigned long cpus[FT_RT_MAX_CPUS / (8 * sizeof(unsigned long))];
+} ft_rt_t;
+
+/* struct sched_attr of sched_setattr(2), not in every libc */
+typedef struct ft_sched_attr {
+	uint32_t size;
+	uint32_t sched_policy;
+	uint64_t sched_flags;
+	int32_t sched_nice;
+	uint32_t sched_priority;
+	uint64_t sched_runtime;          // ns
+	uint64_t sched_deadline;
+	uint64_t sched_period;
+} ft_sched_attr_t;
+
+/*
+ * Name: ft_cpulist_parse
+ * Function: Set the bits of a cpu (or node) list like "0-3,6" in mask, up to
+ *           the end of the string or of the line
+ * Return: 0 on success, -1 if the list is malformed or too large
+ */
+int ft_cpulist_parse(const char *p, unsigned long *mask)
+{
+	char *end;
+	while (*p && *p != '\n') {
+		unsigned long lo = strtoul(p, &end, 10), hi = lo;
+		if (end == p) return -1;
+		p = end;
+		if (*p == '-') {
+			hi = strtoul(p + 1, &end, 10);
+			if (end == p + 1 || hi < lo) return -1;
+			p = end;
+		}
+		if (hi >= FT_RT_MAX_CPUS) return -1;
+		for (; lo <= hi; lo++)
+			mask[lo / (8 * sizeof(unsigned long))] |= 1UL << (lo % (8 * sizeof(unsigned long)));
+		if (*p == ',') p++;
+		else if (*p && *p != '\n') return -1;
+	}
+	return 0;
+}
+
+/*
+ * Name: ft_rt_parse
+ * Function: Parse a FT_RT_<role> value into rt
+ * Return: 0 on success, -1 if spec is malformed
+ */
+int ft_rt_parse(const char *spec, ft_rt_t *rt)
+{
+	const char *p = spec;
+	char *end;
+	memset(rt, 0, sizeof(ft_rt_t));
+	rt->policy = SCHED_OTHER;
+
+	size_t n = strcspn(p, ":@");
+	if (n == 0 || (n == 5 && strncmp(p, "other", n) == 0)) {
+		rt->policy = SCHED_OTHER;
+	} else if (n == 4 && strncmp(p, "fifo", n) == 0) {
+		rt->policy = SCHED_FIFO;
+	} else if (n == 2 && strncmp(p, "rr", n) == 0) {
+		rt->policy = SCHED_RR;
+	} else if (n == 8 && strncmp(p, "deadline", n) == 0) {
+		rt->policy = SCHED_DEADLINE;
+	} else {
+		return -1;
+	}
+	p += n;
+
+	if (*p == ':') {
+		unsigned long v = strtoul(p + 1, &end, 10);
+		if (end == p + 1) return -1;
+		p = end;
+		if (rt->policy == SCHED_FIFO || rt->policy == SCHED_RR) {
+			rt->priority = (int)v;
+		} else if (rt->policy == SCHED_DEADLINE && *p == ':') {
+			rt->runtime_us = v;
+			rt->period_us = strtoul(p + 1, &end, 10);
+			if (end == p + 1) return -1;
+			p = end;
+		} else {
+			return -1;
+		}
+	}
+	if (rt->policy == SCHED_DEADLINE &&
+		(rt->runtime_us == 0 || rt->period_us < rt->runtime_us))
+		return -1;
+	if ((rt->policy == SCHED_FIFO || rt->policy == SCHED_RR) && rt->priority == 0)
+		rt->priority = 1;
+
+	if (*p == '@') {
+		rt->pin = true;
+		return ft_cpulist_parse(p + 1, rt->cpus);
+	}
+	return *p == '\0' ? 0 : -1;
+}
+
+/*
+ * Name: ft_rt_thread
+ * Function: Apply FT_RT_<role>, if set, to the calling thread
+ * Return: 0 if unset or applied, -1 otherwise
+ */
+int ft_rt_thread(const char *role)
+{
+	char var[64];
+	ft_rt_t rt;
+	snprintf(var, sizeof(var), "FT_RT_%s", role);
+	const char *spec = getenv(var);
+	if (spec == NULL) return 0;
+	if (ft_rt_parse(spec, &rt) < 0) {
+		fprintf(stderr, "Bad %s (%s)\n", var, spec);
+		return -1;
+	}
+
+	int res = 0;
+	// Pin first: the kernel refuses to narrow the CPUs of a SCHED_DEADLINE thread
+	if (rt.pin && syscall(SYS_sched_setaffinity, 0, sizeof(rt.cpus), rt.cpus) != 0) {
+		fprintf(stderr, "%s: sched_setaffinity: %s\n", var, strerror(errno));
+		res = -1;
+	}
+	if (rt.policy != SCHED_OTHER) {
+		ft_sched_attr_t attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.sched_policy = rt.policy;
+		attr.sched_priority = rt.priority;
+		attr.sched_runtime = rt.runtime_us * 1000;
+		attr.sched_deadline = rt.period_us * 1000;
+		attr.sched_period = rt.period_us * 1000;
+		if (syscall(SYS_sched_setattr, 0, &attr, 0) != 0) {
+			// EPERM without CAP_SYS_NICE or an RLIMIT_RTPRIO, EBUSY if the
+			// deadline bandwidth is used up
+			fprintf(stderr, "%s: sched_setattr: %s\n", var, strerror(errno));
+			res = -1;
+		}
+	}
+	return res;
+}
+
+/*
+ * Name: ft_rt_mlock
+ * Function: With FT_RT_MLOCK=1 lock a shared region in memory, so beating
+ *           or checking a heartbeat never waits for a page fault. Only the
+ *           regions are locked: mlockall would also lock the stacks of the
+ *           FT_HB_DATA_MAX_DATA heartbeat threads of mid.
+ * Return: 0 if unset or locked, -1 otherwise
+ */
+int ft_rt_mlock(void *addr, size_t len)
+{
+	const char *v = getenv("FT_RT_MLOCK");
+	if (v == NULL || strcmp(v, "1") != 0) return 0;
+	if (mlock(addr, len) != 0) {
+		perror("FT_RT_MLOCK: mlock");
+		return -1;
+	}
+	return 0;
+}
+
+// -------------------------------------------------------------------
+/* NUMA placement of the heartbeat and submission regions */
+// On a host with several NUMA nodes the server makes one heartbeat region
+// ("ft_data", "ft_data_1", ...) and one ft-jobs list ("ft_jobs",
+// "ft_jobs_1", ...) per node, each in the memory of its node, and drains
+// every list from a thread on that node. A client uses the shards of the
+// node it starts on and keeps its heartbeat thread there, so beating,
+// checking and submitting stay on one socket. FT_NUMA=0 turns this off,
+// FT_NUMA=<n> makes n shards whatever nodes the host has (for testing).
+#define FT_NUMA_MAX_NODES 8
+#define FT_NUMA_SYSFS "/sys/devices/system/node"
+
+/* Read a cpu or node list file of sysfs into mask */
+static int ft_numa_read_list(const char *path, unsigned long *mask)
+{
+	char buf[4096];
+	FILE *f = fopen(path, "r");
+	if (f == NULL) return -1;
+	char *line = fgets(buf, sizeof(buf), f);
+	fclose(f);
+	memset(mask, 0, FT_RT_MAX_CPUS / 8);
+	return line ? ft_cpulist_parse(line, mask) : -1;
+}
+
+/*
+ * Name: ft_numa_nodes
+ * Function: Number of shards to make, highest online node + 1
+ * Return: 1 on a single node host, with FT_NUMA=0 or if sysfs is missing,
+ *         n with FT_NUMA=<n>
+ */
+int ft_numa_nodes()
+{
+	unsigned long mask[FT_RT_MAX_CPUS / (8 * sizeof(unsigned long))];
+	const char *v = getenv("FT_NUMA");
+	if (v && *v) {
+		int forced = atoi(v);
+		if (forced < 1) return 1;
+		return forced < FT_NUMA_MAX_NODES ? forced : FT_NUMA_MAX_NODES;
+	}
+	if (ft_numa_read_list(FT_NUMA_SYSFS "/online", mask) < 0) return 1;
+
+	int n, nodes = 1;
+	for (n = 0; n < FT_NUMA_MAX_NODES; n++)
+		if (mask[0] & (1UL << n)) nodes = n + 1;
+	return nodes;
+}
+
+/*
+ * Name: ft_numa_node
+ * Function: NUMA node the calling thread runs on
+ */
+int ft_numa_node()
+{
+	unsigned int cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) return 0;
+	return node < FT_NUMA_MAX_NODES ? (int)node : 0;
+}
+
+/*
+ * Name: ft_numa_run_on
+ * Function: Keep the calling thread on the CPUs of node
+ * Return: 0 on success, -1 otherwise (the thread runs on where it was)
+ */
+int ft_numa_run_on(int node)
+{
+	char path[64];
+	unsigned long cpus[FT_RT_MAX_CPUS / (8 * sizeof(unsigned long))];
+	snprintf(path, sizeof(path), FT_NUMA_SYSFS "/node%d/cpulist", node);
+	if (ft_numa_read_list(path, cpus) < 0) return -1;
+	if (syscall(SYS_sched_setaffinity, 0, sizeof(cpus), cpus) != 0) {
+		fprintf(stderr, "FT NUMA node %d: sched_setaffinity: %s\n", node, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/* Name of the shard of region base on node, base itself on node 0 */
+void ft_shard_name(char *name, const char *base, int node)
+{
+	if (node == 0) snprintf(name, JOB_MEM_NAME_MAX_LEN, "%s", base);
+	else snprintf(name, JOB_MEM_NAME_MAX_LEN, "%s_%d", base, node);
+}
+
 // -------------------------------------------------------------------
 // Called in server
 /*
- * Name: init_ft_jobs
- * Function: Create a shared memory region for ft-jobs list
+ * Name: init_ft_jobs_shard
+ * Function: Create the ft-jobs list of a NUMA node, the server (init_flag)
+ *           places it in the memory of the node
  */
-int init_ft_jobs(int *fd, ft_jobs_t **addr, bool init_flag)
+int init_ft_jobs_shard(int *fd, ft_jobs_t **addr, bool init_flag, int node)
 {
+	char name[JOB_MEM_NAME_MAX_LEN];
+	ft_shard_name(name, FT_JOBS_NAME, node);
+
 	/* Get access to shared FT_JOBS_SIZE memory region */
-	errno = 0;  //  automatically set when error occurs
 	// open/create POSIX shared memory; if it doesn't exist, create one.
-	*fd = shm_init(FT_JOBS_NAME, FT_JOBS_SIZE);
-    if (*fd == -1){
-        perror("[Error] in mmap_ft_jobs_queue: shm_init failed");
-        return -1;
-    }
-
-    *addr = (ft_jobs_t *)mmap(  NULL,
+    *addr = (ft_jobs_t *)mid_shm_map_on(name,
                         FT_JOBS_SIZE,
                         PROT_READ|PROT_WRITE,
-                        MAP_SHARED,
-                        *fd,
-                        0);
+                        init_flag,
+                        fd,
+                        init_flag && ft_numa_nodes() > 1 ? node : -1);
 
     if (*addr == MAP_FAILED) {
     	printf("FT size: %ld\n", FT_JOBS_SIZE);
@@ -133,60 +577,305 @@ int init_ft_jobs(int *fd, ft_jobs_t **addr, bool init_flag)
 		ft_jobs_t *fj = *addr;
 		fj->is_active = 1;
 		fj->total_count = 0;
+		fj->n_shards = 1;
 		// Zero out the ft-jobs' names array. 
 		memset(fj->job_names, 0, FT_JOBS_MAX_JOBS * JOB_MEM_NAME_MAX_LEN);
+		// Segments left by an earlier mid are emptied when reused
+		fj->node = node;
+		fj->fill_seg = 0;
+		fj->n_segs = 0;
+		strncpy(fj->seg_base, name, JOB_MEM_NAME_MAX_LEN);
+
+		// Initialize the global lock on the ft_job_names list, PROCESS_SHARED
+		// and ROBUST so a client dying inside submit_ft_job can't block it
+		(void) init_robust_mutex(&(fj->requests_q_lock));
+	}
+	return 0;
+}
 
-		// Initialize the global lock on the ft_job_names list
-		pthread_mutexattr_t mutex_attr;
+/*
+ * Name: init_ft_jobs
+ * Function: Create a shared memory region for ft-jobs list
+ */
+int init_ft_jobs(int *fd, ft_jobs_t **addr, bool init_flag)
+{
+	return init_ft_jobs_shard(fd, addr, init_flag, 0);
+}
 
-		// Initialize requests_q_lock to be PROCESS_SHARED
-		(void) pthread_mutexattr_init(&mutex_attr);
-		(void) pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+/* Overflow segments mapped in this process, by list (NUMA node). Only
+   touched under the requests_q_lock of the list. Segments are never
+   unmapped or unlinked, so the mappings stay valid across mid restarts. */
+static ft_jobs_seg_t *ft_jobs_segs[FT_NUMA_MAX_NODES][FT_JOBS_MAX_SEGS];
 
-		(void) pthread_mutex_init(&(fj->requests_q_lock), &mutex_attr);
+/*
+ * Name: ft_jobs_slots
+ * Function: Name slots of part k of an ft-jobs list: k = 0 is the list
+ *           itself, 1..FT_JOBS_MAX_SEGS its overflow segments, mapped on
+ *           first use. Call it holding requests_q_lock.
+ * Input: create, empty the segment (it is new to the list)
+ * Output: *count and *names, the name count and names of part k
+ * Return: capacity of part k, -1 if it doesn't exist or can't be mapped
+ */
+int ft_jobs_slots(ft_jobs_t *fj, int k, bool create, int **count,
+	char (**names)[JOB_MEM_NAME_MAX_LEN])
+{
+	if (k == 0) {
+		*count = &(fj->total_count);
+		*names = fj->job_names;
+		return FT_JOBS_MAX_JOBS;
 	}
-	return 0;
+	if (k < 1 || k > FT_JOBS_MAX_SEGS) return -1;
+
+	int node = fj->node >= 0 && fj->node < FT_NUMA_MAX_NODES ? fj->node : 0;
+	ft_jobs_seg_t **seg = &(ft_jobs_segs[node][k - 1]);
+	if (*seg == NULL) {
+		char name[JOB_MEM_NAME_MAX_LEN + 16];
+		int fd;
+		snprintf(name, sizeof(name), "%.*s_seg%d", JOB_MEM_NAME_MAX_LEN - 1, fj->seg_base, k);
+		ft_jobs_seg_t *s = (ft_jobs_seg_t *)mid_shm_map(name, FT_JOBS_SEG_SIZE,
+			PROT_READ|PROT_WRITE, false, &fd);
+		if (s == MAP_FAILED) {
+			perror("[Error] in ft_jobs_slots: mmap");
+			return -1;
+		}
+		close(fd);
+		*seg = s;
+	}
+	if (create) (*seg)->total_count = 0;
+	*count = &((*seg)->total_count);
+	*names = (*seg)->job_names;
+	return FT_JOBS_SEG_JOBS;
+}
+
+/*
+ * Name: take_ft_jobs
+ * Function: Hand every name queued in an ft-jobs list and its overflow
+ *           segments to take, in submission order, and empty them. Call it
+ *           holding requests_q_lock; take should only copy the name.
+ * Return: number of names taken
+ */
+int take_ft_jobs(ft_jobs_t *fj, void (*take)(const char *name, void *arg), void *arg)
+{
+	int k, i, n = 0, cap, *count;
+	char (*names)[JOB_MEM_NAME_MAX_LEN];
+
+	for (k = 0; k <= fj->fill_seg; k++) {
+		if ((cap = ft_jobs_slots(fj, k, false, &count, &names)) < 0) continue;
+		if (*count > cap) *count = cap;
+		for (i = 0; i < *count; i++) {
+			if (names[i][0] == '\0' || memchr(names[i], '\0', JOB_MEM_NAME_MAX_LEN) == NULL)
+				continue;
+			take(names[i], arg);
+			n++;
+		}
+		*count = 0;
+	}
+	fj->fill_seg = 0;
+	return n;
 }
 
 /* 
- * Name: init_ft_data
- * Function: Create a shared memory region for heartbeat data
+ * Name: init_ft_data_shard
+ * Function: Create the heartbeat region of a NUMA node, the server
+ *           (init_flag) places it in the memory of the node and clears it
  */
-int init_ft_data(int *fd, ft_data_t **addr, bool init_flag, int index)
+int init_ft_data_shard(int *fd, ft_data_t **addr, bool init_flag, int node)
 {
+	char name[JOB_MEM_NAME_MAX_LEN];
+	ft_shard_name(name, FT_DATA_NAME, node);
+
 	/* Get access to shared FT_DATA_SIZE memory region */
-	errno = 0; // automatically set when error occurs
 	// Open/create POSIX shared memory; if it doesnt exist, create one.
-	*fd = shm_init(FT_DATA_NAME, FT_DATA_SIZE);
-
-	if (*fd == -1) 
-	{
-		perror("[Error] in mmap_ft_data: shm_init failed");
-		return -1;
-	}
-	*addr = (ft_data_t *)mmap(
-								NULL,// kernel chooses the address at which to create the mapping
+	*addr = (ft_data_t *)mid_shm_map_on(name,
     							FT_DATA_SIZE,
     							PROT_READ | PROT_WRITE, // pages may be read | pages may be written
-    							MAP_SHARED, // sharing this mapping
-    							*fd,
-    							0);
+    							init_flag,
+    							fd,
+    							init_flag && ft_numa_nodes() > 1 ? node : -1);
 	if (*addr == MAP_FAILED) 
 	{
-		perror("[Error] in mmap_ft_data: shm_init failed");
+		perror("[Error] in mmap_ft_data: mmap");
 		return -1;
 	}
 
+	if (init_flag)
+	{
+		memset(*addr, 0, FT_DATA_SIZE);
+	}
+
+	return 0;
+} 
+
+/* 
+ * Name: init_ft_data
+ * Function: Create a shared memory region for heartbeat data
+ */
+int init_ft_data(int *fd, ft_data_t **addr, bool init_flag, int index)
+{
+	int res = init_ft_data_shard(fd, addr, false, 0);
+	if (res < 0) return res;
+
 	/* Initialize the ft_data_t struct in shared memory*/
 	if (init_flag)
 	{
 		ft_data_t *ft_data = *addr;
 		ft_data->heart_beat[index] = 0; // hardcode heartbeat value for main and replica
+		ft_data->replica_heart_beat[index] = 0;
+		ft_data->progress[index] = 0;
+		ft_data->replica_progress[index] = 0;
 	}
 
 	return 0;
 } 
 
+/* 
+ * Name: init_ft_results
+ * Function: Create a shared memory region for the active-active result slots
+ */
+int init_ft_results(int *fd, ft_results_t **addr, bool init_flag)
+{
+	*addr = (ft_results_t *)mid_shm_map(FT_RESULTS_NAME,
+								FT_RESULTS_SIZE,
+								PROT_READ | PROT_WRITE,
+								init_flag,
+								fd);
+	if (*addr == MAP_FAILED)
+	{
+		perror("[Error] in mmap_ft_results: mmap");
+		return -1;
+	}
+
+	/* Initialize every slot with a PROCESS_SHARED lock, default first-writer */
+	if (init_flag)
+	{
+		ft_results_t *fr = *addr;
+		memset(fr, 0, FT_RESULTS_SIZE);
+
+		int g, s;
+		for (g = 0; g < FT_HB_DATA_MAX_DATA; g++) {
+			fr->policy[g] = FT_FIRST_WRITER;
+			fr->quorum[g] = 2;
+			for (s = 0; s < FT_RESULT_SLOTS; s++) {
+				(void) init_robust_mutex(&(fr->slot[g][s].lock));
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Name: ft_hb_missed
+ * Function: Feed one sample of a heartbeat into its monitor, called once per
+ *           check period by the local heartbeat threads and the network layer
+ * Return: true once, when the heartbeat has not changed for
+ *         FT_HB_MISS_LIMIT checks (a zero heartbeat never started, so it is
+ *         never reported)
+ */
+bool ft_hb_missed(ft_hb_monitor_t *m, unsigned long long heart_beat)
+{
+	if (m->pre_heart_beat == heart_beat) {
+		// Count the number of times at which the heartbeat doesnt change
+		m->count ++;
+	}
+	else {
+		m->pre_heart_beat = heart_beat;
+		m->count = 0;
+	}
+
+	if (m->count == FT_HB_MISS_LIMIT) {
+		m->count = 0;
+		return heart_beat != 0;
+	}
+	return false;
+}
+
+/*
+ * Name: ft_progress_missed
+ * Function: Feed one sample of a frame counter into its monitor, called once
+ *           per check period (1 ms) by the local heartbeat threads
+ * Input: deadline_ms, time without a new frame before a failure, 0 to not
+ *        watch the counter
+ * Return: true once, when the counter has not changed for deadline_ms of
+ *         CLOCK_MONOTONIC time, however late the checks run (a zero
+ *         counter never started, so it is never reported)
+ */
+bool ft_progress_missed(ft_progress_monitor_t *m, unsigned long long progress,
+	unsigned int deadline_ms)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	unsigned long long now_ms = (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+	if (m->pre_progress != progress || deadline_ms == 0 || progress == 0) {
+		m->pre_progress = progress;
+		m->since_ms = now_ms;
+		return false;
+	}
+
+	if (now_ms - m->since_ms >= deadline_ms) {
+		m->since_ms = now_ms;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Name: ft_kill_hung
+ * Function: Kill a main whose frames stopped while its heartbeat went on,
+ *           as its replica takes over: it would beat next to the replica,
+ *           and run the group's frames again if it ever resumed
+ * Return: 0 if it is gone, -1 on error
+ */
+int ft_kill_hung(pid_t pid)
+{
+	if (pid <= 0) return -1;
+	if (kill(pid, SIGKILL) < 0 && errno != ESRCH) return -1;
+	return 0;
+}
+
+/*
+ * Name: ft_result_digest
+ * Function: FNV-1a hash of a published result, compared when voting
+ */
+unsigned long long ft_result_digest(const void *buf, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)buf;
+	unsigned long long h = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/*
+ * Name: repair_ft_result_slot
+ * Function: Drop votes a voter died in the middle of writing, i.e. those
+ *           whose data no longer matches their digest
+ */
+void repair_ft_result_slot(void *arg)
+{
+	ft_result_slot_t *slot = (ft_result_slot_t *)arg;
+	int i, n = 0;
+
+	if (slot->n_votes < 0) slot->n_votes = 0;
+	if (slot->n_votes > FT_RESULT_MAX_VOTERS) slot->n_votes = FT_RESULT_MAX_VOTERS;
+	for (i = 0; i < slot->n_votes; i++) {
+		if (slot->len[i] > FT_RESULT_MAX_BYTES ||
+			ft_result_digest(slot->data[i], slot->len[i]) != slot->digest[i])
+			continue;
+		if (n != i) {
+			slot->digest[n] = slot->digest[i];
+			slot->len[n] = slot->len[i];
+			memcpy(slot->data[n], slot->data[i], slot->len[i]);
+			if (slot->winner == i) slot->winner = n;
+		}
+		n++;
+	}
+	slot->n_votes = n;
+}
+
 #endif 
 
 
@@ -0,0 +1,436 @@
+/*
+	FT(fault tolerance) manager network transport(c++)
+	Carries heartbeats and FT job registrations between FT managers on
+	different nodes over UDP, so a replica can run on another board.
+
+	- ft_net_start  --- called in server (or test harness)
+	   - ft_net_send_thread
+	     - collect hook, batches local heartbeats into MTU-sized packets
+	     - marks peers DEAD when they stay silent
+	   - ft_net_recv_thread
+	     - drops stale or duplicated packets by sequence number, which
+	       starts over when the sender's boot id changes
+	     - deliver / on_register / on_member hooks
+	- ft_net_announce --- send a FT job registration to every peer
+	- ft_net_stop
+
+	Remote heartbeats are handed to the deliver hook. The FT manager copies
+	them into ft_data_t, so remote mains go through the same ft_hb_thread
+	failure detection as local ones.
+
+	Membership is kept per configured peer: any packet makes it ALIVE,
+	silence for FT_NET_DEAD_US makes it DEAD. A JOIN is sent on start and
+	answered with the receiver's registrations, so late joiners learn the
+	current groups. Every packet carries the sender's boot id, so a peer
+	that restarted is recognised even if its JOIN is lost.
+*/
+#ifndef FT_NET
+#define FT_NET
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>          // htobe64, be64toh
+#include <arpa/inet.h>       // htonl, inet_pton
+#include <netinet/in.h>      // sockaddr_in
+#include <sys/socket.h>
+#include "ft_lib.h"          // FT_HB_DATA_MAX_DATA, ft_job_type
+
+#define FT_NET_MAGIC 0x46544e54     // "FTNT"
+#define FT_NET_MAX_PEERS 16
+#define FT_NET_HB_PERIOD_US 1000    // same 1 ms period as the heartbeat threads
+#define FT_NET_DEAD_US (FT_HB_MISS_LIMIT*FT_NET_HB_PERIOD_US)
+#define FT_NET_MAX_REGISTERED (2*FT_HB_DATA_MAX_DATA)   // a main and a replica per group
+#define FT_NET_MAX_PAYLOAD 1472     // 1500 B Ethernet MTU less IPv4 and UDP headers
+
+enum ft_net_msg_type {FT_NET_JOIN, FT_NET_HB, FT_NET_REGISTER, FT_NET_LEAVE};
+enum ft_net_member_state {FT_NET_UNKNOWN, FT_NET_ALIVE, FT_NET_DEAD};
+
+/* One heartbeat or registration, sent in network byte order */
+typedef struct ft_net_entry {
+	uint16_t index;              // FT group, index into heart_beat array
+	uint16_t type;               // enum ft_job_type
+	uint32_t pid;
+	uint64_t beat;
+} __attribute__((packed)) ft_net_entry_t;
+
+typedef struct ft_net_hdr {
+	uint32_t magic;
+	uint16_t type;               // enum ft_net_msg_type
+	uint16_t count;              // number of valid entries
+	uint32_t node_id;
+	uint64_t boot;               // sender's boot id, new on every ft_net_start
+	uint64_t seq;                // per-sender sequence number
+} __attribute__((packed)) ft_net_hdr_t;
+
+// Entries per packet, so a packet is never fragmented
+#define FT_NET_MAX_ENTRIES ((FT_NET_MAX_PAYLOAD - sizeof(ft_net_hdr_t)) / sizeof(ft_net_entry_t))
+
+typedef struct ft_net_msg {
+	ft_net_hdr_t hdr;
+	ft_net_entry_t entry[FT_NET_MAX_ENTRIES];
+} __attribute__((packed)) ft_net_msg_t;
+
+#define FT_NET_MSG_HDR_SIZE sizeof(ft_net_hdr_t)
+
+typedef struct ft_net_peer {
+	struct sockaddr_in addr;
+	uint32_t node_id;            // learned from the first packet
+	uint64_t boot;               // boot id last_seq belongs to
+	uint64_t last_seq;
+	uint64_t last_heard_us;
+	int state;                   // enum ft_net_member_state
+} ft_net_peer_t;
+
+typedef struct ft_net ft_net_t;
+struct ft_net {
+	int sock;
+	uint32_t node_id;
+	uint64_t boot;
+	uint64_t seq;
+	int n_peers;
+	ft_net_peer_t peer[FT_NET_MAX_PEERS];
+	pthread_mutex_t lock;        // peers, registrations and seq
+
+	// Registrations of local FT jobs, re-sent when a peer joins
+	int n_registered;
+	ft_net_entry_t registered[FT_NET_MAX_REGISTERED];
+
+	volatile bool running;
+	pthread_t send_thread;
+	pthread_t recv_thread;
+
+	// Hooks, called from the transport threads
+	int (*collect)(ft_net_t *net, ft_net_entry_t *out, int max);
+	void (*deliver)(ft_net_t *net, uint32_t node_id, const ft_net_entry_t *e);
+	void (*on_register)(ft_net_t *net, uint32_t node_id, const ft_net_entry_t *e);
+	void (*on_member)(ft_net_t *net, uint32_t node_id, int state);
+	void *ctx;
+};
+
+static uint64_t ft_net_now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Name: ft_net_boot_id
+ * Function: Pick the boot id of this ft_net_start, different from the ones
+ *           before it so peers reset the sequence numbers they expect
+ */
+static uint64_t ft_net_boot_id()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec) ^ ((uint64_t)getpid() << 32);
+}
+
+/*
+ * Name: ft_net_send
+ * Function: Stamp a message with our node id and next sequence number, and
+ *           send it to one peer (or to every peer when to is NULL)
+ */
+static void ft_net_send(ft_net_t *net, ft_net_msg_t *msg, int type, int count,
+	const ft_net_peer_t *to)
+{
+	int i;
+	msg->hdr.magic = htonl(FT_NET_MAGIC);
+	msg->hdr.type = htons(type);
+	msg->hdr.count = htons(count);
+	msg->hdr.node_id = htonl(net->node_id);
+	msg->hdr.boot = htobe64(net->boot);
+
+	pthread_mutex_lock(&(net->lock));
+	msg->hdr.seq = htobe64(++net->seq);
+	pthread_mutex_unlock(&(net->lock));
+
+	size_t len = FT_NET_MSG_HDR_SIZE + count * sizeof(ft_net_entry_t);
+	for (i = 0; i < net->n_peers; i++) {
+		if (to && to != &(net->peer[i])) continue;
+		sendto(net->sock, msg, len, 0,
+			(const struct sockaddr *)&(net->peer[i].addr), sizeof(struct sockaddr_in));
+	}
+}
+
+static void ft_net_fill_entry(ft_net_entry_t *e, int index, int type, pid_t pid,
+	unsigned long long beat)
+{
+	e->index = htons(index);
+	e->type = htons(type);
+	e->pid = htonl(pid);
+	e->beat = htobe64(beat);
+}
+
+/*
+ * Name: ft_net_send_thread
+ * Function: Every FT_NET_HB_PERIOD_US send all local heartbeats, batched
+ *           FT_NET_MAX_ENTRIES to a packet, and mark peers DEAD once they
+ *           have been silent for FT_NET_DEAD_US
+ */
+static void *ft_net_send_thread(void *varpg)
+{
+	ft_net_t *net = (ft_net_t *)varpg;
+	ft_net_msg_t msg;
+	ft_net_entry_t local[FT_HB_DATA_MAX_DATA];
+	struct timespec time_sleep = {0, FT_NET_HB_PERIOD_US * 1000};
+	int i, k;
+
+	while (net->running)
+	{
+		/* Batch the local heartbeats, an empty packet still keeps us alive */
+		int n = net->collect ? net->collect(net, local, FT_HB_DATA_MAX_DATA) : 0;
+		i = 0;
+		do {
+			int count = n - i < (int)FT_NET_MAX_ENTRIES ? n - i : FT_NET_MAX_ENTRIES;
+			for (k = 0; k < count; k++) {
+				ft_net_fill_entry(&(msg.entry[k]), local[i + k].index,
+					local[i + k].type, local[i + k].pid, local[i + k].beat);
+			}
+			ft_net_send(net, &msg, FT_NET_HB, count, NULL);
+			i += count;
+		} while (i < n);
+
+		/* Membership: a silent peer is dead. The receive thread may have
+		   heard it after now was read, so the difference is signed. */
+		uint64_t now = ft_net_now_us();
+		for (i = 0; i < net->n_peers; i++) {
+			ft_net_peer_t *p = &(net->peer[i]);
+			pthread_mutex_lock(&(net->lock));
+			bool dead = p->state == FT_NET_ALIVE &&
+				(int64_t)(now - p->last_heard_us) > FT_NET_DEAD_US;
+			if (dead) p->state = FT_NET_DEAD;
+			uint32_t node_id = p->node_id;
+			pthread_mutex_unlock(&(net->lock));
+			if (dead && net->on_member) net->on_member(net, node_id, FT_NET_DEAD);
+		}
+
+		nanosleep(&time_sleep, NULL);
+	}
+	return NULL;
+}
+
+/*
+ * Name: ft_net_reply_registered
+ * Function: Send our FT job registrations to a peer that just joined
+ */
+static void ft_net_reply_registered(ft_net_t *net, ft_net_peer_t *p)
+{
+	ft_net_msg_t msg;
+	ft_net_entry_t registered[FT_NET_MAX_REGISTERED];
+	pthread_mutex_lock(&(net->lock));
+	int n = net->n_registered, i;
+	memcpy(registered, net->registered, n * sizeof(ft_net_entry_t));
+	pthread_mutex_unlock(&(net->lock));
+
+	// One packet holds FT_NET_MAX_ENTRIES entries
+	for (i = 0; i < n; i += FT_NET_MAX_ENTRIES) {
+		int count = n - i < (int)FT_NET_MAX_ENTRIES ? n - i : FT_NET_MAX_ENTRIES;
+		memcpy(msg.entry, registered + i, count * sizeof(ft_net_entry_t));
+		ft_net_send(net, &msg, FT_NET_REGISTER, count, p);
+	}
+}
+
+/*
+ * Name: ft_net_recv_thread
+ * Function: Receive packets from peers, drop anything not newer than the
+ *           peer's last sequence number of the same boot id, and hand
+ *           entries to the hooks
+ */
+static void *ft_net_recv_thread(void *varpg)
+{
+	ft_net_t *net = (ft_net_t *)varpg;
+	ft_net_msg_t msg;
+	struct sockaddr_in from;
+	int i;
+
+	while (net->running)
+	{
+		socklen_t from_len = sizeof(from);
+		ssize_t len = recvfrom(net->sock, &msg, sizeof(msg), 0,
+			(struct sockaddr *)&from, &from_len);
+		if (len < (ssize_t)FT_NET_MSG_HDR_SIZE) continue; // timeout or runt
+		if (ntohl(msg.hdr.magic) != FT_NET_MAGIC) continue;
+
+		int type = ntohs(msg.hdr.type);
+		int count = ntohs(msg.hdr.count);
+		uint64_t boot = be64toh(msg.hdr.boot);
+		uint64_t seq = be64toh(msg.hdr.seq);
+		if (count > (int)FT_NET_MAX_ENTRIES ||
+			len < (ssize_t)(FT_NET_MSG_HDR_SIZE + count * sizeof(ft_net_entry_t)))
+			continue;
+
+		/* Find the configured peer this packet came from */
+		ft_net_peer_t *p = NULL;
+		for (i = 0; i < net->n_peers; i++) {
+			if (net->peer[i].addr.sin_addr.s_addr == from.sin_addr.s_addr &&
+				net->peer[i].addr.sin_port == from.sin_port) {
+				p = &(net->peer[i]);
+				break;
+			}
+		}
+		if (!p) continue;
+
+		pthread_mutex_lock(&(net->lock));
+		// A restarted peer starts counting from 1 again, under a new boot id
+		if (boot != p->boot) {
+			p->boot = boot;
+			p->last_seq = 0;
+		}
+		if (seq <= p->last_seq) {
+			pthread_mutex_unlock(&(net->lock));
+			continue;
+		}
+		p->last_seq = seq;
+		p->node_id = ntohl(msg.hdr.node_id);
+		p->last_heard_us = ft_net_now_us();
+		bool alive = p->state != FT_NET_ALIVE && type != FT_NET_LEAVE;
+		if (alive) p->state = FT_NET_ALIVE;
+		else if (type == FT_NET_LEAVE) p->state = FT_NET_DEAD;
+		pthread_mutex_unlock(&(net->lock));
+		if (alive && net->on_member) net->on_member(net, p->node_id, FT_NET_ALIVE);
+
+		for (i = 0; i < count; i++) {
+			ft_net_entry_t e;
+			e.index = ntohs(msg.entry[i].index);
+			e.type = ntohs(msg.entry[i].type);
+			e.pid = ntohl(msg.entry[i].pid);
+			e.beat = be64toh(msg.entry[i].beat);
+			if (e.index >= FT_HB_DATA_MAX_DATA) continue;
+
+			if (type == FT_NET_HB && net->deliver)
+				net->deliver(net, p->node_id, &e);
+			else if (type == FT_NET_REGISTER && net->on_register)
+				net->on_register(net, p->node_id, &e);
+		}
+
+		if (type == FT_NET_JOIN) {
+			ft_net_reply_registered(net, p);
+		}
+		else if (type == FT_NET_LEAVE) {
+			if (net->on_member) net->on_member(net, p->node_id, FT_NET_DEAD);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Name: ft_net_parse_peers
+ * Function: Parse "host:port,host:port" into the peer table
+ * Return: number of peers, -1 on a malformed entry
+ */
+int ft_net_parse_peers(ft_net_t *net, const char *peers)
+{
+	char buf[1024];
+	strncpy(buf, peers, sizeof(buf) - 1);
+	buf[sizeof(buf) - 1] = '\0';
+
+	net->n_peers = 0;
+	char *save = NULL;
+	char *tok = strtok_r(buf, ",", &save);
+	while (tok && net->n_peers < FT_NET_MAX_PEERS) {
+		char *colon = strrchr(tok, ':');
+		if (!colon) return -1;
+		*colon = '\0';
+
+		ft_net_peer_t *p = &(net->peer[net->n_peers]);
+		memset(p, 0, sizeof(*p));
+		p->addr.sin_family = AF_INET;
+		p->addr.sin_port = htons(atoi(colon + 1));
+		if (inet_pton(AF_INET, tok, &(p->addr.sin_addr)) != 1) return -1;
+		net->n_peers++;
+		tok = strtok_r(NULL, ",", &save);
+	}
+	return net->n_peers;
+}
+
+/*
+ * Name: ft_net_start
+ * Function: Bind the UDP port, announce ourselves with a JOIN and start the
+ *           send and receive threads. Hooks and peers must be set before.
+ * Input: port, the local UDP port; node_id, unique id of this FT manager
+ */
+int ft_net_start(ft_net_t *net, uint32_t node_id, int port)
+{
+	net->node_id = node_id;
+	net->boot = ft_net_boot_id();
+	net->seq = 0;
+	net->n_registered = 0;
+	pthread_mutex_init(&(net->lock), NULL);
+
+	net->sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (net->sock < 0) {
+		perror("[Error] in ft_net_start: socket");
+		return -1;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(net->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("[Error] in ft_net_start: bind");
+		close(net->sock);
+		return -1;
+	}
+
+	// Wake up now and then so ft_net_stop is noticed
+	struct timeval tv = {0, 100000};
+	setsockopt(net->sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	net->running = true;
+	pthread_create(&(net->recv_thread), NULL, ft_net_recv_thread, net);
+
+	ft_net_msg_t msg;
+	ft_net_send(net, &msg, FT_NET_JOIN, 0, NULL);
+
+	pthread_create(&(net->send_thread), NULL, ft_net_send_thread, net);
+	return 0;
+}
+
+/*
+ * Name: ft_net_announce
+ * Function: Register a local FT job with every peer
+ */
+void ft_net_announce(ft_net_t *net, enum ft_job_type type, int index, pid_t pid)
+{
+	ft_net_msg_t msg;
+	int i;
+
+	pthread_mutex_lock(&(net->lock));
+	// Replace an older registration of the same group and type
+	for (i = 0; i < net->n_registered; i++) {
+		if (net->registered[i].index == htons(index) &&
+			net->registered[i].type == htons(type))
+			break;
+	}
+	if (i < FT_NET_MAX_REGISTERED) {
+		ft_net_fill_entry(&(net->registered[i]), index, type, pid, 0);
+		if (i == net->n_registered) net->n_registered++;
+	}
+	pthread_mutex_unlock(&(net->lock));
+
+	ft_net_fill_entry(&(msg.entry[0]), index, type, pid, 0);
+	ft_net_send(net, &msg, FT_NET_REGISTER, 1, NULL);
+}
+
+/*
+ * Name: ft_net_stop
+ * Function: Stop the transport threads
+ * Input: leave, tell peers we are going away; false simulates a node crash
+ */
+void ft_net_stop(ft_net_t *net, bool leave)
+{
+	if (leave) {
+		ft_net_msg_t msg;
+		ft_net_send(net, &msg, FT_NET_LEAVE, 0, NULL);
+	}
+	net->running = false;
+	pthread_join(net->send_thread, NULL);
+	pthread_join(net->recv_thread, NULL);
+	close(net->sock);
+}
+
+#endif
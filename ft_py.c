@@ -0,0 +1,225 @@
+/*
+	CPython extension "ft": the FT and tag client API for python clients,
+	instead of calling libft.so through ctypes.
+
+	Every call parses its arguments once in C and releases the GIL while it
+	may block (the wait for the FT manager, admission in tag_job_begin) or
+	copies, so other python threads keep running. Results take any object
+	with the buffer protocol (bytes, bytearray, memoryview, numpy arrays):
+	publish copies straight from the object into the shared result slot and
+	read_result straight into a writable one, with no python bytes in
+	between.
+
+	Functions (return codes are those of the C functions):
+	- init_wait(type, num, active=False)  --- ft_init_wait / ft_init_wait_active
+	- init_wait_spare()                   --- ft_init_wait_spare
+	- start_heartbeat(num)                --- init_ft_hb
+	- tag_begin(name, slacktime, first=False, shareable=True, mem=0)
+	- tag_end(name)                       --- also counts a frame, ft_progress
+	- progress()                          --- ft_progress
+	- progress_deadline(num, ms)          --- ft_progress_deadline
+	- set_result_policy(num, policy, quorum)  policy FIRST_WRITER or MAJORITY
+	- publish(num, voter, frame, buf)     --- ft_publish_result
+	- read_result(num, frame, buf)        --- ft_read_result
+	- last_result(num, buf)               --- ft_last_result, returns (frame, length)
+	pid and tid are those of the calling process and thread.
+
+	Build with make ft_py, it lands in lib/ next to libft.so.
+*/
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <sys/syscall.h>
+
+#include "tag_gpu.h"            // tag_job_begin, tag_job_end
+#include "ft_utils_client.c"
+
+static pid_t ft_py_tid()
+{
+	return (pid_t)syscall(SYS_gettid);
+}
+
+static PyObject *ft_py_init_wait(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"type", "num", "active", NULL};
+	const char *type;
+	int num, active = 0, res;
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "si|p", kwlist, &type, &num, &active))
+		return NULL;
+	pid_t pid = getpid(), tid = ft_py_tid();
+
+	// Blocks until the FT manager triggers this client
+	Py_BEGIN_ALLOW_THREADS
+	res = active ? ft_init_wait_active(pid, tid, type, num) : ft_init_wait(pid, tid, type, num);
+	Py_END_ALLOW_THREADS
+	return PyLong_FromLong(res);
+}
+
+static PyObject *ft_py_init_wait_spare(PyObject *self, PyObject *args)
+{
+	int res;
+	pid_t pid = getpid(), tid = ft_py_tid();
+
+	// Blocks until some main without a replica fails
+	Py_BEGIN_ALLOW_THREADS
+	res = ft_init_wait_spare(pid, tid);
+	Py_END_ALLOW_THREADS
+	return PyLong_FromLong(res);
+}
+
+static PyObject *ft_py_start_heartbeat(PyObject *self, PyObject *args)
+{
+	int num;
+	if (!PyArg_ParseTuple(args, "i", &num)) return NULL;
+	return PyLong_FromLong(init_ft_hb(num));
+}
+
+static PyObject *ft_py_tag_begin(PyObject *self, PyObject *args, PyObject *kw)
+{
+	static char *kwlist[] = {"name", "slacktime", "first", "shareable", "mem", NULL};
+	const char *name;
+	long long slacktime;
+	int first = 0, shareable = 1, res;
+	unsigned long long mem = 0;
+	if (!PyArg_ParseTupleAndKeywords(args, kw, "sL|ppK", kwlist,
+			&name, &slacktime, &first, &shareable, &mem))
+		return NULL;
+	pid_t pid = getpid(), tid = ft_py_tid();
+
+	// Blocks until mid admits the job
+	Py_BEGIN_ALLOW_THREADS
+	res = tag_job_begin(pid, tid, name, slacktime, first, shareable, mem);
+	Py_END_ALLOW_THREADS
+	return PyLong_FromLong(res);
+}
+
+static PyObject *ft_py_tag_end(PyObject *self, PyObject *args)
+{
+	const char *name;
+	int res;
+	if (!PyArg_ParseTuple(args, "s", &name)) return NULL;
+	pid_t pid = getpid(), tid = ft_py_tid();
+
+	Py_BEGIN_ALLOW_THREADS
+	res = tag_job_end(pid, tid, name);
+	Py_END_ALLOW_THREADS
+	ft_progress();
+	return PyLong_FromLong(res);
+}
+
+static PyObject *ft_py_progress(PyObject *self, PyObject *args)
+{
+	ft_progress();
+	Py_RETURN_NONE;
+}
+
+static PyObject *ft_py_progress_deadline(PyObject *self, PyObject *args)
+{
+	int num;
+	unsigned int ms;
+	if (!PyArg_ParseTuple(args, "iI", &num, &ms)) return NULL;
+	return PyLong_FromLong(ft_progress_deadline(num, ms));
+}
+
+static PyObject *ft_py_set_result_policy(PyObject *self, PyObject *args)
+{
+	int num, policy, quorum;
+	if (!PyArg_ParseTuple(args, "iii", &num, &policy, &quorum)) return NULL;
+	if (policy != FT_FIRST_WRITER && policy != FT_MAJORITY) {
+		PyErr_SetString(PyExc_ValueError, "policy must be FIRST_WRITER or MAJORITY");
+		return NULL;
+	}
+	return PyLong_FromLong(ft_set_result_policy(num, (enum ft_vote_policy)policy, quorum));
+}
+
+static PyObject *ft_py_publish(PyObject *self, PyObject *args)
+{
+	int num, voter, res;
+	unsigned long long frame;
+	Py_buffer buf;
+	if (!PyArg_ParseTuple(args, "iiKy*", &num, &voter, &frame, &buf)) return NULL;
+	if (buf.len > FT_RESULT_MAX_BYTES) {
+		PyBuffer_Release(&buf);
+		PyErr_Format(PyExc_ValueError, "result is larger than %d bytes", FT_RESULT_MAX_BYTES);
+		return NULL;
+	}
+
+	// The view keeps buf alive and unresized while the GIL is released
+	Py_BEGIN_ALLOW_THREADS
+	res = ft_publish_result(num, voter, frame, buf.buf, buf.len);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+	return PyLong_FromLong(res);
+}
+
+static PyObject *ft_py_read_result(PyObject *self, PyObject *args)
+{
+	int num, res;
+	unsigned long long frame;
+	Py_buffer buf;
+	if (!PyArg_ParseTuple(args, "iKw*", &num, &frame, &buf)) return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	res = ft_read_result(num, frame, buf.buf, buf.len);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+	return PyLong_FromLong(res);
+}
+
+static PyObject *ft_py_last_result(PyObject *self, PyObject *args)
+{
+	int num, res;
+	unsigned long long frame = 0;
+	Py_buffer buf;
+	if (!PyArg_ParseTuple(args, "iw*", &num, &buf)) return NULL;
+
+	Py_BEGIN_ALLOW_THREADS
+	res = ft_last_result(num, &frame, buf.buf, buf.len);
+	Py_END_ALLOW_THREADS
+	PyBuffer_Release(&buf);
+	return Py_BuildValue("(Ki)", frame, res);
+}
+
+static PyMethodDef ft_py_methods[] = {
+	{"init_wait", (PyCFunction)(void (*)(void))ft_py_init_wait, METH_VARARGS | METH_KEYWORDS,
+		"init_wait(type, num, active=False): register as main or replica of group num "
+		"and wait to be triggered, then start the heartbeat"},
+	{"init_wait_spare", ft_py_init_wait_spare, METH_NOARGS,
+		"init_wait_spare(): wait as a spare of any group, returns the group taken over "
+		"once its heartbeat started, -1 on error"},
+	{"start_heartbeat", ft_py_start_heartbeat, METH_VARARGS,
+		"start_heartbeat(num): beat the heartbeat of group num from a C thread"},
+	{"tag_begin", (PyCFunction)(void (*)(void))ft_py_tag_begin, METH_VARARGS | METH_KEYWORDS,
+		"tag_begin(name, slacktime, first=False, shareable=True, mem=0): wait for the GPU"},
+	{"tag_end", ft_py_tag_end, METH_VARARGS,
+		"tag_end(name): release the GPU, and count a frame for the progress watchdog"},
+	{"progress", ft_py_progress, METH_NOARGS,
+		"progress(): count a frame for the progress watchdog"},
+	{"progress_deadline", ft_py_progress_deadline, METH_VARARGS,
+		"progress_deadline(num, ms): fail group num over after ms without a frame, 0: off"},
+	{"set_result_policy", ft_py_set_result_policy, METH_VARARGS,
+		"set_result_policy(num, policy, quorum)"},
+	{"publish", ft_py_publish, METH_VARARGS,
+		"publish(num, voter, frame, buf): offer the result or checkpoint of a frame"},
+	{"read_result", ft_py_read_result, METH_VARARGS,
+		"read_result(num, frame, buf): copy the accepted result of a frame into buf, "
+		"returns its length, 0 if undecided, -1 if gone"},
+	{"last_result", ft_py_last_result, METH_VARARGS,
+		"last_result(num, buf): copy the newest accepted result of group num into buf, "
+		"returns (frame, length), length 0 if there is none"},
+	{NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef ft_py_module = {
+	PyModuleDef_HEAD_INIT, "ft", "FT and tag client API of cuMiddleware", -1, ft_py_methods
+};
+
+PyMODINIT_FUNC PyInit_ft(void)
+{
+	PyObject *m = PyModule_Create(&ft_py_module);
+	if (m == NULL) return NULL;
+	PyModule_AddIntConstant(m, "FIRST_WRITER", FT_FIRST_WRITER);
+	PyModule_AddIntConstant(m, "MAJORITY", FT_MAJORITY);
+	PyModule_AddIntConstant(m, "RESULT_MAX_BYTES", FT_RESULT_MAX_BYTES);
+	PyModule_AddIntConstant(m, "MAX_GROUPS", FT_HB_DATA_MAX_DATA);
+	return m;
+}
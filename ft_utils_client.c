@@ -4,15 +4,22 @@
 	
 	- ft_init_wait  --- called in client
 	   - tag_ft_job_begin                
-	     - init_ft_jobs
-	     - build_ft_job
-	     - submit_ft_job
+	     - submit_ft_request
+	       - init_ft_jobs / init_ft_jobs_shard
+	       - build_ft_job
+	       - submit_ft_job
 	     - sem_wait
-	     - sem_destroy
-	     - destroy_ft_job
+	     - finish_ft_request
+	       - sem_destroy
+	       - destroy_ft_job
 	   - init_ft_hb
 	     - heartbeat_thread
-	       - init_ft_data
+	       - init_ft_data_shard
+	- ft_init_wait_active --- same as ft_init_wait, replica runs next to main
+	- ft_init_wait_spare  --- replica of whichever group fails first
+	- ft_publish_result / ft_read_result / ft_last_result --- per-frame result slots
+	  - init_ft_results
+	- ft_progress_deadline / ft_progress --- frame progress watchdog, called in client
 
 	Ruiying Wu (ECE)
 	5/2020
@@ -31,6 +38,10 @@
 
 static int client_FT_fd = 0;    // fd pointing to heartbeat shared region
 static ft_data_t *client_FT_data = NULL; // heartbeat data structure
+static bool client_hb_replica = false;   // active replica beats into replica_heart_beat
+static int client_ft_node = 0;  // NUMA node of the shards this client uses
+static unsigned long long *client_progress = NULL; // frame counter, set by heartbeat_thread
+static unsigned long long client_frames = 0;
 
 
 /*
@@ -44,11 +55,32 @@ void* heartbeat_thread(void *varpg)
 	int index = *(int *)varpg;
 
 	/* FT hearbeat checker */
-	/* First, init FT data if not already*/
+	/* First, init FT data of our NUMA node if not already*/
 	if (client_FT_data == NULL) {
-		FT_DEBUG_FN(init_ft_data, &client_FT_fd, &client_FT_data, false, index);
+		FT_DEBUG_FN(init_ft_data_shard, &client_FT_fd, &client_FT_data, false, client_ft_node);
 		close(client_FT_fd); 
 	}
+	// Stay on the node of the shard, unless FT_RT_CLIENT_HB pins the thread
+	const char *rt_spec = getenv("FT_RT_CLIENT_HB");
+	if (client_ft_node > 0 && !(rt_spec && strchr(rt_spec, '@')))
+		(void) ft_numa_run_on(client_ft_node);
+	(void) ft_rt_thread("CLIENT_HB");
+	(void) ft_rt_mlock(client_FT_data, FT_DATA_SIZE);
+
+	/* Tell the server which shard to watch, in shard 0 */
+	ft_data_t *base = client_FT_data;
+	if (client_ft_node > 0) {
+		FT_DEBUG_FN(init_ft_data_shard, &client_FT_fd, &base, false, 0);
+		close(client_FT_fd);
+	}
+	if (client_hb_replica) base->replica_hb_node[index] = client_ft_node;
+	else base->hb_node[index] = client_ft_node;
+	if (base != client_FT_data) munmap(base, FT_DATA_SIZE);
+
+	/* Pick the heartbeat array, an active replica must not refresh the main's */
+	unsigned long long *beat = client_hb_replica ?
+		&(client_FT_data->replica_heart_beat[index]) :
+		&(client_FT_data->heart_beat[index]);
 
 	/* Next, update the heart beat in the shared memory*/
 	clock_t start, end;
@@ -60,13 +92,13 @@ void* heartbeat_thread(void *varpg)
 
 	while(1){
 
-		if(client_FT_data->heart_beat[index] > 100){
+		if(*beat > 100){
 			// Refresh the heartbeat when it is bigger than 100
-			client_FT_data->heart_beat[index] = 0;
+			*beat = 0;
 		}
 		else{
 			// Increment heartbeat every 1ms
-			client_FT_data->heart_beat[index] ++;
+			(*beat) ++;
 		}
 
 		end = clock();
@@ -93,6 +125,15 @@ int init_ft_hb(int index)
 {
 	pthread_t helper_thread;
 
+	/* Map the heartbeats here, so frames count from the return on */
+	if (client_FT_data == NULL) {
+		FT_DEBUG_FN(init_ft_data_shard, &client_FT_fd, &client_FT_data, false, client_ft_node);
+		close(client_FT_fd);
+	}
+	__atomic_store_n(&client_progress, client_hb_replica ?
+		&(client_FT_data->replica_progress[index]) :
+		&(client_FT_data->progress[index]), __ATOMIC_RELEASE);
+
 	printf("Creating the heartbeat thread...\n");
 	int * idx = (int *) malloc(sizeof(int));
 	*idx = index;
@@ -101,23 +142,79 @@ int init_ft_hb(int index)
 	return 0;
 }
 
+/*
+ * Name: ft_progress_deadline
+ * Function: Have the FT manager fail the group over when its client goes
+ *           deadline_ms without a frame (ft_progress), even though its
+ *           heartbeat thread still beats; 0 stops watching
+ * Return: 0 on success, -1 if the heartbeat region can't be mapped
+ */
+int ft_progress_deadline(int index, unsigned int deadline_ms)
+{
+	int fd;
+	ft_data_t *base;
+	if (index < 0 || index >= FT_HB_DATA_MAX_DATA) return -1;
+	if (init_ft_data_shard(&fd, &base, false, 0) < 0) return -1;
+	close(fd);
+	__atomic_store_n(&(base->progress_deadline_ms[index]), deadline_ms, __ATOMIC_RELAXED);
+	munmap(base, FT_DATA_SIZE);
+	return 0;
+}
+
+/*
+ * Name: ft_progress
+ * Function: Count one frame done, once per frame from the threads doing the
+ *           work (say after tag_job_end); one relaxed store, a no-op
+ *           before init_ft_hb. Threads of a client may race on the count,
+ *           any change is progress.
+ */
+void ft_progress()
+{
+	unsigned long long *p = __atomic_load_n(&client_progress, __ATOMIC_ACQUIRE);
+	if (p) __atomic_store_n(p, ++client_frames, __ATOMIC_RELAXED);
+}
+
 //==========================================================================================================
 /*
  * Name: submit_ft_job
  * Function: add a ft job's name to ft-jobs list
+ * Return: 0 on success, -1 if the list and all its overflow segments are
+ *         full or its lock is unusable
  */
-void submit_ft_job(ft_jobs_t *fj, ft_job_t *new_job, char *job_name){
+int submit_ft_job(ft_jobs_t *fj, ft_job_t *new_job, char *job_name){
 	// First, grab the requests_q_lock to modify job_name list
-	pthread_mutex_lock(&(fj->requests_q_lock));
+	// (repairs the list if a previous submitter died holding it)
+	if (robust_mutex_lock(&(fj->requests_q_lock), repair_ft_jobs, fj, false) != 0) {
+		fprintf(stderr, "Failed to lock ft-jobs list\n");
+		return -1;
+	}
+	// Fill the list, then its overflow segments one after the other
+	int *count;
+	char (*names)[JOB_MEM_NAME_MAX_LEN];
+	int k = fj->fill_seg;
+	int cap = ft_jobs_slots(fj, k, false, &count, &names);
+	if (cap >= 0 && *count >= cap) {
+		k++;
+		cap = ft_jobs_slots(fj, k, k > fj->n_segs, &count, &names);
+		if (cap >= 0) {
+			if (k > fj->n_segs) fj->n_segs = k;
+			fj->fill_seg = k;
+		}
+	}
+	if (cap < 0 || *count >= cap) {
+		pthread_mutex_unlock(&(fj->requests_q_lock));
+		fprintf(stderr, "ft-jobs list is full\n");
+		return -1;
+	}
 
-	// Then modify job_names
-	strncpy(fj->job_names[fj->total_count], job_name, JOB_MEM_NAME_MAX_LEN);
-	fj->total_count += 1;
-	printf("Added FT job (%s)\n\n", fj->job_names[fj->total_count-1]);
+	// Then modify job_names, the name only counts once it is fully written
+	strncpy(names[*count], job_name, JOB_MEM_NAME_MAX_LEN);
+	*count += 1;
+	printf("Added FT job (%s)\n\n", job_name);
 
 	// Lastly, unlock
 	pthread_mutex_unlock(&(fj->requests_q_lock));
-	return;
+	return 0;
 }
 
 /*
@@ -125,8 +222,8 @@ void submit_ft_job(ft_jobs_t *fj, ft_job_t *new_job, char *job_name){
  * Function: Create a shared memory for a FT job based on its job name
  */
 int build_ft_job(pid_t pid, pid_t tid, const char *job_name,
-				enum ft_job_type curr_type, ft_job_t **save_new_job,
-				char *copy_ft_job_name, int num){
+				enum ft_job_type curr_type, enum ft_mode mode,
+				ft_job_t **save_new_job, char *copy_ft_job_name, int num){
 	
 	// First construct FT job name for shared memory region
 	char ft_job_name[JOB_MEM_NAME_MAX_LEN];
@@ -167,6 +264,7 @@ int build_ft_job(pid_t pid, pid_t tid, const char *job_name,
 	ft_job->req_type = curr_type;
 	ft_job->num = num;// store arg2 value
 	ft_job->is_executed = 0;
+	ft_job->mode = mode;
 
 	// Second, init client-server semaphore and state
 	int pshared = 1; // If pshared is nonzero, then the semaphore is shared between
@@ -203,18 +301,30 @@ static ft_jobs_t *ft_jobs = NULL;
 static int ft_fd = 0;
 
 /*
- * Name: tag_ft_job_begin
- * Function: Create a shared memory for ft job,
- *           Add job's name to ft-jobs list, 
- *           Wait for the wakeup.
+ * Name: submit_ft_request
+ * Function: First half of tag_ft_job_begin_mode: create a shared memory for
+ *           ft job <label>_<tid> and add its name to ft-jobs list
+ * Input: label, names the shared memory, ft_job_name unless a thread has
+ *        several requests outstanding
+ * Output: *job, the ft job to wait on, client_wake is posted by the server
+ * Return: 0 on success, -1 otherwise
  */
-int tag_ft_job_begin(pid_t pid, pid_t tid, 
-	const char* ft_job_name, int num){
+int submit_ft_request(pid_t pid, pid_t tid, const char *ft_job_name, const char *label,
+	int num, enum ft_mode mode, ft_job_t **job){
 	
-	/* First, init ft jobs if not already */
+	/* First, init ft jobs if not already, the list of our NUMA node if the
+	 * server made one per node */
 	if (ft_jobs == NULL) {
 		FT_DEBUG_FN(init_ft_jobs, &ft_fd, &ft_jobs, false);
 		close(ft_fd);
+		int node = ft_numa_node();
+		if (node > 0 && node < __atomic_load_n(&(ft_jobs->n_shards), __ATOMIC_ACQUIRE)) {
+			ft_jobs_t *base = ft_jobs;
+			FT_DEBUG_FN(init_ft_jobs_shard, &ft_fd, &ft_jobs, false, node);
+			close(ft_fd);
+			munmap(base, FT_JOBS_SIZE);
+			client_ft_node = node;
+		}
 	}
 
 	/* Next, build a ft_job_t in shared memory */
@@ -234,21 +344,30 @@ int tag_ft_job_begin(pid_t pid, pid_t tid,
 	}
 
 	// Create and init ft job shared memory in build_ft_job
-	FT_DEBUG_FN(build_ft_job, pid, tid, ft_job_name,
-			curr_type,
+	FT_DEBUG_FN(build_ft_job, pid, tid, label,
+			curr_type, mode,
 			&tagged_job,
 			job_name, num);
 
 	/* Then, enqueue name of ft job to ft-jobs list */
-	submit_ft_job(ft_jobs, tagged_job, job_name);
+	if (submit_ft_job(ft_jobs, tagged_job, job_name) < 0) {
+		sem_destroy(&(tagged_job->client_wake));
+		destroy_ft_job(&tagged_job);
+		return -1;
+	}
     printf("Submitted FT job to ft-jobs list.\n\n");
-	/* 
-	 * Finally, sem_wait on tagged_job, will wake when server allows client 
-	 * to wake or notifies client to wake
-	 */
-	printf("Waiting FT job (%s) be waked...\n", tagged_job->job_name);
-	sem_wait(&(tagged_job->client_wake));
-	printf("Waked up FT job (%s)\n\n", tagged_job->job_name);
+	*job = tagged_job;
+	return 0;
+}
+
+/*
+ * Name: finish_ft_request
+ * Function: Second half of tag_ft_job_begin_mode, once client_wake of the
+ *           ft job was posted: unmap it and read the server's decision
+ * Return: 0 if the job may run, -1 otherwise
+ */
+int finish_ft_request(ft_job_t **job, pid_t tid, const char *ft_job_name){
+	ft_job_t *tagged_job = *job;
 
 	// Destroy the sem
 	sem_destroy(&(tagged_job->client_wake)); //
@@ -261,7 +380,7 @@ int tag_ft_job_begin(pid_t pid, pid_t tid,
 	 * removing clients reference to shm object 
 	 */
 	fprintf(stdout, "Destroying shared job...\n");
-	FT_DEBUG_FN(destroy_ft_job, &tagged_job);
+	FT_DEBUG_FN(destroy_ft_job, job);
 	fprintf(stdout, "Destroyed shared job\n\n");
 
 	/* 
@@ -274,7 +393,40 @@ int tag_ft_job_begin(pid_t pid, pid_t tid,
 	} else {
 		return 0;
 	}
+}
+
+/*
+ * Name: tag_ft_job_begin_mode
+ * Function: Create a shared memory for ft job,
+ *           Add job's name to ft-jobs list, 
+ *           Wait for the wakeup.
+ * Input: mode, FT_ACTIVE replicas are woken right away by the server
+ */
+int tag_ft_job_begin_mode(pid_t pid, pid_t tid, 
+	const char* ft_job_name, int num, enum ft_mode mode){
+	ft_job_t *tagged_job;
+
+	if (submit_ft_request(pid, tid, ft_job_name, ft_job_name, num, mode, &tagged_job) < 0)
+		return -1;
+
+	/* 
+	 * Finally, sem_wait on tagged_job, will wake when server allows client 
+	 * to wake or notifies client to wake
+	 */
+	printf("Waiting FT job (%s) be waked...\n", tagged_job->job_name);
+	sem_wait(&(tagged_job->client_wake));
+	printf("Waked up FT job (%s)\n\n", tagged_job->job_name);
 
+	return finish_ft_request(&tagged_job, tid, ft_job_name);
+}
+
+/*
+ * Name: tag_ft_job_begin
+ * Function: tag_ft_job_begin_mode for the default passive replica
+ */
+int tag_ft_job_begin(pid_t pid, pid_t tid, 
+	const char* ft_job_name, int num){
+	return tag_ft_job_begin_mode(pid, tid, ft_job_name, num, FT_PASSIVE);
 }
 
 //==========================================================================================================
@@ -307,6 +459,242 @@ int ft_init_wait(pid_t pid, pid_t tid,
 
 }
 
+/*
+ * Name: ft_init_wait_active
+ * Function: Same as ft_init_wait, but the replica is triggered at once and
+ *           runs concurrently with its main. Both should publish every frame
+ *           with ft_publish_result.
+ */
+int ft_init_wait_active(pid_t pid, pid_t tid, 
+	const char* ft_job_name, int num){
+	
+	int res;
+
+	/* Replica beats on its own array so the main's death stays visible */
+	client_hb_replica = !strcmp(ft_job_name, "replica");
+
+	res = tag_ft_job_begin_mode(pid, tid, ft_job_name, num, FT_ACTIVE);
+	if(res < 0) {
+		fprintf(stderr, "Failed to tag fit job");
+		return EXIT_FAILURE;
+	}
+
+	if((res = init_ft_hb(num)) < 0) 
+	{
+		fprintf(stderr, "Failed to init ft");
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
+
+/*
+ * Name: ft_init_wait_spare
+ * Function: Same as ft_init_wait for a replica of no group: wait in the
+ *           spare pool of the server until a main without a replica of its
+ *           own fails, then beat for that group. The spare only then loads
+ *           the group's model and checkpoint (ft_last_result, say), so it
+ *           holds no group's memory while it waits.
+ * Return: the group taken over, -1 on error
+ */
+int ft_init_wait_spare(pid_t pid, pid_t tid)
+{
+	ft_job_t *tagged_job;
+
+	if (submit_ft_request(pid, tid, "replica", "spare", FT_SPARE_ANY, FT_SPARE, &tagged_job) < 0) {
+		fprintf(stderr, "Failed to tag fit job");
+		return -1;
+	}
+	printf("Waiting FT job (%s) be waked...\n", tagged_job->job_name);
+	sem_wait(&(tagged_job->client_wake));
+	printf("Waked up FT job (%s)\n\n", tagged_job->job_name);
+
+	// The server set num before waking us
+	int num = tagged_job->num;
+	if (finish_ft_request(&tagged_job, tid, "spare") < 0) return -1;
+	if (num < 0 || num >= FT_HB_DATA_MAX_DATA) return -1;
+
+	// Beat right away, loading the checkpoint may take longer than a miss
+	if (init_ft_hb(num) < 0)
+	{
+		fprintf(stderr, "Failed to init ft");
+		return -1;
+	}
+	return num;
+}
+
+//==========================================================================================================
+
+static ft_results_t *client_FT_results = NULL;
+static int client_FR_fd = 0;
+
+/*
+ * Name: ft_set_result_policy
+ * Function: Choose first-writer-wins or quorum voting for a group's frames
+ */
+int ft_set_result_policy(int num, enum ft_vote_policy policy, int quorum)
+{
+	if (num < 0 || num >= FT_HB_DATA_MAX_DATA) return -1;
+	if (quorum < 1 || quorum > FT_RESULT_MAX_VOTERS) return -1;
+	if (client_FT_results == NULL) {
+		FT_DEBUG_FN(init_ft_results, &client_FR_fd, &client_FT_results, false);
+		close(client_FR_fd);
+	}
+	client_FT_results->quorum[num] = quorum;
+	client_FT_results->policy[num] = policy;
+	return 0;
+}
+
+/*
+ * Name: ft_publish_result
+ * Function: Offer the output of one frame of group num.
+ * Input: voter, 0 for main, 1 for replica (2 for an extra voter)
+ * Return: 0 when this output was accepted for the frame,
+ *         1 when another output was (or may still be) accepted instead,
+ *         -1 on error or when the frame's slot was already reused.
+ */
+int ft_publish_result(int num, int voter, unsigned long long frame,
+	const void *buf, size_t len)
+{
+	if (num < 0 || num >= FT_HB_DATA_MAX_DATA) return -1;
+	if (voter < 0 || voter >= FT_RESULT_MAX_VOTERS) return -1;
+	if (len > FT_RESULT_MAX_BYTES) return -1;
+	if (client_FT_results == NULL) {
+		FT_DEBUG_FN(init_ft_results, &client_FR_fd, &client_FT_results, false);
+		close(client_FR_fd);
+	}
+
+	ft_result_slot_t *slot = &(client_FT_results->slot[num][frame % FT_RESULT_SLOTS]);
+	unsigned long long want = frame + 1;
+
+	if (client_FT_results->policy[num] == FT_FIRST_WRITER) {
+		/* First writer to move claimed up to frame+1 owns the slot */
+		unsigned long long cur = __atomic_load_n(&(slot->claimed), __ATOMIC_ACQUIRE);
+		while (cur < want) {
+			if (__atomic_compare_exchange_n(&(slot->claimed), &cur, want, false,
+						__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				// The owners of an older and a newer frame copy one at a time
+				if (robust_mutex_lock(&(slot->lock), repair_ft_result_slot, slot, false) != 0)
+					return -1;
+				if (__atomic_load_n(&(slot->claimed), __ATOMIC_ACQUIRE) != want) {
+					pthread_mutex_unlock(&(slot->lock));
+					return -1;
+				}
+				// Readers of the frame the slot held must not take the new data
+				__atomic_store_n(&(slot->decided), 0ULL, __ATOMIC_RELAXED);
+				__atomic_thread_fence(__ATOMIC_RELEASE);
+				memcpy(slot->data[0], buf, len);
+				slot->len[0] = len;
+				slot->winner = 0;
+				slot->frame = frame;
+				__atomic_store_n(&(slot->decided), want, __ATOMIC_RELEASE);
+				pthread_mutex_unlock(&(slot->lock));
+				return 0;
+			}
+		}
+		return cur == want ? 1 : -1;
+	}
+
+	/* FT_MAJORITY: accept the first output that quorum voters agree on */
+	int res = 1;
+	if (robust_mutex_lock(&(slot->lock), repair_ft_result_slot, slot, false) != 0)
+		return -1;
+	if (slot->frame != frame) {
+		if ((slot->n_votes > 0 || slot->decided) && slot->frame > frame) {
+			pthread_mutex_unlock(&(slot->lock));
+			return -1;
+		}
+		// Slot still holds an older frame, recycle it
+		slot->frame = frame;
+		slot->n_votes = 0;
+		__atomic_store_n(&(slot->decided), 0ULL, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+	if (slot->decided == want || slot->n_votes >= FT_RESULT_MAX_VOTERS) {
+		pthread_mutex_unlock(&(slot->lock));
+		return slot->decided == want ? 1 : -1;
+	}
+
+	int v = slot->n_votes++;
+	slot->digest[v] = ft_result_digest(buf, len);
+	slot->len[v] = len;
+	memcpy(slot->data[v], buf, len);
+
+	int i, agree = 0;
+	for (i = 0; i <= v; i++) {
+		if (slot->digest[i] == slot->digest[v] && slot->len[i] == len) agree++;
+	}
+	if (agree >= client_FT_results->quorum[num]) {
+		slot->winner = v;
+		__atomic_store_n(&(slot->decided), want, __ATOMIC_RELEASE);
+		res = 0;
+	}
+	pthread_mutex_unlock(&(slot->lock));
+	return res;
+}
+
+/*
+ * Name: ft_read_result
+ * Function: Copy the accepted output of a frame of group num into buf
+ * Return: length copied, 0 if the frame is not decided yet,
+ *         -1 if the slot was reused by a newer frame or buf is too small
+ */
+int ft_read_result(int num, unsigned long long frame, void *buf, size_t cap)
+{
+	if (num < 0 || num >= FT_HB_DATA_MAX_DATA) return -1;
+	if (client_FT_results == NULL) {
+		FT_DEBUG_FN(init_ft_results, &client_FR_fd, &client_FT_results, false);
+		close(client_FR_fd);
+	}
+
+	ft_result_slot_t *slot = &(client_FT_results->slot[num][frame % FT_RESULT_SLOTS]);
+	unsigned long long want = frame + 1;
+	unsigned long long decided = __atomic_load_n(&(slot->decided), __ATOMIC_ACQUIRE);
+	if (decided < want) return 0;
+	if (decided > want) return -1;
+
+	int w = slot->winner;
+	size_t len = slot->len[w];
+	if (len > cap) return -1;
+	memcpy(buf, slot->data[w], len);
+
+	// A newer frame may have recycled the slot while copying: its writer
+	// clears decided before touching the data
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&(slot->decided), __ATOMIC_RELAXED) != want) return -1;
+	return (int)len;
+}
+
+/*
+ * Name: ft_last_result
+ * Function: Copy the accepted output of the newest decided frame of group
+ *           num into buf, the checkpoint a spare resumes from
+ * Output: *frame, that frame
+ * Return: as ft_read_result, 0 if no frame of the group is decided
+ */
+int ft_last_result(int num, unsigned long long *frame, void *buf, size_t cap)
+{
+	if (num < 0 || num >= FT_HB_DATA_MAX_DATA) return -1;
+	if (client_FT_results == NULL) {
+		FT_DEBUG_FN(init_ft_results, &client_FR_fd, &client_FT_results, false);
+		close(client_FR_fd);
+	}
+
+	// A newer frame may recycle the slot while copying, try the newest again
+	int s, tries, res = -1;
+	for (tries = 0; tries < FT_RESULT_SLOTS && res < 0; tries++) {
+		unsigned long long newest = 0;
+		for (s = 0; s < FT_RESULT_SLOTS; s++) {
+			unsigned long long d = __atomic_load_n(&(client_FT_results->slot[num][s].decided),
+				__ATOMIC_ACQUIRE);
+			if (d > newest) newest = d;
+		}
+		if (newest == 0) return 0;
+		*frame = newest - 1;
+		res = ft_read_result(num, *frame, buf, cap);
+	}
+	return res;
+}
+
 #endif
 
 
@@ -3,11 +3,23 @@
 	Following shows how these functions are related to each other:
 	
 	- launch_ft_man  --- called in server
+	   - init_ft_shards --- one heartbeat region and ft-jobs list per NUMA node
 	   - ft_jobs_thread                
-	     - peek_ft_job_queued_at_i
-	     	- get_ft_job
+	     - ft_drain_jobs
+	       - take_ft_jobs, see ft_lib.h
+	       - get_ft_job
 	     - trigger_ft_job
+	   - ft_jobs_shard_thread --- ft_drain_jobs of the other nodes
 	   - ft_hb_thread
+	     - ft_take_spare --- a pooled spare for a group without a replica
+	     - ft_take_over  --- wake the replica (or spare) of a failed main
+	   - launch_ft_net (only when FT_NET_PORT is set)
+	     - ft_net_start, see ft_net.cpp
+	- ft_active_replica  --- called in server admission (mymid.cpp)
+	- ft_promoted_replica / ft_drop_promoted --- replicas that took over,
+	  for failover-aware admission (mymid.cpp, sched_set_failover)
+	- recover_ft_jobs    --- called by launch_ft_man after a mid restart
+	- ft_persist_groups  --- FT group table into mid_state, see mid_state.cpp
 
 	Ruiying Wu (ECE)
 	5/2020
@@ -16,25 +28,45 @@
 #define FT_UTILS_SERVER
 
 #include <unordered_map>	// std::unordered_map
+#include <vector>           // std::vector
+#include <string>           // std::string
 #include <semaphore.h>	    // sem_t, sem_*()
 #include "ft_lib.h"         // ft_data_t, ft_job_t, ft_jobs_t, 
                             // init_ft_data, init_ft_jobs
-
-static int FT_fd = 0;       // fd pointing to heartbeat shared memory region
-static ft_data_t *FT_data = NULL; // heartbeat data structure
+#include "ft_net.cpp"       // ft_net_t, cross-node heartbeats
+#include "mid_state.cpp"    // mid_state_record_ft, FT group table
+#include "mid_trace.cpp"    // MID_TRACE_EVENT
+#include "mid_stats.h"      // mid_stats_t, live statistics page
+#include "mid_bell.h"       // mid_bell_t, doorbells of async clients
+
+static ft_data_t *FT_data = NULL; // heartbeat data structure, shard of node 0
+static ft_data_t *FT_shards[FT_NUMA_MAX_NODES]; // heartbeat shard of every node
+static ft_jobs_t *FJ_shards[FT_NUMA_MAX_NODES]; // ft-jobs list of every node
+static int FT_n_shards = 1;
+static int FR_fd = 0;       // fd pointing to active-active result slots
+static ft_results_t *FR = NULL;
 
 pthread_mutex_t lock;// lock for running and sleeping job list
 
+static mid_stats_t *STATS = NULL;  // statistics page, mapped by mid if at all
+static mid_bell_t *BELL = NULL;    // client doorbells, mapped by mid if at all
+
+static ft_net_t FT_net;            // transport to FT managers on other nodes
+static bool ft_net_enabled = false;
+
 /* Name: trigger_ft_job
  * Function: Wake client with ability to run job
  * Input: tj, which is a ft job
  */
 int trigger_ft_job(ft_job_t *tj) {
 	if (!tj) return -1;
+	MID_TRACE_EVENT(TRACE_FT_TRIGGER, tj->pid, tj->tid, tj->job_name, tj->num, tj->req_type);
 	
 	// Set client's execution flag to run
 	tj->client_exec_allowed = true;
-	return sem_post(&(tj->client_wake));// Unlock the semophora
+	int res = sem_post(&(tj->client_wake));// Unlock the semophora
+	mid_bell_ring(BELL, tj->pid);
+	return res;
 }
 
 /*
@@ -52,7 +84,7 @@ int get_ft_job(const char *name, ft_job_t **save_job)
         return -1;
     }
 
-    printf("Getting FT job (%s, fd = %d)\n", name, fd);
+    MID_LOG("Getting FT job (%s, fd = %d)\n", name, fd);
 
 	// Mmap the job_t object stored in shared memory
 	ft_job_t *ft_job = (ft_job_t *)
@@ -69,40 +101,235 @@ int get_ft_job(const char *name, ft_job_t **save_job)
         return -1;
     }  
 
-	// Client opened the shared memory, it should still have a reference to
-	// This only destroys local connection to shared memory object
-	shm_destroy(name, fd);
+	// Keep the name until the job leaves the FT lists, a restarted mid
+	// maps the job again by name (see recover_ft_jobs)
+	close(fd);
 	*save_job = ft_job;
  	return 0;
 }
 
+// Global lists that store either running ft job or sleeping ft job
+static std::unordered_map<std::string, ft_job_t*> running_ft_jobs; // store running job
+static std::unordered_map<std::string, ft_job_t*> sleeping_ft_jobs; // store sleeping job
+static std::unordered_map<std::string, ft_job_t*> active_ft_jobs; // replicas running next to main
+static std::unordered_map<pid_t, int> active_replica_pids; // active replica pid -> group index
+static std::vector<ft_job_t*> spare_ft_jobs; // spares of no group yet, the last one is taken first
+static std::unordered_map<pid_t, int> promoted_replica_pids; // replicas woken by failover -> group index
+
+// Set whenever the lists above change, ft_jobs_thread then persists them
+static volatile bool ft_groups_dirty = false;
+
 /*
- * Name: peek_ft_job_queued_at_i
- * Function: called in ft_jobs_thread to get a ft job with a name in ft-jobs list
- * Input: fj, which is the ft-jobs list; qd_job, which is the ft job found; i, 
- * index to get a job name
- * Return: res, indicating whether a ft job is got
+ * Name: ft_persist_groups
+ * Function: Write the running, sleeping and active lists into the FT group
+ *           table of mid_state, so a restarted mid can rebuild them
  */
-int peek_ft_job_queued_at_i(ft_jobs_t *fj, ft_job_t **qd_job, int i)
+void ft_persist_groups()
 {
-	assert(fj != NULL);
-	assert(fj->total_count > 0);
-	assert(fj->total_count > i);
-
-	// Grab the name from job_shm_names 
-	char *ft_job_mem_name = fj->job_names[i];
-	int res = get_ft_job(ft_job_mem_name, qd_job); // Get the ith ft_job
-	return res;
+	int where[FT_HB_DATA_MAX_DATA][2];
+	const char *names[FT_HB_DATA_MAX_DATA][2];
+	memset(where, 0, sizeof(where));
+	memset(names, 0, sizeof(names));
+
+	std::unordered_map<std::string, ft_job_t*> *lists[3] =
+		{&running_ft_jobs, &sleeping_ft_jobs, &active_ft_jobs};
+	int list_where[3] = {MID_FT_RUNNING, MID_FT_SLEEPING, MID_FT_ACTIVE};
+
+	pthread_mutex_lock(&lock);
+	ft_groups_dirty = false;
+	int l, g;
+	for (l = 0; l < 3; l++) {
+		for (auto &it : *lists[l]) {
+			ft_job_t *j = it.second;
+			if (j->num < 0 || j->num >= FT_HB_DATA_MAX_DATA) continue;
+			where[j->num][j->req_type] = list_where[l];
+			names[j->num][j->req_type] = j->job_name;
+		}
+	}
+	for (g = 0; g < FT_HB_DATA_MAX_DATA; g++) {
+		mid_state_record_ft(g, MAIN, where[g][MAIN], names[g][MAIN]);
+		mid_state_record_ft(g, REPLICA, where[g][REPLICA], names[g][REPLICA]);
+	}
+	pthread_mutex_unlock(&lock);
 }
 
-// Global lists that store either running ft job or sleeping ft job
-static std::unordered_map<std::string, ft_job_t*> running_ft_jobs; // store running job
-static std::unordered_map<std::string, ft_job_t*> sleeping_ft_jobs; // store sleeping job
+/*
+ * Name: recover_ft_jobs
+ * Function: Rebuild the running, sleeping and active lists from the FT group
+ *           table left behind by a crashed mid. Jobs whose shm object is gone
+ *           are dropped.
+ * Return: number of recovered FT jobs
+ */
+int recover_ft_jobs()
+{
+	int g, t, n = 0;
+	char key[JOB_MEM_TYPE_MAX_LEN];
+	if (!MS) return 0;
+
+	for (g = 0; g < FT_HB_DATA_MAX_DATA; g++) {
+		for (t = MAIN; t <= REPLICA; t++) {
+			mid_state_ft_t *sf = &(MS->ft[g]);
+			if (sf->where[t] == MID_FT_NONE) continue;
+
+			ft_job_t *j;
+			if (get_ft_job(sf->shm_name[t], &j) < 0 || j->pid == 0) {
+				// Client went away while mid was down
+				unlink_shared_job(sf->shm_name[t], sizeof(ft_job_t));
+				sf->where[t] = MID_FT_NONE;
+				continue;
+			}
 
-// arg1 and arg2 of the job, such as main_0, replica_0
-char ft_job_type[JOB_MEM_TYPE_MAX_LEN]; 
+			sprintf(key, "%s_%d", t == MAIN ? "main" : "replica", g);
+			if (sf->where[t] == MID_FT_RUNNING) {
+				running_ft_jobs[key] = j;
+			} else if (sf->where[t] == MID_FT_SLEEPING) {
+				sleeping_ft_jobs[key] = j;
+			} else {
+				active_ft_jobs[key] = j;
+				active_replica_pids[j->pid] = g;
+			}
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Name: ft_take_spare
+ * Function: Assign a pooled spare to group index, skipping spares that
+ *           died while pooled; called holding lock
+ * Return: the spare, its num set to index, or NULL if the pool is empty
+ */
+ft_job_t *ft_take_spare(int index)
+{
+	while (!spare_ft_jobs.empty()) {
+		ft_job_t *s = spare_ft_jobs.back();
+		spare_ft_jobs.pop_back();
+		if (STATS) mid_stat_set(&(STATS->spares), spare_ft_jobs.size());
+		if (kill(s->pid, 0) < 0 && errno == ESRCH) {
+			unlink_shared_job(s->job_name, sizeof(ft_job_t));
+			continue;
+		}
+		// Read by the spare once woken, sem_post orders it
+		s->num = index;
+		return s;
+	}
+	return NULL;
+}
 
 static bool ft_continue_flag = true;
+
+/* take_ft_jobs callback of ft_drain_jobs, collects the names in a batch */
+static void ft_batch_name(const char *name, void *batch)
+{
+	((std::vector<std::string> *)batch)->push_back(name);
+}
+
+/*
+ * Name: ft_drain_jobs
+ * Function: Move the new ft jobs of one ft-jobs list, and of its overflow
+ *           segments, into the running, sleeping or active list. The names
+ *           are taken in one batch under requests_q_lock, so submitters
+ *           only wait for the copy. Every NUMA node has its own list and
+ *           drain thread, so the lists are only changed under lock.
+ * Input: curr_FJ, a ft-jobs list
+ */
+void ft_drain_jobs(ft_jobs_t *curr_FJ)
+{
+	// arg1 and arg2 of the job, such as main_0, replica_0
+	char ft_job_type[JOB_MEM_TYPE_MAX_LEN];
+	std::vector<std::string> batch;
+
+	/* FT job reader */
+	// Grab ft-jobs list lock before emptying, repairing the list if a
+	// client died inside submit_ft_job
+	if (robust_mutex_lock(&(curr_FJ->requests_q_lock), repair_ft_jobs, curr_FJ, true) != 0)
+	{
+		fprintf(stderr, "Failed to lock ft-jobs list. Continuing...\n");
+		return;
+	}
+	(void) take_ft_jobs(curr_FJ, ft_batch_name, &batch);
+	pthread_mutex_unlock(&(curr_FJ->requests_q_lock));
+
+	// Grab all new coming ft jobs of the batch
+	for (size_t i = 0; i < batch.size(); i++)
+	{
+		ft_job_t *q_job;
+
+		// Map the ft job of the ith name
+		if (get_ft_job(batch[i].c_str(), &q_job) < 0)
+		{
+			// Skip it, a bad entry must not stop the FT manager
+			fprintf(stderr, "Failed to get FT job (%s). Continuing...\n", batch[i].c_str());
+			continue;
+		}
+		MID_TRACE_EVENT(TRACE_FT_REGISTER, q_job->pid, q_job->tid, q_job->job_name,
+			q_job->num, q_job->req_type);
+
+		// Enqueue job request to right list
+		if(q_job->req_type == MAIN) {
+			// Create a lable with type and num, like main_1, main_2
+			sprintf(ft_job_type, "%s_%d", "main",q_job->num);
+			// Adding to run list
+			pthread_mutex_lock(&lock);
+			running_ft_jobs[ft_job_type] = q_job;
+			pthread_mutex_unlock(&lock);
+			printf("Adding FT job (%s) with key (%s) to running list\n",\
+			 q_job->job_name, ft_job_type);
+
+		}
+		else if(q_job->req_type == REPLICA && q_job->mode == FT_ACTIVE){
+			// Active replica: run it right away next to its main
+			sprintf(ft_job_type, "%s_%d", "replica",q_job->num);
+			pthread_mutex_lock(&lock);
+			active_ft_jobs[ft_job_type] = q_job;
+			active_replica_pids[q_job->pid] = q_job->num;
+			pthread_mutex_unlock(&lock);
+
+			q_job->is_executed = 1;
+			if(trigger_ft_job(q_job) < 0)
+			{
+				fprintf(stderr, "\tFailed to wake FT client!\n");
+			}
+			printf("Triggered active FT job (%s) with key (%s)\n",\
+				q_job->job_name, ft_job_type);
+		}
+		else if(q_job->req_type == REPLICA && q_job->mode == FT_SPARE){
+			// Spare: pool it until some main fails, it holds no group's state
+			pthread_mutex_lock(&lock);
+			spare_ft_jobs.push_back(q_job);
+			size_t n_spares = spare_ft_jobs.size();
+			if (STATS) mid_stat_set(&(STATS->spares), n_spares);
+			pthread_mutex_unlock(&lock);
+			printf("Adding FT job (%s) to the spare pool (%zu spares)\n",\
+				q_job->job_name, n_spares);
+			continue;
+		}
+		else if(q_job->req_type == REPLICA){
+			// create lable with type and num, like replica_1, replica_2
+			sprintf(ft_job_type, "%s_%d", "replica",q_job->num);
+			// adding to sleep list
+			pthread_mutex_lock(&lock);
+			sleeping_ft_jobs[ft_job_type] = q_job;
+			pthread_mutex_unlock(&lock);
+			printf("Adding FT job (%s) with key (%s) to sleeping list\n",\
+				q_job->job_name, ft_job_type);
+
+		}
+		else// Error
+		{
+			fprintf(stderr, "Failed to add job request to list.");
+		}
+
+		// Let FT managers on other nodes know about this job
+		if(ft_net_enabled)
+			ft_net_announce(&FT_net, q_job->req_type, q_job->num, q_job->pid);
+
+		// Continue onto next FT job to process
+		ft_groups_dirty = true;
+	}
+}
+
 /*
  * Name: ft_jobs_thread
  * Fucntion: keep checking the new coming ft jobs and trigger and kill a job based on the
@@ -110,84 +337,39 @@ static bool ft_continue_flag = true;
  *   1. when main is running, replica is sleeping
  *   2. when main is killed, replica will be run
  *   3. when main is restarted, replica will be killed
- * Input: FJ, which is the ft-jobs list
+ * Input: FJ, which is the ft-jobs list (of NUMA node 0)
  */
 void *ft_jobs_thread(void *FJ)
 {	
 	ft_jobs_t *curr_FJ = (ft_jobs_t*)FJ;
+	if (FT_n_shards > 1) (void) ft_numa_run_on(0);
+	(void) ft_rt_thread("FT_JOBS");
+	(void) ft_rt_mlock(curr_FJ, FT_JOBS_SIZE);
 	// Begin moving ft jobs from ft_job list to E_list or S_list
 	// check every __50_ us
 	while (ft_continue_flag)
 	{	
-		
-		/* FT job reader */
-		// Grab ft-jobs list lock before emptying
-		pthread_mutex_lock(&(curr_FJ->requests_q_lock));
-		int i = 0;
-
-		// Grab all new coming ft jobs based on ft-jobs list
-		while ((curr_FJ->total_count - i) > 0)
-		{	
-			int res;
-			ft_job_t *q_job;
-
-			// Peek a ft job from ft-jobs list
-			if ((res=peek_ft_job_queued_at_i(curr_FJ, &q_job, i)) < 0)
-			{
-				fprintf(stderr, "Failed to peek FT job at idx %d. Continuing...\n", i);
-			    return 0;
-            }
-			// Enqueue job request to right list
-			if(q_job->req_type == MAIN) {
-				// Create a lable with type and num, like main_1, main_2
-				sprintf(ft_job_type, "%s_%d", "main",q_job->num);
-				// Adding to run list
-				running_ft_jobs[ft_job_type] = q_job;
-				printf("Adding FT job (%s) with key (%s) to running list\n",\
-				 q_job->job_name, ft_job_type);
-
-			}
-			else if(q_job->req_type == REPLICA){
-				// create lable with type and num, like replica_1, replica_2
-				sprintf(ft_job_type, "%s_%d", "replica",q_job->num);
-				// adding to sleep list
-				sleeping_ft_jobs[ft_job_type] = q_job;
-				printf("Adding FT job (%s) with key (%s) to sleeping list\n",\
-					q_job->job_name, ft_job_type);
-
-			}
-			else// Error
-			{
-				fprintf(stderr, "Failed to add job request to list.");
-			}
-
-			// Continue onto next FT job to process
-			i++;
-		}
-		// Reset total count
-		curr_FJ->total_count = 0;
-		pthread_mutex_unlock(&(curr_FJ->requests_q_lock)); 
+		ft_drain_jobs(curr_FJ);
 
 		/* FT trigger and killer */
-		i = 0;
+		int i;
 		char job_type_m[JOB_MEM_TYPE_MAX_LEN]; // type and number for main
 		char job_type_r[JOB_MEM_TYPE_MAX_LEN]; // type and number for replica
 		
 		/* FT job trigger first checks out the running list to see whether
-		 * main_index and replica_index exist
+		 * main_index and replica_index exist, for every group index
 		 */
-		while((running_ft_jobs.size() - i) > 0){
+		pthread_mutex_lock(&lock);
+		for (i = 0; i < FT_HB_DATA_MAX_DATA && running_ft_jobs.size(); i++){
 			/* Create the key, main_i and replica_i */
 			sprintf(job_type_m, "%s_%d", "main",i);
 			sprintf(job_type_r, "%s_%d", "replica",i);
 
 			/* Check main and repica in runnint list */
-			pthread_mutex_lock(&lock);
+			// Held across the iteration: the drain threads of other NUMA
+			// nodes insert into the lists, which would invalidate it_m, it_r
 			auto it_m = running_ft_jobs.find(job_type_m);
 			auto it_r = running_ft_jobs.find(job_type_r);
-			pthread_mutex_unlock(&lock);
-
-			i++;
 
 			/* Check wether replica not exists and main exists */
 			if(it_r == running_ft_jobs.end() && it_m != running_ft_jobs.end()){
@@ -211,43 +393,86 @@ void *ft_jobs_thread(void *FJ)
 			}
 			else if(it_r != running_ft_jobs.end() && it_m != running_ft_jobs.end())
 			{
-				// There are both replica and main
-				// it means the main is new and replica needs to be killed.
-				if(it_r->second->is_executed == 0){
-					// Main is killed, replica needs to be wake up
-
-					// MAIN is killed, remove MAIN from running list
-					running_ft_jobs.erase(it_m);  
-
-					// Already been waked in FT heartbeat thread, no need 
-					// call trigger again, just need set a flag
-					it_r->second->is_executed = 1; 
-					printf("Triggered FT job (%s, pid=%d, tid=%d)!\n", \
-						it_r->second->job_name,it_r->second->pid, it_r->second->tid);
-				}
-				else { 
-					// Replica is running and the main is new
-					// Kill the replica and trigger the main
-					pthread_mutex_lock(&lock);
-					kill(it_r->second->pid, SIGINT); // kill replica
-					running_ft_jobs.erase(it_r);     // remove it from running list
-					pthread_mutex_unlock(&lock);
-					printf("Killed FT job (%s, pid=%d, tid=%d)!\n", \
-						it_r->second->job_name,it_r->second->pid, it_r->second->tid);
-
-					it_m->second->is_executed = 1;   // set the flag 
-					trigger_ft_job(it_m->second);    // trigger the main
-					fprintf(stdout, "Triggered FT job (%s, pid=%d, tid=%d)\n", \
-						it_m->second->job_name, it_m->second->pid, it_m->second->tid);
-				}
+				// There are both replica and main. The replica took over
+				// and ft_take_over dropped the failed main, so the main is
+				// new: kill the replica and trigger the main.
+				ft_job_t *r = it_r->second;
+				kill(r->pid, SIGINT); // kill replica
+				MID_TRACE_EVENT(TRACE_FT_KILL, r->pid, r->tid, r->job_name, r->num, 0);
+				promoted_replica_pids.erase(r->pid);
+				unlink_shared_job(r->job_name, sizeof(ft_job_t));
+				running_ft_jobs.erase(it_r);     // remove it from running list
+				ft_groups_dirty = true;
+				printf("Killed FT job (%s, pid=%d, tid=%d)!\n", \
+					r->job_name, r->pid, r->tid);
+
+				it_m->second->is_executed = 1;   // set the flag 
+				trigger_ft_job(it_m->second);    // trigger the main
+				fprintf(stdout, "Triggered FT job (%s, pid=%d, tid=%d)\n", \
+					it_m->second->job_name, it_m->second->pid, it_m->second->tid);
 			}
 		}
+		pthread_mutex_unlock(&lock);
+
+		/* Persist the lists for a restarted mid */
+		if (ft_groups_dirty)
+			ft_persist_groups();
+
 		/* Sleep before starting loop again */
 		usleep(SLEEP_MICROSECONDS);// 50 us
 	}
 	return NULL;
 }
 
+/*
+ * Name: ft_jobs_shard_thread
+ * Function: Drain the ft-jobs list of one NUMA node other than 0, running on
+ *           that node; ft_jobs_thread triggers and kills for all of them
+ * Input: the node
+ */
+void *ft_jobs_shard_thread(void *varpg)
+{
+	int node = *((int*)varpg);
+	ft_jobs_t *curr_FJ = FJ_shards[node];
+	(void) ft_numa_run_on(node);
+	(void) ft_rt_thread("FT_JOBS");
+	(void) ft_rt_mlock(curr_FJ, FT_JOBS_SIZE);
+	while (ft_continue_flag)
+	{
+		ft_drain_jobs(curr_FJ);
+		usleep(SLEEP_MICROSECONDS);
+	}
+	return NULL;
+}
+
+/*
+ * Name: ft_take_over
+ * Function: Wake replica r (or a spare) for the failed main of group index
+ *           and drop the main from the running list; called holding lock.
+ *           The replica runs from now on: it is published to the other
+ *           nodes (ft_net_collect), and killed once a main of the group
+ *           registers again, here (ft_jobs_thread) or on another node
+ *           (ft_net_on_register).
+ */
+static void ft_take_over(ft_job_t *r, int index)
+{
+	char key[JOB_MEM_TYPE_MAX_LEN];
+
+	trigger_ft_job(r);
+	r->is_executed = 1;
+	promoted_replica_pids[r->pid] = index;
+	sprintf(key, "%s_%d", "replica", index);
+	running_ft_jobs[key] = r;
+
+	sprintf(key, "%s_%d", "main", index);
+	auto it_m = running_ft_jobs.find(key);
+	if (it_m != running_ft_jobs.end()) {
+		unlink_shared_job(it_m->second->job_name, sizeof(ft_job_t));
+		running_ft_jobs.erase(it_m);
+	}
+	ft_groups_dirty = true;
+}
+
 //==========================================================================================================
 /*
  * Name: ft_hb_thread:
@@ -258,20 +483,33 @@ void *ft_jobs_thread(void *FJ)
 void *ft_hb_thread(void *varpg)
 {	
 	int index = *((int*)varpg);
-	/* First, create a FT data shared memory region*/
-	int res;
-	ft_data_t *curr_ftdata;
-
-	if((res = init_ft_data(&FT_fd, &FT_data, true, index)) < 0)
-	{
-		fprintf(stderr, "Failed to init ft data");
-		return (void*)EXIT_FAILURE;
+	/* First, reset the heartbeats of this client, the shards are mapped by launch_ft_man */
+	ft_data_t *curr_ftdata = FT_data;    // shard the main beats in
+	ft_data_t *replica_ftdata = FT_data; // shard an active replica beats in
+	int n, node = 0;
+	for (n = 0; n < FT_n_shards; n++) {
+		FT_shards[n]->heart_beat[index] = 0;
+		FT_shards[n]->replica_heart_beat[index] = 0;
+		FT_shards[n]->progress[index] = 0;
+		FT_shards[n]->replica_progress[index] = 0;
 	}
-	curr_ftdata = FT_data;
+	// The progress deadline stays: clients set it once, a fresh start cleared it
+	// With NUMA shards the thread follows the main to its node, unless
+	// FT_RT_HB pins it
+	const char *rt_spec = getenv("FT_RT_HB");
+	bool follow = FT_n_shards > 1 && !(rt_spec && strchr(rt_spec, '@'));
+	(void) ft_rt_thread("HB");
+	for (n = 0; n < FT_n_shards; n++)
+		(void) ft_rt_mlock(FT_shards[n], FT_DATA_SIZE);
 
 	/* Next, keep reading the heart beat value*/
-	unsigned long long pre_heart_beat = 0;
-	int count = 0;
+	ft_hb_monitor_t main_mon = {0, 0};
+	ft_hb_monitor_t replica_mon = {0, 0}; // active replica's own heartbeat
+	ft_progress_monitor_t main_prog = {0, 0};    // frames of the main
+	ft_progress_monitor_t replica_prog = {0, 0}; // and of the active replica
+	unsigned long long stale_ms = 0;      // checks since the heartbeat changed
+	unsigned long long detect_ns = 0;     // set while waiting for a takeover
+	bool hang_detected = false;           // the main hung, its heartbeat goes on
 
 	// timing variables 
 	double time_passed;
@@ -284,36 +522,152 @@ void *ft_hb_thread(void *varpg)
 	/* Keep tracking the heartbeat*/
 	while(1)
 	{	
-		/* Check wether the main is dead*/
-		if(pre_heart_beat == curr_ftdata->heart_beat[index]){
-			// Count the number of times at which the heartbeat doesnt change
-			count ++;
+		/* Read the shards the clients of the group beat in */
+		if (FT_n_shards > 1) {
+			int m = FT_data->hb_node[index], r = FT_data->replica_hb_node[index];
+			curr_ftdata = FT_shards[m >= 0 && m < FT_n_shards ? m : 0];
+			replica_ftdata = FT_shards[r >= 0 && r < FT_n_shards ? r : 0];
+			if (follow && m != node && m >= 0 && m < FT_n_shards) {
+				node = m;
+				(void) ft_numa_run_on(node);
+			}
 		}
-		else {
-			// Store the current heartbeat
-			pre_heart_beat = curr_ftdata->heart_beat[index]; // store the curr heartbeat as pre heart beat
-			count = 0;
+
+		// Frames of the main, watched when its client set a progress deadline
+		unsigned int deadline_ms = __atomic_load_n(&(FT_data->progress_deadline_ms[index]),
+			__ATOMIC_RELAXED);
+		unsigned long long frames = __atomic_load_n(&(curr_ftdata->progress[index]),
+			__ATOMIC_RELAXED);
+
+		/* Publish staleness, and the takeover time once the replica beats */
+		// After a hang the hung main beats on, the replica shows with its first frame
+		bool beat = curr_ftdata->heart_beat[index] != main_mon.pre_heart_beat;
+		if (hang_detected ? frames != main_prog.pre_progress : beat) {
+			if (detect_ns && STATS) {
+				unsigned long long now = mid_stats_now_ns();
+				mid_stat_set(&(STATS->group[index].last_takeover_ns), now);
+				mid_hist_add(&(STATS->detect_to_takeover_us), (now - detect_ns) / 1000);
+			}
+			detect_ns = 0;
+			hang_detected = false;
 		}
-		
-		if (count == 50 && curr_ftdata->heart_beat[index] != 0)
+		stale_ms = beat ? 0 : stale_ms + 1;
+		if (STATS) mid_stat_set(&(STATS->group[index].hb_stale_ms), stale_ms);
+
+		/* Check wether the main is dead, or alive but hung */
+		// Remote mains (ft_net) are copied into the same heartbeat array
+		bool missed = ft_hb_missed(&main_mon, curr_ftdata->heart_beat[index]);
+		bool hung = ft_progress_missed(&main_prog, frames, deadline_ms) && !missed;
+		if (hung)
+		{
+			// Its heartbeat thread beats on, but no frame for deadline_ms
+			if (STATS) {
+				mid_stat_add(&(STATS->hangs), 1);
+				mid_stat_add(&(STATS->group[index].hangs), 1);
+				mid_stat_set(&(STATS->group[index].last_detect_ns), mid_stats_now_ns());
+			}
+			MID_TRACE_EVENT(TRACE_HANG, 0, 0, NULL, index, frames);
+			hang_detected = true;
+		}
+		if (missed)
+		{
+			if (STATS) {
+				mid_stat_add(&(STATS->hb_misses), 1);
+				mid_stat_add(&(STATS->group[index].hb_misses), 1);
+				mid_stat_set(&(STATS->group[index].last_detect_ns), mid_stats_now_ns());
+			}
+			MID_TRACE_EVENT(TRACE_HB_MISS, 0, 0, NULL, index, curr_ftdata->heart_beat[index]);
+			hang_detected = false;
+		}
+		if (missed || hung)
 		{
-			// The heartbeat doesnt change for 50 times, the main is supposed to be died,
-			// wake up the replica.
+			// The heartbeat doesnt change for 50 times, or the frames for
+			// deadline_ms, the main is supposed to be died, wake up the replica.
 
 			/* Wake up replica */
+			sprintf(ft_job_type,"%s_%d", "main", index);
+			pthread_mutex_lock(&lock);
+			// A hung main is not dead: once something runs in its place, kill
+			// it, or the two run side by side when it resumes
+			pid_t hung_pid = 0, hung_tid = 0;
+			char hung_name[MAX_FT_NAME];
+			auto it_m = running_ft_jobs.find(ft_job_type);
+			if (hung && it_m != running_ft_jobs.end()) {
+				hung_pid = it_m->second->pid;
+				hung_tid = it_m->second->tid;
+				strcpy(hung_name, it_m->second->job_name);
+			}
+			bool replaced = false;
+
 			// Create the key for the replica to be stored in the running list
 			sprintf(ft_job_type,"%s_%d", "replica", index);
 			auto it_sleep_r = sleeping_ft_jobs.find(ft_job_type);
 			if(it_sleep_r != sleeping_ft_jobs.end()){
 				// wake up Replica
-				trigger_ft_job(it_sleep_r->second);
-				pthread_mutex_lock(&lock);
-				running_ft_jobs[ft_job_type] = it_sleep_r->second; // put the replica into running list
-				sleeping_ft_jobs.erase(it_sleep_r);                // remove it from sleeping list
-				pthread_mutex_unlock(&lock);
-				
+				MID_TRACE_EVENT(TRACE_FAILOVER, it_sleep_r->second->pid, it_sleep_r->second->tid,
+					it_sleep_r->second->job_name, index, 0);
+				if (STATS) {
+					mid_stat_add(&(STATS->failovers), 1);
+					mid_stat_add(&(STATS->group[index].failovers), 1);
+					detect_ns = mid_stats_now_ns();
+				}
+				ft_take_over(it_sleep_r->second, index); // put the replica into running list
+				sleeping_ft_jobs.erase(it_sleep_r);       // remove it from sleeping list
+				replaced = true;
+			}
+			else if(active_ft_jobs.find(ft_job_type) != active_ft_jobs.end()) {
+				// An active replica is already running, the failure is masked
+				printf("Main %d failed, masked by active replica\n", index);
+				replaced = true;
+			}
+			else if(running_ft_jobs.find(ft_job_type) == running_ft_jobs.end()) {
+				// No replica of its own, a spare loads the group's checkpoint
+				ft_job_t *s = ft_take_spare(index);
+				if (s) {
+					MID_TRACE_EVENT(TRACE_FAILOVER, s->pid, s->tid, s->job_name, index, 1);
+					if (STATS) {
+						mid_stat_add(&(STATS->failovers), 1);
+						mid_stat_add(&(STATS->spare_failovers), 1);
+						mid_stat_add(&(STATS->group[index].failovers), 1);
+						detect_ns = mid_stats_now_ns();
+					}
+					ft_take_over(s, index); // from now on the group's replica
+					printf("Main %d failed, taken over by spare (pid=%d)\n", index, s->pid);
+					replaced = true;
+				}
+			}
+			if (hung_pid > 0 && !replaced) {
+				// Slow rather than dead maybe, it is all the group has
+				printf("Main %d hung, no replica to take over, left running\n", index);
+			}
+			else if (hung_pid > 0 && ft_kill_hung(hung_pid) == 0) {
+				MID_TRACE_EVENT(TRACE_FT_KILL, hung_pid, hung_tid, hung_name, index, 1);
+				printf("Killed hung main %d (pid=%d)\n", index, hung_pid);
 			}
-			count = 0;
+			pthread_mutex_unlock(&lock);
+		}
+
+		/* Check wether an active replica is dead, or hung */
+		bool replica_missed = ft_hb_missed(&replica_mon, replica_ftdata->replica_heart_beat[index]);
+		bool replica_hung = ft_progress_missed(&replica_prog,
+			__atomic_load_n(&(replica_ftdata->replica_progress[index]), __ATOMIC_RELAXED),
+			deadline_ms);
+		if (replica_missed || replica_hung)
+		{
+			// Drop it so its GPU work is no longer accounted as duplicated
+			sprintf(ft_job_type,"%s_%d", "replica", index);
+			pthread_mutex_lock(&lock);
+			auto it_active_r = active_ft_jobs.find(ft_job_type);
+			if(it_active_r != active_ft_jobs.end()){
+				active_replica_pids.erase(it_active_r->second->pid);
+				unlink_shared_job(it_active_r->second->job_name, sizeof(ft_job_t));
+				active_ft_jobs.erase(it_active_r);
+				ft_groups_dirty = true;
+				printf("Active replica %d failed\n", index);
+			}
+			pthread_mutex_unlock(&lock);
+			replica_ftdata->replica_heart_beat[index] = 0;
+			replica_ftdata->replica_progress[index] = 0;
 		}
 
 		/* Sleep for the resest of 1 ms using nanosleep */
@@ -332,21 +686,188 @@ void *ft_hb_thread(void *varpg)
 }
 
 //==========================================================================================================
+/*
+ * Name: ft_net_collect
+ * Function: ft_net hook, report heartbeats of mains (or promoted replicas)
+ *           running on this node
+ */
+int ft_net_collect(ft_net_t *net, ft_net_entry_t *out, int max)
+{
+	int n = 0;
+	if (FT_data == NULL) return 0;
+
+	pthread_mutex_lock(&lock);
+	for (auto it = running_ft_jobs.begin(); it != running_ft_jobs.end() && n < max; ++it) {
+		ft_job_t *j = it->second;
+		if (!j->is_executed || j->num < 0 || j->num >= FT_HB_DATA_MAX_DATA) continue;
+		out[n].index = j->num;
+		out[n].type = j->req_type;
+		out[n].pid = j->pid;
+		int node = FT_data->hb_node[j->num];
+		out[n].beat = FT_shards[node >= 0 && node < FT_n_shards ? node : 0]->heart_beat[j->num];
+		n++;
+	}
+	pthread_mutex_unlock(&lock);
+	return n;
+}
+
+/*
+ * Name: ft_net_deliver
+ * Function: ft_net hook, copy a remote heartbeat into the local heartbeat
+ *           array unless this node runs the group itself
+ */
+void ft_net_deliver(ft_net_t *net, uint32_t node_id, const ft_net_entry_t *e)
+{
+	char job_type_m[JOB_MEM_TYPE_MAX_LEN];
+	char job_type_r[JOB_MEM_TYPE_MAX_LEN];
+	if (FT_data == NULL) return;
+
+	sprintf(job_type_m, "%s_%d", "main", e->index);
+	sprintf(job_type_r, "%s_%d", "replica", e->index);
+	pthread_mutex_lock(&lock);
+	bool local = running_ft_jobs.find(job_type_m) != running_ft_jobs.end() ||
+		running_ft_jobs.find(job_type_r) != running_ft_jobs.end();
+	pthread_mutex_unlock(&lock);
+
+	if (!local) {
+		// No local client beats this group, read it from shard 0
+		FT_data->hb_node[e->index] = 0;
+		FT_data->heart_beat[e->index] = e->beat;
+	}
+}
+
+/*
+ * Name: ft_net_on_register
+ * Function: ft_net hook, a main registered on another node. If our replica
+ *           of that group took over, kill it like a local main restart does.
+ */
+void ft_net_on_register(ft_net_t *net, uint32_t node_id, const ft_net_entry_t *e)
+{
+	char job_type_r[JOB_MEM_TYPE_MAX_LEN];
+	if (e->type != MAIN) return;
+
+	sprintf(job_type_r, "%s_%d", "replica", e->index);
+	pthread_mutex_lock(&lock);
+	auto it_r = running_ft_jobs.find(job_type_r);
+	if (it_r != running_ft_jobs.end() && it_r->second->is_executed) {
+		kill(it_r->second->pid, SIGINT); // kill replica
+		MID_TRACE_EVENT(TRACE_FT_KILL, it_r->second->pid, it_r->second->tid,
+			it_r->second->job_name, e->index, node_id);
+		promoted_replica_pids.erase(it_r->second->pid);
+		printf("Killed FT job (%s, pid=%d), main %d is back on node %u!\n", \
+			it_r->second->job_name, it_r->second->pid, e->index, node_id);
+		unlink_shared_job(it_r->second->job_name, sizeof(ft_job_t));
+		running_ft_jobs.erase(it_r);
+		ft_groups_dirty = true;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+void ft_net_on_member(ft_net_t *net, uint32_t node_id, int state)
+{
+	printf("FT node %u is %s\n", node_id, state == FT_NET_ALIVE ? "alive" : "dead");
+}
+
+/*
+ * Name: launch_ft_net
+ * Function: Start the cross-node transport when configured by environment:
+ *           FT_NET_PORT    local UDP port (transport is off when unset)
+ *           FT_NET_PEERS   host:port,host:port of the other FT managers
+ *           FT_NET_NODE_ID unique id of this node (default: the port)
+ */
+int launch_ft_net()
+{
+	const char *port = getenv("FT_NET_PORT");
+	const char *peers = getenv("FT_NET_PEERS");
+	const char *node_id = getenv("FT_NET_NODE_ID");
+	if (port == NULL) return 0;
+
+	memset(&FT_net, 0, sizeof(FT_net));
+	if (peers && ft_net_parse_peers(&FT_net, peers) < 0) {
+		fprintf(stderr, "Bad FT_NET_PEERS (%s)\n", peers);
+		return -1;
+	}
+	FT_net.collect = ft_net_collect;
+	FT_net.deliver = ft_net_deliver;
+	FT_net.on_register = ft_net_on_register;
+	FT_net.on_member = ft_net_on_member;
+
+	printf("\tStarting FT network transport on port %s...\n", port);
+	if (ft_net_start(&FT_net, node_id ? atoi(node_id) : atoi(port), atoi(port)) < 0)
+		return -1;
+	ft_net_enabled = true;
+	return 0;
+}
+
+//==========================================================================================================
+/*
+ * Name: init_ft_shards
+ * Function: Map a heartbeat region per NUMA node, and a ft-jobs list per node
+ *           besides FJ (node 0), then tell clients in FJ that they exist
+ * Input: recover, keep the contents left by a crashed mid
+ */
+int init_ft_shards(ft_jobs_t *FJ, bool recover)
+{
+	int n, fd;
+	FT_n_shards = ft_numa_nodes();
+	FJ_shards[0] = FJ;
+	for (n = 0; n < FT_n_shards; n++) {
+		if (init_ft_data_shard(&fd, &FT_shards[n], !recover, n) < 0) return -1;
+		close(fd);
+		if (n > 0) {
+			if (init_ft_jobs_shard(&fd, &FJ_shards[n], !recover, n) < 0) return -1;
+			close(fd);
+		}
+	}
+	FT_data = FT_shards[0];
+	__atomic_store_n(&(FJ->n_shards), FT_n_shards, __ATOMIC_RELEASE);
+	if (FT_n_shards > 1)
+		printf("\tFT regions sharded over %d NUMA nodes.\n", FT_n_shards);
+	return 0;
+}
+
 /*
  * Name: launch_ft_man
  * Function: The API for the client to launch ft manager to check ft-jobs list and heartbeats
  * Input: FJ, which is a shared ft-jobs list 
+ *        recover, rebuild the FT lists left by a crashed mid instead of starting empty
  */
-int launch_ft_man(ft_jobs_t *FJ){
+int launch_ft_man(ft_jobs_t *FJ, bool recover){
+
+	/* Heartbeat regions and the ft-jobs lists of the other NUMA nodes */
+	if(init_ft_shards(FJ, recover) < 0)
+	{
+		fprintf(stderr, "Failed to init ft shards");
+		return -1;
+	}
+
+	/* Result slots must exist before any active main or replica publishes */
+	if(init_ft_results(&FR_fd, &FR, !recover) < 0)
+	{
+		fprintf(stderr, "Failed to init ft results");
+		return -1;
+	}
 
-	pthread_t helper_thread[FT_HB_DATA_MAX_DATA+1]; 
+	if(recover)
+	{
+		printf("\tRecovered %d FT jobs.\n", recover_ft_jobs());
+	}
+
+	pthread_t helper_thread[FT_HB_DATA_MAX_DATA+FT_NUMA_MAX_NODES]; 
 	printf("\tCreating FT jobs thread...\n");
 	pthread_create(&helper_thread[0], NULL, ft_jobs_thread, FJ); //. pass FJ job list
+	static int shard_node[FT_NUMA_MAX_NODES];
+	int n;
+	for(n = 1; n < FT_n_shards; n++){
+		shard_node[n] = n;
+		pthread_create(&helper_thread[FT_HB_DATA_MAX_DATA+n], NULL, ft_jobs_shard_thread,
+			(void *)(&shard_node[n]));
+	}
 	printf("\tCreated FT jobs thread.\n\n");
 
 	printf("\tCreating the heartbeat thread...\n");
 	// generate 100 threads for heart beats
-	int index[FT_HB_DATA_MAX_DATA];
+	static int index[FT_HB_DATA_MAX_DATA];
 	int i;
 	for(i = 0; i < FT_HB_DATA_MAX_DATA; i++){
 		index[i] = i; // set index[i] value as i and pass it to thread
@@ -354,9 +875,74 @@ int launch_ft_man(ft_jobs_t *FJ){
 	}
 	printf("\tCreated the heartbeat thread.\n");
 
+	if(launch_ft_net() < 0)
+	{
+		fprintf(stderr, "Failed to launch ft network transport");
+		return -1;
+	}
+
 	return 0;
 }
 
+/*
+ * Name: ft_active_replica
+ * Function: Tell the GPU scheduler whether pid is an active replica, whose
+ *           jobs duplicate the work of its main.
+ * Input: pid of a tagged job
+ * Return: true if pid is an active replica, *main_pid is then set to the
+ *         pid of the group's running main (or pid itself if none is running)
+ */
+bool ft_active_replica(pid_t pid, pid_t *main_pid)
+{
+	bool found = false;
+	char job_type_m[JOB_MEM_TYPE_MAX_LEN];
+
+	pthread_mutex_lock(&lock);
+	auto it = active_replica_pids.find(pid);
+	if(it != active_replica_pids.end()){
+		found = true;
+		*main_pid = pid;
+		sprintf(job_type_m, "%s_%d", "main", it->second);
+		auto it_m = running_ft_jobs.find(job_type_m);
+		if(it_m != running_ft_jobs.end())
+			*main_pid = it_m->second->pid;
+	}
+	pthread_mutex_unlock(&lock);
+	return found;
+}
+
+/*
+ * Name: ft_promoted_replica
+ * Function: Tell the GPU scheduler whether pid is a replica (or spare) that
+ *           took over a failed main, see sched_set_failover in mid_sched.cpp
+ * Input: pid of a tagged job
+ * Return: true if it is, *group is then its group index
+ */
+bool ft_promoted_replica(pid_t pid, int *group)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&lock);
+	auto it = promoted_replica_pids.find(pid);
+	if(it != promoted_replica_pids.end()){
+		found = true;
+		*group = it->second;
+	}
+	pthread_mutex_unlock(&lock);
+	return found;
+}
+
+/*
+ * Name: ft_drop_promoted
+ * Function: Forget a promoted replica that exited, so its pid can be reused
+ */
+void ft_drop_promoted(pid_t pid)
+{
+	pthread_mutex_lock(&lock);
+	promoted_replica_pids.erase(pid);
+	pthread_mutex_unlock(&lock);
+}
+
 #endif
 
 
@@ -0,0 +1,108 @@
+ // ftstat.c: print the live statistics of a running mid
+ //
+ // Usage: ./ftstat [interval_ms] [count]
+ //   Samples the "mid_stats" page every interval_ms (default 1000) and prints
+ //   one report per sample, count times (default forever). Rates are over the
+ //   last interval, percentiles over the whole life of mid.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "mid_stats.h"
+
+#define FTSTAT_STALE_MS 10      // only list FT groups at least this stale
+
+static double rate(unsigned long long now, unsigned long long before, double secs)
+{
+	return secs > 0 ? (now - before) / secs : 0;
+}
+
+static void print_hist(const char *name, const mid_hist_t *h, const char *unit)
+{
+	unsigned long long n = mid_stat_get(&(h->count));
+	printf("  %-22s n=%-10llu avg=%-8llu p50<=%-8llu p99<=%-8llu %s\n",
+		name, n, n ? mid_stat_get(&(h->sum)) / n : 0,
+		mid_hist_percentile(h, 50), mid_hist_percentile(h, 99), unit);
+}
+
+int main(int argc, char **argv)
+{
+	int interval_ms = argc > 1 ? atoi(argv[1]) : 1000;
+	int count = argc > 2 ? atoi(argv[2]) : -1;
+	int fd;
+	mid_stats_t *st;
+
+	if (interval_ms <= 0) interval_ms = 1000;
+	if (init_mid_stats(&fd, &st, false) < 0) return EXIT_FAILURE;
+	if (__atomic_load_n(&(st->magic), __ATOMIC_ACQUIRE) != MID_STATS_MAGIC ||
+		st->version != MID_STATS_VERSION) {
+		fprintf(stderr, "mid is not running or publishes another stats version\n");
+		return EXIT_FAILURE;
+	}
+
+	unsigned long long prev_sub = mid_stat_get(&(st->submitted));
+	unsigned long long prev_adm = mid_stat_get(&(st->admitted));
+	unsigned long long prev_cmp = mid_stat_get(&(st->completed));
+	unsigned long long prev_ns = mid_stats_now_ns();
+
+	while (count != 0) {
+		usleep(interval_ms * 1000);
+		if (count > 0) count--;
+
+		unsigned long long now_ns = mid_stats_now_ns();
+		double secs = (now_ns - prev_ns) / 1e9;
+		unsigned long long sub = mid_stat_get(&(st->submitted));
+		unsigned long long adm = mid_stat_get(&(st->admitted));
+		unsigned long long cmp = mid_stat_get(&(st->completed));
+		unsigned long long max_b = mid_stat_get(&(st->gpu_mem_max_b));
+		unsigned long long used_b = mid_stat_get(&(st->gpu_mem_used_b));
+
+		printf("---- mid up %.1f s, %llu periods\n",
+			(now_ns - st->start_ns) / 1e9, mid_stat_get(&(st->periods)));
+		printf("  queues    fifo %llu  pq %llu  executing %llu\n",
+			mid_stat_get(&(st->fifo_depth)), mid_stat_get(&(st->pq_depth)),
+			mid_stat_get(&(st->executing_depth)));
+		printf("  jobs/s    submitted %.1f  admitted %.1f  completed %.1f\n",
+			rate(sub, prev_sub, secs), rate(adm, prev_adm, secs), rate(cmp, prev_cmp, secs));
+		printf("  totals    aborted %llu  reclaimed %llu  preempted %llu  batched %llu\n",
+			mid_stat_get(&(st->aborted)), mid_stat_get(&(st->reclaimed)),
+			mid_stat_get(&(st->preempted)), mid_stat_get(&(st->batched)));
+		printf("  stale     shed %llu  late %llu\n",
+			mid_stat_get(&(st->shed)), mid_stat_get(&(st->late)));
+		printf("  gpu mem   %llu / %llu MB (%.0f%%)\n",
+			used_b >> 20, max_b >> 20, max_b ? 100.0 * used_b / max_b : 0);
+		print_hist("admit latency", &(st->admit_latency_us), "us");
+		print_hist("fifo depth", &(st->fifo_depth_hist), "jobs");
+		print_hist("pq depth", &(st->pq_depth_hist), "jobs");
+		print_hist("gpu util", &(st->gpu_util_pct), "%");
+		print_hist("catch-up", &(st->catchup_us), "us");
+		printf("  ft        hb misses %llu  hangs %llu  failovers %llu\n",
+			mid_stat_get(&(st->hb_misses)), mid_stat_get(&(st->hangs)),
+			mid_stat_get(&(st->failovers)));
+		printf("  spares    pooled %llu  took over %llu\n",
+			mid_stat_get(&(st->spares)), mid_stat_get(&(st->spare_failovers)));
+		print_hist("detect to takeover", &(st->detect_to_takeover_us), "us");
+		printf("  failover  boosted jobs %llu\n", mid_stat_get(&(st->boosted)));
+		print_hist("takeover to frame", &(st->takeover_to_frame_us), "us");
+
+		int i;
+		for (i = 0; i < FT_HB_DATA_MAX_DATA; i++) {
+			mid_stats_group_t *g = &(st->group[i]);
+			unsigned long long stale = mid_stat_get(&(g->hb_stale_ms));
+			if (stale < FTSTAT_STALE_MS && !mid_stat_get(&(g->failovers))) continue;
+			printf("  group %-3d stale %llu ms  misses %llu  hangs %llu  failovers %llu\n",
+				i, stale, mid_stat_get(&(g->hb_misses)), mid_stat_get(&(g->hangs)),
+				mid_stat_get(&(g->failovers)));
+		}
+		fflush(stdout);
+
+		prev_sub = sub;
+		prev_adm = adm;
+		prev_cmp = cmp;
+		prev_ns = now_ns;
+	}
+
+	munmap(st, MID_STATS_SIZE);
+	close(fd);
+	return 0;
+}
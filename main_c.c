@@ -10,6 +10,7 @@
 #include "tag_gpu.h"
 
 #include "ft_utils_client.c"
+#include "mid_tasks.h" // mid_task_register
 
 
 int main(int argc, char **argv) {
@@ -28,14 +29,33 @@ int main(int argc, char **argv) {
 	pid_t pid = getpid();
 	pid_t tid = gettid();
 
+	// optional arg 3: "active" runs main and replica concurrently
+	bool active = argc > 3 && !strcmp(argv[3], "active");
+	int voter = strcmp(ft_job_name, "main") ? 1 : 0;
+
 	/* Init FT manager and wait for the wake up from the server */
 	int res;
-	res = ft_init_wait(pid, tid, ft_job_name, num);
+	if (active)
+		res = ft_init_wait_active(pid, tid, ft_job_name, num);
+	else
+		res = ft_init_wait(pid, tid, ft_job_name, num);
 	
 	printf("Start working!\n");
     printf("========================================================\n");
 
 	const char *job_name = "opencv_get_image";
+
+	// Declare the loop below as a periodic task: a 2s job every 3s.
+	// If mid degrades it, wait out the longer period it granted.
+	int64_t period_us = 3000000;
+	int task = mid_task_register(job_name, period_us, 2000000, 0, 0, true, &period_us);
+	if (task < 0) {
+		fprintf(stdout, "opencv_get_image: not admitted as a periodic task\n");
+		period_us = 3000000;
+	}
+	// A main that hangs but still beats is failed over after two periods
+	// without a frame
+	ft_progress_deadline(num, 2 * period_us / 1000);
 	for (int i = 0; i < 10; i++)
 	{
 		fprintf(stdout, "opencv: tag_beginning() %d\n", i);
@@ -48,9 +68,19 @@ int main(int argc, char **argv) {
 
 		// Tag_end /////////////////////////////////////////////////////////////////////////
 		tag_job_end(pid, tid, job_name);
+		ft_progress();
+
+		if (active) {
+			// Offer this frame's output, the first one published is kept
+			char out[32];
+			int len = sprintf(out, "frame %d", i);
+			res = ft_publish_result(num, voter, i, out, len);
+			fprintf(stdout, "frame %d result %s\n", i, res == 0 ? "accepted" : "dropped");
+		}
 
-		fprintf(stdout, "opencv_get_image: onto next job in 1s\n");
-		sleep(1);
+		fprintf(stdout, "opencv_get_image: onto next job in %lds\n", (long)(period_us / 1000000 - 2));
+		usleep(period_us - 2000000);
 	}
+	mid_task_unregister(task);
 
 }
@@ -1,49 +1,19 @@
 # main_py.c: A python-client program
 # 
-# Functions used from ft_utils_client.c:
-#   1. tag_job_begin
-#   2. tag_job_end
-#   3. setup_ft_manager
+# Functions used from the ft extension module (ft_py.c, make ft_py):
+#   1. ft.tag_begin
+#   2. ft.tag_end
+#   3. ft.init_wait
 # Ruiying Wu (ECE)
 # 5/2020
 
-import os         # os.getpid()
+import os
 import sys
-import functools
-from ctypes import cdll, c_uint, c_int, c_void_p, c_char_p, c_ulonglong, c_double, c_longlong, c_bool
 import time       # time.sleep()
 
-# Create interface for tag functions
-libc = cdll.LoadLibrary('libc.so.6')
-libft = cdll.LoadLibrary("/home/ruiyingw/rw_work/cuMiddleware/lib/libft.so")
-
-# Modify the res and argtypes of tag function interface
-libft.tag_job_begin.restype = c_int
-libft.tag_job_begin.argtypes = [c_uint, c_uint, c_char_p, c_longlong,
-								c_bool, c_bool, c_ulonglong]
-libft.tag_job_end.restype = c_int
-libft.tag_job_end.argtypes = [c_uint, c_uint, c_char_p]
-
-libft.setup_ft_manager.restype = c_int
-libft.setup_ft_manager.argtypes = [c_uint, c_uint, c_char_p, c_int]
-
-# Create python version of tag_job_begin
-def tag_job_begin_py(pid, tid, job_name, slacktime, first_flag, shareable_flag,required_mem):
-	# print("Call the tag_job_begin")
-	res = c_int(libft.tag_job_begin(pid, tid, job_name, slacktime, first_flag, shareable_flag,required_mem))
-	return res
-
-# Create python version of tag_job_end
-def tag_job_end_py(pid, tid, job_name):
-	# print("Call the tag_job_end")
-	res = c_int(libft.tag_job_end(pid, tid, job_name))
-	return res
-
-# Create python version of setup_ft_manager
-def setup_ft_manager_py(pid, tid, job_name, num):
-	# print("Call the setup_ft_manager")
-	res = c_int(libft.setup_ft_manager(pid, tid, job_name, num))
-	return res
+# The ft module is built into lib/, next to libft.so
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), "lib"))
+import ft
 
 # ------------------ checkpoint ----------------------------------------------
 def add_1(x):
@@ -90,27 +60,15 @@ def update_checkpoint(x, func):
 if __name__ == "__main__":
 	# Get input arguments
 	ft_job_name = sys.argv[1]
-	f_name = c_char_p(ft_job_name.encode('utf-8'))
 
 	ft_job_num = sys.argv[2]
 	f_num = int(ft_job_num)
-	
-	# Get tid and pid
-	SYS_gettid = 186 # SYS_gettid
-	tid = c_uint(libc.syscall(SYS_gettid))
-	pid = c_uint(os.getpid())
 
 	# Create name of the job
 	job_name = "opencv_get_image"
-	c_name = c_char_p(job_name.encode('utf-8'))
 
-	# Convert number 1 and 15 into c type
-	one = c_ulonglong(1) 
-	fiften = c_longlong(15)
-
-	# Set up the FT manager
-	# ft_init_wait()
-	res = setup_ft_manager_py(pid, tid, f_name, f_num)
+	# Set up the FT manager, pid and tid are taken by the module
+	res = ft.init_wait(ft_job_name, f_num)
 
 
 	# ---------- Initial x value or get checkpoint ------------------------
@@ -138,7 +96,7 @@ if __name__ == "__main__":
 	for i in range(0,10):
 		print("opencv: tag_beginning() %d" %i)
 		# Tagging begin
-		res = tag_job_begin_py(pid, tid, c_name, fiften, False, True, one)
+		res = ft.tag_begin(job_name, 15, False, True, 1)
 
 		## layer-level checkpointing ##
 		# QuestionL do I need to know which layer replica should start from ???
@@ -184,6 +142,6 @@ if __name__ == "__main__":
 		time.sleep(1)
 		print(" ")
 		# Tagging end
-		res = tag_job_end_py(pid, tid, c_name)
+		res = ft.tag_end(job_name)
 		time.sleep(1)
 
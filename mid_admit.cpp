@@ -0,0 +1,253 @@
+/*
+	Admission control(c++) of periodic tasks declared through mid_tasks.h.
+
+	A new task is tested together with every task admitted so far, by the
+	test that matches the scheduling policy of pq_jobs (mid_sched.cpp):
+	- edf, llf      density: sum of wcet / min(deadline, period) <= 1
+	- fp, rm        response time analysis, R = C + sum ceil(R / T_j) C_j over
+	                the tasks of higher or equal priority, R <= deadline
+	                (fp by declared priority, rm by period)
+	- slack, wfq    utilization: sum of wcet / period <= 1
+	The GPU is treated as one processor, which is pessimistic for shareable
+	jobs that run concurrently. A task that doesn't fit is rejected, or if
+	it allows it, degraded to the shortest period (up to
+	ADMIT_DEGRADE_MAX times its own) with which the set passes; its deadline
+	is stretched with its period.
+
+	Admitted tasks are entered into sched_tasks, so the policies order their
+	jobs by the declared parameters.
+
+	Functions:
+	- admit_schedulable     --- test a task set
+	- admit_decide          --- decide on one declared task
+	- admit_process         --- called in the server loop, answers clients
+	- admit_drop_pid        --- forget the tasks of a dead client
+	- admit_recover         --- rebuild the admitted set of a restarted mid
+*/
+#ifndef MID_ADMIT
+#define MID_ADMIT
+
+#include <stdio.h>
+#include <string>		// std::string
+#include <vector>		// std::vector
+#include <algorithm>	// std::remove_if
+
+#include "mid_tasks.h"
+#include "mid_sched.cpp"	// sched_policy, sched_tasks
+
+#define ADMIT_DEGRADE_MAX 16	// a degraded period is at most 16 times the declared one
+
+typedef struct admit_task {
+	int slot;				// in mid_tasks_t, -1 if not declared through it
+	pid_t pid;
+	std::string name;
+	int64_t period_us;		// granted
+	int64_t wcet_us;
+	int64_t deadline_us;	// granted, never 0
+	int priority;
+} admit_task_t;
+
+static std::vector<admit_task_t> admit_set;
+// sched_tasks entries of the names with admitted tasks, as they were before
+typedef struct admit_saved {
+	bool had_entry;
+	sched_task_t task;
+} admit_saved_t;
+static std::unordered_map<std::string, admit_saved_t> admit_saved_tasks;
+
+/* Response time analysis; rank orders the tasks, lower rank runs first */
+template <typename Rank>
+static bool admit_rta(const std::vector<admit_task_t> &set, Rank rank) {
+	for (size_t i = 0; i < set.size(); i++) {
+		int64_t r = set[i].wcet_us, prev = 0;
+		while (r != prev) {
+			if (r > set[i].deadline_us) return false;
+			prev = r;
+			r = set[i].wcet_us;
+			for (size_t j = 0; j < set.size(); j++) {
+				// Equal ranks interfere both ways, the order among them is arbitrary
+				if (j == i || rank(set[j]) > rank(set[i])) continue;
+				r += (prev + set[j].period_us - 1) / set[j].period_us * set[j].wcet_us;
+			}
+		}
+	}
+	return true;
+}
+
+/*
+ * Name: admit_schedulable
+ * Function: Test a task set under the current sched_policy
+ * Return: true if every task meets its deadline
+ */
+bool admit_schedulable(const std::vector<admit_task_t> &set) {
+	double load = 0;
+	switch (sched_policy) {
+	case SCHED_FP:
+		return admit_rta(set, [](const admit_task_t &t) { return -(int64_t)t.priority; });
+	case SCHED_RM:
+		return admit_rta(set, [](const admit_task_t &t) { return t.period_us; });
+	case SCHED_EDF:
+	case SCHED_LLF:
+		for (const admit_task_t &t : set)
+			load += (double)t.wcet_us / std::min(t.deadline_us, t.period_us);
+		return load <= 1.0;
+	default:
+		for (const admit_task_t &t : set) {
+			if (t.wcet_us > t.deadline_us) return false;
+			load += (double)t.wcet_us / t.period_us;
+		}
+		return load <= 1.0;
+	}
+}
+
+/* The admitted set plus t with its period (and deadline) stretched to period_us */
+static bool admit_fits(admit_task_t t, int64_t declared_period_us, int64_t period_us) {
+	t.deadline_us = t.deadline_us * period_us / declared_period_us;
+	t.period_us = period_us;
+	std::vector<admit_task_t> set(admit_set);
+	set.push_back(t);
+	return admit_schedulable(set);
+}
+
+/* Make sched_tasks hold the parameters of the admitted tasks named name */
+static void admit_update_sched_task(const std::string &name) {
+	auto saved = admit_saved_tasks.find(name);
+	for (const admit_task_t &t : admit_set) {
+		if (t.name != name) continue;
+		if (saved == admit_saved_tasks.end()) {
+			auto it = sched_tasks.find(name);
+			bool had = it != sched_tasks.end();
+			admit_saved_tasks[name] = {had, had ? it->second : sched_task_default};
+			sched_tasks[name] = admit_saved_tasks[name].task;
+		}
+		sched_task_t &st = sched_tasks[name];
+		st.priority = t.priority;
+		st.period_us = t.period_us;
+		st.wcet_us = t.wcet_us;
+		st.deadline_us = t.deadline_us;
+		return;
+	}
+	// No admitted task left under this name
+	if (saved == admit_saved_tasks.end()) return;
+	if (saved->second.had_entry) sched_tasks[name] = saved->second.task;
+	else sched_tasks.erase(name);
+	admit_saved_tasks.erase(saved);
+}
+
+/*
+ * Name: admit_decide
+ * Function: Test a declared task against the admitted ones and admit it if
+ *           it fits, possibly with a longer period
+ * Return: TASK_ADMITTED, TASK_DEGRADED or TASK_REJECTED; d->granted_period_us
+ *         is set unless rejected
+ */
+int admit_decide(mid_task_decl_t *d, int slot) {
+	d->name[JOB_MEM_NAME_MAX_LEN - 1] = '\0';
+	int64_t deadline_us = d->deadline_us ? d->deadline_us : d->period_us;
+	if (d->period_us <= 0 || d->wcet_us <= 0 || deadline_us < d->wcet_us) {
+		fprintf(stderr, "Rejected task %s (pid=%d): bad parameters\n", d->name, d->pid);
+		return TASK_REJECTED;
+	}
+
+	admit_task_t t = {slot, d->pid, d->name, d->period_us, d->wcet_us, deadline_us, d->priority};
+	int64_t period_us = d->period_us;
+	if (!admit_fits(t, d->period_us, period_us)) {
+		int64_t hi = d->period_us * ADMIT_DEGRADE_MAX;
+		if (!d->allow_degrade || !admit_fits(t, d->period_us, hi)) {
+			MID_LOG("Rejected task %s (pid=%d): not schedulable\n", d->name, d->pid);
+			return TASK_REJECTED;
+		}
+		// Shortest period that fits, to 1/64 of the declared one
+		int64_t lo = period_us, step = std::max<int64_t>(d->period_us / 64, 1);
+		while (hi - lo > step) {
+			int64_t mid = lo + (hi - lo) / 2;
+			if (admit_fits(t, d->period_us, mid)) hi = mid;
+			else lo = mid;
+		}
+		period_us = hi;
+	}
+
+	t.deadline_us = t.deadline_us * period_us / d->period_us;
+	t.period_us = period_us;
+	admit_set.push_back(t);
+	admit_update_sched_task(t.name);
+	d->granted_period_us = period_us;
+	MID_LOG("Admitted task %s (pid=%d) period %ld us (declared %ld us)\n",
+		d->name, d->pid, period_us, d->period_us);
+	return period_us == d->period_us ? TASK_ADMITTED : TASK_DEGRADED;
+}
+
+/* Remove the admitted tasks matching pred, freeing their slots in mt */
+template <typename Pred>
+static void admit_remove(mid_tasks_t *mt, Pred pred) {
+	std::vector<std::string> names;
+	auto end = std::remove_if(admit_set.begin(), admit_set.end(), [&](const admit_task_t &t) {
+		if (!pred(t)) return false;
+		names.push_back(t.name);
+		if (mt && t.slot >= 0)
+			__atomic_store_n(&(mt->task[t.slot].status), TASK_FREE, __ATOMIC_RELEASE);
+		return true;
+	});
+	admit_set.erase(end, admit_set.end());
+	for (const std::string &name : names) admit_update_sched_task(name);
+}
+
+/*
+ * Name: admit_process
+ * Function: Answer the pending registrations and drop the tasks of clients
+ *           that unregistered
+ * Return: pids of newly admitted tasks, appended to *pids
+ */
+void admit_process(mid_tasks_t *mt, std::vector<pid_t> *pids) {
+	int i;
+	for (i = 0; i < MID_TASKS_MAX; i++) {
+		mid_task_decl_t *d = &(mt->task[i]);
+		int status = __atomic_load_n(&(d->status), __ATOMIC_ACQUIRE);
+		if (status == TASK_PENDING) {
+			int res = admit_decide(d, i);
+			// The client may have given up waiting and taken the slot back
+			if (!__atomic_compare_exchange_n(&(d->status), &status, res,
+					false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+				admit_remove(NULL, [i](const admit_task_t &t) { return t.slot == i; });
+				continue;
+			}
+			if (res != TASK_REJECTED) pids->push_back(d->pid);
+			sem_post(&(d->wake));
+		} else if (status == TASK_LEAVING) {
+			admit_remove(mt, [i](const admit_task_t &t) { return t.slot == i; });
+			__atomic_store_n(&(d->status), TASK_FREE, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/*
+ * Name: admit_drop_pid
+ * Function: Forget the tasks of a client that died without unregistering
+ */
+void admit_drop_pid(mid_tasks_t *mt, pid_t pid) {
+	admit_remove(mt, [pid](const admit_task_t &t) { return t.pid == pid; });
+}
+
+/*
+ * Name: admit_recover
+ * Function: Rebuild the admitted set from the task region a previous mid
+ *           left, its clients registered once and don't declare again
+ * Return: pids of the admitted tasks, appended to *pids
+ */
+void admit_recover(mid_tasks_t *mt, std::vector<pid_t> *pids) {
+	int i;
+	for (i = 0; i < MID_TASKS_MAX; i++) {
+		mid_task_decl_t *d = &(mt->task[i]);
+		int status = __atomic_load_n(&(d->status), __ATOMIC_ACQUIRE);
+		if (status != TASK_ADMITTED && status != TASK_DEGRADED) continue;
+		d->name[JOB_MEM_NAME_MAX_LEN - 1] = '\0';
+		int64_t deadline_us = d->deadline_us ? d->deadline_us : d->period_us;
+		admit_task_t t = {i, d->pid, d->name, d->granted_period_us, d->wcet_us,
+			deadline_us * d->granted_period_us / d->period_us, d->priority};
+		admit_set.push_back(t);
+		admit_update_sched_task(t.name);
+		pids->push_back(d->pid);
+	}
+}
+
+#endif
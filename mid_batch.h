@@ -0,0 +1,179 @@
+/*
+	Batches of jobs admitted together, in the shared memory region
+	"mid_batch".
+
+	With MID_BATCH_WINDOW_US set, mid (mid_sched.cpp) admits queued jobs of
+	the same job name from any process together, sharing one memory
+	reservation. Before it wakes the members of a batch it posts their
+	batch here: the batch ID, the number of members and each member's rank.
+	After tag_job_begin returns, a client looks its job up with
+	tag_job_batch, and the members can run one batched kernel (rank 0
+	gathers the inputs of the others, say) instead of one kernel each.
+	Every member still ends with its own tag_job_end; the reservation is
+	released with the last one.
+
+	Functions:
+	- init_mid_batch                        --- called in server (init_flag) and in clients
+	- mid_batch_post / mid_batch_clear / mid_batch_clear_pid --- server only
+	- mid_batch_clear_dead                  --- server, after a mid restart
+	- tag_job_batch                         --- client, batch of an admitted job
+
+	Only mid writes the region. A restarted mid keeps it, as it keeps the
+	batches of executing jobs (mid_state.cpp), and batch IDs go on from
+	the highest one it recovers.
+*/
+#ifndef MID_BATCH_H
+#define MID_BATCH_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>         // kill
+#include <sys/mman.h>
+#include "mid_shm.h"        // mid_shm_map
+#include "ft_lib.h"         // JOB_MEM_NAME_MAX_LEN
+
+#define MID_BATCH_NAME "mid_batch"
+#define MID_BATCH_MAX 256               // members of all executing batches
+
+typedef struct mid_batch_slot {
+	pid_t pid;                          // 0: slot free
+	pid_t tid;
+	char job_name[JOB_MEM_NAME_MAX_LEN];
+	unsigned long long batch;
+	int size;                           // members of the batch
+	int rank;                           // 0 .. size - 1
+} mid_batch_slot_t;
+
+typedef struct mid_batch {
+	mid_batch_slot_t slot[MID_BATCH_MAX];
+} mid_batch_t;
+
+#define MID_BATCH_SIZE sizeof(mid_batch_t)
+
+static int client_batch_fd = -1;
+static mid_batch_t *client_batch = NULL;
+
+/*
+ * Name: init_mid_batch
+ * Function: Map the batch region; the server (init_flag) clears it
+ */
+static inline int init_mid_batch(int *fd, mid_batch_t **addr, bool init_flag)
+{
+	*addr = (mid_batch_t *)mid_shm_map(MID_BATCH_NAME,
+							MID_BATCH_SIZE,
+							PROT_READ|PROT_WRITE,
+							init_flag,
+							fd);
+	if (*addr == MAP_FAILED) {
+		perror("[Error] in init_mid_batch: mmap");
+		return -1;
+	}
+
+	if (init_flag) memset(*addr, 0, MID_BATCH_SIZE);
+	return 0;
+}
+
+// -------------------------- Server Side Functions ----------------------------
+/*
+ * Name: mid_batch_post
+ * Function: Post the batch of the job (pid, tid, job_name), before waking it
+ * Return: 0 on success, -1 if all slots are in use (the job then looks like
+ *         it runs alone)
+ */
+static inline int mid_batch_post(mid_batch_t *b, pid_t pid, pid_t tid, const char *job_name,
+	unsigned long long batch, int size, int rank)
+{
+	int i;
+	for (i = 0; i < MID_BATCH_MAX; i++) {
+		mid_batch_slot_t *s = &(b->slot[i]);
+		if (s->pid != 0) continue;
+		s->tid = tid;
+		strncpy(s->job_name, job_name, JOB_MEM_NAME_MAX_LEN - 1);
+		s->job_name[JOB_MEM_NAME_MAX_LEN - 1] = '\0';
+		s->batch = batch;
+		s->size = size;
+		s->rank = rank;
+		__atomic_store_n(&(s->pid), pid, __ATOMIC_RELEASE);
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Name: mid_batch_clear
+ * Function: Drop the batch of a job that released the GPU
+ */
+static inline void mid_batch_clear(mid_batch_t *b, pid_t pid, pid_t tid, const char *job_name)
+{
+	int i;
+	for (i = 0; i < MID_BATCH_MAX; i++) {
+		mid_batch_slot_t *s = &(b->slot[i]);
+		if (s->pid == pid && s->tid == tid && strcmp(s->job_name, job_name) == 0)
+			__atomic_store_n(&(s->pid), 0, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Name: mid_batch_clear_pid
+ * Function: Drop the batches of a dead client's jobs
+ */
+static inline void mid_batch_clear_pid(mid_batch_t *b, pid_t pid)
+{
+	int i;
+	for (i = 0; i < MID_BATCH_MAX; i++) {
+		if (b->slot[i].pid == pid) __atomic_store_n(&(b->slot[i].pid), 0, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Name: mid_batch_clear_dead
+ * Function: Drop the batches of clients that died while mid was down, their
+ *           jobs are not recovered so no one else drops them
+ * Return: number of slots freed
+ */
+static inline int mid_batch_clear_dead(mid_batch_t *b)
+{
+	int i, n = 0;
+	for (i = 0; i < MID_BATCH_MAX; i++) {
+		pid_t pid = b->slot[i].pid;
+		if (pid == 0 || kill(pid, 0) == 0 || errno != ESRCH) continue;
+		__atomic_store_n(&(b->slot[i].pid), 0, __ATOMIC_RELEASE);
+		n++;
+	}
+	return n;
+}
+
+// -------------------------- Client Side Functions ----------------------------
+/*
+ * Name: tag_job_batch
+ * Function: Batch of a job that tag_job_begin admitted
+ * Output: *batch, *size and *rank of its batch (any may be NULL)
+ * Return: 1 if the job was admitted in a batch, 0 if alone, -1 if mid
+ *         doesn't publish batches
+ */
+static inline int tag_job_batch(pid_t pid, pid_t tid, const char *job_name,
+	unsigned long long *batch, int *size, int *rank)
+{
+	if (client_batch == NULL) {
+		if (client_batch_fd != -1 || init_mid_batch(&client_batch_fd, &client_batch, false) < 0) {
+			client_batch_fd = -2;   // don't retry on every call
+			return -1;
+		}
+	}
+
+	int i;
+	for (i = 0; i < MID_BATCH_MAX; i++) {
+		mid_batch_slot_t *s = &(client_batch->slot[i]);
+		if (__atomic_load_n(&(s->pid), __ATOMIC_ACQUIRE) != pid || s->tid != tid) continue;
+		if (strncmp(s->job_name, job_name, JOB_MEM_NAME_MAX_LEN - 1) != 0) continue;
+		if (batch) *batch = s->batch;
+		if (size) *size = s->size;
+		if (rank) *rank = s->rank;
+		return 1;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,134 @@
+/*
+	Per-process doorbells of clients that wait for many jobs at once, in
+	the shared memory region "mid_bell".
+
+	A client blocked in tag_ft_job_begin or tag_job_begin sleeps in sem_wait
+	on the semaphore of its job, one thread per pending job. A process with
+	a reactor (ft_async.cpp) instead claims a doorbell: a futex word in this
+	region, keyed by its pid. Whenever mid posts the semaphore of a job it
+	also rings the doorbell of the job's pid, so the reactor sleeps on one
+	futex and only looks at its pending semaphores when one of them may
+	have been posted.
+
+	Functions:
+	- init_mid_bell     --- called in server (init_flag) and in clients
+	- mid_bell_ring     --- server, after every sem_post to a client
+	- mid_bell_claim    --- client, doorbell of this process
+	- mid_bell_wait     --- client, sleep until rung or timeout
+
+	Slots are found by linear probing from pid % MID_BELL_MAX and never go
+	back to free, a client takes over the slot of a dead process instead, so
+	a ring stops at the first free slot.
+*/
+#ifndef MID_BELL_H
+#define MID_BELL_H
+
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>         // kill(pid, 0)
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "mid_shm.h"        // mid_shm_map
+
+#define MID_BELL_NAME "mid_bell"
+#define MID_BELL_MAX 1024
+
+typedef struct mid_bell_slot {
+	pid_t pid;                  // owner, 0: never used
+	unsigned int seq;           // futex word, bumped on every ring
+	unsigned int waiting;       // threads of the owner sleeping on seq
+} mid_bell_slot_t;
+
+typedef struct mid_bell {
+	mid_bell_slot_t slot[MID_BELL_MAX];
+} mid_bell_t;
+
+#define MID_BELL_SIZE sizeof(mid_bell_t)
+
+/*
+ * Name: init_mid_bell
+ * Function: Map the doorbell region. The server (init_flag) keeps what
+ *           is in it: clients waiting across a mid restart keep their
+ *           doorbells, slots of dead clients are taken over anyway.
+ */
+static inline int init_mid_bell(int *fd, mid_bell_t **addr, bool init_flag)
+{
+	*addr = (mid_bell_t *)mid_shm_map(MID_BELL_NAME,
+							MID_BELL_SIZE,
+							PROT_READ|PROT_WRITE,
+							init_flag,
+							fd);
+	if (*addr == MAP_FAILED) {
+		perror("[Error] in init_mid_bell: mmap");
+		return -1;
+	}
+	return 0;
+}
+
+/* Wake the owner of a slot, if it sleeps */
+static inline void mid_bell_poke(mid_bell_slot_t *s)
+{
+	__atomic_fetch_add(&(s->seq), 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(s->waiting), __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &(s->seq), FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// -------------------------- Server Side Functions ----------------------------
+/*
+ * Name: mid_bell_ring
+ * Function: Ring the doorbell of process pid, if it has one
+ */
+static inline void mid_bell_ring(mid_bell_t *b, pid_t pid)
+{
+	int i, k;
+	if (b == NULL || pid <= 0) return;
+	for (i = 0, k = pid % MID_BELL_MAX; i < MID_BELL_MAX; i++, k = (k + 1) % MID_BELL_MAX) {
+		pid_t owner = __atomic_load_n(&(b->slot[k].pid), __ATOMIC_ACQUIRE);
+		if (owner == 0) return;
+		if (owner == pid) {
+			mid_bell_poke(&(b->slot[k]));
+			return;
+		}
+	}
+}
+
+// -------------------------- Client Side Functions ----------------------------
+/*
+ * Name: mid_bell_claim
+ * Function: Find or claim the doorbell of process pid
+ * Return: the slot, NULL if every slot belongs to a live process
+ */
+static inline mid_bell_slot_t *mid_bell_claim(mid_bell_t *b, pid_t pid)
+{
+	int i, k;
+	for (i = 0, k = pid % MID_BELL_MAX; i < MID_BELL_MAX; i++, k = (k + 1) % MID_BELL_MAX) {
+		mid_bell_slot_t *s = &(b->slot[k]);
+		pid_t owner = __atomic_load_n(&(s->pid), __ATOMIC_ACQUIRE);
+		if (owner == pid) return s;
+		if (owner != 0 && (kill(owner, 0) == 0 || errno != ESRCH)) continue;
+		// Free, or its owner is dead
+		if (__atomic_compare_exchange_n(&(s->pid), &owner, pid, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return s;
+	}
+	return NULL;
+}
+
+/*
+ * Name: mid_bell_wait
+ * Function: Sleep until the slot is rung after its seq was seen as seq, or
+ *           timeout_ms passed
+ */
+static inline void mid_bell_wait(mid_bell_slot_t *s, unsigned int seq, int timeout_ms)
+{
+	struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+	__atomic_fetch_add(&(s->waiting), 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&(s->seq), __ATOMIC_SEQ_CST) == seq)
+		syscall(SYS_futex, &(s->seq), FUTEX_WAIT, seq, &ts, NULL, 0);
+	__atomic_fetch_sub(&(s->waiting), 1, __ATOMIC_RELAXED);
+}
+
+#endif
@@ -0,0 +1,222 @@
+/*
+	Stage graphs(c++) of frame pipelines declared through mid_dag.h.
+
+	When a pipeline is declared, the latest finish time of every stage is
+	computed relative to the frame deadline: 0 for the last stages, and
+	for the others the latest finish of each successor minus its WCET,
+	taking the minimum over the successors. This is the frame deadline
+	pushed back along the critical path. The n-th job a stage tags
+	belongs to frame n. Its slacktime_us is set to that frame's deadline
+	plus the stage's latest finish, minus now. The job is held back until
+	every predecessor stage has completed its n-th job, then queued by
+	the server loop. The job counts of every stage live in the region, so
+	a restarted mid builds the pipeline again where it was; the jobs it
+	held are queued by the recovery right away.
+
+	Like mid_sched.cpp nothing here touches job shared memory: the caller
+	queues the jobs handed back and destroys those of dead clients.
+
+	Functions:
+	- dag_process    --- called in the server loop, picks up declarations
+	- dag_submit     --- a job arrived: set its slack, hold it or let it queue
+	- dag_complete   --- a job completed: hand back the stages it held back
+	- dag_drop_pid   --- forget the pipelines of a dead client
+
+	A stage job that yields (mid_yield.h) tags again and counts as the job
+	of the next frame, so pipeline stages should not use yield points.
+*/
+#ifndef MID_DAG
+#define MID_DAG
+
+#include <stdio.h>
+#include <deque>		// std::deque
+#include <string>		// std::string
+#include <vector>		// std::vector
+#include <unordered_map>	// std::unordered_map
+
+#include "mid_dag.h"
+#include "mid_sched.cpp"	// sched_now_us
+
+typedef struct dag_held {
+	job_t *job;
+	unsigned long long frame;
+} dag_held_t;
+
+typedef struct dag_pipeline {
+	bool active;
+	pid_t pid;
+	int n_stages;
+	uint32_t preds[MID_DAG_MAX_STAGES];
+	uint32_t succs[MID_DAG_MAX_STAGES];
+	int64_t lft_us[MID_DAG_MAX_STAGES];		// latest finish, relative to the frame deadline
+	unsigned long long *submitted;		// jobs tagged so far, in the region
+	unsigned long long *completed;
+	std::deque<dag_held_t> held[MID_DAG_MAX_STAGES];	// waiting for predecessors
+} dag_pipeline_t;
+
+static dag_pipeline_t dag_pipes[MID_DAG_MAX];
+// "<pid>/<job name>" of every declared stage -> slot * MID_DAG_MAX_STAGES + stage
+static std::unordered_map<std::string, int> dag_stage_of;
+
+static std::string dag_key(pid_t pid, const char *name) {
+	return std::to_string(pid) + "/" + name;
+}
+
+/* Slot and stage of job j, false if it is not a declared stage */
+static bool dag_find(const job_t *j, int *slot, int *stage) {
+	auto it = dag_stage_of.find(dag_key(j->pid, j->job_name));
+	if (it == dag_stage_of.end()) return false;
+	*slot = it->second / MID_DAG_MAX_STAGES;
+	*stage = it->second % MID_DAG_MAX_STAGES;
+	return true;
+}
+
+/* Whether the predecessors of stage s are done with frame n */
+static bool dag_ready(const dag_pipeline_t &p, int s, unsigned long long n) {
+	for (int q = 0; q < p.n_stages; q++) {
+		if ((p.preds[s] >> q & 1) && p.completed[q] <= n) return false;
+	}
+	return true;
+}
+
+/* Slack of the stage s job of frame n, from the frame's deadline if published */
+static void dag_set_slack(mid_dag_region_t *r, int slot, int s, unsigned long long n, job_t *j) {
+	const mid_dag_decl_t *d = &(r->dag[slot]);
+	unsigned long long frames = __atomic_load_n(&(d->frames), __ATOMIC_ACQUIRE);
+	if (n >= frames || frames - n > MID_DAG_FRAMES) return;	// keep the client's
+	int64_t slack = d->deadline_us[n % MID_DAG_FRAMES] + dag_pipes[slot].lft_us[s] - sched_now_us;
+	j->slacktime_us = slack > 0 ? slack : 0;
+}
+
+/* Build the pipeline of a newly active slot (or of a restarted mid), false
+   if it is unusable */
+static bool dag_build(mid_dag_decl_t *d, int slot) {
+	dag_pipeline_t &p = dag_pipes[slot];
+	int s, t;
+	if (!mid_dag_valid(d->stage, d->n_stages)) {
+		fprintf(stderr, "Rejected pipeline (pid=%d): bad stage graph\n", d->pid);
+		return false;
+	}
+	for (s = 0; s < d->n_stages; s++) {
+		if (dag_stage_of.count(dag_key(d->pid, d->stage[s].name))) {
+			fprintf(stderr, "Rejected pipeline (pid=%d): stage %s is declared twice\n",
+				d->pid, d->stage[s].name);
+			return false;
+		}
+	}
+
+	p.active = true;
+	p.pid = d->pid;
+	p.n_stages = d->n_stages;
+	p.submitted = d->submitted;
+	p.completed = d->completed;
+	for (s = 0; s < p.n_stages; s++) {
+		p.preds[s] = d->stage[s].preds;
+		p.succs[s] = 0;
+		p.held[s].clear();
+		dag_stage_of[dag_key(p.pid, d->stage[s].name)] = slot * MID_DAG_MAX_STAGES + s;
+	}
+	for (s = 0; s < p.n_stages; s++)
+		for (t = 0; t < s; t++)
+			if (p.preds[s] >> t & 1) p.succs[t] |= 1u << s;
+
+	// Critical path, successors come later in topological order
+	for (s = p.n_stages - 1; s >= 0; s--) {
+		p.lft_us[s] = 0;
+		bool first = true;
+		for (t = s + 1; t < p.n_stages; t++) {
+			if (!(p.succs[s] >> t & 1)) continue;
+			int64_t lft = p.lft_us[t] - d->stage[t].wcet_us;
+			if (first || lft < p.lft_us[s]) p.lft_us[s] = lft;
+			first = false;
+		}
+	}
+	MID_LOG("Pipeline of %d stages (pid=%d), critical path %ld us\n",
+		p.n_stages, p.pid, d->stage[0].wcet_us - p.lft_us[0]);
+	return true;
+}
+
+/* Forget the pipeline of slot, its held jobs are appended to *jobs */
+static void dag_remove(mid_dag_region_t *r, int slot, std::vector<job_t*> *jobs) {
+	dag_pipeline_t &p = dag_pipes[slot];
+	for (int s = 0; s < p.n_stages; s++) {
+		for (const dag_held_t &h : p.held[s]) jobs->push_back(h.job);
+		p.held[s].clear();
+		dag_stage_of.erase(dag_key(p.pid, r->dag[slot].stage[s].name));
+	}
+	p.active = false;
+	__atomic_store_n(&(r->dag[slot].status), DAG_FREE, __ATOMIC_RELEASE);
+}
+
+/*
+ * Name: dag_process
+ * Function: Pick up newly declared pipelines and drop those their clients
+ *           left; jobs they held back are appended to *jobs, to be queued
+ * Return: pids of newly declared pipelines, appended to *pids
+ */
+void dag_process(mid_dag_region_t *r, std::vector<job_t*> *jobs, std::vector<pid_t> *pids) {
+	for (int i = 0; i < MID_DAG_MAX; i++) {
+		mid_dag_decl_t *d = &(r->dag[i]);
+		int status = __atomic_load_n(&(d->status), __ATOMIC_ACQUIRE);
+		if (status == DAG_ACTIVE && !dag_pipes[i].active) {
+			if (dag_build(d, i)) pids->push_back(d->pid);
+			else __atomic_store_n(&(d->status), DAG_FREE, __ATOMIC_RELEASE);
+		} else if (status == DAG_LEAVING) {
+			if (dag_pipes[i].active) dag_remove(r, i, jobs);
+			else __atomic_store_n(&(d->status), DAG_FREE, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+/*
+ * Name: dag_submit
+ * Function: A job arrived; if it is a pipeline stage, give it the slack of
+ *           its frame and hold it back unless its predecessors are done
+ * Return: true if the job is held (don't queue it), false to queue it now
+ */
+bool dag_submit(mid_dag_region_t *r, job_t *j) {
+	int slot, s;
+	if (!dag_find(j, &slot, &s)) return false;
+	dag_pipeline_t &p = dag_pipes[slot];
+	unsigned long long n = p.submitted[s]++;
+
+	dag_set_slack(r, slot, s, n, j);
+	if (dag_ready(p, s, n)) return false;
+	p.held[s].push_back({j, n});
+	return true;
+}
+
+/*
+ * Name: dag_complete
+ * Function: A job released the GPU; if it is a pipeline stage, hand back
+ *           the successor jobs now ready, with their slack updated
+ */
+void dag_complete(mid_dag_region_t *r, job_t *j, std::vector<job_t*> *jobs) {
+	int slot, s;
+	if (!dag_find(j, &slot, &s)) return;
+	dag_pipeline_t &p = dag_pipes[slot];
+	p.completed[s]++;
+
+	for (int t = s + 1; t < p.n_stages; t++) {
+		if (!(p.succs[s] >> t & 1)) continue;
+		while (p.held[t].size() && dag_ready(p, t, p.held[t].front().frame)) {
+			dag_held_t h = p.held[t].front();
+			p.held[t].pop_front();
+			dag_set_slack(r, slot, t, h.frame, h.job);
+			jobs->push_back(h.job);
+		}
+	}
+}
+
+/*
+ * Name: dag_drop_pid
+ * Function: Forget the pipelines of a client that died; the jobs they held
+ *           back are appended to *jobs, to be destroyed
+ */
+void dag_drop_pid(mid_dag_region_t *r, pid_t pid, std::vector<job_t*> *jobs) {
+	for (int i = 0; i < MID_DAG_MAX; i++) {
+		if (dag_pipes[i].active && dag_pipes[i].pid == pid) dag_remove(r, i, jobs);
+	}
+}
+
+#endif
@@ -0,0 +1,194 @@
+/*
+	Frame pipelines declared to mid as stage graphs, in the shared memory
+	region "mid_dag".
+
+	A frame usually goes through a chain or graph of stages (capture ->
+	detect -> track -> plan), each tagged with its own tag_job_begin. Scheduled
+	one by one, every stage gets the slacktime_us its client guessed. A
+	client can instead declare the graph once: per stage the job name it
+	tags, its WCET and its predecessors. Then per frame it only publishes
+	the end-to-end deadline of the frame. mid (mid_dag.cpp):
+	- gives every stage job the deadline of its frame minus the WCETs on
+	  the longest path after the stage (the critical path), as its slack
+	- holds a stage job until the stages before it in the same frame have
+	  completed, and queues it then, without the client asking again
+	so stage threads can call tag_job_begin for a frame as early as they
+	like.
+
+	Every stage tags exactly one job per frame, in frame order; the n-th
+	job of a stage belongs to the n-th frame published.
+
+	Data structures:
+	- mid_dag_stage_t  one stage
+	- mid_dag_decl_t   one declared pipeline, a slot owned by its client
+	- mid_dag_region_t the whole region
+
+	Functions:
+	- init_mid_dag       --- called in server (init_flag) and in clients
+	- mid_dag_declare    --- client, declare a pipeline
+	- mid_dag_frame      --- client, release a frame with its deadline
+	- mid_dag_leave      --- client, drop a pipeline
+
+	Slots need no lock: a client claims a free slot with a CAS on status,
+	fills it and marks it active; only mid frees it again. mid counts the
+	jobs of every stage in the slot as well, so a restarted mid keeps the
+	region and picks each pipeline up at the frame it was at.
+*/
+#ifndef MID_DAG_H
+#define MID_DAG_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mid_shm.h"        // mid_shm_map
+#include "mid_stats.h"      // mid_stats_now_ns, the clock of deadlines
+#include "ft_lib.h"         // JOB_MEM_NAME_MAX_LEN
+
+#define MID_DAG_NAME "mid_dag"
+#define MID_DAG_MAX 32                  // pipelines
+#define MID_DAG_MAX_STAGES 16
+#define MID_DAG_FRAMES 16               // frame deadlines kept per pipeline
+
+enum mid_dag_status {
+	DAG_FREE,           // slot unused
+	DAG_CLAIMED,        // client is filling it in
+	DAG_ACTIVE,         // declared, mid schedules its stages
+	DAG_LEAVING,        // client is done, mid frees the slot
+};
+
+typedef struct mid_dag_stage {
+	char name[JOB_MEM_NAME_MAX_LEN];    // job name given to tag_job_begin
+	int64_t wcet_us;
+	uint32_t preds;                     // bit i: stage i runs before this one
+} mid_dag_stage_t;
+
+typedef struct mid_dag_decl {
+	int status;                         // enum mid_dag_status
+	pid_t pid;
+	int n_stages;
+	mid_dag_stage_t stage[MID_DAG_MAX_STAGES];
+	unsigned long long frames;          // frames published
+	int64_t deadline_us[MID_DAG_FRAMES]; // of frame n at n % MID_DAG_FRAMES,
+	                                    // mid_stats_now_ns() / 1000
+	unsigned long long submitted[MID_DAG_MAX_STAGES]; // mid, jobs tagged per stage
+	unsigned long long completed[MID_DAG_MAX_STAGES]; // mid, jobs done per stage
+} mid_dag_decl_t;
+
+typedef struct mid_dag_region {
+	mid_dag_decl_t dag[MID_DAG_MAX];
+} mid_dag_region_t;
+
+#define MID_DAG_SIZE sizeof(mid_dag_region_t)
+
+static int client_dag_fd = -1;
+static mid_dag_region_t *client_dag = NULL;
+
+/*
+ * Name: init_mid_dag
+ * Function: Map the pipeline region; the server (init_flag) clears it
+ */
+static inline int init_mid_dag(int *fd, mid_dag_region_t **addr, bool init_flag)
+{
+	*addr = (mid_dag_region_t *)mid_shm_map(MID_DAG_NAME,
+							MID_DAG_SIZE,
+							PROT_READ|PROT_WRITE,
+							init_flag,
+							fd);
+	if (*addr == MAP_FAILED) {
+		perror("[Error] in init_mid_dag: mmap");
+		return -1;
+	}
+
+	if (init_flag) memset(*addr, 0, MID_DAG_SIZE);
+	return 0;
+}
+
+/*
+ * Name: mid_dag_valid
+ * Function: Check a stage graph: 1..MID_DAG_MAX_STAGES stages in
+ *           topological order (predecessors come first), distinct names
+ */
+static inline bool mid_dag_valid(const mid_dag_stage_t *stages, int n)
+{
+	int i, j;
+	if (n < 1 || n > MID_DAG_MAX_STAGES) return false;
+	for (i = 0; i < n; i++) {
+		if (stages[i].wcet_us < 0 || (stages[i].preds >> i) != 0) return false;
+		if (memchr(stages[i].name, '\0', JOB_MEM_NAME_MAX_LEN) == NULL) return false;
+		for (j = 0; j < i; j++)
+			if (strcmp(stages[i].name, stages[j].name) == 0) return false;
+	}
+	return true;
+}
+
+/*
+ * Name: mid_dag_declare
+ * Function: Declare the stage graph of a pipeline of this process
+ * Input: stages in topological order, preds of stage i only name stages < i
+ * Return: slot of the pipeline (pass it to mid_dag_frame), -1 on error
+ */
+static inline int mid_dag_declare(const mid_dag_stage_t *stages, int n)
+{
+	int i;
+	if (!mid_dag_valid(stages, n)) {
+		fprintf(stderr, "mid_dag_declare: bad stage graph\n");
+		return -1;
+	}
+	if (client_dag == NULL && init_mid_dag(&client_dag_fd, &client_dag, false) < 0)
+		return -1;
+
+	/* Claim a free slot */
+	mid_dag_decl_t *d = NULL;
+	for (i = 0; i < MID_DAG_MAX && d == NULL; i++) {
+		int expected = DAG_FREE;
+		if (__atomic_compare_exchange_n(&(client_dag->dag[i].status), &expected,
+				DAG_CLAIMED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			d = &(client_dag->dag[i]);
+	}
+	if (d == NULL) {
+		fprintf(stderr, "mid_dag_declare: no free pipeline slot\n");
+		return -1;
+	}
+
+	d->pid = getpid();
+	d->n_stages = n;
+	memcpy(d->stage, stages, n * sizeof(mid_dag_stage_t));
+	d->frames = 0;
+	memset(d->submitted, 0, sizeof(d->submitted));
+	memset(d->completed, 0, sizeof(d->completed));
+	__atomic_store_n(&(d->status), DAG_ACTIVE, __ATOMIC_RELEASE);
+	return d - client_dag->dag;
+}
+
+/*
+ * Name: mid_dag_frame
+ * Function: Release the next frame of a pipeline, due deadline_us from now;
+ *           call it before or while its first stages tag their jobs
+ * Return: the frame number, -1 if slot is not a pipeline of this process
+ */
+static inline long long mid_dag_frame(int slot, int64_t deadline_us)
+{
+	if (client_dag == NULL || slot < 0 || slot >= MID_DAG_MAX) return -1;
+	mid_dag_decl_t *d = &(client_dag->dag[slot]);
+	if (__atomic_load_n(&(d->status), __ATOMIC_ACQUIRE) != DAG_ACTIVE || d->pid != getpid())
+		return -1;
+	unsigned long long n = d->frames;
+	d->deadline_us[n % MID_DAG_FRAMES] = (int64_t)(mid_stats_now_ns() / 1000) + deadline_us;
+	__atomic_store_n(&(d->frames), n + 1, __ATOMIC_RELEASE);
+	return n;
+}
+
+/*
+ * Name: mid_dag_leave
+ * Function: Tell mid the pipeline of slot won't tag jobs anymore
+ */
+static inline void mid_dag_leave(int slot)
+{
+	if (client_dag == NULL || slot < 0 || slot >= MID_DAG_MAX) return;
+	__atomic_store_n(&(client_dag->dag[slot].status), DAG_LEAVING, __ATOMIC_RELEASE);
+}
+
+#endif
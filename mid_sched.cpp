@@ -0,0 +1,1161 @@
+/*
+	Admission logic(c++) of mid: the job queues, GPU memory and GPU sharing
+	bookkeeping. Nothing here touches shared memory, so it is driven by the
+	server loop in mymid.cpp and, in-process, by tests/bench_sched.cpp.
+
+	Data structures:
+	- fifo_jobs        jobs without slack (noslack_flag), in arrival order
+	- pq_jobs          jobs with slack, ordered by the key of the policy
+	- executing_jobs   jobs holding the GPU
+	- running_pid_jobs / gpu_excl_jobs / admitted_jobs, GPU sharing
+	- sched_tasks      per job name parameters (priority, period, ...)
+
+	Functions:
+	- init_mid_sched   --- set the GPU memory
+	- set_sched_policy / load_sched_tasks --- pick the policy at startup
+	- sched_tick       --- current time, real or simulated
+	- sched_enqueue    --- queue a job submitted by a client
+	- sched_complete   --- release the GPU held by a completed job
+	- sched_run_fifo / sched_run_pq --- admit queued jobs while they fit
+	  - job_acquire_gpu / alloc_gpu_for_job / job_release_gpu
+	- sched_set_preempt --- let urgent jobs ask executing ones to yield
+	- sched_set_batch / sched_batch_of --- admit jobs of one model together
+	- sched_restore_exec --- put back an executing job after a mid restart
+	- sched_set_stale / sched_shed / sched_late_us --- drop jobs that can't
+	  meet their deadline any more
+	- sched_set_failover / sched_set_reserve / load_sched_reserves ---
+	  capacity and priority for replicas the FT manager promoted
+	  - sched_boosted / sched_promoted_of / sched_failover_drop_pid
+
+	Policies (SlackPolicy, EdfPolicy, ...) are structs of static inline
+	functions: key() orders pq_jobs, ready() may hold a job back, admitted()
+	sees every admitted job. The sched_* entry points switch once on
+	sched_policy into a template instance, so the per-job code of every
+	policy is inlined like the original slack policy was.
+
+	The caller wakes or aborts clients from the sched_job_fn callbacks, and
+	forwards yield requests to clients from the sched_preempt_fn callback.
+	Active replicas are recognized by ft_active_replica, which the FT
+	manager (ft_utils_server.cpp) or a benchmark provides.
+*/
+#ifndef MID_SCHED
+#define MID_SCHED
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>	// std::find_if
+#include <queue>		// std::queue, std::priority_queue
+#include <string>		// std::string
+#include <vector>		// std::vector
+#include <unordered_map>	// std::unordered_map
+
+#include "mid_structs.h"
+#include "mid_common.h"
+#include "mid_trace.cpp"	// MID_TRACE_EVENT
+#include "mid_state.cpp"	// mid_state_set_job
+
+bool ft_active_replica(pid_t pid, pid_t *main_pid);
+
+typedef void (*sched_job_fn)(job_t *j);
+typedef void (*sched_preempt_fn)(job_t *j, int64_t deadline_us);
+typedef bool (*sched_stale_fn)(job_t *j, int64_t late_us);
+typedef bool (*sched_failover_fn)(pid_t pid, int *group);
+
+// Helper define for slacktime threshold check
+#define SLACKTIME_THRESHOLD (5*SLEEP_MICROSECONDS)
+#define CURR_SLACKTIME_PQ_EMPTY_OFFSET (rel_priority_period_count*SLEEP_MICROSECONDS)
+#define WITHIN_SLACKTIME_THRESHOLD(s) \
+	(s < (int64_t)CURR_SLACKTIME_PQ_EMPTY_OFFSET + slacktime_threshold_us)
+
+static int64_t slacktime_threshold_us = SLACKTIME_THRESHOLD;	// mid_sim tries others
+
+/* A queued job with the key its policy gave it, lower keys run first */
+typedef struct sched_entry {
+	int64_t key;
+	uint64_t seq;		// arrival order, breaks ties
+	job_t *job;
+	int64_t deadline_us;	// sched_now_us at arrival + slacktime_us
+	int64_t arrival_us;		// sched_now_us at arrival
+} sched_entry_t;
+
+struct CompareEntryKey {
+public:
+	/* One job is higher priority than another if its key is lower, or equal
+	 * and it came first */
+	bool operator()(const sched_entry_t &e1, const sched_entry_t &e2) const {
+		return e1.key > e2.key || (e1.key == e2.key && e1.seq > e2.seq);
+	}
+};
+struct CompareJobPtr {
+	job_t *lhs;
+	public: 
+		CompareJobPtr(job_t *_lhs) : lhs(_lhs) {}
+		bool operator()(job_t *&rhs) {
+			return lhs->pid == rhs->pid \
+				&& lhs->tid == rhs->tid \
+				&& strcmp(lhs->job_name, rhs->job_name) == 0 ;
+		}
+};
+
+static uint64_t max_gpu_memory_available; // In B
+static uint64_t gpu_memory_available;	// In Bytes
+
+static std::priority_queue<sched_entry_t,\
+		std::vector<sched_entry_t>, CompareEntryKey> pq_jobs;
+static std::queue<job_t*> fifo_jobs;
+static std::vector<job_t*> executing_jobs;
+static std::queue<job_t*> completed_jobs;
+static std::unordered_map<pid_t, int> running_pid_jobs;	// How many jobs per pid concurrently running on GPU
+static int gpu_excl_jobs = 0;	// How many jobs are running on GPU with non-shareable flag
+
+// Active-active FT: an active replica's jobs duplicate its main's work. They
+// are admitted as if they came from the main's pid (so main and replica can
+// share the GPU like threads of one process), and the memory they hold is
+// capped so duplicates can't crowd out every other job.
+struct admitted_job_t {
+	pid_t admit_pid;	// pid the job was accounted under in running_pid_jobs
+	bool ft_dup;		// job is duplicated work of an active replica
+	int64_t deadline_us;	// of its pq entry, INT64_MAX if it came from fifo_jobs
+	bool yield_asked;	// job was asked to yield once already
+	uint64_t batch;		// sched_batches key, 0 if admitted alone
+	uint64_t mem_b;		// memory it took, the batch's if in one
+};
+static std::unordered_map<job_t*, admitted_job_t> admitted_jobs;
+static uint64_t ft_dup_mem_b = 0;		// In B, held by duplicated jobs
+static uint64_t max_ft_dup_mem_b;		// In B
+// In order to maintain a relative ordering of old and new jobs on the pq
+// (which is ordered by slacktimes, which is relative to an absolute client
+// frame deadline), we must keep a counter for periods in which the pq is not
+// empty.
+static int rel_priority_period_count = 0;
+
+// ---- Scheduling policies ----
+enum sched_policy_id {SCHED_SLACK, SCHED_EDF, SCHED_FP, SCHED_RM, SCHED_LLF, SCHED_WFQ};
+static const char *sched_policy_names[] = {"slack", "edf", "fp", "rm", "llf", "wfq"};
+static int sched_policy = SCHED_SLACK;
+static int64_t sched_now_us = 0;		// set by sched_tick
+static uint64_t sched_seq = 0;
+
+// Parameters of a task (job name), for the policies that need more than
+// the slacktime_us of a job. Unlisted tasks get sched_task_default.
+typedef struct sched_task {
+	int priority;			// SCHED_FP, higher runs first
+	int64_t period_us;		// SCHED_RM, shorter runs first
+	int64_t wcet_us;		// SCHED_LLF and SCHED_WFQ cost
+	int64_t deadline_us;	// relative; 0 uses the job's slacktime_us
+	int weight;				// SCHED_WFQ share of the pid
+} sched_task_t;
+static const sched_task_t sched_task_default = {0, 0, 0, 0, 1};
+static std::unordered_map<std::string, sched_task_t> sched_tasks;
+
+static const sched_task_t &sched_task_of(const job_t *j) {
+	auto it = sched_tasks.find(j->job_name);
+	return it == sched_tasks.end() ? sched_task_default : it->second;
+}
+
+static inline int64_t sched_deadline_us(const job_t *j, const sched_task_t &t) {
+	return sched_now_us + (t.deadline_us ? t.deadline_us : j->slacktime_us);
+}
+
+/* The original policy: smallest slack first, held back until the slack is
+ * within a threshold of the server period */
+struct SlackPolicy {
+	static inline int64_t key(job_t *j) {
+		if (rel_priority_period_count) {
+			// Locally modify the relative priority of this job
+			// compared to older jobs on the pq
+			j->slacktime_us += rel_priority_period_count*SLEEP_MICROSECONDS;
+		}
+		return j->slacktime_us;
+	}
+	static inline bool ready(const job_t *j) {
+		// Whether job should run now depends on slacktime threshold
+		return WITHIN_SLACKTIME_THRESHOLD(j->slacktime_us);
+	}
+	static inline void admitted(const sched_entry_t &e) {}
+};
+
+/* Earliest deadline first, work conserving */
+struct EdfPolicy {
+	static inline int64_t key(job_t *j) { return sched_deadline_us(j, sched_task_of(j)); }
+	static inline bool ready(const job_t *j) { return true; }
+	static inline void admitted(const sched_entry_t &e) {}
+};
+
+/* Fixed priority from the task table */
+struct FixedPriorityPolicy {
+	static inline int64_t key(job_t *j) { return -(int64_t)sched_task_of(j).priority; }
+	static inline bool ready(const job_t *j) { return true; }
+	static inline void admitted(const sched_entry_t &e) {}
+};
+
+/* Rate monotonic: shorter period first, tasks without a period last */
+struct RateMonotonicPolicy {
+	static inline int64_t key(job_t *j) {
+		int64_t p = sched_task_of(j).period_us;
+		return p > 0 ? p : INT64_MAX;
+	}
+	static inline bool ready(const job_t *j) { return true; }
+	static inline void admitted(const sched_entry_t &e) {}
+};
+
+/* Least laxity first. Queued jobs age at the same rate, so ordering by
+ * deadline - wcet at arrival is the same as by laxity at any later time */
+struct LeastLaxityPolicy {
+	static inline int64_t key(job_t *j) {
+		const sched_task_t &t = sched_task_of(j);
+		return sched_deadline_us(j, t) - t.wcet_us;
+	}
+	static inline bool ready(const job_t *j) { return true; }
+	static inline void admitted(const sched_entry_t &e) {}
+};
+
+/* Weighted fair share between pids (start-time fair queuing): a job's key
+ * is its virtual start time, the cost of a job is its wcet (1 ms if
+ * unknown) divided by its weight */
+static std::unordered_map<pid_t, int64_t> wfq_finish;	// last virtual finish per pid
+static int64_t wfq_vtime = 0;						// start of the last admitted job
+struct WeightedFairPolicy {
+	static inline int64_t key(job_t *j) {
+		const sched_task_t &t = sched_task_of(j);
+		int64_t cost = (t.wcet_us ? t.wcet_us : 1000) * 1000 / (t.weight > 0 ? t.weight : 1);
+		int64_t &finish = wfq_finish[j->pid];
+		int64_t start = std::max(wfq_vtime, finish);
+		finish = start + cost;
+		return start;
+	}
+	static inline bool ready(const job_t *j) { return true; }
+	static inline void admitted(const sched_entry_t &e) { wfq_vtime = std::max(wfq_vtime, e.key); }
+};
+
+// ---- Cooperative preemption ----
+// A pq job due within PREEMPT_SLACK_US that can't get the GPU asks the
+// executing slack job with the latest deadline (later than its own by at
+// least PREEMPT_SLACK_US) to yield at its next yield point, through
+// sched_preempt. The job releases the GPU with tag_job_end and queues
+// again with its remaining slack. One request is outstanding at a time, a
+// job is asked once, and one that doesn't yield within PREEMPT_TIMEOUT_US
+// is left to run to its end.
+#define PREEMPT_SLACK_US SLACKTIME_THRESHOLD
+#define PREEMPT_TIMEOUT_US (20*SLEEP_MICROSECONDS)
+
+static sched_preempt_fn sched_preempt = NULL;	// NULL: never preempt
+static job_t *preempt_victim = NULL;			// asked to yield, still executing
+static int64_t preempt_since_us;
+
+static void sched_try_preempt(const sched_entry_t &e) {
+	if (preempt_victim) {
+		if (sched_now_us - preempt_since_us < PREEMPT_TIMEOUT_US) return;
+		preempt_victim = NULL;
+	}
+	if (e.deadline_us - sched_now_us > PREEMPT_SLACK_US) return;
+
+	job_t *victim = NULL;
+	int64_t latest = e.deadline_us + PREEMPT_SLACK_US;
+	for (job_t *j : executing_jobs) {
+		auto adm = admitted_jobs.find(j);
+		if (j->noslack_flag || adm == admitted_jobs.end() || adm->second.yield_asked) continue;
+		// A member yielding frees nothing while the rest of its batch runs
+		if (adm->second.batch) continue;
+		if (adm->second.deadline_us > latest) {
+			latest = adm->second.deadline_us;
+			victim = j;
+		}
+	}
+	if (victim == NULL) return;
+
+	admitted_jobs[victim].yield_asked = true;
+	preempt_victim = victim;
+	preempt_since_us = sched_now_us;
+	MID_TRACE_EVENT2(TRACE_PREEMPT, victim->pid, victim->tid, victim->job_name,
+			e.job->pid, e.deadline_us - sched_now_us, std::max<int64_t>(latest - sched_now_us, 0));
+	sched_preempt(victim, latest);
+}
+
+// ---- Batching ----
+// Several processes often tag the same job name (the same model) within a
+// few server periods. With a batching window set, the pq job admitted
+// first pulls the queued jobs of the same name along (up to
+// SCHED_BATCH_MAX), and all of them share its one memory reservation: a
+// batch runs one copy of the model. The reservation is released when the
+// last member completes. Before that, a batchable job at the head of
+// pq_jobs waits for peers up to the window after its arrival, but only
+// while no queued job is due within the window plus SLACKTIME_THRESHOLD,
+// so waiting can't make a job late.
+// Members must be shareable pq jobs with a memory requirement no larger
+// than the first one's, and not active replicas.
+#define SCHED_BATCH_MAX 16
+
+typedef struct sched_batch {
+	uint64_t mem_b;		// the one reservation of the batch
+	int size;
+	int left;			// members still executing
+} sched_batch_t;
+
+typedef struct sched_batch_info {
+	uint64_t id;
+	int size;
+	int rank;			// 0: the job the batch was formed around
+} sched_batch_info_t;
+
+static int64_t sched_batch_window_us = 0;	// 0: no batching
+static uint64_t sched_batch_seq = 0;
+static std::unordered_map<uint64_t, sched_batch_t> sched_batches;
+static std::unordered_map<job_t*, sched_batch_info_t> sched_batch_jobs;
+
+// ---- Load shedding ----
+// A pq job is stale once its deadline is closer than the WCET of its task
+// (sched_tasks), or passed if the WCET is unknown: it would end late, and
+// so would the jobs queued behind it. sched_shed asks sched_stale whether
+// to drop each stale job; the others run late.
+static sched_stale_fn sched_stale = NULL;	// NULL: never shed
+
+/* How late the job of entry e would end if it ran now, <= 0 if in time */
+static inline int64_t sched_late_by(const sched_entry_t &e) {
+	if (e.deadline_us == INT64_MAX) return 0;
+	return sched_now_us + sched_task_of(e.job).wcet_us - e.deadline_us;
+}
+
+// ---- Failover ----
+// A replica (or spare) the FT manager just promoted must not wait behind a
+// full GPU while its frames fall behind. A FT group may reserve GPU memory
+// for its takeover: a held reservation is kept free of other jobs (a
+// whole-GPU job gets all of the GPU but the held ones), a borrowable one is
+// used by them, and they are asked to yield (sched_preempt) once the
+// promoted replica needs it. sched_failover tells at enqueue whether a
+// pid is a promoted replica, and of which group; the group's held
+// reservation is then kept for that pid alone until one of its jobs is
+// admitted into it, and its pq jobs are boosted: they
+// go first and don't wait for their slack, until one of them completes by
+// its deadline (it caught up) or SCHED_BOOST_MAX_US passed. Jobs queued
+// while boosted keep their place.
+#define SCHED_BOOST_MAX_US 1000000
+
+typedef struct sched_reserve {
+	uint64_t mem_b;
+	bool borrowable;
+	bool claimed;		// its promoted replica was admitted, not held anymore
+} sched_reserve_t;
+
+typedef struct sched_promoted {
+	int group;
+	int64_t since_us;	// sched_now_us when first seen promoted
+	int frames;			// jobs completed since
+	bool boosted;		// until it caught up
+} sched_promoted_t;
+
+static sched_failover_fn sched_failover = NULL;	// NULL: no FT manager
+static std::unordered_map<int, sched_reserve_t> sched_reserves;
+static uint64_t sched_reserved_mem_b = 0;	// held and unclaimed, kept free
+static std::unordered_map<pid_t, sched_promoted_t> sched_promoted;
+
+static void sched_reserve_claim(int group, bool claim) {
+	auto r = sched_reserves.find(group);
+	if (r == sched_reserves.end() || r->second.claimed == claim) return;
+	r->second.claimed = claim;
+	if (r->second.borrowable) return;
+	if (claim) sched_reserved_mem_b -= r->second.mem_b;
+	else sched_reserved_mem_b += r->second.mem_b;
+}
+
+/* Ask the FT manager about the pid of a job being queued */
+static void sched_failover_note(const job_t *j) {
+	int group;
+	if (sched_failover == NULL || sched_promoted.count(j->pid)) return;
+	if (!sched_failover(j->pid, &group)) return;
+	sched_promoted[j->pid] = {group, sched_now_us, 0, true};
+}
+
+/* Held memory a job of pid must leave free, all but its own reservation */
+static uint64_t sched_held_for(pid_t pid) {
+	if (sched_promoted.empty()) return sched_reserved_mem_b;
+	auto p = sched_promoted.find(pid);
+	if (p == sched_promoted.end()) return sched_reserved_mem_b;
+	auto r = sched_reserves.find(p->second.group);
+	if (r == sched_reserves.end() || r->second.borrowable || r->second.claimed)
+		return sched_reserved_mem_b;
+	return sched_reserved_mem_b - r->second.mem_b;
+}
+
+/*
+ * Name: sched_boosted
+ * Function: Whether pid is a promoted replica still catching up
+ */
+bool sched_boosted(pid_t pid) {
+	if (sched_promoted.empty()) return false;
+	auto p = sched_promoted.find(pid);
+	if (p == sched_promoted.end() || !p->second.boosted) return false;
+	if (sched_now_us - p->second.since_us < SCHED_BOOST_MAX_US) return true;
+	p->second.boosted = false;
+	return false;
+}
+
+#define SCHED_DISPATCH(fn, ...) \
+	switch (sched_policy) { \
+	case SCHED_EDF: return fn<EdfPolicy>(__VA_ARGS__); \
+	case SCHED_FP:  return fn<FixedPriorityPolicy>(__VA_ARGS__); \
+	case SCHED_RM:  return fn<RateMonotonicPolicy>(__VA_ARGS__); \
+	case SCHED_LLF: return fn<LeastLaxityPolicy>(__VA_ARGS__); \
+	case SCHED_WFQ: return fn<WeightedFairPolicy>(__VA_ARGS__); \
+	default:        return fn<SlackPolicy>(__VA_ARGS__); \
+	}
+
+int job_release_gpu(job_t *comp_job) {
+	if (!comp_job) {
+		fprintf(stderr, "Couldn't release job because of bad pointer!\n");
+		return -1;
+	}
+
+	// Verify release of memory
+	if (gpu_memory_available + comp_job->required_mem_b < gpu_memory_available) {
+		// Something's wrong, overflow occurred when releasing memory
+		fprintf(stderr, "Overflow occurred when releasing gpu for job with name %s (wpm %lu, avail %lu)\n!",\
+				comp_job->job_name, comp_job->required_mem_b, gpu_memory_available);
+		return -2;
+	}
+
+	// Look up the pid the job was admitted under
+	auto adm = admitted_jobs.find(comp_job);
+	if (adm == admitted_jobs.end()) {
+		fprintf(stderr, "Couldn't release job because it was never admitted (%d)!\n", comp_job->pid);
+		return -2;
+	}
+	pid_t admit_pid = adm->second.admit_pid;
+	// Acquired memory
+	uint64_t acquired_mem = adm->second.mem_b;
+	// A batch holds one reservation, released with its last member
+	auto batch = sched_batches.find(adm->second.batch);
+	if (batch != sched_batches.end()) {
+		acquired_mem = batch->second.left == 1 ? batch->second.mem_b : 0;
+	}
+
+	// Verify decrement number of jobs running under job's pid
+	auto it = running_pid_jobs.find(admit_pid);
+	if (it == running_pid_jobs.end()) {
+		fprintf(stderr, "Couldn't release job because cannot find is running pid (%d)!\n", admit_pid);
+		return -2;
+	} else {
+		if (running_pid_jobs[admit_pid]< 1) {
+			fprintf(stderr, "Couldn't release job because too running pid jobs for pid (%d)!\n", admit_pid);
+			return -2;
+		}
+	}
+	if (!comp_job->shareable_flag) {
+		if (gpu_excl_jobs < 1) {
+			fprintf(stderr, "Couldn't release job because too few gpu_excl_jobs!\n");
+			return -2;
+		}
+		gpu_excl_jobs--;
+	}
+
+	// Actually release memory and reduce running_pid_jobs
+	gpu_memory_available += acquired_mem;
+	if (adm->second.ft_dup) {
+		ft_dup_mem_b -= acquired_mem;
+	}
+	admitted_jobs.erase(adm);
+	sched_batch_jobs.erase(comp_job);
+	if (batch != sched_batches.end() && --batch->second.left == 0) {
+		sched_batches.erase(batch);
+	}
+	running_pid_jobs[admit_pid]--;
+	// Remove pid from running_pid_jobs if its tid count is 0
+	if (running_pid_jobs[admit_pid] == 0) {
+		running_pid_jobs.erase(it);
+	}
+	return 0;
+}
+
+// Helper function for bookkeeping of allocating gpu resources for job;
+// a member of a batch (sched_batches key) shares the batch's memory
+void alloc_gpu_for_job(job_t *j, pid_t admit_pid, bool ft_dup, uint64_t batch = 0) {
+	// A whole-GPU job takes all that is free but the held reservations
+	uint64_t held = sched_held_for(j->pid);
+	uint64_t acquired_mem = j->required_mem_b ? j->required_mem_b :
+		gpu_memory_available - std::min(held, gpu_memory_available);
+	if (batch) {
+		// Memory was taken when the batch was formed
+		acquired_mem = sched_batches[batch].mem_b;
+	} else {
+		gpu_memory_available -= acquired_mem;
+	}
+	if (ft_dup) {
+		ft_dup_mem_b += acquired_mem;
+	}
+	// A promoted replica took its group's reservation, it is held no more
+	if (held != sched_reserved_mem_b) {
+		sched_reserve_claim(sched_promoted[j->pid].group, true);
+	}
+	admitted_jobs[j] = {admit_pid, ft_dup, INT64_MAX, false, batch, acquired_mem};
+	mid_state_set_job(j, MID_Q_EXEC, admit_pid, ft_dup, batch, batch ? sched_batches[batch].mem_b : 0);
+
+	auto it = running_pid_jobs.find(admit_pid);
+	if (it != running_pid_jobs.end()) {
+		// Increment number of threads running for job's pid
+		running_pid_jobs[admit_pid]++;
+	} else {
+		running_pid_jobs[admit_pid] = 1;
+	}
+
+	if (!j->shareable_flag) { // TODO
+		gpu_excl_jobs++;
+	}
+	return;
+}
+
+/*
+ * A job can acquire the gpu under the following conditions:
+ * 1) Job's memory requirement fits on memory available for GPU
+ * AND 
+ * 2) job can appropriately share the GPU with other threads or pids
+ * AND
+ * 3) the policy lets it run now (for SlackPolicy, job's slacktime below a
+ *    threshold relative to server period)
+ * Returns 0 on success, -1 on wait signal, -2 on abort signal for job
+ */
+template <class P>
+int job_acquire_gpu(job_t *j) {
+	if (!j) return -2;
+
+	// Held reservations of FT groups stay free for their takeover, a
+	// promoted replica may take its own
+	uint64_t held = sched_held_for(j->pid);
+	uint64_t free_b = gpu_memory_available - std::min(held, gpu_memory_available);
+	bool can_alloc_mem = false;
+	if (j->required_mem_b > max_gpu_memory_available) {
+		// Must abort job, can never run on the GPU
+		return -2;
+	} else {
+		if (j->required_mem_b == 0 && free_b == max_gpu_memory_available
+				- std::min(held, max_gpu_memory_available)) {
+			can_alloc_mem = true;
+		} else if (j->required_mem_b < free_b) {
+			can_alloc_mem = true;
+		} else {
+			can_alloc_mem = false;
+		}
+	}
+	if (!can_alloc_mem) {
+		// Must wait for jobs to free up GPU mem
+		return -1;
+	}
+
+	// Active replicas are accounted under their main's pid
+	pid_t admit_pid = j->pid;
+	bool ft_dup = ft_active_replica(j->pid, &admit_pid);
+	if (ft_dup) {
+		uint64_t dup_mem = j->required_mem_b ? j->required_mem_b : max_gpu_memory_available;
+		if (ft_dup_mem_b > 0 && ft_dup_mem_b + dup_mem > max_ft_dup_mem_b) {
+			// Must wait for other duplicated jobs to complete
+			return -1;
+		}
+	}
+
+	bool should_run_now = false;
+	if (j->noslack_flag || sched_boosted(j->pid)) {
+		should_run_now = true;
+	} else {
+		should_run_now = P::ready(j);
+	}
+	if (!should_run_now) {
+		// Must wait for slacktime to be within running threshold
+		return -1;
+	}
+
+
+	bool can_run_now = false;
+	if (running_pid_jobs.size() == 0) {
+		can_run_now = true;
+	} else {
+		auto it = running_pid_jobs.find(admit_pid);
+		if (it != running_pid_jobs.end()) {
+			// Job shares pid with running job
+			if (j->shareable_flag) {
+				can_run_now = true;
+			} else if (running_pid_jobs.size() == 1 && !j->shareable_flag) {
+				can_run_now = true;
+			} else {
+				// Job is not shareable and multiple pids running, must wait
+				can_run_now = false;
+			}
+		} else {
+			// Job is first of its process to run next to other jobs
+			if (j->shareable_flag) {
+				if (gpu_excl_jobs == 0) {
+					// Can run if no other jobs are not-shareable
+					can_run_now = true;
+				} else {
+					can_run_now = false;
+				}
+			} else {
+				// Job can't share gpu with other processes
+				can_run_now = false;
+			}
+		}
+	}
+	if (!can_run_now) {
+		return -1;
+	} else {
+		alloc_gpu_for_job(j, admit_pid, ft_dup);
+		MID_TRACE_EVENT(TRACE_ADMIT, j->pid, j->tid, j->job_name, ft_dup, admitted_jobs[j].mem_b);
+		return 0;
+	}
+}
+
+/* pq_jobs is a heap in a vector, batching takes jobs out of its middle */
+struct sched_pq_access : decltype(pq_jobs) {
+	static std::vector<sched_entry_t> &entries(decltype(pq_jobs) &q) {
+		return q.*(&sched_pq_access::c);
+	}
+};
+
+static inline bool sched_batchable(const job_t *j) {
+	return sched_batch_window_us > 0 && j->shareable_flag && !j->noslack_flag
+		&& j->required_mem_b > 0;
+}
+
+static inline bool sched_batch_peer(const job_t *lead, const job_t *j) {
+	return j != lead && sched_batchable(j) && j->required_mem_b <= lead->required_mem_b
+		&& strcmp(j->job_name, lead->job_name) == 0;
+}
+
+/* Whether the head e of pq_jobs should wait for more jobs of its name;
+ * not if it or any job queued behind it is due within the window */
+static bool sched_batch_wait(const sched_entry_t &e) {
+	if (!sched_batchable(e.job)) return false;
+	if (sched_now_us - e.arrival_us >= sched_batch_window_us) return false;
+	int peers = 0;
+	for (const sched_entry_t &o : sched_pq_access::entries(pq_jobs)) {
+		if (o.deadline_us - sched_now_us <= sched_batch_window_us + SLACKTIME_THRESHOLD) return false;
+		if (sched_batch_peer(e.job, o.job)) peers++;
+	}
+	return peers + 1 < SCHED_BATCH_MAX;
+}
+
+/*
+ * Take the queued peers of the just admitted job lead out of pq_jobs, in
+ * the order of the policy, and admit them into lead's reservation.
+ * Returns the admitted peers.
+ */
+static std::vector<sched_entry_t> sched_batch_form(job_t *lead) {
+	std::vector<sched_entry_t> peers;
+	auto adm = admitted_jobs.find(lead);
+	if (!sched_batchable(lead) || adm == admitted_jobs.end() || adm->second.ft_dup) return peers;
+
+	std::vector<sched_entry_t> &q = sched_pq_access::entries(pq_jobs);
+	std::vector<sched_entry_t> rest;
+	for (const sched_entry_t &e : q) {
+		pid_t admit_pid = e.job->pid;
+		bool can_share = gpu_excl_jobs == 0 || running_pid_jobs.count(e.job->pid);
+		if (sched_batch_peer(lead, e.job) && can_share && !ft_active_replica(e.job->pid, &admit_pid))
+			peers.push_back(e);
+		else
+			rest.push_back(e);
+	}
+	if (peers.empty()) return peers;
+	// Best first; those over SCHED_BATCH_MAX stay queued
+	std::sort(peers.begin(), peers.end(), [](const sched_entry_t &a, const sched_entry_t &b) {
+		return CompareEntryKey()(b, a);
+	});
+	if (peers.size() > SCHED_BATCH_MAX - 1) {
+		rest.insert(rest.end(), peers.begin() + SCHED_BATCH_MAX - 1, peers.end());
+		peers.resize(SCHED_BATCH_MAX - 1);
+	}
+	q.swap(rest);
+	std::make_heap(q.begin(), q.end(), CompareEntryKey());
+
+	uint64_t id = ++sched_batch_seq;
+	int size = (int)peers.size() + 1;
+	sched_batches[id] = {lead->required_mem_b, size, size};
+	adm->second.batch = id;
+	mid_state_set_job(lead, MID_Q_EXEC, adm->second.admit_pid, false, id, lead->required_mem_b);
+	sched_batch_jobs[lead] = {id, size, 0};
+	for (size_t i = 0; i < peers.size(); i++) {
+		job_t *j = peers[i].job;
+		alloc_gpu_for_job(j, j->pid, false, id);
+		admitted_jobs[j].deadline_us = peers[i].deadline_us;
+		sched_batch_jobs[j] = {id, size, (int)i + 1};
+		MID_TRACE_EVENT(TRACE_ADMIT, j->pid, j->tid, j->job_name, 0, 0);
+	}
+	return peers;
+}
+
+/*
+ * Name: init_mid_sched
+ * Function: Start with empty queues and all of the GPU memory available.
+ *           The policy, task table and FT reservations are kept.
+ */
+void init_mid_sched(uint64_t gpu_mem_b) {
+	max_gpu_memory_available = gpu_mem_b;
+	gpu_memory_available = max_gpu_memory_available;
+	max_ft_dup_mem_b = max_gpu_memory_available / 2;
+	ft_dup_mem_b = 0;
+	gpu_excl_jobs = 0;
+	rel_priority_period_count = 0;
+	sched_seq = 0;
+	preempt_victim = NULL;
+	wfq_finish.clear();
+	wfq_vtime = 0;
+	sched_batch_seq = 0;
+	sched_batches.clear();
+	sched_batch_jobs.clear();
+	sched_promoted.clear();
+	sched_reserved_mem_b = 0;
+	for (auto &r : sched_reserves) {
+		r.second.claimed = false;
+		if (!r.second.borrowable) sched_reserved_mem_b += r.second.mem_b;
+	}
+
+	// Empty, so a simulator can run again from scratch
+	pq_jobs = decltype(pq_jobs)();
+	fifo_jobs = decltype(fifo_jobs)();
+	completed_jobs = decltype(completed_jobs)();
+	executing_jobs.clear();
+	running_pid_jobs.clear();
+	admitted_jobs.clear();
+}
+
+/*
+ * Name: set_sched_policy
+ * Function: Select the policy by name (slack, edf, fp, rm, llf, wfq)
+ * Return: 0 on success, -1 if the name is unknown
+ */
+int set_sched_policy(const char *name) {
+	for (int i = 0; i < (int)(sizeof(sched_policy_names) / sizeof(sched_policy_names[0])); i++) {
+		if (strcmp(name, sched_policy_names[i]) == 0) {
+			sched_policy = i;
+			return 0;
+		}
+	}
+	fprintf(stderr, "Unknown scheduling policy %s\n", name);
+	return -1;
+}
+
+/*
+ * Name: load_sched_tasks
+ * Function: Read task parameters, one task per line:
+ *           <job name> <priority> <period_us> <wcet_us> <deadline_us> <weight>
+ *           Empty lines and lines starting with # are skipped.
+ * Return: number of tasks read, -1 on error
+ */
+int load_sched_tasks(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (f == NULL) {
+		perror("[Error] in load_sched_tasks: fopen");
+		return -1;
+	}
+	char line[256], name[JOB_MEM_NAME_MAX_LEN];
+	int n = 0, lineno = 0;
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n') continue;
+		sched_task_t t = sched_task_default;
+		long long period, wcet, deadline;
+		if (sscanf(line, "%99s %d %lld %lld %lld %d", name, &(t.priority),
+				&period, &wcet, &deadline, &(t.weight)) != 6) {
+			fprintf(stderr, "%s:%d: expected name priority period_us wcet_us deadline_us weight\n",
+				path, lineno);
+			continue;
+		}
+		t.period_us = period;
+		t.wcet_us = wcet;
+		t.deadline_us = deadline;
+		sched_tasks[name] = t;
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/*
+ * Name: sched_tick
+ * Function: Tell the policies the current time, once per server period
+ */
+void sched_tick(uint64_t now_us) {
+	sched_now_us = now_us;
+}
+
+/*
+ * Name: sched_set_preempt
+ * Function: Let urgent pq jobs ask executing jobs to yield, fn forwards
+ *           the request with the deadline the job had when it was queued
+ */
+void sched_set_preempt(sched_preempt_fn fn) {
+	sched_preempt = fn;
+}
+
+/*
+ * Name: sched_set_stale
+ * Function: Let sched_shed drop stale pq jobs for which fn(job, late_us)
+ *           returns true
+ */
+void sched_set_stale(sched_stale_fn fn) {
+	sched_stale = fn;
+}
+
+/*
+ * Name: sched_shed
+ * Function: Take the stale pq jobs that sched_stale drops off pq_jobs and
+ *           hand them to shed, which aborts them; call it before
+ *           sched_run_pq in every server period
+ * Return: number of dropped jobs; *n_late, stale jobs kept to run late
+ */
+int sched_shed(sched_job_fn shed, int *n_late) {
+	*n_late = 0;
+	if (sched_stale == NULL || pq_jobs.empty()) return 0;
+
+	std::vector<sched_entry_t> &q = sched_pq_access::entries(pq_jobs);
+	std::vector<job_t*> dropped;
+	size_t kept = 0;
+	for (size_t i = 0; i < q.size(); i++) {
+		int64_t late_us = sched_late_by(q[i]);
+		if (late_us > 0 && sched_stale(q[i].job, late_us)) {
+			dropped.push_back(q[i].job);
+			continue;
+		}
+		if (late_us > 0) (*n_late)++;
+		q[kept++] = q[i];
+	}
+	if (dropped.empty()) return 0;
+	q.resize(kept);
+	std::make_heap(q.begin(), q.end(), CompareEntryKey());
+	for (job_t *j : dropped) shed(j);
+	return (int)dropped.size();
+}
+
+/*
+ * Name: sched_late_us
+ * Function: How late an executing job admitted from pq_jobs ends if it
+ *           runs its WCET from now
+ * Return: us late, <= 0 if it is in time or has no deadline
+ */
+int64_t sched_late_us(job_t *j) {
+	auto adm = admitted_jobs.find(j);
+	if (adm == admitted_jobs.end()) return 0;
+	return sched_late_by({0, 0, j, adm->second.deadline_us, 0});
+}
+
+/*
+ * Name: sched_set_batch
+ * Function: Admit pq jobs of the same name together, waiting for peers up
+ *           to window_us after a job's arrival; 0 turns batching off
+ */
+void sched_set_batch(int64_t window_us) {
+	sched_batch_window_us = window_us > 0 ? window_us : 0;
+}
+
+/*
+ * Name: sched_batch_of
+ * Function: Batch of an executing job
+ * Return: true and *info if the job was admitted in a batch
+ */
+bool sched_batch_of(job_t *j, sched_batch_info_t *info) {
+	auto it = sched_batch_jobs.find(j);
+	if (it == sched_batch_jobs.end()) return false;
+	*info = it->second;
+	return true;
+}
+
+/*
+ * Name: sched_set_failover
+ * Function: Let fn(pid, &group) tell which pids are replicas the FT manager
+ *           promoted; their jobs get their group's reservation and a boost
+ */
+void sched_set_failover(sched_failover_fn fn) {
+	sched_failover = fn;
+}
+
+/*
+ * Name: sched_set_reserve
+ * Function: Reserve mem_b of GPU memory for the takeover of FT group; a
+ *           borrowable reservation is used by other jobs until then, a held
+ *           one is kept free. mem_b 0 drops the reservation.
+ * Return: 0 on success, -1 if held reservations would take over half of
+ *         the GPU
+ */
+int sched_set_reserve(int group, uint64_t mem_b, bool borrowable) {
+	auto r = sched_reserves.find(group);
+	uint64_t held = sched_reserved_mem_b;
+	if (r != sched_reserves.end() && !r->second.borrowable && !r->second.claimed) held -= r->second.mem_b;
+	if (!borrowable && held + mem_b > max_gpu_memory_available / 2) {
+		fprintf(stderr, "FT group %d: held reservations over half of the GPU\n", group);
+		return -1;
+	}
+	bool claimed = r != sched_reserves.end() && r->second.claimed;
+	sched_reserve_claim(group, true);
+	sched_reserves.erase(group);
+	if (mem_b == 0) return 0;
+	sched_reserves[group] = {mem_b, borrowable, true};
+	if (!claimed) sched_reserve_claim(group, false);
+	return 0;
+}
+
+/*
+ * Name: load_sched_reserves
+ * Function: Set reservations from "group:MB[:borrow],...", e.g. the
+ *           MID_FT_RESERVE environment variable
+ * Return: number of reservations set, -1 on error
+ */
+int load_sched_reserves(const char *spec) {
+	int n = 0;
+	const char *s = spec;
+	while (*s) {
+		int group, len = 0;
+		unsigned long long mb;
+		if (sscanf(s, "%d:%llu%n", &group, &mb, &len) != 2) {
+			fprintf(stderr, "Bad FT reservation at %s, expected group:MB[:borrow]\n", s);
+			return -1;
+		}
+		s += len;
+		bool borrowable = strncmp(s, ":borrow", 7) == 0;
+		if (borrowable) s += 7;
+		if (*s != ',' && *s != '\0') {
+			fprintf(stderr, "Bad FT reservation at %s, expected group:MB[:borrow]\n", s);
+			return -1;
+		}
+		if (*s == ',') s++;
+		if (sched_set_reserve(group, mb << 20, borrowable) < 0) return -1;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Name: sched_promoted_of
+ * Function: Failover state of a promoted replica
+ * Return: true and *p if pid was seen promoted
+ */
+bool sched_promoted_of(pid_t pid, sched_promoted_t *p) {
+	auto it = sched_promoted.find(pid);
+	if (it == sched_promoted.end()) return false;
+	*p = it->second;
+	return true;
+}
+
+/*
+ * Name: sched_failover_drop_pid
+ * Function: Forget a promoted replica that exited; its group's reservation
+ *           is reserved again for the next takeover
+ */
+void sched_failover_drop_pid(pid_t pid) {
+	auto p = sched_promoted.find(pid);
+	if (p == sched_promoted.end()) return;
+	sched_reserve_claim(p->second.group, false);
+	sched_promoted.erase(p);
+}
+
+/*
+ * Name: sched_restore_exec
+ * Function: Put back a job that was executing before a mid restart, as
+ *           recorded in mid_state; the members of a batch share its one
+ *           reservation of batch_mem_b again
+ */
+void sched_restore_exec(job_t *j, pid_t admit_pid, bool ft_dup, uint64_t batch,
+	uint64_t batch_mem_b) {
+	if (batch) {
+		auto b = sched_batches.find(batch);
+		if (b == sched_batches.end()) {
+			// First member back takes the batch's memory
+			gpu_memory_available -= std::min(batch_mem_b, gpu_memory_available);
+			b = sched_batches.insert({batch, {batch_mem_b, 0, 0}}).first;
+		}
+		// Ranks are not recorded, members get them in the order they come back
+		int rank = b->second.size++;
+		b->second.left++;
+		sched_batch_jobs[j] = {batch, b->second.size, rank};
+		for (auto &m : sched_batch_jobs) {
+			if (m.second.id == batch) m.second.size = b->second.size;
+		}
+		sched_batch_seq = std::max(sched_batch_seq, batch);
+	}
+	alloc_gpu_for_job(j, admit_pid, ft_dup, batch);
+	executing_jobs.push_back(j);
+}
+
+template <class P>
+int sched_enqueue(job_t *j) {
+	sched_failover_note(j);
+	if (j->noslack_flag) {
+		fifo_jobs.push(j);
+		return MID_Q_FIFO;
+	}
+	// Before key(), which may shift slacktime_us
+	int64_t deadline_us = sched_now_us + j->slacktime_us;
+	int64_t key = P::key(j);
+	// A promoted replica catching up goes first
+	if (sched_boosted(j->pid)) key = INT64_MIN;
+	pq_jobs.push({key, sched_seq++, j, deadline_us, sched_now_us});
+	return MID_Q_PQ;
+}
+
+/*
+ * Name: sched_enqueue
+ * Function: Put a job submitted by a client on fifo_jobs (noslack) or pq_jobs
+ * Return: MID_Q_FIFO or MID_Q_PQ, the queue the job was put on
+ */
+int sched_enqueue(job_t *j) {
+	SCHED_DISPATCH(sched_enqueue, j);
+}
+
+/*
+ * Name: sched_requeue
+ * Function: Put a job back on pq_jobs as it was, e.g. after a mid restart
+ */
+void sched_requeue(job_t *j) {
+	if (sched_policy == SCHED_SLACK) {
+		// slacktime_us was already shifted when the job was first queued
+		pq_jobs.push({j->slacktime_us, sched_seq++, j, sched_now_us + j->slacktime_us, sched_now_us});
+	} else {
+		// Keys of the other policies are not persisted, the job counts as new
+		sched_enqueue(j);
+	}
+}
+
+/*
+ * Name: sched_complete
+ * Function: Release the GPU of the executing job compl_job (the client's
+ *           completion request) refers to, and drop it from executing_jobs
+ * Return: the executing job, NULL if it is unknown or couldn't be released
+ */
+job_t *sched_complete(job_t *compl_job) {
+	auto it = std::find_if(executing_jobs.begin(),
+			executing_jobs.end(),
+			CompareJobPtr(compl_job));
+	if (it == executing_jobs.end()) {
+		fprintf(stderr, "Completed job (%s) is not executing!\n", compl_job->job_name);
+		return NULL;
+	}
+	job_t *orig_job = *it;
+
+	// A promoted replica caught up once a job of it ends by its deadline
+	auto p = sched_promoted.find(orig_job->pid);
+	auto adm = admitted_jobs.find(orig_job);
+	if (p != sched_promoted.end() && adm != admitted_jobs.end()) {
+		p->second.frames++;
+		if (sched_now_us <= adm->second.deadline_us) p->second.boosted = false;
+	}
+
+	if (job_release_gpu(orig_job) != 0) {
+		fprintf(stderr, "Something went wrong releasing job's resources!\n");
+		return NULL;
+	}
+	executing_jobs.erase(it);
+	if (orig_job == preempt_victim) {
+		// Yielded or ended, either way its GPU is free
+		preempt_victim = NULL;
+	}
+	return orig_job;
+}
+
+template <class P>
+int sched_run_fifo(bool *wait_for_complete, sched_job_fn admitted, sched_job_fn aborted) {
+	int n = 0;
+	while (!*wait_for_complete && fifo_jobs.size()) {
+		/* Peek at job from jobs_queued */
+		job_t *q_job = fifo_jobs.front();
+
+		/* Handle queued jobs */
+		int res = job_acquire_gpu<P>(q_job);
+		if (res == -1) {
+			// Failed to acquire GPU, must wait for other jobs to complete
+			*wait_for_complete = true;
+			break;
+		}
+		// Actually pop job off queue
+		fifo_jobs.pop();
+		if (res < 0) {
+			// Job is too big to fit on the GPU, client must abort it
+			aborted(q_job);
+		} else {
+			// Adds q_job to executing_jobs on success
+			executing_jobs.push_back(q_job);
+			admitted(q_job);
+			n++;
+		}
+	}
+	return n;
+}
+
+/*
+ * Name: sched_run_fifo
+ * Function: Run jobs that have never run yet (and therefore have no
+ *           priority) in arrival order, until one has to wait
+ * Return: number of admitted jobs; *wait_for_complete is set when the head
+ *         of fifo_jobs must wait for a job to complete
+ */
+int sched_run_fifo(bool *wait_for_complete, sched_job_fn admitted, sched_job_fn aborted) {
+	SCHED_DISPATCH(sched_run_fifo, wait_for_complete, admitted, aborted);
+}
+
+template <class P>
+int sched_run_pq(sched_job_fn admitted, sched_job_fn aborted) {
+	int n = 0;
+	if (pq_jobs.size()) {
+		// Priority queue is not empty, increment the rel_priority_period_count
+		rel_priority_period_count++;
+	}
+	while (pq_jobs.size()) {
+		/* Peek at top job from pq_jobs */
+		sched_entry_t top = pq_jobs.top();
+		job_t *q_job = top.job;
+
+		// Give jobs of the same model a moment to join it, unless it is a
+		// promoted replica catching up
+		bool boosted = sched_boosted(q_job->pid);
+		if (!boosted && sched_batch_wait(top)) break;
+
+		/* Handle queued jobs */
+		int res = job_acquire_gpu<P>(q_job);
+		if (res == -1) {
+			// Failed to acquire GPU, must wait for other jobs to complete,
+			// or if it is due soon, ask one of them to yield; a promoted
+			// replica is due now, borrowers of its reservation yield to it
+			if (sched_preempt && boosted) {
+				sched_entry_t due = top;
+				due.deadline_us = sched_now_us;
+				sched_try_preempt(due);
+			} else if (sched_preempt && P::ready(q_job)) {
+				sched_try_preempt(top);
+			}
+			break;
+		}
+		// Pop job off priority-queue
+		pq_jobs.pop();
+		if (res < 0) {
+			// Job is too big to fit on the GPU, client must abort it
+			aborted(q_job);
+		} else {
+			// Adds q_job to executing_jobs on success
+			executing_jobs.push_back(q_job);
+			admitted_jobs[q_job].deadline_us = top.deadline_us;
+			P::admitted(top);
+			std::vector<sched_entry_t> peers = sched_batch_form(q_job);
+			admitted(q_job);
+			n++;
+			for (const sched_entry_t &e : peers) {
+				executing_jobs.push_back(e.job);
+				P::admitted(e);
+				admitted(e.job);
+				n++;
+			}
+		}
+
+		if (pq_jobs.size() == 0) {
+			// Reset the relative priority period counter
+			rel_priority_period_count = 0;
+		}
+	}
+	return n;
+}
+
+/*
+ * Name: sched_run_pq
+ * Function: Run as many jobs (according to priority) as can fit on GPU
+ * Return: number of admitted jobs
+ */
+int sched_run_pq(sched_job_fn admitted, sched_job_fn aborted) {
+	SCHED_DISPATCH(sched_run_pq, admitted, aborted);
+}
+
+#endif
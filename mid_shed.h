@@ -0,0 +1,217 @@
+/*
+	Staleness policies of jobs, in the shared memory region "mid_shed".
+
+	Under overload a queued job can miss its deadline before it gets the
+	GPU. Run anyway, it makes every frame after it late as well. A client
+	thread declares with tag_job_begin_stale what to do with its job once
+	its deadline can't be met any more (deadline - now < WCET of the job
+	name in the task table, or the deadline passed):
+	- SHED_RUN      run it late anyway, as with tag_job_begin
+	- SHED_DROP     mid aborts it right away (mid_sched.cpp, sched_shed);
+	                tag_job_begin_stale returns TAG_JOB_SHED
+	- SHED_DEGRADE  run it, but tell the client how late it is, so it can
+	                run a cheaper variant; tag_job_begin_stale returns
+	                TAG_JOB_DEGRADED and the lateness
+	Jobs tagged with plain tag_job_begin run anyway.
+
+	Functions:
+	- init_mid_shed       --- called in server (init_flag) and in clients
+	- mid_shed_policy     --- server, policy of a queued job
+	- mid_shed_post       --- server, what mid did with a stale job
+	- mid_shed_clear_pid  --- server, free the slots of a dead client
+	- mid_shed_clear_dead --- server, free the slots of clients that died
+	                          while mid was down
+	- tag_job_begin_stale --- client, tag_job_begin with a staleness policy
+
+	A client thread owns one slot, claimed with a CAS on pid on its first
+	call; it writes the policy, mid writes the result. Slots are freed when
+	their process exits. A restarted mid keeps the region, policies of client
+	threads outlive it.
+*/
+#ifndef MID_SHED_H
+#define MID_SHED_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>         // kill
+#include <sys/mman.h>
+#include "mid_shm.h"        // mid_shm_map
+#include "tag_gpu.h"        // tag_job_begin
+
+#define MID_SHED_NAME "mid_shed"
+#define MID_SHED_MAX 1024               // client threads
+
+#define TAG_JOB_SHED (-100)             // mid dropped the stale job, don't run it
+#define TAG_JOB_DEGRADED 1              // admitted late, run a cheaper variant
+
+enum mid_shed_policy {SHED_RUN, SHED_DROP, SHED_DEGRADE};
+enum mid_shed_result {SHED_NONE, SHED_DROPPED, SHED_LATE};
+
+typedef struct mid_shed_slot {
+	pid_t pid;                          // 0: slot free
+	pid_t tid;
+	char job_name[JOB_MEM_NAME_MAX_LEN];
+	int policy;                         // enum mid_shed_policy, client
+	int result;                         // enum mid_shed_result, mid
+	int64_t late_us;                    // mid, by how much the deadline is missed
+} mid_shed_slot_t;
+
+typedef struct mid_shed {
+	mid_shed_slot_t slot[MID_SHED_MAX];
+} mid_shed_t;
+
+#define MID_SHED_SIZE sizeof(mid_shed_t)
+
+static int client_shed_fd = -1;
+static mid_shed_t *client_shed = NULL;
+static __thread mid_shed_slot_t *client_shed_slot = NULL;
+
+/*
+ * Name: init_mid_shed
+ * Function: Map the staleness region; the server (init_flag) clears it
+ */
+static inline int init_mid_shed(int *fd, mid_shed_t **addr, bool init_flag)
+{
+	*addr = (mid_shed_t *)mid_shm_map(MID_SHED_NAME,
+							MID_SHED_SIZE,
+							PROT_READ|PROT_WRITE,
+							init_flag,
+							fd);
+	if (*addr == MAP_FAILED) {
+		perror("[Error] in init_mid_shed: mmap");
+		return -1;
+	}
+
+	if (init_flag) memset(*addr, 0, MID_SHED_SIZE);
+	return 0;
+}
+
+static inline mid_shed_slot_t *mid_shed_find(mid_shed_t *s, pid_t pid, pid_t tid, const char *job_name)
+{
+	int i;
+	for (i = 0; i < MID_SHED_MAX; i++) {
+		mid_shed_slot_t *e = &(s->slot[i]);
+		if (__atomic_load_n(&(e->pid), __ATOMIC_ACQUIRE) != pid || e->tid != tid) continue;
+		return strncmp(e->job_name, job_name, JOB_MEM_NAME_MAX_LEN - 1) == 0 ? e : NULL;
+	}
+	return NULL;
+}
+
+// -------------------------- Server Side Functions ----------------------------
+/*
+ * Name: mid_shed_policy
+ * Function: Staleness policy of the job (pid, tid, job_name)
+ * Return: enum mid_shed_policy, SHED_RUN if the job declared none
+ */
+static inline int mid_shed_policy(mid_shed_t *s, pid_t pid, pid_t tid, const char *job_name)
+{
+	mid_shed_slot_t *e = mid_shed_find(s, pid, tid, job_name);
+	return e ? __atomic_load_n(&(e->policy), __ATOMIC_ACQUIRE) : SHED_RUN;
+}
+
+/*
+ * Name: mid_shed_post
+ * Function: Tell the client what mid did with its stale job, before waking it
+ */
+static inline void mid_shed_post(mid_shed_t *s, pid_t pid, pid_t tid, const char *job_name,
+	int result, int64_t late_us)
+{
+	mid_shed_slot_t *e = mid_shed_find(s, pid, tid, job_name);
+	if (e == NULL) return;
+	e->late_us = late_us;
+	__atomic_store_n(&(e->result), result, __ATOMIC_RELEASE);
+}
+
+/*
+ * Name: mid_shed_clear_pid
+ * Function: Free the slots of a dead client
+ */
+static inline void mid_shed_clear_pid(mid_shed_t *s, pid_t pid)
+{
+	int i;
+	for (i = 0; i < MID_SHED_MAX; i++) {
+		if (s->slot[i].pid == pid) __atomic_store_n(&(s->slot[i].pid), 0, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Name: mid_shed_clear_dead
+ * Function: Free the slots of clients that are gone, after a mid restart:
+ *           mid did not see them exit, so no one else frees their slots
+ * Return: number of slots freed
+ */
+static inline int mid_shed_clear_dead(mid_shed_t *s)
+{
+	int i, n = 0;
+	for (i = 0; i < MID_SHED_MAX; i++) {
+		pid_t pid = __atomic_load_n(&(s->slot[i].pid), __ATOMIC_ACQUIRE);
+		if (pid == 0 || kill(pid, 0) == 0 || errno != ESRCH) continue;
+		__atomic_store_n(&(s->slot[i].pid), 0, __ATOMIC_RELEASE);
+		n++;
+	}
+	return n;
+}
+
+// -------------------------- Client Side Functions ----------------------------
+/* Slot of the calling thread, claimed on first use */
+static inline mid_shed_slot_t *tag_job_shed_slot(pid_t pid, pid_t tid)
+{
+	if (client_shed_slot && client_shed_slot->pid == pid && client_shed_slot->tid == tid)
+		return client_shed_slot;
+	if (client_shed == NULL) {
+		if (client_shed_fd != -1 || init_mid_shed(&client_shed_fd, &client_shed, false) < 0) {
+			client_shed_fd = -2;    // don't retry on every job
+			return NULL;
+		}
+	}
+
+	int i;
+	for (i = 0; i < MID_SHED_MAX; i++) {
+		mid_shed_slot_t *e = &(client_shed->slot[i]);
+		pid_t owner = 0;
+		if (!__atomic_compare_exchange_n(&(e->pid), &owner, pid, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			continue;
+		e->tid = tid;
+		client_shed_slot = e;
+		return e;
+	}
+	fprintf(stderr, "tag_job_begin_stale: no free slot, jobs run anyway\n");
+	return NULL;
+}
+
+/*
+ * Name: tag_job_begin_stale
+ * Function: tag_job_begin, with what mid should do if the job can't meet
+ *           its deadline any more (enum mid_shed_policy)
+ * Output: *late_us, how late the job is when TAG_JOB_DEGRADED (may be NULL)
+ * Return: as tag_job_begin; TAG_JOB_SHED if mid dropped the job, and
+ *         TAG_JOB_DEGRADED if it was admitted late under SHED_DEGRADE
+ */
+static inline int tag_job_begin_stale(pid_t pid, pid_t tid, const char *job_name,
+	int64_t slacktime_us, bool first_flag, bool shareable_flag, uint64_t required_mem_b,
+	int policy, int64_t *late_us)
+{
+	mid_shed_slot_t *e = tag_job_shed_slot(pid, tid);
+	if (e) {
+		__atomic_store_n(&(e->result), SHED_NONE, __ATOMIC_RELAXED);
+		strncpy(e->job_name, job_name, JOB_MEM_NAME_MAX_LEN - 1);
+		e->job_name[JOB_MEM_NAME_MAX_LEN - 1] = '\0';
+		__atomic_store_n(&(e->policy), policy, __ATOMIC_RELEASE);
+	}
+
+	int res = tag_job_begin(pid, tid, job_name, slacktime_us, first_flag, shareable_flag,
+		required_mem_b);
+	int result = e ? __atomic_load_n(&(e->result), __ATOMIC_ACQUIRE) : SHED_NONE;
+	if (res < 0 && result == SHED_DROPPED) return TAG_JOB_SHED;
+	if (res >= 0 && result == SHED_LATE) {
+		if (late_us) *late_us = e->late_us;
+		return TAG_JOB_DEGRADED;
+	}
+	return res;
+}
+
+#endif
@@ -0,0 +1,192 @@
+/*
+	Shared memory regions of mid(c) and (c++), optionally on huge pages.
+
+	The regions mid owns (ft_jobs, ft_data, ft_results, mid_state,
+	mid_stats, mid_tasks, mid_yield) are mapped with mid_shm_map. By default
+	that is shm_init + mmap on 4 KB pages, as before. MID_HUGEPAGES in the
+	environment of mid selects:
+	- thp        the shm object is advised MADV_HUGEPAGE; takes effect when
+	             /sys/kernel/mm/transparent_hugepage/shmem_enabled is
+	             advise, within_size or always
+	- hugetlbfs  the region is a file in MID_HUGETLBFS (default
+	             /dev/hugepages), sized up to whole huge pages; needs
+	             reserved pages (vm.nr_hugepages), falls back to thp
+	With either, mid populates every region when it creates it, so frames
+	don't take page faults on first touch, and clients populate what they
+	map. Regions under MID_SHM_HUGE_MIN stay on 4 KB pages (a huge page
+	each would be mostly empty) but are populated all the same.
+
+	Clients need no setting: they map the hugetlbfs file of a region if
+	there is one, the shm object otherwise. Per-job objects are small and
+	created by clients, they stay on 4 KB pages.
+
+	Functions:
+	- mid_shm_mode  --- MID_HUGEPAGES
+	- mid_shm_map   --- called in server (init_flag) and in clients
+	- mid_shm_map_on --- same, the server places the pages on a NUMA node
+*/
+#ifndef MID_SHM_H
+#define MID_SHM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>        // statfs, huge page size of hugetlbfs
+#include <sys/syscall.h>    // SYS_mbind
+#include "mid_common.h"     // shm_init
+
+#define MID_HUGETLBFS_DIR "/dev/hugepages"
+#define MID_SHM_HUGE_MIN (64 * 1024)    // smaller regions keep 4 KB pages
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23          // Linux 5.14
+#endif
+
+enum mid_shm_modes {MID_SHM_DEFAULT, MID_SHM_THP, MID_SHM_HUGETLBFS};
+
+/*
+ * Name: mid_shm_mode
+ * Function: Page size mode of the regions mid creates, from MID_HUGEPAGES
+ */
+static inline int mid_shm_mode()
+{
+	const char *v = getenv("MID_HUGEPAGES");
+	if (v == NULL || *v == '\0' || strcmp(v, "off") == 0) return MID_SHM_DEFAULT;
+	if (strcmp(v, "thp") == 0) return MID_SHM_THP;
+	if (strcmp(v, "hugetlbfs") == 0) return MID_SHM_HUGETLBFS;
+	fprintf(stderr, "Bad MID_HUGEPAGES (%s), using 4 KB pages\n", v);
+	return MID_SHM_DEFAULT;
+}
+
+/* Path of the hugetlbfs file of region name */
+static inline void mid_shm_huge_path(char *path, size_t cap, const char *name)
+{
+	const char *dir = getenv("MID_HUGETLBFS");
+	snprintf(path, cap, "%s/%s", dir ? dir : MID_HUGETLBFS_DIR, name);
+}
+
+/* Fault every page of a mapping in, writable, without changing it */
+static inline void mid_shm_populate(void *addr, size_t len)
+{
+	if (madvise(addr, len, MADV_POPULATE_WRITE) == 0) return;
+	// Older kernels: add 0 to one byte of every page, safe while clients
+	// of a recovered region write to it
+	size_t off;
+	for (off = 0; off < len; off += 4096)
+		__atomic_fetch_add((char *)addr + off, 0, __ATOMIC_RELAXED);
+}
+
+/* Map the region from its hugetlbfs file; len is set to the mapped length */
+static inline void *mid_shm_map_huge(int fd, size_t *len, int prot, bool create)
+{
+	struct statfs fs;
+	struct stat st;
+	if (fstatfs(fd, &fs) != 0) return MAP_FAILED;
+	size_t huge = fs.f_bsize;
+	if (create) {
+		*len = (*len + huge - 1) / huge * huge;
+		if (ftruncate(fd, *len) != 0) return MAP_FAILED;
+	} else {
+		if (fstat(fd, &st) != 0 || (size_t)st.st_size < *len) return MAP_FAILED;
+		*len = st.st_size;
+	}
+	// Shared hugetlb pages are reserved here, so this fails without a pool
+	return mmap(NULL, *len, prot, MAP_SHARED, fd, 0);
+}
+
+/*
+ * Name: mid_shm_bind
+ * Function: Place the pages of a mapping on NUMA node when they are first
+ *           touched, so call it before the region is written
+ * Return: 0 on success, -1 otherwise (pages go where the first writer runs)
+ */
+static inline int mid_shm_bind(void *addr, size_t len, int node)
+{
+	unsigned long nodes = 1UL << node;
+	if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &nodes, 8 * sizeof(nodes), 0) != 0) {
+		fprintf(stderr, "NUMA node %d: mbind: %s\n", node, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Name: mid_shm_map_on
+ * Function: Map the shared region name of size bytes. The server (init_flag)
+ *           creates it with the pages MID_HUGEPAGES selects, on NUMA node
+ *           (unless node < 0), and populates it; clients map the region the
+ *           server created.
+ * Output: *fd, open on the region, the caller closes it
+ * Return: the mapping, MAP_FAILED with errno set on error. A hugetlbfs
+ *         mapping is longer than size, it is unmapped when the process exits.
+ */
+static inline void *mid_shm_map_on(const char *name, size_t size, int prot, bool init_flag,
+	int *fd, int node)
+{
+	char path[256];
+	void *addr = MAP_FAILED;
+	size_t len = size;
+	int mode = init_flag ? mid_shm_mode() : MID_SHM_DEFAULT;
+	bool huge = size >= MID_SHM_HUGE_MIN;
+	mid_shm_huge_path(path, sizeof(path), name);
+	if (!init_flag) node = -1;
+
+	if (!init_flag) {
+		// Clients take the hugetlbfs file if the server made one
+		*fd = open(path, prot & PROT_WRITE ? O_RDWR : O_RDONLY);
+		if (*fd != -1) {
+			addr = mid_shm_map_huge(*fd, &len, prot, false);
+			if (addr == MAP_FAILED) close(*fd);
+		}
+		mode = mid_shm_mode();  // populate if set for the client too
+	} else if (mode == MID_SHM_HUGETLBFS && huge) {
+		*fd = open(path, O_RDWR|O_CREAT, 0666);
+		if (*fd != -1) {
+			addr = mid_shm_map_huge(*fd, &len, prot, true);
+			if (addr == MAP_FAILED) close(*fd);
+		}
+		if (addr == MAP_FAILED) {
+			fprintf(stderr, "%s: no huge pages in %s (%s), using thp\n",
+				name, path, strerror(errno));
+			mode = MID_SHM_THP;
+		}
+	}
+
+	if (addr == MAP_FAILED) {
+		// A file of an earlier mid that ran on hugetlbfs would hide this region
+		if (init_flag) unlink(path);
+		errno = 0;
+		*fd = shm_init(name, size);
+		if (*fd == -1) return MAP_FAILED;
+		addr = mmap(NULL, size, prot, MAP_SHARED, *fd, 0);
+		if (addr == MAP_FAILED) return addr;
+		if (mode == MID_SHM_THP && huge && madvise(addr, size, MADV_HUGEPAGE) != 0)
+			perror("mid_shm_map: madvise(MADV_HUGEPAGE)");
+	}
+
+	if (node >= 0) (void) mid_shm_bind(addr, len, node);
+	if (mode != MID_SHM_DEFAULT) {
+		if (prot & PROT_WRITE) mid_shm_populate(addr, len);
+		else (void) madvise(addr, len, MADV_WILLNEED);
+	}
+	return addr;
+}
+
+/*
+ * Name: mid_shm_map
+ * Function: mid_shm_map_on without NUMA placement
+ */
+static inline void *mid_shm_map(const char *name, size_t size, int prot, bool init_flag, int *fd)
+{
+	return mid_shm_map_on(name, size, prot, init_flag, fd, -1);
+}
+
+#endif
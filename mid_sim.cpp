@@ -0,0 +1,305 @@
+ // mid_sim.cpp: replay a recorded mid trace through the admission logic
+ //
+ // Usage: ./mid_sim [-P policy,...] [-T threshold_us,...] [-t tasks] [-m gpu_mem_b] <trace file>
+ //   Reads the submits of a MID_TRACE file (see mid_trace.cpp) and how long
+ //   every job ran between trigger and complete, then replays the arrivals
+ //   through mid_sched.cpp under a simulated clock, once per policy (slack,
+ //   edf, fp, rm, llf, wfq) and slack threshold. Task parameters for the
+ //   policies are read from the -t file, see load_sched_tasks.
+ //   Server periods without anything to decide are skipped, so a replay runs
+ //   much faster than real time and gives the same result every time.
+ //
+ //   Prints one JSON object per run with the metrics mid publishes in
+ //   mid_stats (admission latency, deadline misses, GPU memory use).
+ //   Arrivals are replayed open loop: a client's next submit keeps its
+ //   recorded time even if the policy admits the previous job earlier or later.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>	// std::sort
+#include <map>			// std::map
+#include <queue>		// std::priority_queue
+#include <string>		// std::string
+#include <tuple>		// std::tuple
+#include <vector>		// std::vector
+
+#include "mid_sched.cpp"
+#include "mid_stats.h"	// mid_hist_t, the metrics of the live system
+
+#define SIM_GPU_MEM_B (1ULL<<30)	// same as mid
+
+/* The simulator has no FT manager */
+bool ft_active_replica(pid_t pid, pid_t *main_pid)
+{
+	return false;
+}
+
+typedef struct sim_job {
+	job_t job;
+	uint64_t submit_us;		// since the first submit in the trace
+	int64_t slack_us;		// as submitted
+	uint64_t run_us;		// trigger to complete in the trace
+	uint64_t admit_us;
+	bool done;
+} sim_job_t;
+
+typedef struct sim_result {
+	unsigned long long admitted, aborted, slack_jobs, missed, periods, steps;
+	uint64_t end_us;
+	double wall_s;
+	mid_stats_t *st;
+} sim_result_t;
+
+static std::vector<sim_job_t> sim_jobs;
+static uint64_t now_us;
+static sim_result_t res;
+typedef std::pair<uint64_t, sim_job_t*> sim_end_t;	// completes at, job
+static std::priority_queue<sim_end_t, std::vector<sim_end_t>, std::greater<sim_end_t> > running;
+
+/*
+ * Name: load_trace
+ * Function: Turn the submit/trigger/complete events of a trace into jobs
+ * Return: number of jobs, -1 on error
+ */
+int load_trace(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		perror("[Error] in load_trace: fopen");
+		return -1;
+	}
+	mid_trace_header_t hdr;
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+		memcmp(hdr.magic, MID_TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+		hdr.version != MID_TRACE_VERSION || hdr.event_size != sizeof(mid_trace_event_t)) {
+		fprintf(stderr, "%s is not a version %d mid trace\n", path, MID_TRACE_VERSION);
+		fclose(f);
+		return -1;
+	}
+	std::vector<mid_trace_event_t> ev;
+	mid_trace_event_t e;
+	while (fread(&e, sizeof(e), 1, f) == 1) ev.push_back(e);
+	fclose(f);
+
+	// Rings are flushed one after another, order by time
+	std::stable_sort(ev.begin(), ev.end(), [](const mid_trace_event_t &a, const mid_trace_event_t &b) {
+		return a.ts_ns < b.ts_ns;
+	});
+
+	typedef std::tuple<pid_t, pid_t, std::string> key_t;
+	std::map<key_t, size_t> queued, triggered;	// -> index in sim_jobs
+	uint64_t first_ns = 0;
+	std::vector<uint64_t> trigger_ns;
+	sim_jobs.clear();
+	for (auto &e : ev) {
+		e.name[MID_TRACE_NAME_LEN - 1] = '\0';
+		key_t key(e.pid, e.tid, e.name);
+		if (e.type == TRACE_SUBMIT) {
+			if (sim_jobs.empty()) first_ns = e.ts_ns;
+			sim_job_t sj;
+			memset(&sj, 0, sizeof(sj));
+			sj.job.pid = e.pid;
+			sj.job.tid = e.tid;
+			strncpy(sj.job.job_name, e.name, sizeof(sj.job.job_name) - 1);
+			sj.job.req_type = QUEUED;
+			sj.job.noslack_flag = e.arg & TRACE_F_NOSLACK;
+			sj.job.first_flag = sj.job.noslack_flag;
+			sj.job.shareable_flag = e.arg & TRACE_F_SHAREABLE;
+			sj.job.required_mem_b = e.value;
+			sj.slack_us = e.arg2;
+			sj.submit_us = (e.ts_ns - first_ns) / 1000;
+			queued[key] = sim_jobs.size();
+			sim_jobs.push_back(sj);
+			trigger_ns.push_back(0);
+		} else if (e.type == TRACE_TRIGGER && queued.count(key)) {
+			size_t i = queued[key];
+			queued.erase(key);
+			trigger_ns[i] = e.ts_ns;
+			triggered[key] = i;
+		} else if ((e.type == TRACE_COMPLETE || e.type == TRACE_RECLAIM) && triggered.count(key)) {
+			size_t i = triggered[key];
+			triggered.erase(key);
+			sim_jobs[i].run_us = (e.ts_ns - trigger_ns[i]) / 1000;
+			sim_jobs[i].done = true;
+		} else if (e.type == TRACE_ABORT && queued.count(key)) {
+			// Replayed too, the policy decides whether it aborts again
+			sim_jobs[queued[key]].done = true;
+			queued.erase(key);
+		}
+	}
+
+	// Drop jobs the trace ends in the middle of
+	sim_jobs.erase(std::remove_if(sim_jobs.begin(), sim_jobs.end(),
+		[](const sim_job_t &j) { return !j.done; }), sim_jobs.end());
+	return sim_jobs.size();
+}
+
+/* sched_job_fn: same metrics as note_admitted in mymid.cpp */
+void sim_admitted(job_t *j)
+{
+	sim_job_t *sj = (sim_job_t *)j;	// job is the first member
+	uint64_t waited = now_us - sj->submit_us;
+	sj->admit_us = now_us;
+	mid_stat_add(&(res.st->admitted), 1);
+	mid_hist_add(&(res.st->admit_latency_us), waited);
+	if (!j->noslack_flag) {
+		res.slack_jobs++;
+		if ((int64_t)waited > sj->slack_us) res.missed++;
+	}
+	res.admitted++;
+	running.push(sim_end_t(now_us + sj->run_us, sj));
+}
+
+void sim_aborted(job_t *j)
+{
+	mid_stat_add(&(res.st->aborted), 1);
+	res.aborted++;
+}
+
+/*
+ * Name: simulate
+ * Function: Replay all jobs once, stepping the server period by period
+ *           while there is something to decide and jumping ahead otherwise
+ */
+void simulate(uint64_t gpu_mem_b)
+{
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	mid_stats_t *st = res.st;
+	memset(&res, 0, sizeof(res));
+	memset(st, 0, sizeof(*st));
+	res.st = st;
+	init_mid_sched(gpu_mem_b);
+	mid_stat_set(&(st->gpu_mem_max_b), gpu_mem_b);
+	running = decltype(running)();
+
+	size_t next = 0;
+	bool wait_for_complete = false;
+	now_us = 0;
+	while (next < sim_jobs.size() || running.size() || fifo_jobs.size() || pq_jobs.size()) {
+		/* Same order as the loop in mymid.cpp: arrivals, completions, admission */
+		sched_tick(now_us);
+		for (; next < sim_jobs.size() && sim_jobs[next].submit_us <= now_us; next++) {
+			sim_job_t *sj = &sim_jobs[next];
+			sj->job.slacktime_us = sj->slack_us;	// sched_enqueue shifts it
+			mid_stat_add(&(st->submitted), 1);
+			sched_enqueue(&(sj->job));
+		}
+		while (running.size() && running.top().first <= now_us) {
+			sched_complete(&(running.top().second->job));
+			running.pop();
+			mid_stat_add(&(st->completed), 1);
+			wait_for_complete = false;
+		}
+		sched_run_fifo(&wait_for_complete, sim_admitted, sim_aborted);
+		sched_run_pq(sim_admitted, sim_aborted);
+		res.steps++;
+
+		/* Periods until the next step; with only blocked fifo jobs (or
+		 * nothing) queued, nothing changes before an arrival or completion */
+		uint64_t periods = 1;
+		if (pq_jobs.empty() && (fifo_jobs.empty() || wait_for_complete)) {
+			uint64_t until = UINT64_MAX;
+			if (next < sim_jobs.size()) until = sim_jobs[next].submit_us;
+			if (running.size()) until = std::min(until, running.top().first);
+			if (until != UINT64_MAX && until > now_us)
+				periods = (until - now_us + SLEEP_MICROSECONDS - 1) / SLEEP_MICROSECONDS;
+		}
+
+		uint64_t used = max_gpu_memory_available - gpu_memory_available;
+		uint64_t pct = used * 100 / max_gpu_memory_available;
+		for (uint64_t p = 0; p < periods && p < MID_HIST_BUCKETS; p++)
+			mid_hist_add(&(st->gpu_util_pct), pct);
+		if (periods > MID_HIST_BUCKETS) {
+			// Idle stretch, account the rest in one go
+			uint64_t rest = periods - MID_HIST_BUCKETS;
+			mid_stat_add(&(st->gpu_util_pct.count), rest);
+			mid_stat_add(&(st->gpu_util_pct.sum), pct * rest);
+			mid_stat_add(&(st->gpu_util_pct.bucket[mid_hist_bucket(pct)]), rest);
+		}
+		mid_stat_add(&(st->periods), periods);
+		res.periods += periods;
+		now_us += periods * SLEEP_MICROSECONDS;
+	}
+	res.end_us = now_us;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	res.wall_s = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+}
+
+void print_result(const char *policy, int64_t threshold_us)
+{
+	mid_stats_t *st = res.st;
+	unsigned long long util_n = mid_stat_get(&(st->gpu_util_pct.count));
+	double util = util_n ? (double)mid_stat_get(&(st->gpu_util_pct.sum)) / util_n : 0;
+	double miss_rate = res.slack_jobs ? (double)res.missed / res.slack_jobs : 0;
+	unsigned long long adm = mid_stat_get(&(st->admit_latency_us.count));
+
+	printf("{\"policy\":\"%s\",\"slack_threshold_us\":%lld,\"jobs\":%zu,\"admitted\":%llu,\"aborted\":%llu,"
+		"\"sim_ms\":%.1f,\"speedup\":%.0f,\"admit_latency_us\":{\"avg\":%llu,\"p50\":%llu,"
+		"\"p99\":%llu},\"deadline_miss_rate\":%.4f,\"gpu_util_pct\":%.1f}\n",
+		policy, (long long)threshold_us, sim_jobs.size(), res.admitted, res.aborted,
+		res.end_us / 1000.0, res.wall_s > 0 ? res.end_us / 1e6 / res.wall_s : 0,
+		adm ? mid_stat_get(&(st->admit_latency_us.sum)) / adm : 0,
+		mid_hist_percentile(&(st->admit_latency_us), 50),
+		mid_hist_percentile(&(st->admit_latency_us), 99), miss_rate, util);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<int64_t> thresholds;
+	std::vector<std::string> policies;
+	uint64_t gpu_mem_b = SIM_GPU_MEM_B;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "P:T:t:m:")) != -1) {
+		switch (opt) {
+		case 'P':
+			for (char *p = strtok(optarg, ","); p; p = strtok(NULL, ",")) {
+				if (set_sched_policy(p) < 0) return 1;
+				policies.push_back(p);
+			}
+			break;
+		case 't':
+			if (load_sched_tasks(optarg) < 0) return 1;
+			break;
+		case 'T':
+			for (char *t = strtok(optarg, ","); t; t = strtok(NULL, ","))
+				thresholds.push_back(atoll(t));
+			break;
+		case 'm': gpu_mem_b = strtoull(optarg, NULL, 10); break;
+		default:
+			fprintf(stderr, "usage: %s [-P policy,...] [-T threshold_us,...] [-t tasks] "
+			"[-m gpu_mem_b] <trace file>\n", argv[0]);
+			return 1;
+		}
+	}
+	if (optind != argc - 1 || gpu_mem_b == 0) {
+		fprintf(stderr, "usage: %s [-P policy,...] [-T threshold_us,...] [-t tasks] "
+			"[-m gpu_mem_b] <trace file>\n", argv[0]);
+		return 1;
+	}
+	if (thresholds.empty()) thresholds.push_back(SLACKTIME_THRESHOLD);
+	if (policies.empty()) policies.push_back(sched_policy_names[SCHED_SLACK]);
+
+	int n = load_trace(argv[optind]);
+	if (n < 0) return 1;
+	fprintf(stderr, "Replaying %d jobs\n", n);
+
+	res.st = (mid_stats_t *)calloc(1, sizeof(mid_stats_t));
+	for (auto &p : policies) {
+		set_sched_policy(p.c_str());
+		for (int64_t t : thresholds) {
+			slacktime_threshold_us = t;
+			simulate(gpu_mem_b);
+			print_result(p.c_str(), t);
+		}
+	}
+	free(res.st);
+	return 0;
+}
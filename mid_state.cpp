@@ -0,0 +1,268 @@
+/*
+	Persistent server state(c++) of mid, kept in shared memory so a
+	restarted mid can pick up where the crashed one stopped.
+
+	Data structures:
+	- mid_state_t      versioned region "mid_state"
+	  - mid_state_job_t  every queued or executing job and pending
+	                     completion, by shm name
+	  - mid_state_ft_t   FT group table (main/replica per group)
+
+	Functions:
+	- attach_mid_state     --- map the region, tell whether it can be recovered
+	- detach_mid_state     --- mark a clean shutdown
+	- mid_state_record_job / mid_state_set_job / mid_state_drop_job
+	- mid_state_record_ft
+	- get_shared_job_by_name / unlink_shared_job
+
+	Only the main thread of mid writes the job table and only
+	ft_jobs_thread writes the FT table, so neither needs a lock. GPU
+	reservations are not stored: they are rebuilt from the executing jobs
+	on recovery, which keeps them consistent with the job table by
+	construction; members of a batch record the batch, so they share its
+	one reservation again.
+*/
+#ifndef MID_STATE
+#define MID_STATE
+
+#include <vector>           // std::vector
+#include <string>           // std::string
+#include <unordered_map>    // std::unordered_map
+#include "mid_structs.h"
+#include "mid_common.h"
+#include "mid_shm.h"         // mid_shm_map
+#include "ft_lib.h"         // FT_HB_DATA_MAX_DATA, JOB_MEM_NAME_MAX_LEN
+
+#define MID_STATE_NAME "mid_state"
+#define MID_STATE_MAGIC 0x4d494453      // "MIDS"
+#define MID_STATE_VERSION 3             // bump when mid_state_t changes
+#define MID_STATE_MAX_JOBS 256
+
+// MID_Q_DONE: a completion (tag_job_end) mid took off global_jobs but
+// has not released the executing job of yet
+enum mid_state_queue {MID_Q_FREE, MID_Q_FIFO, MID_Q_PQ, MID_Q_EXEC, MID_Q_DONE};
+
+typedef struct mid_state_job {
+	int queue;                          // enum mid_state_queue
+	unsigned long long seq;             // enqueue order, restores fifo order
+	char shm_name[JOB_MEM_NAME_MAX_LEN];
+	pid_t admit_pid;                    // MID_Q_EXEC: pid the job is accounted under
+	bool ft_dup;                        // MID_Q_EXEC: duplicated active-replica work
+	uint64_t batch;                     // MID_Q_EXEC: batch of the job, 0 if alone
+	uint64_t batch_mem_b;               // MID_Q_EXEC: the batch's one reservation
+} mid_state_job_t;
+
+enum mid_state_ft_where {MID_FT_NONE, MID_FT_RUNNING, MID_FT_SLEEPING, MID_FT_ACTIVE};
+
+typedef struct mid_state_ft {
+	int where[2];                       // indexed by enum ft_job_type
+	char shm_name[2][JOB_MEM_NAME_MAX_LEN];
+} mid_state_ft_t;
+
+typedef struct mid_state {
+	unsigned int magic;
+	unsigned int version;
+	size_t size;                        // sizeof(mid_state_t) of the writer
+	unsigned long long generation;      // incremented on every mid start
+	int clean_shutdown;
+
+	uint64_t max_gpu_memory_available;
+	int rel_priority_period_count;
+	unsigned long long next_seq;
+
+	mid_state_job_t job[MID_STATE_MAX_JOBS];
+	mid_state_ft_t ft[FT_HB_DATA_MAX_DATA];
+} mid_state_t;
+
+#define MID_STATE_SIZE sizeof(mid_state_t)
+
+static mid_state_t *MS = NULL;
+static int MS_fd = -1;
+static std::vector<int> mid_state_free;                 // free slots of MS->job
+static std::unordered_map<job_t*, int> mid_state_slot;  // job -> slot in MS->job
+// Jobs that found the table full, by shm name, still unlinked when dropped
+static std::unordered_map<job_t*, std::string> mid_state_unrecorded;
+static char mid_state_dropped[JOB_MEM_NAME_MAX_LEN];
+
+/*
+ * Name: attach_mid_state
+ * Function: Map the persistent state region of mid
+ * Return: 1 if it holds the state of a mid that did not shut down cleanly
+ *         (the caller should recover), 0 if it was (re)initialized, -1 on error
+ */
+int attach_mid_state()
+{
+	// mid owns the region, so it creates it with the pages MID_HUGEPAGES asks for
+	MS = (mid_state_t *)mid_shm_map(MID_STATE_NAME,
+						MID_STATE_SIZE,
+						PROT_READ|PROT_WRITE,
+						true,
+						&MS_fd);
+	if (MS == MAP_FAILED) {
+		perror("[Error] in attach_mid_state: mmap");
+		MS = NULL;
+		return -1;
+	}
+
+	bool recover = MS->magic == MID_STATE_MAGIC &&
+		MS->version == MID_STATE_VERSION &&
+		MS->size == MID_STATE_SIZE &&
+		!MS->clean_shutdown;
+
+	if (!recover) {
+		// Fresh start, or a layout written by another version of mid
+		memset(MS, 0, MID_STATE_SIZE);
+		MS->magic = MID_STATE_MAGIC;
+		MS->version = MID_STATE_VERSION;
+		MS->size = MID_STATE_SIZE;
+	}
+	MS->generation++;
+	MS->clean_shutdown = 0;
+
+	mid_state_free.clear();
+	mid_state_slot.clear();
+	for (int i = MID_STATE_MAX_JOBS - 1; i >= 0; i--) {
+		if (MS->job[i].queue == MID_Q_FREE) mid_state_free.push_back(i);
+	}
+	return recover ? 1 : 0;
+}
+
+/*
+ * Name: detach_mid_state
+ * Function: Mark a clean shutdown, the next mid starts fresh
+ */
+void detach_mid_state()
+{
+	if (!MS) return;
+	MS->clean_shutdown = 1;
+	munmap(MS, MID_STATE_SIZE);
+	close(MS_fd);
+	MS = NULL;
+}
+
+/*
+ * Name: mid_state_record_job
+ * Function: Remember a job that was just put on fifo_jobs or pq_jobs, or
+ *           a completion on completed_jobs (MID_Q_DONE)
+ * Return: 0 on success, -1 if the table is full (job is then not
+ *         recoverable, mid_state_drop_job still returns its name)
+ */
+int mid_state_record_job(job_t *j, const char *shm_name, int queue)
+{
+	if (!MS) return -1;
+	if (mid_state_free.empty()) {
+		fprintf(stderr, "mid_state job table full, (%s) won't survive a restart\n", shm_name);
+		mid_state_unrecorded[j] = shm_name;
+		return -1;
+	}
+	int slot = mid_state_free.back();
+	mid_state_free.pop_back();
+
+	mid_state_job_t *sj = &(MS->job[slot]);
+	strncpy(sj->shm_name, shm_name, JOB_MEM_NAME_MAX_LEN);
+	sj->shm_name[JOB_MEM_NAME_MAX_LEN-1] = '\0';
+	sj->seq = MS->next_seq++;
+	sj->admit_pid = 0;
+	sj->ft_dup = false;
+	sj->batch = 0;
+	sj->batch_mem_b = 0;
+	sj->queue = queue; // last, the slot is live from here on
+	mid_state_slot[j] = slot;
+	return 0;
+}
+
+/*
+ * Name: mid_state_set_job
+ * Function: Move a recorded job to another queue, e.g. when it is admitted,
+ *           and record the batch it was admitted in (0: alone)
+ */
+void mid_state_set_job(job_t *j, int queue, pid_t admit_pid, bool ft_dup,
+	uint64_t batch = 0, uint64_t batch_mem_b = 0)
+{
+	auto it = mid_state_slot.find(j);
+	if (it == mid_state_slot.end()) return;
+	mid_state_job_t *sj = &(MS->job[it->second]);
+	sj->admit_pid = admit_pid;
+	sj->ft_dup = ft_dup;
+	sj->batch = batch;
+	sj->batch_mem_b = batch_mem_b;
+	sj->queue = queue;
+}
+
+/*
+ * Name: mid_state_drop_job
+ * Function: Forget a job that completed or was aborted
+ * Return: shm name given to mid_state_record_job, NULL if it wasn't
+ */
+const char *mid_state_drop_job(job_t *j)
+{
+	auto it = mid_state_slot.find(j);
+	if (it == mid_state_slot.end()) {
+		auto un = mid_state_unrecorded.find(j);
+		if (un == mid_state_unrecorded.end()) return NULL;
+		strncpy(mid_state_dropped, un->second.c_str(), JOB_MEM_NAME_MAX_LEN);
+		mid_state_dropped[JOB_MEM_NAME_MAX_LEN-1] = '\0';
+		mid_state_unrecorded.erase(un);
+		return mid_state_dropped;
+	}
+	int slot = it->second;
+	MS->job[slot].queue = MID_Q_FREE;
+	mid_state_slot.erase(it);
+	mid_state_free.push_back(slot);
+	return MS->job[slot].shm_name;
+}
+
+/*
+ * Name: mid_state_record_ft
+ * Function: Store where the main or replica of a FT group currently is
+ */
+void mid_state_record_ft(int index, enum ft_job_type type, int where, const char *shm_name)
+{
+	if (!MS || index < 0 || index >= FT_HB_DATA_MAX_DATA) return;
+	mid_state_ft_t *sf = &(MS->ft[index]);
+	if (shm_name) {
+		strncpy(sf->shm_name[type], shm_name, JOB_MEM_NAME_MAX_LEN);
+		sf->shm_name[type][JOB_MEM_NAME_MAX_LEN-1] = '\0';
+	}
+	sf->where[type] = where;
+}
+
+/*
+ * Name: get_shared_job_by_name
+ * Function: Map a client's job_t by its shm name. Unlike the peek helpers
+ *           the name is not unlinked, so a restarted mid can map it again.
+ */
+int get_shared_job_by_name(const char *name, job_t **save_job)
+{
+	errno = 0;
+	int fd = shm_init(name, sizeof(job_t));
+	if (fd == -1) {
+		perror("[Error] in get_shared_job_by_name: shm_init failed");
+		return -1;
+	}
+	job_t *job = (job_t *)mmap(NULL,
+						sizeof(job_t),
+						PROT_READ|PROT_WRITE,
+						MAP_SHARED,
+						fd,
+						0);
+	close(fd);
+	if (job == MAP_FAILED) {
+		perror("[Error] in get_shared_job_by_name: mmap");
+		return -1;
+	}
+	*save_job = job;
+	return 0;
+}
+
+/*
+ * Name: unlink_shared_job
+ * Function: Remove the name of a job's shm object once mid is done with it
+ */
+void unlink_shared_job(const char *name, size_t size)
+{
+	int fd = shm_init(name, size);
+	if (fd != -1) shm_destroy(name, fd);
+}
+
+#endif
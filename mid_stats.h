@@ -0,0 +1,178 @@
+/*
+	Live statistics of mid and the FT manager, published in a read-only
+	(for readers) shared memory page so tools like ftstat can sample it at
+	any rate. mid only does relaxed atomic stores and adds on it: no locks,
+	no syscalls.
+
+	Data structures:
+	- mid_hist_t        log2-bucketed histogram
+	- mid_stats_group_t per FT group
+	- mid_stats_t       the whole page
+
+	Functions:
+	- init_mid_stats    --- called in server (init_flag) and in readers
+	- mid_hist_add / mid_stat_add / mid_stat_set / mid_stat_get
+	- mid_hist_percentile
+	- mid_stats_now_ns
+*/
+#ifndef MID_STATS_H
+#define MID_STATS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include "mid_shm.h"        // mid_shm_map
+#include "ft_lib.h"         // FT_HB_DATA_MAX_DATA
+
+#define MID_STATS_NAME "mid_stats"
+#define MID_STATS_MAGIC 0x4d535441      // "MSTA"
+#define MID_STATS_VERSION 7
+#define MID_HIST_BUCKETS 64             // bucket i holds values in [2^(i-1), 2^i)
+
+typedef struct mid_hist {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long bucket[MID_HIST_BUCKETS];
+} mid_hist_t;
+
+typedef struct mid_stats_group {
+	unsigned long long hb_stale_ms;     // ms since the main's heartbeat last changed
+	unsigned long long hb_misses;       // times the heartbeat was declared dead
+	unsigned long long hangs;           // times the frames stopped with a live heartbeat
+	unsigned long long failovers;       // times a replica took over
+	unsigned long long last_detect_ns;  // CLOCK_MONOTONIC of the last miss
+	unsigned long long last_takeover_ns;// first heartbeat of the replica after it
+} mid_stats_group_t;
+
+typedef struct mid_stats {
+	unsigned int magic;
+	unsigned int version;
+	unsigned long long start_ns;        // CLOCK_MONOTONIC when mid started
+	unsigned long long periods;         // server loop iterations
+
+	/* Scheduler, written by the main thread of mid */
+	unsigned long long fifo_depth;      // current queue depths
+	unsigned long long pq_depth;
+	unsigned long long executing_depth;
+	mid_hist_t fifo_depth_hist;         // sampled once per server period
+	mid_hist_t pq_depth_hist;
+	mid_hist_t executing_depth_hist;
+
+	unsigned long long submitted;
+	unsigned long long admitted;
+	unsigned long long completed;
+	unsigned long long aborted;
+	unsigned long long reclaimed;
+	unsigned long long preempted;       // executing jobs asked to yield
+	unsigned long long batched;         // jobs admitted as members of a batch
+	unsigned long long shed;            // stale jobs dropped (mid_shed.h), also aborted
+	unsigned long long late;            // stale jobs admitted to run late
+	mid_hist_t catchup_us;              // from a stale job queued until none is
+	mid_hist_t admit_latency_us;        // queued until admitted
+	unsigned long long boosted;         // jobs of promoted replicas admitted first
+	mid_hist_t takeover_to_frame_us;    // takeover until the replica's first
+	                                    // completed job (sched_set_failover)
+
+	unsigned long long gpu_mem_max_b;
+	unsigned long long gpu_mem_used_b;
+	mid_hist_t gpu_util_pct;            // sampled once per server period
+
+	/* FT manager, written by the heartbeat threads */
+	unsigned long long hb_misses;
+	unsigned long long hangs;           // progress deadlines missed (ft_progress_deadline)
+	unsigned long long failovers;
+	unsigned long long spare_failovers; // of those, taken over by a pooled spare
+	unsigned long long spares;          // spares pooled, of no group yet
+	mid_hist_t detect_to_takeover_us;   // miss until the replica's first heartbeat
+	                                    // (first frame after a hang)
+	mid_stats_group_t group[FT_HB_DATA_MAX_DATA];
+} mid_stats_t;
+
+#define MID_STATS_SIZE sizeof(mid_stats_t)
+
+static inline unsigned long long mid_stats_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void mid_stat_add(unsigned long long *c, unsigned long long v)
+{
+	__atomic_fetch_add(c, v, __ATOMIC_RELAXED);
+}
+
+static inline void mid_stat_set(unsigned long long *c, unsigned long long v)
+{
+	__atomic_store_n(c, v, __ATOMIC_RELAXED);
+}
+
+static inline unsigned long long mid_stat_get(const unsigned long long *c)
+{
+	return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+static inline int mid_hist_bucket(unsigned long long v)
+{
+	int b = v ? 64 - __builtin_clzll(v) : 0;
+	return b < MID_HIST_BUCKETS ? b : MID_HIST_BUCKETS - 1;
+}
+
+static inline void mid_hist_add(mid_hist_t *h, unsigned long long v)
+{
+	__atomic_fetch_add(&(h->bucket[mid_hist_bucket(v)]), 1ULL, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(h->sum), v, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&(h->count), 1ULL, __ATOMIC_RELAXED);
+}
+
+/*
+ * Name: mid_hist_percentile
+ * Function: Upper bound of the bucket holding the p-th percentile (0..100)
+ */
+static inline unsigned long long mid_hist_percentile(const mid_hist_t *h, double p)
+{
+	unsigned long long total = 0, seen = 0;
+	int b;
+	for (b = 0; b < MID_HIST_BUCKETS; b++) total += mid_stat_get(&(h->bucket[b]));
+	if (total == 0) return 0;
+
+	unsigned long long rank = (unsigned long long)(p / 100.0 * total);
+	if (rank >= total) rank = total - 1;
+	for (b = 0; b < MID_HIST_BUCKETS; b++) {
+		seen += mid_stat_get(&(h->bucket[b]));
+		if (seen > rank) break;
+	}
+	return b == 0 ? 0 : (b >= 64 ? ~0ULL : (1ULL << b) - 1);
+}
+
+/*
+ * Name: init_mid_stats
+ * Function: Map the statistics page; the server (init_flag) clears it, readers
+ *           map it read-only
+ */
+static inline int init_mid_stats(int *fd, mid_stats_t **addr, bool init_flag)
+{
+	*addr = (mid_stats_t *)mid_shm_map(MID_STATS_NAME,
+							MID_STATS_SIZE,
+							init_flag ? PROT_READ|PROT_WRITE : PROT_READ,
+							init_flag,
+							fd);
+	if (*addr == MAP_FAILED) {
+		perror("[Error] in init_mid_stats: mmap");
+		return -1;
+	}
+
+	if (init_flag) {
+		mid_stats_t *st = *addr;
+		memset(st, 0, MID_STATS_SIZE);
+		st->version = MID_STATS_VERSION;
+		st->start_ns = mid_stats_now_ns();
+		__atomic_store_n(&(st->magic), MID_STATS_MAGIC, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,180 @@
+/*
+	Periodic task registration between clients and mid, in the shared
+	memory region "mid_tasks".
+
+	A client that tags a job every period can declare the job's period,
+	worst case execution time (WCET) and deadline once. mid runs a
+	schedulability test over all declared tasks (mid_admit.cpp) and admits,
+	degrades (stretches the period) or rejects the new task, so overload is
+	found at registration instead of as missed deadlines. Clients that
+	don't register are scheduled as before.
+
+	Data structures:
+	- mid_task_decl_t  one declared task, a slot owned by its client
+	- mid_tasks_t      the whole region
+
+	Functions:
+	- init_mid_tasks       --- called in server (init_flag) and in clients
+	- mid_task_register    --- client, declare a task and wait for the decision
+	- mid_task_unregister  --- client, drop a task
+
+	Slots need no lock: a client claims a free slot with a CAS on status and
+	only mid writes a slot between TASK_PENDING and the decision.
+*/
+#ifndef MID_TASKS_H
+#define MID_TASKS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include "mid_shm.h"        // mid_shm_map
+#include "ft_lib.h"         // JOB_MEM_NAME_MAX_LEN
+
+#define MID_TASKS_NAME "mid_tasks"
+#define MID_TASKS_MAX 64
+#define MID_TASK_WAIT_S 1               // client gives up if mid doesn't answer
+
+enum mid_task_status {
+	TASK_FREE,          // slot unused
+	TASK_CLAIMED,       // client is filling it in
+	TASK_PENDING,       // waiting for mid's decision
+	TASK_ADMITTED,      // schedulable as declared
+	TASK_DEGRADED,      // schedulable with granted_period_us > period_us
+	TASK_REJECTED,      // not schedulable, or bad parameters
+	TASK_LEAVING,       // client is done, mid frees the slot
+};
+
+typedef struct mid_task_decl {
+	int status;                         // enum mid_task_status
+	pid_t pid;
+	char name[JOB_MEM_NAME_MAX_LEN];    // job name given to tag_job_begin
+	int64_t period_us;
+	int64_t wcet_us;
+	int64_t deadline_us;                // relative, 0 means the period
+	int priority;                       // for the fp policy, higher runs first
+	bool allow_degrade;                 // accept a longer period over rejection
+	int64_t granted_period_us;          // set by mid
+	sem_t wake;                         // posted by mid with the decision
+} mid_task_decl_t;
+
+typedef struct mid_tasks {
+	mid_task_decl_t task[MID_TASKS_MAX];
+} mid_tasks_t;
+
+#define MID_TASKS_SIZE sizeof(mid_tasks_t)
+
+static int client_tasks_fd = -1;
+static mid_tasks_t *client_tasks = NULL;
+
+/*
+ * Name: init_mid_tasks
+ * Function: Map the task region; the server (init_flag) clears it
+ */
+static inline int init_mid_tasks(int *fd, mid_tasks_t **addr, bool init_flag)
+{
+	*addr = (mid_tasks_t *)mid_shm_map(MID_TASKS_NAME,
+							MID_TASKS_SIZE,
+							PROT_READ|PROT_WRITE,
+							init_flag,
+							fd);
+	if (*addr == MAP_FAILED) {
+		perror("[Error] in init_mid_tasks: mmap");
+		return -1;
+	}
+
+	if (init_flag) {
+		int i;
+		memset(*addr, 0, MID_TASKS_SIZE);
+		for (i = 0; i < MID_TASKS_MAX; i++) {
+			if (sem_init(&((*addr)->task[i].wake), 1, 0) != 0) {
+				perror("[Error] in init_mid_tasks: sem_init");
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Name: mid_task_register
+ * Function: Declare a periodic task and wait for mid to test it
+ * Input: name, the job name the task tags; period, wcet and deadline in us
+ *        (deadline 0 means the period); allow_degrade accepts a longer period
+ * Output: *granted_period_us, the period the task may run at
+ * Return: slot of the task (pass it to mid_task_unregister), -1 if it was
+ *         rejected or mid didn't answer
+ */
+static inline int mid_task_register(const char *name, int64_t period_us, int64_t wcet_us,
+	int64_t deadline_us, int priority, bool allow_degrade, int64_t *granted_period_us)
+{
+	int i;
+	if (client_tasks == NULL && init_mid_tasks(&client_tasks_fd, &client_tasks, false) < 0)
+		return -1;
+
+	/* Claim a free slot */
+	mid_task_decl_t *t = NULL;
+	for (i = 0; i < MID_TASKS_MAX && t == NULL; i++) {
+		int expected = TASK_FREE;
+		if (__atomic_compare_exchange_n(&(client_tasks->task[i].status), &expected,
+				TASK_CLAIMED, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			t = &(client_tasks->task[i]);
+	}
+	if (t == NULL) {
+		fprintf(stderr, "mid_task_register: no free task slot\n");
+		return -1;
+	}
+	int slot = t - client_tasks->task;
+
+	t->pid = getpid();
+	strncpy(t->name, name, JOB_MEM_NAME_MAX_LEN - 1);
+	t->name[JOB_MEM_NAME_MAX_LEN - 1] = '\0';
+	t->period_us = period_us;
+	t->wcet_us = wcet_us;
+	t->deadline_us = deadline_us;
+	t->priority = priority;
+	t->allow_degrade = allow_degrade;
+	t->granted_period_us = 0;
+	__atomic_store_n(&(t->status), TASK_PENDING, __ATOMIC_RELEASE);
+
+	/* Wait for the decision */
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += MID_TASK_WAIT_S;
+	while (sem_timedwait(&(t->wake), &deadline) != 0) {
+		if (errno == EINTR) continue;
+		// mid is gone; take the slot back unless it decided just now
+		int expected = TASK_PENDING;
+		if (__atomic_compare_exchange_n(&(t->status), &expected, TASK_FREE,
+				false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			fprintf(stderr, "mid_task_register: mid did not answer\n");
+			return -1;
+		}
+		break;
+	}
+
+	int status = __atomic_load_n(&(t->status), __ATOMIC_ACQUIRE);
+	if (status == TASK_REJECTED) {
+		__atomic_store_n(&(t->status), TASK_FREE, __ATOMIC_RELEASE);
+		return -1;
+	}
+	if (granted_period_us) *granted_period_us = t->granted_period_us;
+	return slot;
+}
+
+/*
+ * Name: mid_task_unregister
+ * Function: Tell mid the task of slot won't tag jobs anymore
+ */
+static inline void mid_task_unregister(int slot)
+{
+	if (client_tasks == NULL || slot < 0 || slot >= MID_TASKS_MAX) return;
+	__atomic_store_n(&(client_tasks->task[slot].status), TASK_LEAVING, __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,298 @@
+/*
+	Scheduler tracing(c++) for mid and the FT manager
+
+	Every server thread records compact binary events into its own ring
+	buffer; a background thread drains all rings into a trace file, so the
+	hot paths never take the stdio lock or make a syscall other than the
+	vDSO clock read.
+
+	- mid_trace_init   --- called once in server, reads MID_TRACE
+	   - mid_trace_flush_thread, drains rings every MID_TRACE_FLUSH_MS
+	     or right away on SIGUSR2
+	- MID_TRACE_EVENT  --- record one event from any server thread
+	  (MID_TRACE_EVENT2 with a second argument)
+	- mid_trace_close  --- final flush at shutdown
+
+	Tracing is off unless MID_TRACE names the output file, then
+	MID_TRACE_EVENT costs one predictable branch. mid_trace2json.py converts
+	the file to Chrome trace / Perfetto JSON, mid_sim replays its submits.
+
+	File format (host byte order):
+	  mid_trace_header_t, then any number of mid_trace_event_t
+*/
+#ifndef MID_TRACE
+#define MID_TRACE
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>    // SYS_gettid
+#include <atomic>           // std::atomic
+
+#define MID_TRACE_MAGIC "MIDTRACE"
+#define MID_TRACE_VERSION 2
+#define MID_TRACE_RING_SIZE 4096    // events per thread, power of 2
+#define MID_TRACE_MAX_RINGS 128     // server threads (1 + ft + heartbeat threads)
+#define MID_TRACE_FLUSH_MS 100
+#define MID_TRACE_NAME_LEN 32
+
+enum mid_trace_type {
+	TRACE_SUBMIT = 1,   // job queued by a client, arg = TRACE_F_* flags,
+	                    // arg2 = slacktime_us, value = required_mem_b
+	TRACE_ADMIT,        // job_acquire_gpu reserved the GPU, value = bytes
+	TRACE_TRIGGER,      // client woken to run
+	TRACE_COMPLETE,     // client ended the job
+	TRACE_ABORT,        // client woken to abort
+	TRACE_RECLAIM,      // job of a dead client reclaimed
+	TRACE_FT_REGISTER,  // FT main/replica registered, arg = group
+	TRACE_FT_TRIGGER,   // FT main/replica woken, arg = group
+	TRACE_FT_KILL,      // replica killed since its main is back, or a hung main, arg = group
+	TRACE_HB_MISS,      // heartbeat stopped, arg = group
+	TRACE_FAILOVER,     // sleeping replica woken, arg = group, value = 1 if
+	                    // a pooled spare
+	TRACE_DROPPED,      // ring was full, value = events lost
+	TRACE_PREEMPT,      // executing job asked to yield, arg = pid of the urgent
+	                    // job, arg2 = its slack left, value = slack left of the asked job
+	TRACE_SHED,         // stale job dropped, value = us it would have been late
+	TRACE_HANG,         // frames stopped with a live heartbeat, arg = group,
+	                    // value = last frame
+};
+
+#define TRACE_F_NOSLACK 1
+#define TRACE_F_SHAREABLE 2
+
+typedef struct mid_trace_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t event_size;
+	uint64_t start_ns;              // CLOCK_MONOTONIC at mid_trace_init
+	int32_t pid;                    // pid of mid
+	int32_t pad;
+} mid_trace_header_t;
+
+typedef struct mid_trace_event {
+	uint64_t ts_ns;                 // CLOCK_MONOTONIC
+	uint32_t type;                  // enum mid_trace_type
+	int32_t thread;                 // tid of the server thread that recorded it
+	int32_t pid;                    // client pid
+	int32_t tid;                    // client tid
+	int32_t arg;
+	int32_t arg2;
+	uint64_t value;
+	char name[MID_TRACE_NAME_LEN];  // job name, truncated
+} mid_trace_event_t;                // 72 bytes
+
+/* Single producer (owning thread), single consumer (flush thread) ring */
+typedef struct mid_trace_ring {
+	std::atomic<uint64_t> head;     // next slot written by the owner
+	std::atomic<uint64_t> tail;     // next slot read by the flusher
+	uint64_t dropped;               // owner only
+	int32_t thread;
+	mid_trace_event_t ev[MID_TRACE_RING_SIZE];
+} mid_trace_ring_t;
+
+static bool mid_trace_enabled = false;
+static FILE *mid_trace_file = NULL;
+static mid_trace_ring_t *mid_trace_rings[MID_TRACE_MAX_RINGS];
+static std::atomic<int> mid_trace_n_rings(0);
+static pthread_mutex_t mid_trace_lock = PTHREAD_MUTEX_INITIALIZER; // ring registration, file
+static volatile sig_atomic_t mid_trace_dump_now = 0;
+static volatile bool mid_trace_running = false;
+static pthread_t mid_trace_thread;
+static __thread mid_trace_ring_t *mid_trace_my_ring = NULL;
+
+static inline uint64_t mid_trace_now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Name: mid_trace_ring_get
+ * Function: The calling thread's ring, registered on first use
+ */
+static mid_trace_ring_t *mid_trace_ring_get()
+{
+	if (mid_trace_my_ring) return mid_trace_my_ring;
+
+	pthread_mutex_lock(&mid_trace_lock);
+	int n = mid_trace_n_rings.load();
+	if (n < MID_TRACE_MAX_RINGS) {
+		mid_trace_ring_t *r = new mid_trace_ring_t();
+		r->head = 0;
+		r->tail = 0;
+		r->dropped = 0;
+		r->thread = (int32_t)syscall(SYS_gettid);
+		mid_trace_rings[n] = r;
+		mid_trace_n_rings.store(n + 1, std::memory_order_release);
+		mid_trace_my_ring = r;
+	}
+	pthread_mutex_unlock(&mid_trace_lock);
+	return mid_trace_my_ring;
+}
+
+/*
+ * Name: mid_trace_record
+ * Function: Append one event to the calling thread's ring. Never blocks; when
+ *           the flusher falls behind, the event is counted as dropped.
+ */
+static void mid_trace_record(uint32_t type, pid_t pid, pid_t tid,
+	const char *name, int32_t arg, int32_t arg2, uint64_t value)
+{
+	mid_trace_ring_t *r = mid_trace_ring_get();
+	if (!r) return;
+
+	uint64_t head = r->head.load(std::memory_order_relaxed);
+	if (head - r->tail.load(std::memory_order_acquire) >= MID_TRACE_RING_SIZE) {
+		r->dropped++;
+		return;
+	}
+
+	mid_trace_event_t *e = &(r->ev[head & (MID_TRACE_RING_SIZE - 1)]);
+	e->ts_ns = mid_trace_now_ns();
+	e->type = type;
+	e->thread = r->thread;
+	e->pid = pid;
+	e->tid = tid;
+	e->arg = arg;
+	e->arg2 = arg2;
+	e->value = value;
+	if (name) {
+		strncpy(e->name, name, MID_TRACE_NAME_LEN - 1);
+		e->name[MID_TRACE_NAME_LEN - 1] = '\0';
+	} else {
+		e->name[0] = '\0';
+	}
+
+	// Report earlier drops once there is room again
+	if (r->dropped && head + 1 - r->tail.load(std::memory_order_acquire) < MID_TRACE_RING_SIZE) {
+		r->head.store(head + 1, std::memory_order_release);
+		uint64_t lost = r->dropped;
+		r->dropped = 0;
+		mid_trace_record(TRACE_DROPPED, 0, 0, NULL, 0, 0, lost);
+		return;
+	}
+	r->head.store(head + 1, std::memory_order_release);
+}
+
+#define MID_TRACE_EVENT(type, pid, tid, name, arg, value) \
+	do { \
+		if (mid_trace_enabled) mid_trace_record(type, pid, tid, name, arg, 0, value); \
+	} while (0)
+
+#define MID_TRACE_EVENT2(type, pid, tid, name, arg, arg2, value) \
+	do { \
+		if (mid_trace_enabled) mid_trace_record(type, pid, tid, name, arg, arg2, value); \
+	} while (0)
+
+// Per-job log lines, skipped while tracing since the trace holds the same
+#define MID_LOG(...) \
+	do { \
+		if (!mid_trace_enabled) fprintf(stdout, __VA_ARGS__); \
+	} while (0)
+
+/*
+ * Name: mid_trace_flush
+ * Function: Move every recorded event from the rings to the trace file
+ */
+static void mid_trace_flush()
+{
+	pthread_mutex_lock(&mid_trace_lock);
+	int n = mid_trace_n_rings.load(std::memory_order_acquire);
+	for (int i = 0; i < n; i++) {
+		mid_trace_ring_t *r = mid_trace_rings[i];
+		uint64_t tail = r->tail.load(std::memory_order_relaxed);
+		uint64_t head = r->head.load(std::memory_order_acquire);
+		while (tail != head) {
+			// Write the contiguous run up to the end of the ring at once
+			uint64_t idx = tail & (MID_TRACE_RING_SIZE - 1);
+			uint64_t run = head - tail;
+			if (run > MID_TRACE_RING_SIZE - idx) run = MID_TRACE_RING_SIZE - idx;
+			fwrite(&(r->ev[idx]), sizeof(mid_trace_event_t), run, mid_trace_file);
+			tail += run;
+		}
+		r->tail.store(tail, std::memory_order_release);
+	}
+	fflush(mid_trace_file);
+	pthread_mutex_unlock(&mid_trace_lock);
+}
+
+static void mid_trace_handle_sigusr2(int ign)
+{
+	mid_trace_dump_now = 1;
+}
+
+/*
+ * Name: mid_trace_flush_thread
+ * Function: Drain the rings every MID_TRACE_FLUSH_MS, or as soon as SIGUSR2
+ *           asks for a dump
+ */
+static void *mid_trace_flush_thread(void *varpg)
+{
+	struct timespec tick = {0, 1000000}; // 1 ms
+	int ms = 0;
+	while (mid_trace_running) {
+		nanosleep(&tick, NULL);
+		if (mid_trace_dump_now || ++ms >= MID_TRACE_FLUSH_MS) {
+			mid_trace_dump_now = 0;
+			ms = 0;
+			mid_trace_flush();
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Name: mid_trace_init
+ * Function: Turn tracing on if MID_TRACE names an output file
+ * Return: 0 on success or when tracing is off, -1 on error
+ */
+int mid_trace_init()
+{
+	const char *path = getenv("MID_TRACE");
+	if (path == NULL || path[0] == '\0') return 0;
+
+	mid_trace_file = fopen(path, "wb");
+	if (mid_trace_file == NULL) {
+		perror("[Error] in mid_trace_init: fopen");
+		return -1;
+	}
+
+	mid_trace_header_t hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MID_TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.version = MID_TRACE_VERSION;
+	hdr.event_size = sizeof(mid_trace_event_t);
+	hdr.start_ns = mid_trace_now_ns();
+	hdr.pid = getpid();
+	fwrite(&hdr, sizeof(hdr), 1, mid_trace_file);
+
+	signal(SIGUSR2, mid_trace_handle_sigusr2);
+	mid_trace_running = true;
+	mid_trace_enabled = true;
+	pthread_create(&mid_trace_thread, NULL, mid_trace_flush_thread, NULL);
+	fprintf(stdout, "Tracing to %s\n", path);
+	return 0;
+}
+
+/*
+ * Name: mid_trace_close
+ * Function: Stop the flush thread and write out what is left
+ */
+void mid_trace_close()
+{
+	if (!mid_trace_enabled) return;
+	mid_trace_running = false;
+	pthread_join(mid_trace_thread, NULL);
+	mid_trace_flush();
+	fclose(mid_trace_file);
+	mid_trace_file = NULL;
+	mid_trace_enabled = false;
+}
+
+#endif
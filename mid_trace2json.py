@@ -0,0 +1,82 @@
+# mid_trace2json.py: convert a binary mid trace to Chrome trace JSON
+#
+# Record a trace with MID_TRACE=mid.trace ./mid (kill -USR2 to flush now),
+# then run python3 mid_trace2json.py mid.trace > mid.json and open mid.json
+# in chrome://tracing or ui.perfetto.dev.
+#
+# Every event shows up as an instant event on the mid thread that recorded
+# it. Jobs also get spans on their client's pid/tid: "queued" from submit to
+# trigger (or abort) and "run" from trigger to complete.
+
+import json
+import struct
+import sys
+
+HEADER = struct.Struct("<8sIIQii")
+EVENT = struct.Struct("<QIiiiiiQ32s")
+
+TYPES = {
+	1: "submit", 2: "admit", 3: "trigger", 4: "complete", 5: "abort",
+	6: "reclaim", 7: "ft_register", 8: "ft_trigger", 9: "ft_kill",
+	10: "hb_miss", 11: "failover", 12: "dropped", 13: "preempt", 14: "shed",
+	15: "hang",
+}
+
+def read_trace(path):
+	with open(path, "rb") as f:
+		data = f.read()
+	magic, version, event_size, start_ns, mid_pid, _ = HEADER.unpack_from(data, 0)
+	if magic != b"MIDTRACE":
+		sys.exit("%s is not a mid trace" % path)
+	if version != 2:
+		sys.exit("%s is a version %d trace, expected 2" % (path, version))
+	events = []
+	for off in range(HEADER.size, len(data) - event_size + 1, event_size):
+		ts, etype, thread, pid, tid, arg, arg2, value, name = EVENT.unpack_from(data, off)
+		events.append({
+			"ts": (ts - start_ns) / 1000.0,   # us, as Chrome expects
+			"type": TYPES.get(etype, str(etype)),
+			"thread": thread, "pid": pid, "tid": tid, "arg": arg, "arg2": arg2, "value": value,
+			"name": name.split(b"\0", 1)[0].decode("utf-8", "replace"),
+		})
+	# Rings are flushed one after another, order by time
+	events.sort(key=lambda e: e["ts"])
+	return mid_pid, events
+
+def to_chrome(mid_pid, events):
+	out = []
+	queued = {}   # (pid, tid, name) -> submit ts
+	running = {}  # (pid, tid, name) -> trigger ts
+
+	for e in events:
+		out.append({
+			"name": e["type"] + (" " + e["name"] if e["name"] else ""),
+			"ph": "i", "s": "t", "ts": e["ts"],
+			"pid": mid_pid, "tid": e["thread"],
+			"args": {"pid": e["pid"], "tid": e["tid"], "arg": e["arg"], "arg2": e["arg2"],
+				"value": e["value"]},
+		})
+
+		key = (e["pid"], e["tid"], e["name"])
+		if e["type"] == "submit":
+			queued[key] = e["ts"]
+		elif e["type"] in ("trigger", "abort") and key in queued:
+			start = queued.pop(key)
+			out.append({"name": "queued " + e["name"], "ph": "X", "ts": start,
+				"dur": e["ts"] - start, "pid": e["pid"], "tid": e["tid"]})
+			if e["type"] == "trigger":
+				running[key] = e["ts"]
+		elif e["type"] in ("complete", "reclaim") and key in running:
+			start = running.pop(key)
+			out.append({"name": "run " + e["name"], "ph": "X", "ts": start,
+				"dur": e["ts"] - start, "pid": e["pid"], "tid": e["tid"]})
+
+	out.append({"name": "process_name", "ph": "M", "pid": mid_pid,
+		"args": {"name": "mid"}})
+	return {"traceEvents": out, "displayTimeUnit": "ms"}
+
+if __name__ == "__main__":
+	if len(sys.argv) != 2:
+		sys.exit("usage: python3 mid_trace2json.py <trace file>")
+	mid_pid, events = read_trace(sys.argv[1])
+	json.dump(to_chrome(mid_pid, events), sys.stdout)
@@ -0,0 +1,215 @@
+/*
+	Cooperative preemption of running jobs, in the shared memory region
+	"mid_yield".
+
+	A job holds its GPU reservation until tag_job_end. When an urgent job
+	can't get the GPU, mid (mid_sched.cpp, sched_try_preempt) posts a yield
+	request for one executing job with a later deadline. Long jobs call
+	tag_job_yield at their checkpoints or kernel boundaries: if the job is
+	asked to yield, the callback saves its state, the job ends and queues
+	again with the slack left until the deadline mid published, then
+	tag_job_yield returns once it is admitted again.
+
+	Functions:
+	- init_mid_yield                --- called in server (init_flag) and in clients
+	- mid_yield_ask / mid_yield_clear / mid_yield_clear_pid --- server only
+	- tag_job_set_yield_callback    --- client, checkpoint hook
+	- tag_job_should_yield          --- client, cheap poll
+	- tag_job_yield                 --- client, yield point
+
+	Only mid writes the region. The poll is one load of gen as long as no
+	request was posted or cleared since the thread last looked, so a thread
+	must poll with its own tid.
+*/
+#ifndef MID_YIELD_H
+#define MID_YIELD_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include "mid_shm.h"        // mid_shm_map
+#include "mid_stats.h"      // mid_stats_now_ns, the clock of deadlines
+#include "tag_gpu.h"        // tag_job_begin, tag_job_end
+
+#define MID_YIELD_NAME "mid_yield"
+#define MID_YIELD_MAX 64
+
+typedef struct mid_yield_req {
+	pid_t pid;                          // 0: slot free
+	pid_t tid;
+	char job_name[JOB_MEM_NAME_MAX_LEN];
+	int64_t deadline_us;                // CLOCK_MONOTONIC, mid_stats_now_ns() / 1000
+} mid_yield_req_t;
+
+typedef struct mid_yield {
+	unsigned long long gen;             // bumped on every change
+	int used;                           // slots in use, mid only
+	mid_yield_req_t req[MID_YIELD_MAX];
+} mid_yield_t;
+
+#define MID_YIELD_SIZE sizeof(mid_yield_t)
+
+typedef void (*mid_yield_fn)(void *arg);
+
+static int client_yield_fd = -1;
+static mid_yield_t *client_yield = NULL;
+static mid_yield_fn client_yield_cb = NULL;
+static void *client_yield_cb_arg = NULL;
+static __thread unsigned long long client_yield_gen = 0;	// gen with no request for this thread
+
+/*
+ * Name: init_mid_yield
+ * Function: Map the yield region; the server (init_flag) clears it
+ */
+static inline int init_mid_yield(int *fd, mid_yield_t **addr, bool init_flag)
+{
+	*addr = (mid_yield_t *)mid_shm_map(MID_YIELD_NAME,
+							MID_YIELD_SIZE,
+							PROT_READ|PROT_WRITE,
+							init_flag,
+							fd);
+	if (*addr == MAP_FAILED) {
+		perror("[Error] in init_mid_yield: mmap");
+		return -1;
+	}
+
+	if (init_flag) {
+		memset(*addr, 0, MID_YIELD_SIZE);
+		// Threads that polled a previous mid must look again
+		(*addr)->gen = mid_stats_now_ns();
+	}
+	return 0;
+}
+
+// -------------------------- Server Side Functions ----------------------------
+/*
+ * Name: mid_yield_ask
+ * Function: Ask the job (pid, tid, job_name) to yield
+ * Return: 0 on success, -1 if all slots are in use
+ */
+static inline int mid_yield_ask(mid_yield_t *y, pid_t pid, pid_t tid, const char *job_name,
+	int64_t deadline_us)
+{
+	int i;
+	for (i = 0; i < MID_YIELD_MAX; i++) {
+		mid_yield_req_t *r = &(y->req[i]);
+		if (r->pid != 0) continue;
+		r->tid = tid;
+		strncpy(r->job_name, job_name, JOB_MEM_NAME_MAX_LEN - 1);
+		r->job_name[JOB_MEM_NAME_MAX_LEN - 1] = '\0';
+		r->deadline_us = deadline_us;
+		__atomic_store_n(&(r->pid), pid, __ATOMIC_RELEASE);
+		__atomic_fetch_add(&(y->gen), 1, __ATOMIC_RELEASE);
+		y->used++;
+		return 0;
+	}
+	return -1;
+}
+
+static inline void mid_yield_free(mid_yield_t *y, mid_yield_req_t *r)
+{
+	__atomic_store_n(&(r->pid), 0, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&(y->gen), 1, __ATOMIC_RELEASE);
+	y->used--;
+}
+
+/*
+ * Name: mid_yield_clear
+ * Function: Drop the request of a job that released the GPU
+ */
+static inline void mid_yield_clear(mid_yield_t *y, pid_t pid, pid_t tid, const char *job_name)
+{
+	int i;
+	for (i = 0; i < MID_YIELD_MAX && y->used; i++) {
+		mid_yield_req_t *r = &(y->req[i]);
+		if (r->pid == pid && r->tid == tid && strcmp(r->job_name, job_name) == 0)
+			mid_yield_free(y, r);
+	}
+}
+
+/*
+ * Name: mid_yield_clear_pid
+ * Function: Drop the requests of a dead client
+ */
+static inline void mid_yield_clear_pid(mid_yield_t *y, pid_t pid)
+{
+	int i;
+	for (i = 0; i < MID_YIELD_MAX && y->used; i++) {
+		if (y->req[i].pid == pid) mid_yield_free(y, &(y->req[i]));
+	}
+}
+
+// -------------------------- Client Side Functions ----------------------------
+/*
+ * Name: tag_job_set_yield_callback
+ * Function: fn(arg) runs in tag_job_yield before the job gives up the GPU,
+ *           e.g. to save a checkpoint
+ */
+static inline void tag_job_set_yield_callback(mid_yield_fn fn, void *arg)
+{
+	client_yield_cb = fn;
+	client_yield_cb_arg = arg;
+}
+
+/*
+ * Name: tag_job_should_yield
+ * Function: Poll whether mid asked the job to yield
+ * Output: *deadline_us, the deadline the job had when it was queued
+ */
+static inline bool tag_job_should_yield(pid_t pid, pid_t tid, const char *job_name,
+	int64_t *deadline_us)
+{
+	if (client_yield == NULL) {
+		if (client_yield_fd != -1 || init_mid_yield(&client_yield_fd, &client_yield, false) < 0) {
+			client_yield_fd = -2;   // don't retry on every poll
+			return false;
+		}
+	}
+	unsigned long long gen = __atomic_load_n(&(client_yield->gen), __ATOMIC_ACQUIRE);
+	if (gen == client_yield_gen) return false;
+
+	int i;
+	bool thread_asked = false;
+	for (i = 0; i < MID_YIELD_MAX; i++) {
+		mid_yield_req_t *r = &(client_yield->req[i]);
+		if (__atomic_load_n(&(r->pid), __ATOMIC_ACQUIRE) != pid || r->tid != tid) continue;
+		if (strncmp(r->job_name, job_name, JOB_MEM_NAME_MAX_LEN - 1) == 0) {
+			if (deadline_us) *deadline_us = r->deadline_us;
+			return true;
+		}
+		thread_asked = true;
+	}
+	// Skip the scan until something changes, unless another job of this
+	// thread has a request
+	if (!thread_asked) client_yield_gen = gen;
+	return false;
+}
+
+/*
+ * Name: tag_job_yield
+ * Function: Yield point of a running job; if mid asked it to yield, run the
+ *           callback, release the GPU and queue the job again with the slack
+ *           left until its deadline
+ * Return: 0 if the job keeps running, 1 if it yielded and runs again,
+ *         -1 if it yielded and mid aborted it when queued again
+ */
+static inline int tag_job_yield(pid_t pid, pid_t tid, const char *job_name,
+	bool shareable_flag, uint64_t required_mem_b)
+{
+	int64_t deadline_us;
+	if (!tag_job_should_yield(pid, tid, job_name, &deadline_us)) return 0;
+
+	if (client_yield_cb) client_yield_cb(client_yield_cb_arg);
+	tag_job_end(pid, tid, job_name);
+
+	int64_t slack_us = deadline_us - (int64_t)(mid_stats_now_ns() / 1000);
+	if (tag_job_begin(pid, tid, job_name, slack_us > 0 ? slack_us : 0,
+			false, shareable_flag, required_mem_b) < 0)
+		return -1;
+	return 1;
+}
+
+#endif
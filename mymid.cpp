@@ -13,65 +13,72 @@
 #include <signal.h>             // sigint can trigger the clean up process;
 #include <dlfcn.h>                             // dlsym, RTLD_DEFAULT
 #include <semaphore.h>			// sem_t, sem_*()
+#include <poll.h>				// poll, pidfd readiness
+#include <sys/syscall.h>		// SYS_pidfd_open
 
 #include <algorithm>	// std::find
-#include <cassert>		// assert()
 #include <queue>		// std::queue, std::priority_queue, std::vector
 #include <vector>			// std::vector
 #include <memory>		// std::shared_ptr
 #include <unordered_map>	// std::unordered_map
+#include <unordered_set>	// std::unordered_set
 
 #include "mid_structs.h"
 #include "mid_queue.h"
 #include "mid_common.h"
+#include "mid_yield.h"
+#include "mid_batch.h"
+#include "mid_shed.h"
+
+// ---- Tracing ----
+#include "mid_trace.cpp"
 
 // ---- For FT ----
 #include "ft_utils_server.cpp"
 
-// Helper define for slacktime threshold check
-#define SLACKTIME_THRESHOLD (5*SLEEP_MICROSECONDS)
-#define CURR_SLACKTIME_PQ_EMPTY_OFFSET (rel_priority_period_count*SLEEP_MICROSECONDS)
-#define WITHIN_SLACKTIME_THRESHOLD(s) \
-	(s < (int64_t)CURR_SLACKTIME_PQ_EMPTY_OFFSET + SLACKTIME_THRESHOLD)
-
-struct CompareJobSlack {
-public:
-	/* One job is higher priority than another if its slacktime is <= to others */
-    bool operator()(job_t *&j1, job_t *& j2) {
-		return j2->slacktime_us <= j1->slacktime_us;
-    }
-};
-struct CompareJobPtr {
-	job_t *lhs;
-	public: 
-		CompareJobPtr(job_t *_lhs) : lhs(_lhs) {}
-		bool operator()(job_t *&rhs) {
-			return lhs->pid == rhs->pid \
-				&& lhs->tid == rhs->tid \
-				&& strcmp(lhs->job_name, rhs->job_name) == 0 ;
-		}
-};
+// ---- Persistent state, survives a mid restart ----
+#include "mid_state.cpp"
 
-static uint64_t max_gpu_memory_available; // In B
-static uint64_t gpu_memory_available;	// In Bytes
+// ---- Admission logic: queues and GPU bookkeeping ----
+#include "mid_sched.cpp"
 
-static std::priority_queue<job_t *,\
-		std::vector<job_t *>, CompareJobSlack> pq_jobs;
-static std::queue<job_t*> fifo_jobs;
-static std::vector<job_t*> executing_jobs;
-static std::queue<job_t*> completed_jobs;
-static std::unordered_map<pid_t, int> running_pid_jobs;	// How many jobs per pid concurrently running on GPU
-static int gpu_excl_jobs = 0;	// How many jobs are running on GPU with non-shareable flag
-// In order to maintain a relative ordering of old and new jobs on the pq
-// (which is ordered by slacktimes, which is relative to an absolute client
-// frame deadline), we must keep a counter for periods in which the pq is not
-// empty.
-static int rel_priority_period_count = 0;
+// ---- Admission control of declared periodic tasks (mid_tasks.h) ----
+#include "mid_admit.cpp"
 
+// ---- Stage graphs of frame pipelines (mid_dag.h) ----
+#include "mid_dag.cpp"
 
 static int GJ_fd;
 static global_jobs_t *GJ;
 
+// ---- Statistics page (STATS, mid_stats.h) ----
+static int STATS_fd;
+static std::unordered_map<job_t*, unsigned long long> enqueue_ns;	// when a job was queued
+
+// ---- Declared periodic tasks ----
+static int TASKS_fd;
+static mid_tasks_t *TASKS;
+
+// ---- Yield requests to executing jobs ----
+static int YIELD_fd;
+static mid_yield_t *YIELD;
+
+// ---- Doorbells of clients with a reactor (BELL, mid_bell.h) ----
+static int BELL_fd;
+
+// ---- Batches of jobs admitted together ----
+static int BATCH_fd;
+static mid_batch_t *BATCH;
+
+// ---- Staleness policies of client jobs ----
+static int SHED_fd;
+static mid_shed_t *SHED;
+static unsigned long long behind_since_ns = 0;	// a stale job is queued since, 0: none
+
+// ---- Declared frame pipelines ----
+static int DAG_fd;
+static mid_dag_region_t *DAG;
+
 // ---- For FT ----
 static int FJ_fd;
 static ft_jobs_t *FJ;
@@ -86,6 +93,28 @@ void destroy_global_jobs(int GJ_fd)
 	}
 }
 
+/*
+ * Make the global jobs queue consistent after a client died holding its
+ * requests_q_lock: clamp the count and drop names that were not fully written.
+ */
+void repair_global_jobs(void *arg)
+{
+	global_jobs_t *gj = (global_jobs_t *)arg;
+	const int max_jobs = sizeof(gj->job_names) / sizeof(gj->job_names[0]);
+	const size_t name_len = sizeof(gj->job_names[0]);
+	int n = 0;
+
+	if (gj->total_count < 0) gj->total_count = 0;
+	if (gj->total_count > max_jobs) gj->total_count = max_jobs;
+	for (int i = 0; i < gj->total_count; i++) {
+		if (gj->job_names[i][0] == '\0' || memchr(gj->job_names[i], '\0', name_len) == NULL)
+			continue;
+		if (n != i) memcpy(gj->job_names[n], gj->job_names[i], name_len);
+		n++;
+	}
+	gj->total_count = n;
+}
+
 static bool continue_flag = true;
 void handle_sigint(int ign)
 {
@@ -94,172 +123,427 @@ void handle_sigint(int ign)
 	continue_flag = false;
 }
 
-int job_release_gpu(job_t *comp_job) {
-	if (!comp_job) {
-		fprintf(stderr, "Couldn't release job because of bad pointer!\n");
-		return -1;
-	}
+void watch_client(pid_t pid);
 
-	// Verify release of memory
-	if (gpu_memory_available + comp_job->required_mem_b < gpu_memory_available) {
-		// Something's wrong, overflow occurred when releasing memory
-		fprintf(stderr, "Overflow occurred when releasing gpu for job with name %s (wpm %lu, avail %lu)\n!",\
-				comp_job->job_name, comp_job->required_mem_b, gpu_memory_available);
-		return -2;
+/*
+ * Rebuild the queues, executing_jobs and all GPU reservations from the job
+ * table of a mid that did not shut down cleanly. Clients stay blocked in
+ * sem_wait on their job and are woken as if nothing happened.
+ * Returns the number of recovered jobs.
+ */
+int recover_sched_jobs() {
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	// Restore the fifo order by enqueue sequence
+	std::vector<int> slots;
+	for (int i = 0; i < MID_STATE_MAX_JOBS; i++) {
+		if (MS->job[i].queue != MID_Q_FREE) slots.push_back(i);
 	}
-
-	// Acquired memory
-	int acquired_mem = comp_job->required_mem_b ? comp_job->required_mem_b : max_gpu_memory_available;
-
-	// Verify decrement number of jobs running under job's pid
-	auto it = running_pid_jobs.find(comp_job->pid);
-	if (it == running_pid_jobs.end()) {
-		fprintf(stderr, "Couldn't release job because cannot find is running pid (%d)!\n", comp_job->pid);
-		return -2;
-	} else {
-		if (running_pid_jobs[comp_job->pid]< 1) {
-			fprintf(stderr, "Couldn't release job because too running pid jobs for pid (%d)!\n", comp_job->pid);
-			return -2;
+	std::sort(slots.begin(), slots.end(), [](int a, int b) {
+		return MS->job[a].seq < MS->job[b].seq;
+	});
+	rel_priority_period_count = MS->rel_priority_period_count;
+
+	// Tasks admitted before the restart still run
+	std::vector<pid_t> task_pids;
+	admit_recover(TASKS, &task_pids);
+	for (pid_t pid : task_pids) watch_client(pid);
+
+	// So do pipelines, before their next stage job arrives; none holds a
+	// job yet, those it held are in the job table as queued
+	std::vector<job_t*> released;
+	std::vector<pid_t> dag_pids;
+	dag_process(DAG, &released, &dag_pids);
+	for (pid_t pid : dag_pids) watch_client(pid);
+
+	int n = 0;
+	for (int slot : slots) {
+		mid_state_job_t *sj = &(MS->job[slot]);
+		job_t *j;
+		if (get_shared_job_by_name(sj->shm_name, &j) < 0 || j->pid == 0) {
+			// Client is gone, its name no longer refers to a job
+			unlink_shared_job(sj->shm_name, sizeof(job_t));
+			sj->queue = MID_Q_FREE;
+			mid_state_free.push_back(slot);
+			continue;
 		}
-	}
-	if (!comp_job->shareable_flag) {
-		if (gpu_excl_jobs < 1) {
-			fprintf(stderr, "Couldn't release job because too few gpu_excl_jobs!\n");
-			return -2;
+		mid_state_slot[j] = slot;
+		watch_client(j->pid);
+
+		if (sj->queue == MID_Q_FIFO) {
+			fifo_jobs.push(j);
+		} else if (sj->queue == MID_Q_DONE) {
+			// After the executing job it ends, by seq
+			completed_jobs.push(j);
+		} else if (sj->queue == MID_Q_PQ) {
+			sched_requeue(j);
+		} else {
+			sched_restore_exec(j, sj->admit_pid, sj->ft_dup, sj->batch, sj->batch_mem_b);
 		}
-		gpu_excl_jobs--;
+		n++;
 	}
 
-	// Actually release memory and reduce running_pid_jobs
-	gpu_memory_available += acquired_mem;
-	running_pid_jobs[comp_job->pid]--;
-	// Remove pid from running_pid_jobs if its tid count is 0
-	if (running_pid_jobs[comp_job->pid] == 0) {
-		running_pid_jobs.erase(it);
-	}
-	return 0;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	fprintf(stdout, "Recovered %d jobs in %ld us (generation %llu)\n", n,
+			(t1.tv_sec - t0.tv_sec) * 1000000L + (t1.tv_nsec - t0.tv_nsec) / 1000,
+			MS->generation);
+	return n;
 }
 
-// Helper function for bookkeeping of allocating gpu resources for job
-void alloc_gpu_for_job(job_t *j) {
-	if (j->required_mem_b == 0) {
-		// Allocate all of gpu
-		gpu_memory_available = 0;
-	} else {
-		gpu_memory_available -= j->required_mem_b;
+/* Drop a job from the persistent state and release its shm name */
+void forget_job(job_t *j) {
+	const char *name = mid_state_drop_job(j);
+	if (name) {
+		unlink_shared_job(name, sizeof(job_t));
 	}
+}
 
-	auto it = running_pid_jobs.find(j->pid);
-	if (it != running_pid_jobs.end()) {
-		// Increment number of threads running for job's pid
-		running_pid_jobs[j->pid]++;
-	} else {
-		running_pid_jobs[j->pid] = 1;
-	}
+// -------------------------- Dead-client reclamation ----------------------------
+// A client that dies between trigger_job and tag_job_end never releases its
+// reservation. Every client pid with a job in mid is watched through a pidfd
+// (kill(pid, 0) where pidfd_open is unavailable) and the jobs of dead pids are
+// reclaimed in bulk, every server period: one poll over all pidfds, so a
+// dead client's memory is admitted into before the next period.
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+static std::unordered_map<pid_t, int> client_pidfds;	// -1: no pidfd, use kill
+static std::unordered_set<pid_t> reclaim_retries;		// dead, jobs not released yet
+
+void watch_client(pid_t pid) {
+	if (client_pidfds.find(pid) != client_pidfds.end()) return;
+	client_pidfds[pid] = (int)syscall(SYS_pidfd_open, pid, 0);
+}
 
-	if (!j->shareable_flag) { // TODO
-		gpu_excl_jobs++;
+static inline job_t *queued_job(job_t *j) { return j; }
+static inline job_t *queued_job(const sched_entry_t &e) { return e.job; }
+
+/* Drop the queued jobs of dead pids from a queue, keeping their order */
+template <typename Q, typename Pop>
+void drop_dead_jobs(Q &q, Pop front, const std::unordered_map<pid_t, int> &dead) {
+	Q keep;
+	while (q.size()) {
+		typename Q::value_type e = front(q);
+		job_t *j = queued_job(e);
+		q.pop();
+		if (dead.find(j->pid) == dead.end()) {
+			keep.push(e);
+		} else {
+			forget_job(j);
+			destroy_shared_job(&j);
+		}
 	}
-	return;
+	std::swap(q, keep);
 }
 
 /*
- * A job can acquire the gpu under the following conditions:
- * 1) Job's memory requirement fits on memory available for GPU
- * AND 
- * 2) job can appropriately share the GPU with other threads or pids
- * AND
- * 3) job's slacktime below a threshold relative to server period
- * Returns 0 on success, -1 on wait signal, -2 on abort signal for job
+ * Find clients that died and release everything they held: their
+ * executing_jobs entries with the GPU reservations, and their queued jobs.
+ * A pid stays watched until all of its executing jobs were released, so a
+ * release that failed is tried again the next period.
+ * Returns the number of reclaimed executing jobs.
  */
-int job_acquire_gpu(job_t *j) {
-	if (!j) return -2;
-
-	bool can_alloc_mem = false;
-	if (j->required_mem_b > max_gpu_memory_available) {
-		// Must abort job, can never run on the GPU
-		return -2;
-	} else {
-		if (j->required_mem_b == 0 && gpu_memory_available == max_gpu_memory_available) {
-			can_alloc_mem = true;
-		} else if (j->required_mem_b < gpu_memory_available) {
-			can_alloc_mem = true;
-		} else {
-			can_alloc_mem = false;
+int reclaim_dead_clients() {
+	if (client_pidfds.empty()) return 0;
+
+	// One poll over all pidfds, a pidfd is readable once its process exited
+	std::vector<struct pollfd> pfds;
+	std::vector<pid_t> pids;
+	std::unordered_map<pid_t, int> dead;
+	for (auto &it : client_pidfds) {
+		if (it.second >= 0) {
+			pfds.push_back({it.second, POLLIN, 0});
+			pids.push_back(it.first);
+		} else if (kill(it.first, 0) == -1 && errno == ESRCH) {
+			dead[it.first] = -1;
 		}
 	}
-	if (!can_alloc_mem) {
-		// Must wait for jobs to free up GPU mem
-		return -1;
+	if (pfds.size() && poll(pfds.data(), pfds.size(), 0) > 0) {
+		for (size_t i = 0; i < pfds.size(); i++) {
+			if (pfds[i].revents) dead[pids[i]] = pfds[i].fd;
+		}
 	}
+	if (dead.empty()) return 0;
 
-	bool should_run_now = false;
-	if (j->noslack_flag) {
-		should_run_now = true;
-	} else {
-		// Whether job should run now depends on slacktime threshold
-		should_run_now = WITHIN_SLACKTIME_THRESHOLD(j->slacktime_us);
+	// Their jobs are all dropped below, none is admitted anymore
+	for (auto it = enqueue_ns.begin(); it != enqueue_ns.end(); ) {
+		if (dead.find(it->first->pid) != dead.end()) it = enqueue_ns.erase(it);
+		else ++it;
 	}
-	if (!should_run_now) {
-		// Must wait for slacktime to be within running threshold
-		return -1;
-	}
-
 
-	bool can_run_now = false;
-	if (running_pid_jobs.size() == 0) {
-		can_run_now = true;
-	} else {
-		auto it = running_pid_jobs.find(j->pid);
-		if (it != running_pid_jobs.end()) {
-			// Job shares pid with running job
-			if (j->shareable_flag) {
-				can_run_now = true;
-			} else if (running_pid_jobs.size() == 1 && !j->shareable_flag) {
-				can_run_now = true;
-			} else {
-				// Job is not shareable and multiple pids running, must wait
-				can_run_now = false;
-			}
-		} else {
-			// Job is first of its process to run next to other jobs
-			if (j->shareable_flag) {
-				if (gpu_excl_jobs == 0) {
-					// Can run if no other jobs are not-shareable
-					can_run_now = true;
-				} else {
-					can_run_now = false;
-				}
-			} else {
-				// Job can't share gpu with other processes
-				can_run_now = false;
-			}
+	int reclaimed = 0;
+	std::unordered_map<pid_t, int> unreleased;	// jobs left executing, by pid
+	for (auto it = executing_jobs.begin(); it != executing_jobs.end(); ) {
+		job_t *j = *it;
+		if (dead.find(j->pid) == dead.end()) {
+			++it;
+			continue;
+		}
+		if (job_release_gpu(j) != 0) {
+			unreleased[j->pid]++;
+			++it;
+			continue;
 		}
+		MID_LOG("\tReclaimed job (%s, pid=%d, tid=%d) of dead client\n", j->job_name, j->pid, j->tid);
+		MID_TRACE_EVENT(TRACE_RECLAIM, j->pid, j->tid, j->job_name, 0, 0);
+		it = executing_jobs.erase(it);
+		forget_job(j);
+		destroy_shared_job(&j);
+		reclaimed++;
+		mid_stat_add(&(STATS->reclaimed), 1);
 	}
-	if (!can_run_now) {
-		return -1;
-	} else {
-		alloc_gpu_for_job(j);
-		return 0;
+	drop_dead_jobs(fifo_jobs, [](std::queue<job_t*> &q) { return q.front(); }, dead);
+	drop_dead_jobs(pq_jobs, [](decltype(pq_jobs) &q) { return q.top(); }, dead);
+
+	for (auto &it : dead) {
+		std::vector<job_t*> held;
+		dag_drop_pid(DAG, it.first, &held);
+		for (job_t *j : held) {
+			forget_job(j);
+			destroy_shared_job(&j);
+		}
+		admit_drop_pid(TASKS, it.first);
+		mid_yield_clear_pid(YIELD, it.first);
+		mid_batch_clear_pid(BATCH, it.first);
+		mid_shed_clear_pid(SHED, it.first);
+		sched_failover_drop_pid(it.first);
+		ft_drop_promoted(it.first);
+		if (unreleased.count(it.first)) {
+			if (reclaim_retries.insert(it.first).second)
+				fprintf(stderr, "\t%d jobs of dead client %d not released, trying again\n",
+					unreleased[it.first], it.first);
+			continue;
+		}
+		reclaim_retries.erase(it.first);
+		if (it.second >= 0) close(it.second);
+		client_pidfds.erase(it.first);
 	}
+	return reclaimed;
+}
+
+/* Statistics for a job that was just admitted */
+void note_admitted(job_t *j) {
+	mid_stat_add(&(STATS->admitted), 1);
+	auto it = enqueue_ns.find(j);
+	if (it != enqueue_ns.end()) {
+		mid_hist_add(&(STATS->admit_latency_us), (mid_stats_now_ns() - it->second) / 1000);
+		enqueue_ns.erase(it);
+	}
+}
+
+/* Statistics for a completed job, of a promoted replica's first one */
+void note_completed(job_t *j) {
+	mid_stat_add(&(STATS->completed), 1);
+	sched_promoted_t p;
+	if (!sched_promoted_of(j->pid, &p) || p.frames != 1) return;
+
+	// From the takeover of this failover, or when the replica's first job
+	// was queued if the FT manager hasn't seen it beat yet
+	mid_stats_group_t *g = &(STATS->group[p.group]);
+	unsigned long long now = mid_stats_now_ns();
+	unsigned long long since = mid_stat_get(&(g->last_takeover_ns));
+	if (since == 0 || since < mid_stat_get(&(g->last_detect_ns)) || since > now)
+		since = (unsigned long long)p.since_us * 1000;
+	mid_hist_add(&(STATS->takeover_to_frame_us), (now - since) / 1000);
+}
+
+/* Publish queue depths and GPU use, once per server period */
+void sample_stats() {
+	mid_stat_add(&(STATS->periods), 1);
+	mid_stat_set(&(STATS->fifo_depth), fifo_jobs.size());
+	mid_stat_set(&(STATS->pq_depth), pq_jobs.size());
+	mid_stat_set(&(STATS->executing_depth), executing_jobs.size());
+	mid_hist_add(&(STATS->fifo_depth_hist), fifo_jobs.size());
+	mid_hist_add(&(STATS->pq_depth_hist), pq_jobs.size());
+	mid_hist_add(&(STATS->executing_depth_hist), executing_jobs.size());
+
+	uint64_t used = max_gpu_memory_available - gpu_memory_available;
+	mid_stat_set(&(STATS->gpu_mem_used_b), used);
+	mid_hist_add(&(STATS->gpu_util_pct), used * 100 / max_gpu_memory_available);
 }
 
 /* Wake client, instruct to abort job */
 int abort_job(job_t *aj) {
 	if (!aj) return -1;
+	mid_stat_add(&(STATS->aborted), 1);
+	enqueue_ns.erase(aj);
+	MID_TRACE_EVENT(TRACE_ABORT, aj->pid, aj->tid, aj->job_name, 0, 0);
 
 	// Set client's execution flag to abort
 	aj->client_exec_allowed = false;
-	return sem_post(&(aj->client_wake));
+	int res = sem_post(&(aj->client_wake));
+	mid_bell_ring(BELL, aj->pid);
+	return res;
 }
 
 /* Wake client with ability to run job */
 int trigger_job(job_t *tj) {
 	if (!tj) return -1;
+	MID_TRACE_EVENT(TRACE_TRIGGER, tj->pid, tj->tid, tj->job_name, 0, 0);
 
 	// Set client's execution flag to run
 	tj->client_exec_allowed = true;
-	return sem_post(&(tj->client_wake));
+	int res = sem_post(&(tj->client_wake));
+	mid_bell_ring(BELL, tj->pid);
+	return res;
+}
+
+/* sched_job_fn: a job just got the GPU */
+void admitted_job(job_t *q_job) {
+	note_admitted(q_job);
+
+	// A stale job that declared SHED_DEGRADE learns how late it is
+	int64_t late_us = sched_late_us(q_job);
+	if (late_us > 0) {
+		mid_stat_add(&(STATS->late), 1);
+		if (mid_shed_policy(SHED, q_job->pid, q_job->tid, q_job->job_name) == SHED_DEGRADE)
+			mid_shed_post(SHED, q_job->pid, q_job->tid, q_job->job_name, SHED_LATE, late_us);
+	}
+
+	if (sched_boosted(q_job->pid)) mid_stat_add(&(STATS->boosted), 1);
+
+	// Members of a batch find it once they are woken
+	sched_batch_info_t batch;
+	if (sched_batch_of(q_job, &batch)) {
+		mid_stat_add(&(STATS->batched), 1);
+		if (mid_batch_post(BATCH, q_job->pid, q_job->tid, q_job->job_name,
+				batch.id, batch.size, batch.rank) < 0)
+			fprintf(stderr, "\tNo slot to post batch %lu of job (%s, pid=%d)\n",
+				batch.id, q_job->job_name, q_job->pid);
+	}
+
+	// Wake client to trigger execution
+	MID_LOG("\tJob (%s, pid=%d, tid=%d) can execute!\n", q_job->job_name, q_job->pid, q_job->tid);
+	if (trigger_job(q_job) < 0) {
+		fprintf(stderr, "\tFailed to wake client!\n");
+	}
+}
+
+/* sched_job_fn: a job is too big to ever fit on the GPU */
+void aborted_job(job_t *q_job) {
+	// Instruct client to abort job
+	MID_LOG("\tJob must ABORT!\n");
+	abort_job(q_job);
+	// Its frame goes on without it, don't hold up the stages after it
+	std::vector<job_t*> released;
+	dag_complete(DAG, q_job, &released);
+	for (job_t *j : released) mid_state_set_job(j, sched_enqueue(j), 0, false);
+	// Destroy shared job
+	forget_job(q_job);
+	destroy_shared_job(&q_job);
+}
+
+/* sched_stale_fn: drop a job that can't meet its deadline if it declared SHED_DROP */
+bool stale_job(job_t *j, int64_t late_us) {
+	if (mid_shed_policy(SHED, j->pid, j->tid, j->job_name) != SHED_DROP) return false;
+	mid_shed_post(SHED, j->pid, j->tid, j->job_name, SHED_DROPPED, late_us);
+	MID_TRACE_EVENT(TRACE_SHED, j->pid, j->tid, j->job_name, 0, late_us);
+	return true;
+}
+
+/* sched_job_fn: a stale job was dropped */
+void shed_job(job_t *q_job) {
+	MID_LOG("\tJob (%s, pid=%d, tid=%d) is stale, shed\n", q_job->job_name, q_job->pid, q_job->tid);
+	mid_stat_add(&(STATS->shed), 1);
+	aborted_job(q_job);
+}
+
+/* Time from the first stale job queued until none is, after every shed pass */
+void note_catchup(bool behind) {
+	if (behind && behind_since_ns == 0) {
+		behind_since_ns = mid_stats_now_ns();
+	} else if (!behind && behind_since_ns) {
+		mid_hist_add(&(STATS->catchup_us), (mid_stats_now_ns() - behind_since_ns) / 1000);
+		behind_since_ns = 0;
+	}
+}
+
+/* sched_preempt_fn: an urgent job needs the GPU the executing job j holds */
+void preempt_job(job_t *j, int64_t deadline_us) {
+	MID_LOG("\tJob (%s, pid=%d, tid=%d) asked to yield\n", j->job_name, j->pid, j->tid);
+	if (mid_yield_ask(YIELD, j->pid, j->tid, j->job_name, deadline_us) < 0) {
+		fprintf(stderr, "\tNo free yield slot!\n");
+		return;
+	}
+	mid_stat_add(&(STATS->preempted), 1);
+}
+
+/*
+ * One server period after the requests were drained: answer declarations,
+ * release the GPU of completed jobs and of dead clients, shed stale jobs,
+ * then admit as many queued jobs as fit.
+ */
+void run_period(bool *queued_wait_for_complete) {
+	/* Answer task registrations before admitting jobs of the tasks */
+	std::vector<pid_t> task_pids;
+	admit_process(TASKS, &task_pids);
+	for (pid_t pid : task_pids) watch_client(pid);
+
+	/* Pick up pipelines, queue the stages of those that left */
+	std::vector<job_t*> released;
+	std::vector<pid_t> dag_pids;
+	dag_process(DAG, &released, &dag_pids);
+	for (pid_t pid : dag_pids) watch_client(pid);
+
+	/* Handle all completed jobs first to release GPU resources */
+	while (completed_jobs.size()) {
+		/* Dequeue job from completed */
+		job_t *compl_job = completed_jobs.front();
+		completed_jobs.pop();
+
+		/* Handle completed jobs */
+		// Release the original job and remove it from executing_jobs
+		job_t *orig_job = sched_complete(compl_job);
+		if (orig_job) {
+			note_completed(orig_job);
+			mid_yield_clear(YIELD, orig_job->pid, orig_job->tid, orig_job->job_name);
+			mid_batch_clear(BATCH, orig_job->pid, orig_job->tid, orig_job->job_name);
+
+			/* TODO: Avoid having client sleep waiting for server */
+			// NOTE: It must be the compl_job the client is holding on to
+			sem_post(&(compl_job->client_wake));
+			mid_bell_ring(BELL, compl_job->pid);
+
+			// Reset flags since a job just released gpu resources
+			*queued_wait_for_complete = false;
+
+			// Pipeline stages that waited for this one can run now
+			dag_complete(DAG, orig_job, &released);
+
+			// Destroy shared jobs
+			forget_job(orig_job);
+			destroy_shared_job(&orig_job);
+		}
+		forget_job(compl_job);
+		destroy_shared_job(&compl_job);
+	}
+	for (job_t *j : released) mid_state_set_job(j, sched_enqueue(j), 0, false);
+
+	/* Reclaim jobs of dead clients, then admit into their capacity right away */
+	if (reclaim_dead_clients() > 0) {
+		*queued_wait_for_complete = false;
+	}
+
+	/*
+	 * Drop the stale jobs whose clients would rather skip them than run late.
+	 */
+	int n_late;
+	int n_shed = sched_shed(shed_job, &n_late);
+	note_catchup(n_shed + n_late > 0);
+
+	/*
+	 * Next, run any jobs that have never run yet (and therefore have no priority).
+	 */
+	sched_run_fifo(queued_wait_for_complete, admitted_job, aborted_job);
+
+	/*
+	 * Lastly, run as many jobs (according to priority) as can fit on GPU.
+	 */
+	sched_run_pq(admitted_job, aborted_job);
+	MS->rel_priority_period_count = rel_priority_period_count;
+	sample_stats();
 }
 
 int main(int argc, char **argv)
@@ -267,14 +551,119 @@ int main(int argc, char **argv)
 	(void)argc; (void) argv;
 	fprintf(stdout, "Starting up middleware main...\n");
 
-	max_gpu_memory_available = 1<<30; // 1 GB
-	gpu_memory_available = max_gpu_memory_available;
+	init_mid_sched(1<<30); // 1 GB
+
+	// Scheduling policy of pq_jobs, slack unless MID_SCHED_POLICY says otherwise
+	const char *policy = getenv("MID_SCHED_POLICY");
+	if (policy && set_sched_policy(policy) < 0) {
+		return EXIT_FAILURE;
+	}
+	const char *tasks = getenv("MID_SCHED_TASKS");
+	if (tasks && load_sched_tasks(tasks) < 0) {
+		return EXIT_FAILURE;
+	}
+	// Admit jobs of the same name together (mid_batch.h), off unless set
+	const char *batch_window = getenv("MID_BATCH_WINDOW_US");
+	if (batch_window) {
+		sched_set_batch(atoll(batch_window));
+		fprintf(stdout, "Batching window %s us\n", batch_window);
+	}
+	// GPU memory reserved for the takeover of FT groups, "group:MB[:borrow],..."
+	const char *reserve = getenv("MID_FT_RESERVE");
+	if (reserve && load_sched_reserves(reserve) < 0) {
+		return EXIT_FAILURE;
+	}
+	// Promoted replicas get their group's reservation and go first
+	sched_set_failover(ft_promoted_replica);
+	fprintf(stdout, "Scheduling policy %s\n", sched_policy_names[sched_policy]);
 	fprintf(stdout, "GPU Memory has %lu bytes available at init.\n", gpu_memory_available);
 
 	int res;
 
+	if ((res = mid_trace_init()) < 0)
+	{
+		fprintf(stderr, "Failed to init tracing");
+		return EXIT_FAILURE;
+	}
+
+	/* ------------------------------------Statistics page ---------------------------------------*/
+	if ((res = init_mid_stats(&STATS_fd, &STATS, true)) < 0)
+	{
+		fprintf(stderr, "Failed to init mid stats");
+		return EXIT_FAILURE;
+	}
+	mid_stat_set(&(STATS->gpu_mem_max_b), max_gpu_memory_available);
+
+	/* ------------------------------------Attach persistent state ---------------------------------------*/
+	// A previous mid that didn't shut down cleanly left its state behind:
+	// keep the shared queues and regions and rebuild everything else from it.
+	if ((res = attach_mid_state()) < 0)
+	{
+		fprintf(stderr, "Failed to attach mid state");
+		return EXIT_FAILURE;
+	}
+	bool recover = res == 1;
+	if (recover) {
+		fprintf(stdout, "Recovering state of a previous mid...\n");
+	}
+	MS->max_gpu_memory_available = max_gpu_memory_available;
+
+	/* ------------------------------------Declared periodic tasks ---------------------------------------*/
+	// Clients declare a task once, a restarted mid keeps their slots
+	if ((res = init_mid_tasks(&TASKS_fd, &TASKS, !recover)) < 0)
+	{
+		fprintf(stderr, "Failed to init mid tasks");
+		return EXIT_FAILURE;
+	}
+
+	/* ------------------------------------Yield requests ---------------------------------------*/
+	if ((res = init_mid_yield(&YIELD_fd, &YIELD, true)) < 0)
+	{
+		fprintf(stderr, "Failed to init mid yield");
+		return EXIT_FAILURE;
+	}
+	sched_set_preempt(preempt_job);
+
+	/* ------------------------------------Client doorbells ---------------------------------------*/
+	if ((res = init_mid_bell(&BELL_fd, &BELL, true)) < 0)
+	{
+		fprintf(stderr, "Failed to init mid bell");
+		return EXIT_FAILURE;
+	}
+
+	/* ------------------------------------Batches ---------------------------------------*/
+	// Batches of executing jobs are recovered, so are the ones posted for them
+	if ((res = init_mid_batch(&BATCH_fd, &BATCH, !recover)) < 0)
+	{
+		fprintf(stderr, "Failed to init mid batch");
+		return EXIT_FAILURE;
+	}
+	if (recover) {
+		printf("Freed %d batch slots of dead clients\n", mid_batch_clear_dead(BATCH));
+	}
+
+	/* ------------------------------------Staleness policies ---------------------------------------*/
+	// Client threads declare a policy once, a restarted mid keeps their slots
+	if ((res = init_mid_shed(&SHED_fd, &SHED, !recover)) < 0)
+	{
+		fprintf(stderr, "Failed to init mid shed");
+		return EXIT_FAILURE;
+	}
+	if (recover) {
+		printf("Freed %d staleness slots of dead clients\n", mid_shed_clear_dead(SHED));
+	}
+	sched_set_stale(stale_job);
+
+	/* ------------------------------------Frame pipelines ---------------------------------------*/
+	// Like tasks, a restarted mid keeps the declared pipelines
+	if ((res = init_mid_dag(&DAG_fd, &DAG, !recover)) < 0)
+	{
+		fprintf(stderr, "Failed to init mid dag");
+		return EXIT_FAILURE;
+	}
+
 	/* ------------------------------------Create a FT jobs list ---------------------------------------*/
-	if((res = init_ft_jobs(&FJ_fd, &FJ, true)) < 0)
+	if((res = init_ft_jobs(&FJ_fd, &FJ, !recover)) < 0)
 	{
 		fprintf(stderr, "Failed to init ft jobs list");
 		return EXIT_FAILURE;
@@ -282,7 +671,7 @@ int main(int argc, char **argv)
 	printf("Initialized FT jobs list.\n");
 	/* ------------------------------------Launch FT manager ---------------------------------------*/
 	printf("Start launcing ft manager...\n");
-	if((res = launch_ft_man(FJ)) < 0)
+	if((res = launch_ft_man(FJ, recover)) < 0)
 	{
 		fprintf(stderr, "Failed to launch ft manager");
 		return EXIT_FAILURE;
@@ -291,15 +680,29 @@ int main(int argc, char **argv)
 	//-----------------------------------------------------------------------------------------------
 
 
-	if ((res=init_global_jobs(&GJ_fd, &GJ, true)) < 0)
+	if ((res=init_global_jobs(&GJ_fd, &GJ, !recover)) < 0)
 	{
 		fprintf(stderr, "Failed to init global jobs queue");
 		return EXIT_FAILURE;
 	}
+	if (recover) {
+		sched_tick(mid_stats_now_ns() / 1000);
+		recover_sched_jobs();
+	} else {
+		// Same lock, but ROBUST: a client dying while holding it can't
+		// freeze the scheduler (no client can hold it yet)
+		(void) init_robust_mutex(&(GJ->requests_q_lock));
+	}
 
 	// Set up signal handler
 	signal(SIGINT, handle_sigint);
 
+	// Real-time class and CPUs of the server loop (FT_RT_MID, see ft_lib.h),
+	// set after the FT threads are created so they don't inherit it
+	(void) ft_rt_thread("MID");
+	(void) ft_rt_mlock(GJ, sizeof(global_jobs_t));
+	(void) ft_rt_mlock(STATS, MID_STATS_SIZE);
+
 	// Init flags controlling when jobs_queued_* can't be emptied becase
 	// GPU is at capacity
 	bool queued_wait_for_complete = false;
@@ -308,34 +711,48 @@ int main(int argc, char **argv)
 	// Begin waiting for job_shm_names to be enqueued (sample every 250ms)
 	while (continue_flag)
 	{
+		sched_tick(mid_stats_now_ns() / 1000);
+
 		// Grab job_shm_names lock before emptying
-		pthread_mutex_lock(&(GJ->requests_q_lock));
+		if (robust_mutex_lock(&(GJ->requests_q_lock), repair_global_jobs, GJ, true) != 0) {
+			fprintf(stderr, "Failed to lock global jobs queue. Continuing...\n");
+			usleep(SLEEP_MICROSECONDS);
+			continue;
+		}
 		int i=0;
 		while ((GJ->total_count - i)> 0)
 		{
-			int res;
 			job_t *q_job;
-			if ((res=peek_job_queued_at_i(GJ, &q_job, i)) < 0)
+			// Map by name without unlinking it, so a restarted mid can map
+			// the job again (see mid_state.cpp)
+			const char *q_name = GJ->job_names[i];
+			if (get_shared_job_by_name(q_name, &q_job) < 0)
 			{
 				fprintf(stderr, "Failed to peek job at idx %d. Continuing...\n", i);
+				i++;
+				continue;
 			}
 
 			// Enqueue job request to right queue
 			if (q_job->req_type == QUEUED) {
-				if (q_job->noslack_flag) {
-					fifo_jobs.push(q_job);
-				} else {
-					if (rel_priority_period_count) {
-						// Locally modify the relative priority of this job
-						// compared to older jobs on the pq
-						q_job->slacktime_us += rel_priority_period_count*SLEEP_MICROSECONDS;
-					}
-					pq_jobs.push(q_job);
-					// Just updated pq, can try to process next job immediately
-				}
+				MID_TRACE_EVENT2(TRACE_SUBMIT, q_job->pid, q_job->tid, q_job->job_name,
+						(q_job->noslack_flag ? TRACE_F_NOSLACK : 0) |
+						(q_job->shareable_flag ? TRACE_F_SHAREABLE : 0),
+						q_job->slacktime_us, q_job->required_mem_b);
+				watch_client(q_job->pid);
+				mid_stat_add(&(STATS->submitted), 1);
+				enqueue_ns[q_job] = mid_stats_now_ns();
+				// A pipeline stage waiting for its predecessors is recorded
+				// as queued on pq_jobs, a restarted mid just queues it
+				int q = dag_submit(DAG, q_job) ? (int)MID_Q_PQ : sched_enqueue(q_job);
+				mid_state_record_job(q_job, q_name, q);
 			}
 			else {
+				MID_TRACE_EVENT(TRACE_COMPLETE, q_job->pid, q_job->tid, q_job->job_name, 0, 0);
+				// Kept, name and all, until run_period released the job: a
+				// restarted mid must still see it, the client waits on it
 				completed_jobs.push(q_job);
+				mid_state_record_job(q_job, q_name, MID_Q_DONE);
 			}
 
 			// Continue onto next job_shm_name to process
@@ -345,127 +762,29 @@ int main(int argc, char **argv)
 		GJ->total_count = 0;
 		pthread_mutex_unlock(&(GJ->requests_q_lock));
 
-		/* Handle all completed jobs first to release GPU resources */
-		while (completed_jobs.size()) {
-			/* Dequeue job from completed */
-			job_t *compl_job = completed_jobs.front();
-			completed_jobs.pop();
-
-			/* Handle completed jobs */
-			// First, get original job from executing queue
-			auto it = std::find_if(executing_jobs.begin(),
-					executing_jobs.end(),
-					CompareJobPtr(compl_job));
-			assert(it != executing_jobs.end());
-			job_t *orig_job = executing_jobs[it - executing_jobs.begin()];
-
-			// Next, release job and remove from executing queue
-			if (job_release_gpu(orig_job) == 0) {
-				// Remove job from executing_jobs on successful release
-				executing_jobs.erase(it);
-
-				/* TODO: Avoid having client sleep waiting for server */
-				// NOTE: It must be the compl_job the client is holding on to
-				sem_post(&(compl_job->client_wake));
-
-				// Reset flags since a job just released gpu resources
-				queued_wait_for_complete = false;
-
-				// Destroy shared jobs
-				destroy_shared_job(&orig_job);
-				destroy_shared_job(&compl_job);
-			} else  {
-				fprintf(stderr, "Something went wrong releasing job's resources!\n");
-			}
-
-		}
+		run_period(&queued_wait_for_complete);
 
-		/*
-		 * Next, run any jobs that have never run yet (and therefore have no priority).
-		 */
-		while (!queued_wait_for_complete &&
-				fifo_jobs.size()) {
-			/* Peek at job from jobs_queued */
-			job_t *q_job = fifo_jobs.front();
-
-			/* Handle queued jobs */
-			int res = job_acquire_gpu(q_job);
-			if (res < 0) {
-				if (res == -1) {
-					// Failed to acquire GPU, must wait for other jobs to complete
-					queued_wait_for_complete = true;
-
-					break;
-				} else {
-					// Job is too big to fit on the GPU, instruct client to abort
-					// job
-					fprintf(stdout, "\tJob must ABORT!\n");
-					abort_job(q_job);
-					// Destroy shared job
-					destroy_shared_job(&q_job);
-				}
-			} else {
-				// Adds q_job to executing_jobs on success
-				executing_jobs.push_back(q_job);
-
-				// Wake client to trigger execution
-				fprintf(stdout, "\tJob (%s, pid=%d, tid=%d) can execute!\n", q_job->job_name, q_job->pid, q_job->tid);
-				if (trigger_job(q_job) < 0) {
-					fprintf(stderr, "\tFailed to wake client!\n");
-				}
-			}
-			// Actually pop job off queue
-			fifo_jobs.pop();
-		}
-
-		/*
-		 * Lastly, run as many jobs (according to priority) as can fit on GPU.
-		 */
-		if (pq_jobs.size()) {
-			// Priority queue is not empty, increment the rel_priority_period_count
-			rel_priority_period_count++;
-		}
-		while (pq_jobs.size()) {
-			/* Peek at top job from pq_jobs */
-			job_t *q_job = pq_jobs.top();
-
-			/* Handle queued jobs */
-			int res = job_acquire_gpu(q_job);
-			if (res < 0) {
-				if (res == -1) {
-					// Failed to acquire GPU, must wait for other jobs to complete
-					break;
-				} else {
-					// Job is too big to fit on the GPU, instruct client to abort
-					// job
-					fprintf(stdout, "\tJob must ABORT!\n");
-					abort_job(q_job);
-					// Destroy shared job
-					destroy_shared_job(&q_job);
-				}
-			} else {
-				// Adds q_job to executing_jobs on success
-				executing_jobs.push_back(q_job);
-
-				// Wake client to trigger execution
-				fprintf(stdout, "\tJob (%s, pid=%d, tid=%d) can execute!\n", q_job->job_name, q_job->pid, q_job->tid);
-				if (trigger_job(q_job) < 0) {
-					fprintf(stderr, "\tFailed to wake client!\n");
-				}
-			}
-			// Pop job off priority-queue 
-			pq_jobs.pop();
-
-			if (pq_jobs.size() == 0) {
-				// Reset the relative priority period counter
-				rel_priority_period_count = 0;
-			}
-		}
 		// Sleep before starting loop again
 		usleep(SLEEP_MICROSECONDS);
 	}
 
 	fprintf(stdout, "Cleaning up server...\n");
 	destroy_global_jobs(GJ_fd);
+	detach_mid_state();
+	munmap(STATS, MID_STATS_SIZE);
+	close(STATS_fd);
+	munmap(TASKS, MID_TASKS_SIZE);
+	close(TASKS_fd);
+	munmap(YIELD, MID_YIELD_SIZE);
+	close(YIELD_fd);
+	munmap(BELL, MID_BELL_SIZE);
+	close(BELL_fd);
+	munmap(SHED, MID_SHED_SIZE);
+	close(SHED_fd);
+	munmap(BATCH, MID_BATCH_SIZE);
+	close(BATCH_fd);
+	munmap(DAG, MID_DAG_SIZE);
+	close(DAG_fd);
+	mid_trace_close();
 	return 0;
 }
@@ -0,0 +1,400 @@
+/*
+ * bench_failover.c: end-to-end failover latency of the FT manager
+ *
+ * Starts mid, then N main/replica pairs (N = 1, 2, 4, ... up to the -g
+ * limit), and SIGKILLs a random main at random times. For every kill it
+ * measures, from the moment of the kill:
+ *   detect   - ft_hb_thread declared the main's heartbeat dead
+ *   takeover - the woken replica's first heartbeat reached mid
+ *   ready    - the replica counted its first frame (ft_progress), with
+ *              the model and the group's checkpoint loaded
+ * and then restarts the main and measures
+ *   reclaim  - mid killed the replica and handed the group back to the main
+ * detect and takeover come from the mid_stats page, which uses the same
+ * CLOCK_MONOTONIC as this program.
+ *
+ * Every replica holds a model of -M MB. With -S n, every scale runs a
+ * second time with n spares (ft_init_wait_spare) for all groups instead of
+ * a replica per group: spares load the model only when they take over, so
+ * standby_mb (resident memory of the replicas or spares while all mains
+ * run) goes down and ready goes up. -b kills that many mains at once;
+ * groups left without a spare count as failed.
+ *
+ * Usage: bench_failover [-m mid] [-g max_groups] [-k kills] [-S spares]
+ *                       [-M model_mb] [-b burst] [-s seed] [-o out]
+ * Prints one JSON object per scale to out (default stdout), a summary to stderr.
+ */
+#define _GNU_SOURCE
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include "../ft_utils_client.c"
+#include "../mid_stats.h"
+
+#define BENCH_TIMEOUT_MS 2000   // a failover step taking longer is counted as failed
+#define BENCH_SETTLE_MS 100     // lets ft_jobs_thread register new clients
+
+typedef struct bench_lat {
+	double *ms;
+	int n;
+} bench_lat_t;
+
+static mid_stats_t *st;
+static ft_data_t *hb;
+static pid_t mid_pid;
+static pid_t mains[FT_HB_DATA_MAX_DATA];
+static pid_t replicas[FT_HB_DATA_MAX_DATA]; // replica of each group, or spare i
+static size_t model_b = 64 << 20;
+static char *model;             // kept, so loading it is not optimized away
+
+static void sleep_ms(int ms)
+{
+	usleep(ms * 1000);
+}
+
+/* Load the model, and the checkpoint of group num if it has one */
+static void load_model(int num)
+{
+	char ckpt[FT_RESULT_MAX_BYTES];
+	unsigned long long frame;
+	model = (char *)malloc(model_b);
+	if (model == NULL) _exit(1);
+	memset(model, 1, model_b);
+	if (num >= 0) (void) ft_last_result(num, &frame, ckpt, sizeof(ckpt));
+}
+
+/*
+ * A FT client that only beats its heartbeat once triggered. A main publishes
+ * a checkpoint, a replica loads its model up front and a spare once it knows
+ * its group; both count a frame when ready.
+ */
+static pid_t spawn_client(const char *type, int num)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (freopen("/dev/null", "w", stdout) == NULL) _exit(1);
+		if (freopen("/dev/null", "w", stderr) == NULL) _exit(1);
+		if (!strcmp(type, "spare")) {
+			if ((num = ft_init_wait_spare(getpid(), gettid())) < 0) _exit(1);
+			load_model(num);
+			ft_progress();
+		} else if (!strcmp(type, "replica")) {
+			load_model(-1);
+			ft_init_wait(getpid(), gettid(), type, num);
+			ft_progress();
+		} else {
+			ft_init_wait(getpid(), gettid(), type, num);
+			(void) ft_publish_result(num, 0, 0, "checkpoint", 10);
+		}
+		while (1) pause();
+	}
+	return pid;
+}
+
+/* Resident memory of the clients in pids, in MB */
+static double resident_mb(pid_t *pids, int n)
+{
+	char path[64];
+	long pages = 0, size, rss;
+	int i;
+	for (i = 0; i < n; i++) {
+		if (pids[i] <= 0) continue;
+		sprintf(path, "/proc/%d/statm", pids[i]);
+		FILE *f = fopen(path, "r");
+		if (f == NULL) continue;
+		if (fscanf(f, "%ld %ld", &size, &rss) == 2) pages += rss;
+		fclose(f);
+	}
+	return pages * (double)sysconf(_SC_PAGESIZE) / (1 << 20);
+}
+
+static void stop_client(pid_t *pid)
+{
+	if (*pid <= 0) return;
+	kill(*pid, SIGKILL);
+	waitpid(*pid, NULL, 0);
+	*pid = 0;
+}
+
+static pid_t start_mid(const char *path)
+{
+	unsigned long long launched = mid_stats_now_ns();
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (freopen("/dev/null", "w", stdout) == NULL) _exit(1);
+		execl(path, path, (char *)NULL);
+		perror("[Error] in start_mid: execl");
+		_exit(1);
+	}
+
+	/* mid is up once it has reset the statistics page */
+	int ms;
+	for (ms = 0; ms < BENCH_TIMEOUT_MS; ms++) {
+		if (__atomic_load_n(&(st->magic), __ATOMIC_ACQUIRE) == MID_STATS_MAGIC &&
+			st->start_ns > launched)
+			return pid;
+		sleep_ms(1);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static void stop_mid()
+{
+	kill(mid_pid, SIGINT); // clean shutdown, the next mid starts fresh
+	waitpid(mid_pid, NULL, 0);
+}
+
+/* Wait until the heartbeats of groups [0, n) keep changing */
+static int wait_healthy(int n)
+{
+	int ms, g;
+	for (ms = 0; ms < BENCH_TIMEOUT_MS; ms++) {
+		for (g = 0; g < n; g++)
+			if (mid_stat_get(&(st->group[g].hb_stale_ms)) > FT_HB_MISS_LIMIT / 5) break;
+		if (g == n) return 0;
+		sleep_ms(1);
+	}
+	return -1;
+}
+
+/* Poll *c until it is past since, return the time it took from since in ms */
+static double wait_past(unsigned long long *c, unsigned long long since)
+{
+	unsigned long long deadline = since + BENCH_TIMEOUT_MS * 1000000ULL;
+	while (mid_stats_now_ns() < deadline) {
+		unsigned long long v = mid_stat_get(c);
+		if (v > since) return (v - since) / 1e6;
+		usleep(100);
+	}
+	return -1;
+}
+
+/* Wait until the replica of group g counted a frame */
+static double wait_ready(int g, unsigned long long since)
+{
+	unsigned long long deadline = since + BENCH_TIMEOUT_MS * 1000000ULL;
+	while (mid_stats_now_ns() < deadline) {
+		if (__atomic_load_n(&(hb->progress[g]), __ATOMIC_RELAXED) != 0)
+			return (mid_stats_now_ns() - since) / 1e6;
+		usleep(100);
+	}
+	return -1;
+}
+
+/* Wait for one of pids[0, n) to exit, mid kills the replica when the main
+ * comes back; *which is set to its index */
+static double wait_exit(pid_t *pids, int n, unsigned long long since, int *which)
+{
+	unsigned long long deadline = since + BENCH_TIMEOUT_MS * 1000000ULL;
+	int i;
+	while (mid_stats_now_ns() < deadline) {
+		for (i = 0; i < n; i++) {
+			if (pids[i] > 0 && waitpid(pids[i], NULL, WNOHANG) == pids[i]) {
+				pids[i] = 0;
+				*which = i;
+				return (mid_stats_now_ns() - since) / 1e6;
+			}
+		}
+		usleep(100);
+	}
+	return -1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(bench_lat_t *l, double p)
+{
+	if (l->n == 0) return 0;
+	int i = (int)(p / 100.0 * l->n);
+	return l->ms[i < l->n ? i : l->n - 1];
+}
+
+static void print_lat(FILE *out, const char *name, bench_lat_t *l, bool last)
+{
+	qsort(l->ms, l->n, sizeof(double), cmp_double);
+	fprintf(out, "\"%s\":{\"n\":%d,\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}%s",
+		name, l->n, percentile(l, 50), percentile(l, 90), percentile(l, 99),
+		l->n ? l->ms[l->n - 1] : 0, last ? "" : ",");
+}
+
+/* Arm the standby clients: a replica per group, or the spares */
+static void arm(int n, int spares)
+{
+	int i;
+	for (i = 0; i < (spares ? spares : n); i++)
+		if (replicas[i] <= 0) replicas[i] = spawn_client(spares ? "spare" : "replica", i);
+	sleep_ms(BENCH_SETTLE_MS);
+}
+
+/*
+ * Name: run_scale
+ * Function: One mid with n groups and a replica each, or spares for all of
+ *           them, kills burst mains at once k times
+ * Return: number of groups whose failover did not complete, -1 on setup error
+ */
+static int run_scale(const char *mid_path, int n, int k, int spares, int burst, FILE *out)
+{
+	int g, b, kill_i, failed = 0, n_standby = spares ? spares : n;
+	int hit[FT_HB_DATA_MAX_DATA], order[FT_HB_DATA_MAX_DATA];
+	bench_lat_t detect = {(double *)calloc(k * burst, sizeof(double)), 0};
+	bench_lat_t takeover = {(double *)calloc(k * burst, sizeof(double)), 0};
+	bench_lat_t ready = {(double *)calloc(k * burst, sizeof(double)), 0};
+	bench_lat_t reclaim = {(double *)calloc(k * burst, sizeof(double)), 0};
+	double standby_mb = 0;
+
+	if ((mid_pid = start_mid(mid_path)) < 0) {
+		fprintf(stderr, "mid did not start\n");
+		return -1;
+	}
+	for (g = 0; g < n; g++) mains[g] = spawn_client("main", g);
+	sleep_ms(BENCH_SETTLE_MS);
+	arm(n, spares);
+	if (wait_healthy(n) < 0) {
+		fprintf(stderr, "mains of %d groups did not start beating\n", n);
+		failed = -1;
+		goto done;
+	}
+	standby_mb = resident_mb(replicas, n_standby);
+
+	for (kill_i = 0; kill_i < k; kill_i++) {
+		sleep_ms(100 + rand() % 400);
+
+		/* burst distinct groups */
+		for (g = 0; g < n; g++) order[g] = g;
+		for (b = 0; b < burst; b++) {
+			int j = b + rand() % (n - b);
+			hit[b] = order[j];
+			order[j] = order[b];
+		}
+
+		/* Kill the mains, sleeping replicas or spares must take over */
+		for (b = 0; b < burst; b++) hb->progress[hit[b]] = 0;
+		unsigned long long killed = mid_stats_now_ns();
+		for (b = 0; b < burst; b++) stop_client(&mains[hit[b]]);
+		int taken = 0;
+		for (b = 0; b < burst; b++) {
+			g = hit[b];
+			double d = wait_past(&(st->group[g].last_detect_ns), killed);
+			double t = wait_past(&(st->group[g].last_takeover_ns), killed);
+			double r = t < 0 ? -1 : wait_ready(g, killed);
+			if (t >= 0) taken++;
+			if (d < 0 || t < 0 || r < 0) {
+				failed++;
+				if (!spares) stop_client(&replicas[g]);
+				continue;
+			}
+			detect.ms[detect.n++] = d;
+			takeover.ms[takeover.n++] = t;
+			ready.ms[ready.n++] = r;
+		}
+
+		/* Bring the mains back, mid must kill what took over */
+		unsigned long long restarted = mid_stats_now_ns();
+		for (b = 0; b < burst; b++) mains[hit[b]] = spawn_client("main", hit[b]);
+		for (b = 0; b < taken; b++) {
+			int which;
+			double r = wait_exit(replicas, n_standby, restarted, &which);
+			if (r < 0) {
+				failed++;
+				break;
+			}
+			reclaim.ms[reclaim.n++] = r;
+		}
+
+		/* Arm the groups again */
+		arm(n, spares);
+		wait_healthy(n);
+	}
+
+	fprintf(out, "{\"groups\":%d,\"spares\":%d,\"burst\":%d,\"kills\":%d,\"failed\":%d,"
+		"\"standby_mb\":%.1f,", n, spares, burst, k, failed, standby_mb);
+	print_lat(out, "detect_ms", &detect, false);
+	print_lat(out, "takeover_ms", &takeover, false);
+	print_lat(out, "ready_ms", &ready, false);
+	print_lat(out, "reclaim_ms", &reclaim, true);
+	fprintf(out, "}\n");
+	fflush(out);
+	fprintf(stderr, "groups %3d, %s: standby %.0f MB, detect p50 %.1f p99 %.1f, "
+		"takeover p50 %.1f p99 %.1f, ready p50 %.1f p99 %.1f, "
+		"reclaim p50 %.1f p99 %.1f ms, %d failed\n", n,
+		spares ? "spares" : "replicas", standby_mb,
+		percentile(&detect, 50), percentile(&detect, 99),
+		percentile(&takeover, 50), percentile(&takeover, 99),
+		percentile(&ready, 50), percentile(&ready, 99),
+		percentile(&reclaim, 50), percentile(&reclaim, 99), failed);
+
+done:
+	for (g = 0; g < n; g++) stop_client(&mains[g]);
+	for (g = 0; g < n_standby; g++) stop_client(&replicas[g]);
+	stop_mid();
+	free(detect.ms);
+	free(takeover.ms);
+	free(ready.ms);
+	free(reclaim.ms);
+	return failed;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mid_path = "./mid";
+	const char *out_path = NULL;
+	int max_groups = FT_HB_DATA_MAX_DATA, kills = 20, spares = 0, burst = 1, opt, fd;
+	unsigned int seed = getpid();
+	FILE *out = stdout;
+
+	while ((opt = getopt(argc, argv, "m:g:k:S:M:b:s:o:")) != -1) {
+		switch (opt) {
+		case 'm': mid_path = optarg; break;
+		case 'g': max_groups = atoi(optarg); break;
+		case 'k': kills = atoi(optarg); break;
+		case 'S': spares = atoi(optarg); break;
+		case 'M': model_b = (size_t)atoi(optarg) << 20; break;
+		case 'b': burst = atoi(optarg); break;
+		case 's': seed = atoi(optarg); break;
+		case 'o': out_path = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-m mid] [-g max_groups] [-k kills] [-S spares] "
+				"[-M model_mb] [-b burst] [-s seed] [-o out]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (max_groups < 1 || max_groups > FT_HB_DATA_MAX_DATA || kills < 1) {
+		fprintf(stderr, "groups must be 1..%d, kills at least 1\n", FT_HB_DATA_MAX_DATA);
+		return 1;
+	}
+	if (spares < 0 || spares > FT_HB_DATA_MAX_DATA || burst < 1) {
+		fprintf(stderr, "spares must be 0..%d, burst at least 1\n", FT_HB_DATA_MAX_DATA);
+		return 1;
+	}
+	if (out_path && (out = fopen(out_path, "w")) == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	if (init_mid_stats(&fd, &st, false) < 0) return 1;
+	if (init_ft_data_shard(&fd, &hb, false, 0) < 0) return 1;
+	close(fd);
+	srand(seed);
+	fprintf(stderr, "bench_failover: seed %u\n", seed);
+
+	/* 1, 2, 4, ... and the limit itself, with replicas and then spares */
+	int n, res = 0;
+	for (n = 1; ; n = n * 2 < max_groups ? n * 2 : max_groups) {
+		int b = burst < n ? burst : n;
+		int r = run_scale(mid_path, n, kills, 0, b, out);
+		if (r >= 0 && spares) {
+			int rs = run_scale(mid_path, n, kills, spares, b, out);
+			r = rs < 0 ? rs : r + rs;
+		}
+		if (r != 0) res = 1;
+		if (r < 0 || n == max_groups) break;
+	}
+
+	if (out != stdout) fclose(out);
+	return res;
+}
@@ -0,0 +1,177 @@
+/*
+ * bench_hugepages.c: TLB misses and first-frame latency of the shared regions
+ *
+ * For every MID_HUGEPAGES mode (off, thp, hugetlbfs) the parent creates the
+ * ft_results region like mid does, then a fresh client process publishes
+ * the first frame of every group (mapping the region on the way, so page
+ * faults land in this number) and then frames of random groups, counting
+ * its dTLB load misses with perf_event_open. Do not run it next to a live
+ * mid, it re-creates ft_results.
+ *
+ * Usage: bench_hugepages [-n frames] [-o out]
+ * Prints one JSON object per mode to out (default stdout), a summary to
+ * stderr. "huge" tells whether the client mapping got huge pages: thp needs
+ * shmem_enabled at advise or above, hugetlbfs reserved pages; otherwise the
+ * mode falls back and says so. dtlb_misses is -1 where perf is not allowed.
+ */
+#define _GNU_SOURCE
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include "../ft_utils_client.c"
+#include "../mid_stats.h"       // mid_stats_now_ns
+
+static const char *modes[] = {"off", "thp", "hugetlbfs"};
+
+/* Counter of dTLB load misses of this process in user space, -1 if none */
+static int open_dtlb_counter()
+{
+	struct perf_event_attr pe;
+	memset(&pe, 0, sizeof(pe));
+	pe.size = sizeof(pe);
+	pe.type = PERF_TYPE_HW_CACHE;
+	pe.config = PERF_COUNT_HW_CACHE_DTLB |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	pe.disabled = 1;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+/* Whether the mapping of ft_results in this process uses huge pages */
+static bool results_on_huge_pages()
+{
+	char line[512];
+	bool in_region = false, huge = false;
+	unsigned long kb, lo, hi;
+	FILE *f = fopen("/proc/self/smaps", "r");
+	if (f == NULL) return false;
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+			in_region = strstr(line, FT_RESULTS_NAME) != NULL;
+		} else if (in_region) {
+			if (sscanf(line, "KernelPageSize: %lu kB", &kb) == 1 && kb > 4) huge = true;
+			if (sscanf(line, "ShmemPmdMapped: %lu kB", &kb) == 1 && kb > 0) huge = true;
+		}
+	}
+	fclose(f);
+	return huge;
+}
+
+/*
+ * Name: run_client
+ * Function: The client side of one mode, in a fresh process
+ */
+static void run_client(const char *mode, int frames, FILE *out)
+{
+	static char buf[FT_RESULT_MAX_BYTES];
+	static unsigned long long frame[FT_HB_DATA_MAX_DATA];
+	int g, i;
+	memset(buf, 7, sizeof(buf));
+
+	/* First frame of every group, the region is mapped by the first publish */
+	unsigned long long t0 = mid_stats_now_ns();
+	for (g = 0; g < FT_HB_DATA_MAX_DATA; g++)
+		ft_publish_result(g, 0, frame[g]++, buf, sizeof(buf));
+	double first_us = (mid_stats_now_ns() - t0) / 1000.0;
+
+	/* Then frames of random groups */
+	int pfd = open_dtlb_counter();
+	long long misses = -1;
+	srand(1);
+	if (pfd >= 0) {
+		ioctl(pfd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(pfd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	t0 = mid_stats_now_ns();
+	for (i = 0; i < frames; i++) {
+		g = rand() % FT_HB_DATA_MAX_DATA;
+		ft_publish_result(g, 0, frame[g], buf, sizeof(buf));
+		ft_read_result(g, frame[g]++, buf, sizeof(buf));
+	}
+	double ns_per_frame = (double)(mid_stats_now_ns() - t0) / frames;
+	if (pfd >= 0) {
+		ioctl(pfd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(pfd, &misses, sizeof(misses)) != sizeof(misses)) misses = -1;
+		close(pfd);
+	}
+	bool huge = results_on_huge_pages();
+
+	fprintf(out, "{\"mode\":\"%s\",\"huge\":%s,\"region_bytes\":%zu,\"first_frame_us\":%.1f,"
+		"\"frames\":%d,\"ns_per_frame\":%.1f,\"dtlb_misses\":%lld,\"dtlb_misses_per_frame\":%.3f}\n",
+		mode, huge ? "true" : "false", FT_RESULTS_SIZE, first_us, frames, ns_per_frame,
+		misses, misses < 0 ? -1.0 : (double)misses / frames);
+	fflush(out);
+	fprintf(stderr, "%-9s: %s pages, first frame of %d groups %.1f us, %.1f ns/frame, %lld dTLB misses\n",
+		mode, huge ? "huge" : "4 KB", FT_HB_DATA_MAX_DATA, first_us, ns_per_frame, misses);
+}
+
+/*
+ * Name: run_mode
+ * Function: Create ft_results under mode like mid, then run a client on it
+ * Return: 0 on success, -1 on setup error
+ */
+static int run_mode(const char *mode, int frames, FILE *out)
+{
+	int fd;
+	ft_results_t *fr;
+	setenv("MID_HUGEPAGES", mode, 1);
+	unsigned long long t0 = mid_stats_now_ns();
+	if (init_ft_results(&fd, &fr, true) < 0) return -1;
+	close(fd);
+	fprintf(stderr, "%-9s: created and populated ft_results in %.1f us\n",
+		mode, (mid_stats_now_ns() - t0) / 1000.0);
+
+	fflush(out);
+	pid_t pid = fork();
+	if (pid == 0) {
+		run_client(mode, frames, out);
+		_exit(0);
+	}
+	int status;
+	waitpid(pid, &status, 0);
+	munmap(fr, FT_RESULTS_SIZE);
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	const char *out_path = NULL;
+	int frames = 1000000, opt;
+	FILE *out = stdout;
+
+	while ((opt = getopt(argc, argv, "n:o:")) != -1) {
+		switch (opt) {
+		case 'n': frames = atoi(optarg); break;
+		case 'o': out_path = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-n frames] [-o out]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (frames < 1) {
+		fprintf(stderr, "frames must be at least 1\n");
+		return 1;
+	}
+	if (out_path && (out = fopen(out_path, "w")) == NULL) {
+		perror("fopen");
+		return 1;
+	}
+
+	int res = 0;
+	unsigned int i;
+	for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++)
+		if (run_mode(modes[i], frames, out) < 0) res = 1;
+
+	// Leave no region behind for a mid started later
+	char path[256];
+	mid_shm_huge_path(path, sizeof(path), FT_RESULTS_NAME);
+	unlink(path);
+	shm_unlink(FT_RESULTS_NAME);
+
+	if (out != stdout) fclose(out);
+	return res;
+}
@@ -0,0 +1,81 @@
+# bench_py.py: per-call overhead of the ft extension module against ctypes
+#
+# Publishes and reads back results of one FT group through the ft module
+# (ft_py.c) and through libft.so with ctypes, for a small and a full size
+# result, and reports the time per publish + read pair. Both paths end in
+# the same ft_publish_result / ft_read_result, so the difference is the
+# call overhead. The group's result slots are overwritten, use a group no
+# running client uses.
+#
+# Usage: python3 bench_py.py [-l lib_dir] [-g group] [-n calls] [-o out]
+# Prints one JSON object per (api, size) to out (default stdout).
+
+import argparse
+import ctypes
+import json
+import os
+import sys
+import time
+from ctypes import c_int, c_ulonglong, c_size_t, c_void_p
+
+parser = argparse.ArgumentParser()
+parser.add_argument("-l", "--lib", default="lib", help="directory of libft.so and the ft module")
+parser.add_argument("-g", "--group", type=int, default=99)
+parser.add_argument("-n", "--calls", type=int, default=200000)
+parser.add_argument("-o", "--out", default=None)
+args = parser.parse_args()
+
+sys.path.insert(0, args.lib)
+import ft
+
+libft = ctypes.cdll.LoadLibrary(os.path.join(args.lib, "libft.so"))
+libft.ft_publish_result.restype = c_int
+libft.ft_publish_result.argtypes = [c_int, c_int, c_ulonglong, c_void_p, c_size_t]
+libft.ft_read_result.restype = c_int
+libft.ft_read_result.argtypes = [c_int, c_ulonglong, c_void_p, c_size_t]
+
+frame = 0
+
+
+def bench_ext(g, buf, out, n):
+	global frame
+	publish, read_result = ft.publish, ft.read_result
+	t0 = time.perf_counter_ns()
+	for _ in range(n):
+		publish(g, 0, frame, buf)
+		read_result(g, frame, out)
+		frame += 1
+	return (time.perf_counter_ns() - t0) / n
+
+
+def bench_ctypes(g, buf, out, n):
+	# from_buffer is how ctypes passes a python buffer without copying it
+	global frame
+	publish, read_result = libft.ft_publish_result, libft.ft_read_result
+	t0 = time.perf_counter_ns()
+	for _ in range(n):
+		src = (ctypes.c_char * len(buf)).from_buffer(buf)
+		dst = (ctypes.c_char * len(out)).from_buffer(out)
+		publish(g, 0, frame, ctypes.addressof(src), len(buf))
+		read_result(g, frame, ctypes.addressof(dst), len(out))
+		frame += 1
+	return (time.perf_counter_ns() - t0) / n
+
+
+if __name__ == "__main__":
+	out_file = open(args.out, "w") if args.out else sys.stdout
+	ft.set_result_policy(args.group, ft.FIRST_WRITER, 1)
+	for size in (64, ft.RESULT_MAX_BYTES):
+		buf = bytearray(os.urandom(size))
+		out = bytearray(size)
+		res = {}
+		for api, fn in (("ext", bench_ext), ("ctypes", bench_ctypes)):
+			fn(args.group, buf, out, 1000)  # warm up, maps the region
+			res[api] = fn(args.group, buf, out, args.calls)
+			assert out == buf
+			print(json.dumps({"api": api, "bytes": size, "calls": args.calls,
+				"ns_per_publish_read": round(res[api], 1)}), file=out_file)
+		print("%4d bytes: ext %.0f ns, ctypes %.0f ns per publish + read (%.1fx)" %
+			(size, res["ext"], res["ctypes"], res["ctypes"] / res["ext"]), file=sys.stderr)
+	if out_file is not sys.stdout:
+		out_file.close()
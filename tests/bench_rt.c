@@ -0,0 +1,224 @@
+/*
+ * bench_rt.c: false failovers of the FT manager under CPU stress
+ *
+ * Starts mid and N main/replica pairs that never fail, then saturates the
+ * CPUs with busy processes for a while. Every heartbeat miss mid declares
+ * in that time is a false one. The run is done twice, with mid and the
+ * clients as ordinary SCHED_OTHER threads and with the FT_RT_* settings of
+ * ft_lib.h (real-time class, optional pinning, locked shared regions), to
+ * show what they buy. Without CAP_SYS_NICE or an RLIMIT_RTPRIO the second
+ * run can't raise priorities; it is then reported with "rt_applied":false.
+ *
+ * Usage: bench_rt [-m mid] [-g groups] [-d secs] [-c hogs] [-r rt_spec] [-o out]
+ *        rt_spec is the FT_RT_<role> value for every role, default fifo:50
+ * Prints one JSON object per run to out (default stdout), a summary to stderr.
+ */
+#define _GNU_SOURCE
+#include <sys/wait.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <sched.h>
+#include "../ft_utils_client.c"
+#include "../mid_stats.h"
+
+#define BENCH_TIMEOUT_MS 2000   // mid and the mains must be up by then
+#define BENCH_SETTLE_MS 100     // lets ft_jobs_thread register new clients
+#define BENCH_MAX_HOGS 1024
+
+static const char *rt_roles[] = {"MID", "FT_JOBS", "HB", "CLIENT_HB"};
+
+static mid_stats_t *st;
+static pid_t mid_pid;
+static pid_t mains[FT_HB_DATA_MAX_DATA];
+static pid_t replicas[FT_HB_DATA_MAX_DATA];
+static pid_t hogs[BENCH_MAX_HOGS];
+
+static void sleep_ms(int ms)
+{
+	usleep(ms * 1000);
+}
+
+/* A FT client that only beats its heartbeat once triggered */
+static pid_t spawn_client(const char *type, int num)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (freopen("/dev/null", "w", stdout) == NULL) _exit(1);
+		if (freopen("/dev/null", "w", stderr) == NULL) _exit(1);
+		ft_init_wait(getpid(), gettid(), type, num);
+		while (1) pause();
+	}
+	return pid;
+}
+
+/* Ordinary busy process competing for the CPU */
+static pid_t spawn_hog()
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		volatile unsigned long long n = 0;
+		while (1) n++;
+	}
+	return pid;
+}
+
+static void stop_pid(pid_t *pid)
+{
+	if (*pid <= 0) return;
+	kill(*pid, SIGKILL);
+	waitpid(*pid, NULL, 0);
+	*pid = 0;
+}
+
+static pid_t start_mid(const char *path)
+{
+	unsigned long long launched = mid_stats_now_ns();
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (freopen("/dev/null", "w", stdout) == NULL) _exit(1);
+		execl(path, path, (char *)NULL);
+		perror("[Error] in start_mid: execl");
+		_exit(1);
+	}
+
+	/* mid is up once it has reset the statistics page */
+	int ms;
+	for (ms = 0; ms < BENCH_TIMEOUT_MS; ms++) {
+		if (__atomic_load_n(&(st->magic), __ATOMIC_ACQUIRE) == MID_STATS_MAGIC &&
+			st->start_ns > launched)
+			return pid;
+		sleep_ms(1);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	return -1;
+}
+
+static void stop_mid()
+{
+	kill(mid_pid, SIGINT); // clean shutdown, the next mid starts fresh
+	waitpid(mid_pid, NULL, 0);
+}
+
+/* Wait until the heartbeats of groups [0, n) keep changing */
+static int wait_healthy(int n)
+{
+	int ms, g;
+	for (ms = 0; ms < BENCH_TIMEOUT_MS; ms++) {
+		for (g = 0; g < n; g++)
+			if (mid_stat_get(&(st->group[g].hb_stale_ms)) > FT_HB_MISS_LIMIT / 5) break;
+		if (g == n) return 0;
+		sleep_ms(1);
+	}
+	return -1;
+}
+
+/* FT_RT_* for mid and the clients forked after this, or none of them */
+static void set_rt_env(const char *spec)
+{
+	char var[64];
+	unsigned int i;
+	for (i = 0; i < sizeof(rt_roles) / sizeof(rt_roles[0]); i++) {
+		snprintf(var, sizeof(var), "FT_RT_%s", rt_roles[i]);
+		if (spec) setenv(var, spec, 1);
+		else unsetenv(var);
+	}
+	if (spec) setenv("FT_RT_MLOCK", "1", 1);
+	else unsetenv("FT_RT_MLOCK");
+}
+
+/*
+ * Name: run_stress
+ * Function: One mid with n healthy groups under c hogs for secs seconds
+ * Return: 0 on success, -1 on setup error
+ */
+static int run_stress(const char *mid_path, const char *rt_spec, int n, int c, int secs, FILE *out)
+{
+	int g, i, res = 0;
+	set_rt_env(rt_spec);
+	if ((mid_pid = start_mid(mid_path)) < 0) {
+		fprintf(stderr, "mid did not start\n");
+		return -1;
+	}
+	for (g = 0; g < n; g++) mains[g] = spawn_client("main", g);
+	sleep_ms(BENCH_SETTLE_MS);
+	for (g = 0; g < n; g++) replicas[g] = spawn_client("replica", g);
+	sleep_ms(BENCH_SETTLE_MS);
+	if (wait_healthy(n) < 0) {
+		fprintf(stderr, "mains of %d groups did not start beating\n", n);
+		res = -1;
+		goto done;
+	}
+	// The server loop is mid's main thread, so the process shows its class
+	bool rt_applied = rt_spec && sched_getscheduler(mid_pid) != SCHED_OTHER;
+
+	unsigned long long miss0 = mid_stat_get(&(st->hb_misses));
+	unsigned long long fo0 = mid_stat_get(&(st->failovers));
+	for (i = 0; i < c; i++) hogs[i] = spawn_hog();
+	sleep_ms(secs * 1000);
+	unsigned long long misses = mid_stat_get(&(st->hb_misses)) - miss0;
+	unsigned long long failovers = mid_stat_get(&(st->failovers)) - fo0;
+	for (i = 0; i < c; i++) stop_pid(&hogs[i]);
+
+	fprintf(out, "{\"mode\":\"%s\",\"rt_spec\":\"%s\",\"rt_applied\":%s,\"groups\":%d,\"hogs\":%d,"
+		"\"secs\":%d,\"false_hb_misses\":%llu,\"false_failovers\":%llu,\"false_failovers_per_min\":%.2f}\n",
+		rt_spec ? "rt" : "default", rt_spec ? rt_spec : "", rt_applied ? "true" : "false",
+		n, c, secs, misses, failovers, failovers * 60.0 / secs);
+	fflush(out);
+	fprintf(stderr, "%-7s: %d groups, %d hogs, %d s: %llu false heartbeat misses, %llu false failovers%s\n",
+		rt_spec ? "rt" : "default", n, c, secs, misses, failovers,
+		rt_spec && !rt_applied ? " (real-time class not applied)" : "");
+
+done:
+	for (g = 0; g < n; g++) {
+		stop_pid(&mains[g]);
+		stop_pid(&replicas[g]);
+	}
+	stop_mid();
+	set_rt_env(NULL);
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mid_path = "./mid";
+	const char *out_path = NULL;
+	const char *rt_spec = "fifo:50";
+	int groups = 8, secs = 30, opt, fd;
+	int n_hogs = 2 * sysconf(_SC_NPROCESSORS_ONLN);
+	FILE *out = stdout;
+
+	while ((opt = getopt(argc, argv, "m:g:d:c:r:o:")) != -1) {
+		switch (opt) {
+		case 'm': mid_path = optarg; break;
+		case 'g': groups = atoi(optarg); break;
+		case 'd': secs = atoi(optarg); break;
+		case 'c': n_hogs = atoi(optarg); break;
+		case 'r': rt_spec = optarg; break;
+		case 'o': out_path = optarg; break;
+		default:
+			fprintf(stderr, "usage: %s [-m mid] [-g groups] [-d secs] [-c hogs] [-r rt_spec] [-o out]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	ft_rt_t rt;
+	if (groups < 1 || groups > FT_HB_DATA_MAX_DATA || secs < 1 ||
+		n_hogs < 0 || n_hogs > BENCH_MAX_HOGS || ft_rt_parse(rt_spec, &rt) < 0) {
+		fprintf(stderr, "groups must be 1..%d, secs at least 1, hogs 0..%d, rt_spec as FT_RT_*\n",
+			FT_HB_DATA_MAX_DATA, BENCH_MAX_HOGS);
+		return 1;
+	}
+	if (out_path && (out = fopen(out_path, "w")) == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	if (init_mid_stats(&fd, &st, false) < 0) return 1;
+
+	int res = 0;
+	if (run_stress(mid_path, NULL, groups, n_hogs, secs, out) < 0) res = 1;
+	if (run_stress(mid_path, rt_spec, groups, n_hogs, secs, out) < 0) res = 1;
+
+	if (out != stdout) fclose(out);
+	return res;
+}
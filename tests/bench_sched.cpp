@@ -0,0 +1,356 @@
+/*
+ * bench_sched.cpp: in-process load generator for the admission logic of mid
+ *
+ * Drives mid_sched.cpp directly, without shared memory or client processes,
+ * so results are reproducible for a given seed. Simulated clients loop
+ * tag_job_begin -> run -> tag_job_end -> think, with a configurable mix of
+ * slacktime_us, required_mem_b, shareable_flag and noslack_flag. Time is
+ * simulated in server periods (SLEEP_MICROSECONDS); only the CPU time spent
+ * in the scheduler calls is real.
+ *
+ * Reports admission latency, deadline miss rate (slack jobs admitted after
+ * their slacktime), GPU memory utilization and scheduler CPU per job, then
+ * microbenchmarks of the job lifecycle and of a blocked queue head.
+ *
+ * With -m, clients tag one of that many model names instead of their own,
+ * and -w sets a batching window (sched_set_batch) to admit jobs of the same
+ * model together. With -x every slack job declares SHED_DROP (mid_shed.h):
+ * jobs that can't meet their deadline any more are shed, not run late.
+ *
+ * Usage: bench_sched [-n jobs] [-c clients] [-f noslack_frac] [-S shareable_frac]
+ *        [-l slack_us_min:max] [-b mem_b_min:max] [-r run_us_min:max]
+ *        [-t think_us_min:max] [-s seed] [-P policy] [-m models] [-w window_us]
+ *        [-x] [-o out]
+ * Prints a summary to stderr and one JSON object to out (default stdout).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <getopt.h>
+#include <algorithm>	// std::sort
+#include <vector>		// std::vector
+#include "../mid_sched.cpp"
+
+#define BENCH_GPU_MEM_B (1ULL<<30)	// same as mid
+#define BENCH_MICRO_ITERS 2000
+
+/* No FT manager in this benchmark */
+bool ft_active_replica(pid_t pid, pid_t *main_pid)
+{
+	return false;
+}
+
+enum client_state {THINKING, QUEUED_JOB, RUNNING};
+
+typedef struct bench_client {
+	int state;
+	uint64_t next_us;		// THINKING: submit at, RUNNING: completes at
+	uint64_t submit_us;
+	int64_t slack_us;		// slacktime_us as submitted
+} bench_client_t;
+
+typedef struct bench_range {
+	uint64_t min, max;
+} bench_range_t;
+
+static std::vector<job_t> jobs;		// one outstanding job per client
+static std::vector<bench_client_t> clients;
+static std::vector<double> admit_lat_us;
+static uint64_t now_us = 0;
+static uint64_t seed_state;
+static bench_range_t run_us = {100, 2000}, think_us = {0, 1000};
+static unsigned long long admitted = 0, aborted = 0, missed = 0, slack_admitted = 0, batched = 0;
+static unsigned long long shed = 0;
+static int n_models = 0;	// 0: a job name per client
+
+/* xorshift64, reproducible across libcs */
+static uint64_t rnd()
+{
+	seed_state ^= seed_state << 13;
+	seed_state ^= seed_state >> 7;
+	seed_state ^= seed_state << 17;
+	return seed_state;
+}
+
+static uint64_t rnd_range(bench_range_t r)
+{
+	return r.max > r.min ? r.min + rnd() % (r.max - r.min + 1) : r.min;
+}
+
+static double rnd_frac()
+{
+	return (rnd() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int parse_range(const char *s, bench_range_t *r)
+{
+	unsigned long long a, b;
+	if (sscanf(s, "%llu:%llu", &a, &b) != 2 || a > b) return -1;
+	r->min = a;
+	r->max = b;
+	return 0;
+}
+
+static uint64_t cpu_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* sched_job_fn: a simulated job got the GPU */
+static void bench_admitted(job_t *j)
+{
+	bench_client_t *c = &clients[j - jobs.data()];
+	uint64_t waited = now_us - c->submit_us;
+	admit_lat_us.push_back(waited);
+	if (!j->noslack_flag) {
+		slack_admitted++;
+		if ((int64_t)waited > c->slack_us) missed++;
+	}
+	admitted++;
+	sched_batch_info_t b;
+	if (sched_batch_of(j, &b)) batched++;
+	c->state = RUNNING;
+	c->next_us = now_us + rnd_range(run_us);
+}
+
+/* sched_job_fn: a simulated job can never fit */
+static void bench_aborted(job_t *j)
+{
+	bench_client_t *c = &clients[j - jobs.data()];
+	aborted++;
+	c->state = THINKING;
+	c->next_us = now_us + rnd_range(think_us);
+}
+
+/* sched_stale_fn: with -x every stale job is dropped */
+static bool bench_stale(job_t *j, int64_t late_us)
+{
+	return true;
+}
+
+/* sched_job_fn: a stale job was dropped, the client goes on to its next frame */
+static void bench_shed(job_t *j)
+{
+	bench_client_t *c = &clients[j - jobs.data()];
+	shed++;
+	c->state = THINKING;
+	c->next_us = now_us + rnd_range(think_us);
+}
+
+static double percentile(std::vector<double> &v, double p)
+{
+	if (v.empty()) return 0;
+	size_t i = (size_t)(p / 100.0 * v.size());
+	return v[i < v.size() ? i : v.size() - 1];
+}
+
+/* Fill in the job the way tag_job_begin does */
+static void build_job(job_t *j, int id, bool noslack, bool shareable,
+	int64_t slack_us, uint64_t mem_b)
+{
+	memset(j, 0, sizeof(*j));
+	j->pid = 1000 + id;
+	j->tid = 1000 + id;
+	if (n_models > 0)
+		snprintf(j->job_name, sizeof(j->job_name), "model_%d", (int)(rnd() % n_models));
+	else
+		snprintf(j->job_name, sizeof(j->job_name), "bench_%d", id);
+	j->req_type = QUEUED;
+	j->slacktime_us = slack_us;
+	j->first_flag = noslack;
+	j->noslack_flag = noslack;
+	j->shareable_flag = shareable;
+	j->required_mem_b = mem_b;
+}
+
+/*
+ * Name: micro_lifecycle
+ * Function: ns of scheduler CPU per job for enqueue, admit and release of
+ *           batches of jobs that all fit
+ */
+static double micro_lifecycle(int batch)
+{
+	std::vector<job_t> mj(batch);
+	unsigned long long n = 0;
+	uint64_t ns = 0;
+	for (int it = 0; it < BENCH_MICRO_ITERS; it++) {
+		for (int i = 0; i < batch; i++)
+			build_job(&mj[i], i % 4, false, true, 0, 1 << 20);
+		uint64_t t0 = cpu_ns();
+		for (int i = 0; i < batch; i++) sched_enqueue(&mj[i]);
+		n += sched_run_pq([](job_t *j) {}, [](job_t *j) {});
+		for (int i = 0; i < batch; i++) sched_complete(&mj[i]);
+		ns += cpu_ns() - t0;
+	}
+	return n ? (double)ns / n : 0;
+}
+
+/*
+ * Name: micro_blocked
+ * Function: ns per sched_run_pq call while an exclusive job holds the GPU
+ *           and depth jobs of other pids wait behind it
+ */
+static double micro_blocked(int depth)
+{
+	std::vector<job_t> mj(depth + 1);
+	build_job(&mj[depth], depth, true, false, 0, 1 << 20);
+	bool wait = false;
+	sched_enqueue(&mj[depth]);
+	sched_run_fifo(&wait, [](job_t *j) {}, [](job_t *j) {});
+	for (int i = 0; i < depth; i++) {
+		build_job(&mj[i], i, false, true, 0, 1 << 20);
+		sched_enqueue(&mj[i]);
+	}
+
+	uint64_t t0 = cpu_ns();
+	for (int it = 0; it < BENCH_MICRO_ITERS; it++)
+		sched_run_pq([](job_t *j) {}, [](job_t *j) {});
+	uint64_t ns = cpu_ns() - t0;
+
+	// Let the queue drain so the next benchmark starts empty
+	sched_complete(&mj[depth]);
+	sched_run_pq([](job_t *j) {}, [](job_t *j) {});
+	for (int i = 0; i < depth; i++) sched_complete(&mj[i]);
+	return (double)ns / BENCH_MICRO_ITERS;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long long total = 100000;
+	int n_clients = 1000, opt;
+	double noslack_frac = 0.1, shareable_frac = 0.8;
+	bench_range_t slack_us = {0, 5000}, mem_b = {1 << 20, 128 << 20};
+	uint64_t seed = 1;
+	int64_t window_us = 0;
+	const char *out_path = NULL;
+	FILE *out = stdout;
+
+	while ((opt = getopt(argc, argv, "n:c:f:S:l:b:r:t:s:P:m:w:xo:")) != -1) {
+		int bad = 0;
+		switch (opt) {
+		case 'n': total = strtoull(optarg, NULL, 10); break;
+		case 'c': n_clients = atoi(optarg); break;
+		case 'f': noslack_frac = atof(optarg); break;
+		case 'S': shareable_frac = atof(optarg); break;
+		case 'l': bad = parse_range(optarg, &slack_us); break;
+		case 'b': bad = parse_range(optarg, &mem_b); break;
+		case 'r': bad = parse_range(optarg, &run_us); break;
+		case 't': bad = parse_range(optarg, &think_us); break;
+		case 's': seed = strtoull(optarg, NULL, 10); break;
+		case 'P': bad = set_sched_policy(optarg); break;
+		case 'm': n_models = atoi(optarg); break;
+		case 'w': window_us = atoll(optarg); break;
+		case 'x': sched_set_stale(bench_stale); break;
+		case 'o': out_path = optarg; break;
+		default: bad = -1;
+		}
+		if (bad) {
+			fprintf(stderr, "usage: %s [-n jobs] [-c clients] [-f noslack_frac] "
+				"[-S shareable_frac] [-l slack_us_min:max] [-b mem_b_min:max] "
+				"[-r run_us_min:max] [-t think_us_min:max] [-s seed] [-P policy] [-m models] "
+				"[-w window_us] [-x] [-o out]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (n_clients < 1 || total < 1) {
+		fprintf(stderr, "need at least one client and one job\n");
+		return 1;
+	}
+	if (out_path && (out = fopen(out_path, "w")) == NULL) {
+		perror("fopen");
+		return 1;
+	}
+	seed_state = seed ? seed : 1;
+
+	init_mid_sched(BENCH_GPU_MEM_B);
+	sched_set_batch(window_us);
+	jobs.resize(n_clients);
+	clients.resize(n_clients);
+	admit_lat_us.reserve(total);
+	for (int i = 0; i < n_clients; i++) {
+		clients[i].state = THINKING;
+		clients[i].next_us = rnd_range(think_us);
+	}
+
+	/* One iteration per server period, like the loop in mymid.cpp */
+	unsigned long long submitted = 0, periods = 0;
+	uint64_t sched_ns = 0;
+	double mem_used_sum = 0;
+	bool wait_for_complete = false;
+	while (admitted + aborted + shed < total) {
+		uint64_t ns = 0, t0;
+		sched_tick(now_us);
+		for (int i = 0; i < n_clients; i++) {
+			bench_client_t *c = &clients[i];
+			if (c->next_us > now_us || c->state == QUEUED_JOB) continue;
+			if (c->state == RUNNING) {
+				/* tag_job_end */
+				t0 = cpu_ns();
+				sched_complete(&jobs[i]);
+				ns += cpu_ns() - t0;
+				wait_for_complete = false;
+				c->state = THINKING;
+				c->next_us = now_us + rnd_range(think_us);
+			} else if (submitted < total) {
+				/* tag_job_begin */
+				bool noslack = rnd_frac() < noslack_frac;
+				c->slack_us = noslack ? 0 : rnd_range(slack_us);
+				build_job(&jobs[i], i, noslack, rnd_frac() < shareable_frac,
+					c->slack_us, rnd_range(mem_b));
+				t0 = cpu_ns();
+				sched_enqueue(&jobs[i]);
+				ns += cpu_ns() - t0;
+				c->state = QUEUED_JOB;
+				c->submit_us = now_us;
+				submitted++;
+			}
+		}
+
+		t0 = cpu_ns();
+		int n_late;
+		sched_shed(bench_shed, &n_late);
+		sched_run_fifo(&wait_for_complete, bench_admitted, bench_aborted);
+		sched_run_pq(bench_admitted, bench_aborted);
+		sched_ns += ns + cpu_ns() - t0;
+
+		mem_used_sum += (double)(max_gpu_memory_available - gpu_memory_available) /
+			max_gpu_memory_available;
+		periods++;
+		now_us += SLEEP_MICROSECONDS;
+	}
+
+	/* Drain what is still running */
+	for (int i = 0; i < n_clients; i++)
+		if (clients[i].state == RUNNING) sched_complete(&jobs[i]);
+
+	std::sort(admit_lat_us.begin(), admit_lat_us.end());
+	double miss_rate = slack_admitted ? (double)missed / slack_admitted : 0;
+	double util = periods ? mem_used_sum / periods : 0;
+	double ns_per_job = admitted ? (double)sched_ns / admitted : 0;
+	double jobs_per_s = now_us ? admitted * 1e6 / now_us : 0;
+	// Microbenchmarks measure the scheduler without batching or shedding
+	sched_set_batch(0);
+	sched_set_stale(NULL);
+	double life_ns = micro_lifecycle(64);
+	double blocked_ns = micro_blocked(1000);
+
+	fprintf(out, "{\"policy\":\"%s\",\"seed\":%llu,\"clients\":%d,\"jobs\":%llu,\"admitted\":%llu,"
+		"\"aborted\":%llu,\"shed\":%llu,\"batched\":%llu,\"sim_ms\":%.1f,\"jobs_per_s\":%.0f,\"admit_latency_us\":{\"p50\":%.0f,"
+		"\"p90\":%.0f,\"p99\":%.0f,\"max\":%.0f},\"deadline_miss_rate\":%.4f,"
+		"\"gpu_mem_util\":%.4f,\"sched_cpu_ns_per_job\":%.1f,"
+		"\"micro_lifecycle_ns_per_job\":%.1f,\"micro_blocked_ns_per_call\":%.1f}\n",
+		sched_policy_names[sched_policy], (unsigned long long)seed, n_clients, total, admitted, aborted, shed, batched, now_us / 1000.0, jobs_per_s,
+		percentile(admit_lat_us, 50), percentile(admit_lat_us, 90),
+		percentile(admit_lat_us, 99), admit_lat_us.empty() ? 0 : admit_lat_us.back(),
+		miss_rate, util, ns_per_job, life_ns, blocked_ns);
+	fprintf(stderr, "%llu jobs (%llu shed, %llu batched, %.0f/s), %d clients: admit p50 %.0f p99 %.0f us, %.2f%% deadlines "
+		"missed, gpu mem %.1f%%, %.0f ns sched cpu/job (lifecycle %.0f ns/job, "
+		"blocked head %.0f ns/call)\n", admitted, shed, batched, jobs_per_s, n_clients,
+		percentile(admit_lat_us, 50), percentile(admit_lat_us, 99), miss_rate * 100,
+		util * 100, ns_per_job, life_ns, blocked_ns);
+
+	if (out != stdout) fclose(out);
+	return 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * load_mid.c: end-to-end load generator for a running mid
+ *
+ * Forks -p client processes with -T threads each; every thread loops
+ * tag_job_begin -> run -> tag_job_end -> think for -n jobs with a random mix
+ * of slacktime_us, required_mem_b, shareable_flag and first_flag (noslack).
+ * Measures the time spent in tag_job_begin (admission latency) and counts
+ * slack jobs admitted after their slack (deadline misses). GPU memory
+ * utilization and the jobs mid admitted come from the mid_stats page; with
+ * -P <mid pid> the CPU time mid spent per admitted job is read from /proc.
+ *
+ * Usage: load_mid [-p procs] [-T threads] [-n jobs] [-f noslack_frac]
+ *        [-S shareable_frac] [-l slack_us_min:max] [-b mem_b_min:max]
+ *        [-r run_us_min:max] [-t think_us_min:max] [-s seed] [-P mid_pid]
+ * Prints a summary to stderr and one JSON object to stdout.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include "tag_gpu.h"			// tag_job_begin, tag_job_end
+#include "../mid_stats.h"
+
+typedef struct load_range {
+	unsigned long long min, max;
+} load_range_t;
+
+typedef struct load_result {
+	unsigned long long jobs;
+	unsigned long long aborted;
+	unsigned long long slack_jobs;
+	unsigned long long missed;
+	unsigned long long lat_sum_us;
+	unsigned long long lat_bucket[MID_HIST_BUCKETS];	// log2 us, as in mid_stats.h
+} load_result_t;
+
+static int n_jobs = 1000;
+static double noslack_frac = 0.1, shareable_frac = 0.8;
+static load_range_t slack_us = {0, 5000}, mem_b = {1 << 20, 128 << 20};
+static load_range_t run_us = {100, 2000}, think_us = {0, 1000};
+static load_result_t *results;		// one per thread, shared with the parent
+static unsigned int seed = 1;
+static int n_threads = 4;
+
+static unsigned long long rnd_range(unsigned int *s, load_range_t r)
+{
+	unsigned long long v = ((unsigned long long)rand_r(s) << 31) | rand_r(s);
+	return r.max > r.min ? r.min + v % (r.max - r.min + 1) : r.min;
+}
+
+static int parse_range(const char *s, load_range_t *r)
+{
+	if (sscanf(s, "%llu:%llu", &(r->min), &(r->max)) != 2 || r->min > r->max) return -1;
+	return 0;
+}
+
+static void *client_thread(void *arg)
+{
+	load_result_t *res = (load_result_t *)arg;
+	unsigned int s = seed * 7919 + (res - results);
+	pid_t pid = getpid();
+	pid_t tid = gettid();
+	char name[64];
+	int i;
+
+	snprintf(name, sizeof(name), "load_%d_%d", pid, tid);
+	for (i = 0; i < n_jobs; i++) {
+		bool noslack = rand_r(&s) < noslack_frac * RAND_MAX;
+		bool shareable = rand_r(&s) < shareable_frac * RAND_MAX;
+		int64_t slack = noslack ? 0 : rnd_range(&s, slack_us);
+
+		unsigned long long t0 = mid_stats_now_ns();
+		int r = tag_job_begin(pid, tid, name, slack, noslack, shareable, rnd_range(&s, mem_b));
+		unsigned long long waited_us = (mid_stats_now_ns() - t0) / 1000;
+		if (r < 0) {
+			res->aborted++;
+		} else {
+			res->jobs++;
+			res->lat_sum_us += waited_us;
+			res->lat_bucket[mid_hist_bucket(waited_us)]++;
+			if (!noslack) {
+				res->slack_jobs++;
+				if ((int64_t)waited_us > slack) res->missed++;
+			}
+			usleep(rnd_range(&s, run_us));
+			tag_job_end(pid, tid, name);
+		}
+		usleep(rnd_range(&s, think_us));
+	}
+	return NULL;
+}
+
+static void client_process(load_result_t *res)
+{
+	pthread_t th[n_threads];
+	int i;
+	if (freopen("/dev/null", "w", stdout) == NULL) _exit(1);
+	for (i = 0; i < n_threads; i++) pthread_create(&th[i], NULL, client_thread, &res[i]);
+	for (i = 0; i < n_threads; i++) pthread_join(th[i], NULL);
+	_exit(0);
+}
+
+/* utime + stime of pid in clock ticks, -1 if it can't be read */
+static long long proc_cpu_ticks(pid_t pid)
+{
+	char path[64];
+	unsigned long long ut, st;
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+	FILE *f = fopen(path, "r");
+	if (!f) return -1;
+	int n = fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &ut, &st);
+	fclose(f);
+	return n == 2 ? (long long)(ut + st) : -1;
+}
+
+int main(int argc, char **argv)
+{
+	int n_procs = 4, opt, i, fd;
+	pid_t mid_pid = 0;
+	mid_stats_t *st;
+
+	while ((opt = getopt(argc, argv, "p:T:n:f:S:l:b:r:t:s:P:")) != -1) {
+		int bad = 0;
+		switch (opt) {
+		case 'p': n_procs = atoi(optarg); break;
+		case 'T': n_threads = atoi(optarg); break;
+		case 'n': n_jobs = atoi(optarg); break;
+		case 'f': noslack_frac = atof(optarg); break;
+		case 'S': shareable_frac = atof(optarg); break;
+		case 'l': bad = parse_range(optarg, &slack_us); break;
+		case 'b': bad = parse_range(optarg, &mem_b); break;
+		case 'r': bad = parse_range(optarg, &run_us); break;
+		case 't': bad = parse_range(optarg, &think_us); break;
+		case 's': seed = atoi(optarg); break;
+		case 'P': mid_pid = atoi(optarg); break;
+		default: bad = -1;
+		}
+		if (bad) {
+			fprintf(stderr, "usage: %s [-p procs] [-T threads] [-n jobs] [-f noslack_frac] "
+				"[-S shareable_frac] [-l slack_us_min:max] [-b mem_b_min:max] "
+				"[-r run_us_min:max] [-t think_us_min:max] [-s seed] [-P mid_pid]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (n_procs < 1 || n_threads < 1 || n_jobs < 1) {
+		fprintf(stderr, "procs, threads and jobs must be at least 1\n");
+		return 1;
+	}
+	if (init_mid_stats(&fd, &st, false) < 0 ||
+		__atomic_load_n(&(st->magic), __ATOMIC_ACQUIRE) != MID_STATS_MAGIC) {
+		fprintf(stderr, "mid is not running\n");
+		return 1;
+	}
+
+	int n_res = n_procs * n_threads;
+	results = (load_result_t *)mmap(NULL, n_res * sizeof(load_result_t),
+		PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	memset(results, 0, n_res * sizeof(load_result_t));
+
+	/* Sample mid before and after, utilization from the per-period histogram */
+	unsigned long long adm0 = mid_stat_get(&(st->admitted));
+	unsigned long long util_n0 = mid_stat_get(&(st->gpu_util_pct.count));
+	unsigned long long util_s0 = mid_stat_get(&(st->gpu_util_pct.sum));
+	long long cpu0 = mid_pid ? proc_cpu_ticks(mid_pid) : -1;
+	unsigned long long t0 = mid_stats_now_ns();
+
+	for (i = 0; i < n_procs; i++) {
+		if (fork() == 0) client_process(&results[i * n_threads]);
+	}
+	while (wait(NULL) > 0)
+		;
+
+	double secs = (mid_stats_now_ns() - t0) / 1e9;
+	unsigned long long adm = mid_stat_get(&(st->admitted)) - adm0;
+	unsigned long long util_n = mid_stat_get(&(st->gpu_util_pct.count)) - util_n0;
+	unsigned long long util_s = mid_stat_get(&(st->gpu_util_pct.sum)) - util_s0;
+	long long cpu1 = mid_pid ? proc_cpu_ticks(mid_pid) : -1;
+	double mid_us_per_job = cpu0 >= 0 && cpu1 >= 0 && adm ?
+		(cpu1 - cpu0) * 1e6 / sysconf(_SC_CLK_TCK) / adm : -1;
+
+	/* Merge the threads' results */
+	load_result_t all;
+	mid_hist_t lat;
+	memset(&all, 0, sizeof(all));
+	memset(&lat, 0, sizeof(lat));
+	for (i = 0; i < n_res; i++) {
+		int b;
+		all.jobs += results[i].jobs;
+		all.aborted += results[i].aborted;
+		all.slack_jobs += results[i].slack_jobs;
+		all.missed += results[i].missed;
+		all.lat_sum_us += results[i].lat_sum_us;
+		for (b = 0; b < MID_HIST_BUCKETS; b++) lat.bucket[b] += results[i].lat_bucket[b];
+	}
+	double miss_rate = all.slack_jobs ? (double)all.missed / all.slack_jobs : 0;
+
+	printf("{\"procs\":%d,\"threads\":%d,\"jobs\":%llu,\"aborted\":%llu,\"secs\":%.2f,"
+		"\"jobs_per_sec\":%.1f,\"admit_latency_us\":{\"avg\":%llu,\"p50\":%llu,\"p99\":%llu},"
+		"\"deadline_miss_rate\":%.4f,\"gpu_mem_util\":%.4f,\"mid_cpu_us_per_job\":%.1f}\n",
+		n_procs, n_threads, all.jobs, all.aborted, secs, all.jobs / secs,
+		all.jobs ? all.lat_sum_us / all.jobs : 0,
+		mid_hist_percentile(&lat, 50), mid_hist_percentile(&lat, 99),
+		miss_rate, util_n ? util_s / 100.0 / util_n : 0, mid_us_per_job);
+	fprintf(stderr, "%llu jobs in %.1f s (%llu admitted by mid): admit p50<=%llu p99<=%llu us, "
+		"%.2f%% deadlines missed, gpu mem %.1f%%, mid cpu %.1f us/job\n",
+		all.jobs, secs, adm, mid_hist_percentile(&lat, 50), mid_hist_percentile(&lat, 99),
+		miss_rate * 100, util_n ? (double)util_s / util_n : 0, mid_us_per_job);
+	return 0;
+}
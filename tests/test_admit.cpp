@@ -0,0 +1,213 @@
+/*
+ * test_admit.cpp: admission control of declared periodic tasks
+ *
+ * Checks the schedulability tests of mid_admit.cpp on task sets with known
+ * answers, the degraded periods, that sched_tasks follows the admitted
+ * tasks, and a register/unregister round trip through the "mid_tasks"
+ * region with a server thread answering like the loop of mid, and that a
+ * restarted mid rebuilds the admitted set from that region.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "../mid_admit.cpp"
+#include "test_sched.h"
+
+static mid_tasks_t *tasks;
+static volatile bool serving = true;
+
+static void reset(const char *policy)
+{
+	init_mid_sched(1ULL << 30);
+	set_sched_policy(policy);
+	admit_set.clear();
+	admit_saved_tasks.clear();
+	sched_tasks.clear();
+}
+
+/* Declare a task in-process, returns the decision */
+static int declare(const char *name, int64_t period_us, int64_t wcet_us, int64_t deadline_us,
+	int priority, bool allow_degrade, int64_t *granted_us = NULL)
+{
+	mid_task_decl_t d;
+	memset(&d, 0, sizeof(d));
+	d.pid = 1;
+	strcpy(d.name, name);
+	d.period_us = period_us;
+	d.wcet_us = wcet_us;
+	d.deadline_us = deadline_us;
+	d.priority = priority;
+	d.allow_degrade = allow_degrade;
+	int res = admit_decide(&d, -1);
+	if (granted_us) *granted_us = d.granted_period_us;
+	return res;
+}
+
+static void test_edf()
+{
+	reset("edf");
+	CHECK(declare("a", 10000, 5000, 0, 0, false) == TASK_ADMITTED);
+	CHECK(declare("b", 20000, 10000, 0, 0, false) == TASK_ADMITTED);	// U = 1
+	CHECK(declare("c", 100000, 1, 0, 0, false) == TASK_REJECTED);
+
+	// Constrained deadlines count by density
+	reset("edf");
+	CHECK(declare("a", 10000, 3000, 5000, 0, false) == TASK_ADMITTED);	// 0.6
+	CHECK(declare("b", 10000, 3000, 0, 0, false) == TASK_ADMITTED);		// 0.3
+	CHECK(declare("c", 10000, 2000, 0, 0, false) == TASK_REJECTED);		// 0.2
+}
+
+static void test_rm()
+{
+	// U = 0.833 is above the Liu & Layland bound of 3 tasks, RTA still passes:
+	// R = 1, 3, 10 ms against periods 4, 6, 12 ms
+	reset("rm");
+	CHECK(declare("a", 4000, 1000, 0, 0, false) == TASK_ADMITTED);
+	CHECK(declare("b", 6000, 2000, 0, 0, false) == TASK_ADMITTED);
+	CHECK(declare("c", 12000, 3000, 0, 0, false) == TASK_ADMITTED);
+	// Lowest priority d still fits, R = 11 ms
+	CHECK(declare("d", 24000, 1000, 0, 0, false) == TASK_ADMITTED);
+	// U > 1
+	CHECK(declare("e", 5000, 1000, 0, 0, false) == TASK_REJECTED);
+
+	// Same set under fp, with c given the top priority c still fits but b
+	// doesn't: R(b) = 2 + 1 + 3 = 6, then 2 + 2 + 3 = 7 > 6
+	reset("fp");
+	CHECK(declare("c", 12000, 3000, 0, 10, false) == TASK_ADMITTED);
+	CHECK(declare("a", 4000, 1000, 0, 5, false) == TASK_ADMITTED);
+	CHECK(declare("b", 6000, 2000, 0, 1, false) == TASK_REJECTED);
+}
+
+static void test_degrade()
+{
+	int64_t granted = 0;
+	reset("slack");
+	CHECK(declare("a", 10000, 6000, 0, 0, false) == TASK_ADMITTED);
+	CHECK(declare("b", 10000, 6000, 0, 0, false) == TASK_REJECTED);
+	// 0.6 + 6/T <= 1 needs T >= 15 ms
+	CHECK(declare("b", 10000, 6000, 0, 0, true, &granted) == TASK_DEGRADED);
+	CHECK(granted >= 15000 && granted <= 15000 + 10000 / 64);
+	// Nothing is left, not even at ADMIT_DEGRADE_MAX times the period
+	CHECK(declare("c", 10000, 6000, 0, 0, true) == TASK_REJECTED);
+
+	// Bad parameters
+	CHECK(declare("d", 0, 1000, 0, 0, true) == TASK_REJECTED);
+	CHECK(declare("d", 10000, 2000, 1000, 0, true) == TASK_REJECTED);
+}
+
+static void test_sched_tasks()
+{
+	reset("rm");
+	sched_task_t file_task = {3, 50000, 0, 0, 4};
+	sched_tasks["a"] = file_task;
+	CHECK(declare("a", 10000, 1000, 0, 7, false) == TASK_ADMITTED);
+	CHECK(declare("b", 20000, 1000, 0, 0, false) == TASK_ADMITTED);
+	CHECK(sched_tasks["a"].period_us == 10000 && sched_tasks["a"].weight == 4);
+	CHECK(sched_tasks["b"].period_us == 20000 && sched_tasks["b"].weight == 1);
+
+	// Dropping the tasks restores the entries they replaced
+	admit_drop_pid(NULL, 1);
+	CHECK(admit_set.empty());
+	CHECK(sched_tasks["a"].period_us == 50000 && sched_tasks["a"].priority == 3);
+	CHECK(sched_tasks.find("b") == sched_tasks.end());
+}
+
+void *server_thread(void *arg)
+{
+	while (serving) {
+		std::vector<pid_t> pids;
+		admit_process(tasks, &pids);
+		usleep(SLEEP_MICROSECONDS);
+	}
+	return NULL;
+}
+
+static void test_register()
+{
+	int fd;
+	pthread_t server;
+	int64_t granted = 0;
+	reset("edf");
+	CHECK(init_mid_tasks(&fd, &tasks, true) == 0);
+	pthread_create(&server, NULL, server_thread, NULL);
+
+	int a = mid_task_register("a", 10000, 5000, 0, 0, false, &granted);
+	CHECK(a >= 0 && granted == 10000);
+	CHECK(mid_task_register("b", 10000, 6000, 0, 0, false, NULL) < 0);
+	int b = mid_task_register("b", 10000, 6000, 0, 0, true, &granted);
+	CHECK(b >= 0 && granted >= 12000);
+
+	// Once a leaves, b's declared period fits again
+	mid_task_unregister(a);
+	mid_task_unregister(b);
+	usleep(4 * SLEEP_MICROSECONDS);
+	int c = mid_task_register("c", 10000, 6000, 0, 0, false, &granted);
+	CHECK(c >= 0 && granted == 10000);
+	mid_task_unregister(c);
+
+	serving = false;
+	pthread_join(server, NULL);
+	munmap(tasks, MID_TASKS_SIZE);
+	close(fd);
+	shm_unlink(MID_TASKS_NAME);
+}
+
+static void test_recover()
+{
+	int fd;
+	pthread_t server;
+	int64_t granted = 0;
+	reset("edf");
+	CHECK(init_mid_tasks(&fd, &tasks, true) == 0);
+	// The client's mapping of test_register's region, now unlinked
+	munmap(client_tasks, MID_TASKS_SIZE);
+	client_tasks = NULL;
+	serving = true;
+	pthread_create(&server, NULL, server_thread, NULL);
+	int a = mid_task_register("a", 10000, 5000, 0, 0, false, NULL);
+	int b = mid_task_register("b", 10000, 4000, 0, 0, true, &granted);
+	CHECK(a >= 0 && b >= 0 && granted == 10000);
+	int c = mid_task_register("c", 10000, 2000, 0, 0, true, &granted);
+	CHECK(c >= 0 && granted > 10000);
+	serving = false;
+	pthread_join(server, NULL);
+	munmap(tasks, MID_TASKS_SIZE);
+	close(fd);
+
+	// mid restarts: the region survives, the tasks still count
+	reset("edf");
+	CHECK(init_mid_tasks(&fd, &tasks, false) == 0);
+	std::vector<pid_t> pids;
+	admit_recover(tasks, &pids);
+	CHECK(admit_set.size() == 3 && pids.size() == 3 && pids[0] == getpid());
+	CHECK(sched_tasks["c"].period_us == granted);
+	CHECK(sched_tasks["c"].deadline_us == granted);
+	CHECK(declare("d", 10000, 1000, 0, 0, false) == TASK_REJECTED);
+
+	// And a task leaving after the restart frees its share
+	mid_task_unregister(a);
+	admit_process(tasks, &pids);
+	CHECK(admit_set.size() == 2);
+	CHECK(declare("d", 10000, 1000, 0, 0, false) == TASK_ADMITTED);
+	mid_task_unregister(b);
+	mid_task_unregister(c);
+	munmap(tasks, MID_TASKS_SIZE);
+	close(fd);
+	shm_unlink(MID_TASKS_NAME);
+}
+
+int main(int argc, char **argv)
+{
+	test_edf();
+	test_rm();
+	test_degrade();
+	test_sched_tasks();
+	test_register();
+	test_recover();
+	if (failures) {
+		fprintf(stderr, "FAIL: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
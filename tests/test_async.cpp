@@ -0,0 +1,159 @@
+/*
+ * test_async.cpp: many FT job requests in flight on one reactor thread
+ *
+ * One ft_session submits TEST_REQUESTS main requests (futures, callbacks
+ * and C++20 coroutines), while a thread of the test plays the FT manager:
+ * it drains the ft-jobs list like ft_drain_jobs, then wakes the jobs in
+ * reverse order (aborting every tenth) and rings the doorbell like mid.
+ * Every request must complete once, with the manager's decision, on the
+ * session's one reactor thread. It re-creates ft_jobs and mid_bell, do not
+ * run it next to a live mid.
+ */
+#include <stdio.h>
+#include <chrono>
+#include <set>
+#include "../ft_async.cpp"
+
+#define TEST_REQUESTS 600
+#define TEST_TIMEOUT_S 10
+
+static int failures = 0;
+static FILE *out;       // the client API is chatty, results go here
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(out, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+static mid_bell_t *bell;
+static ft_jobs_t *fj;
+static std::atomic<int> done_ok(0), done_abort(0), done_co(0);
+static std::mutex threads_lock;
+static std::set<std::thread::id> cb_threads;
+
+/* take_ft_jobs callback of the manager thread */
+static void take_name(const char *name, void *batch)
+{
+	((std::vector<std::string> *)batch)->push_back(name);
+}
+
+/* The FT manager: collect every request, then wake them all */
+static void manager()
+{
+	std::vector<std::string> names;
+	auto t0 = std::chrono::steady_clock::now();
+	while (names.size() < TEST_REQUESTS &&
+		std::chrono::steady_clock::now() - t0 < std::chrono::seconds(TEST_TIMEOUT_S)) {
+		pthread_mutex_lock(&(fj->requests_q_lock));
+		(void) take_ft_jobs(fj, take_name, &names);
+		pthread_mutex_unlock(&(fj->requests_q_lock));
+		usleep(1000);
+	}
+
+	for (size_t i = names.size(); i-- > 0;) {
+		int fd = shm_init(names[i].c_str(), sizeof(ft_job_t));
+		ft_job_t *j = (ft_job_t *)mmap(NULL, sizeof(ft_job_t), PROT_READ|PROT_WRITE,
+			MAP_SHARED, fd, 0);
+		close(fd);
+		shm_unlink(names[i].c_str());
+		if (j == MAP_FAILED) continue;
+		j->client_exec_allowed = (i % 10 != 0);
+		sem_post(&(j->client_wake));
+		mid_bell_ring(bell, j->pid);
+		munmap(j, sizeof(ft_job_t));
+	}
+}
+
+static void note_done(int res)
+{
+	if (res == 0) done_ok++;
+	else done_abort++;
+	std::lock_guard<std::mutex> g(threads_lock);
+	cb_threads.insert(std::this_thread::get_id());
+}
+
+#if defined(__cpp_impl_coroutine)
+/* Fire-and-forget coroutine type */
+struct test_task {
+	struct promise_type {
+		test_task get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+static test_task await_grant(ft_session *s, int num)
+{
+	int res = co_await s->begin_co("main", num);
+	note_done(res);
+	done_co++;
+}
+#endif
+
+int main()
+{
+	int fd, i;
+	if ((out = fdopen(dup(STDOUT_FILENO), "w")) == NULL) return 1;
+	setvbuf(out, NULL, _IONBF, 0);
+	if (freopen("/dev/null", "w", stdout) == NULL) return 1;
+	if (freopen("/dev/null", "w", stderr) == NULL) return 1;
+	if (init_ft_jobs(&fd, &fj, true) < 0) return 1;
+	close(fd);
+	if (init_mid_bell(&fd, &bell, true) < 0) return 1;
+	close(fd);
+
+	ft_session s;
+	std::vector<std::future<int>> futures;
+	int n_co = 0;
+	for (i = 0; i < TEST_REQUESTS; i++) {
+		int num = i % FT_HB_DATA_MAX_DATA;
+		if (i % 3 == 0) {
+			futures.push_back(s.begin_future("main", num));
+		} else if (i % 3 == 1) {
+			CHECK(s.begin("main", num, FT_PASSIVE, note_done) == 0);
+		} else {
+#if defined(__cpp_impl_coroutine)
+			await_grant(&s, num);
+			n_co++;
+#else
+			CHECK(s.begin("main", num, FT_PASSIVE, note_done) == 0);
+#endif
+		}
+	}
+	CHECK(s.pending() == TEST_REQUESTS);
+
+	std::thread m(manager);
+	for (auto &f : futures) {
+		CHECK(f.wait_for(std::chrono::seconds(TEST_TIMEOUT_S)) == std::future_status::ready);
+		note_done(f.get());
+	}
+	m.join();
+	for (i = 0; i < TEST_TIMEOUT_S * 1000 && s.pending() > 0; i++) usleep(1000);
+
+	CHECK(s.pending() == 0);
+	CHECK(done_ok + done_abort == TEST_REQUESTS);
+	CHECK(done_abort == TEST_REQUESTS / 10);
+	CHECK(done_co == n_co);
+	// The main thread collected the futures, everything else ran on the reactor
+	cb_threads.erase(std::this_thread::get_id());
+	CHECK(cb_threads.size() == 1);
+
+	char name[JOB_MEM_NAME_MAX_LEN + 16];
+	for (i = 1; i <= fj->n_segs; i++) {
+		sprintf(name, "%s_seg%d", FT_JOBS_NAME, i);
+		shm_unlink(name);
+	}
+	shm_unlink(FT_JOBS_NAME);
+	shm_unlink(MID_BELL_NAME);
+	if (failures) {
+		fprintf(out, "FAIL: %d checks failed (%d granted, %d aborted)\n",
+			failures, done_ok.load(), done_abort.load());
+		return 1;
+	}
+	fprintf(out, "PASS: %d requests (%d coroutines) on one reactor thread\n", TEST_REQUESTS, n_co);
+	return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * test_batch.cpp: jobs of the same model admitted together
+ *
+ * Drives mid_sched.cpp in-process with a batching window: jobs of one name
+ * from several pids must be admitted as one batch sharing one memory
+ * reservation, which is released with the last member, while a job due
+ * too soon to wait for peers runs right away. Then posts a batch through
+ * the "mid_batch" region and looks it up as a client does, and restores a
+ * batch from mid_state as a restarted mid does, keeping the posted batches
+ * of live clients only. It re-creates mid_batch
+ * and mid_state, do not run it next to a live mid.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include "../mid_sched.cpp"
+#include "../mid_batch.h"
+#include "test_sched.h"
+
+#define TEST_GPU_MEM_B (1ULL << 30)
+#define TEST_MODEL_MEM_B (400ULL << 20)
+#define TEST_WINDOW_US (4 * SLEEP_MICROSECONDS)
+
+static void test_batch()
+{
+	init_mid_sched(TEST_GPU_MEM_B);
+	set_sched_policy("edf");
+	sched_set_batch(TEST_WINDOW_US);
+	admitted.clear();
+	int64_t now = 1000000;
+	sched_tick(now);
+
+	// Three processes run the same model, only two fit one by one
+	job_t a = make_job(1, "detect", 100000, TEST_MODEL_MEM_B);
+	job_t b = make_job(2, "detect", 90000, TEST_MODEL_MEM_B);
+	sched_enqueue(&a);
+	sched_enqueue(&b);
+	// The head waits for peers within the window
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 0);
+	sched_tick(now += SLEEP_MICROSECONDS);
+	job_t c = make_job(3, "detect", 95000, TEST_MODEL_MEM_B);
+	job_t other = make_job(4, "plan", 200000, TEST_MODEL_MEM_B);
+	sched_enqueue(&c);
+	sched_enqueue(&other);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 0);
+
+	// Window over: b leads, a and c join it in deadline order
+	sched_tick(now += TEST_WINDOW_US);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 4);
+	CHECK(executing_jobs.size() == 4);
+	CHECK(gpu_memory_available == TEST_GPU_MEM_B - 2 * TEST_MODEL_MEM_B);
+
+	sched_batch_info_t ib, ic, ia, io;
+	CHECK(sched_batch_of(&b, &ib) && ib.rank == 0 && ib.size == 3);
+	CHECK(sched_batch_of(&c, &ic) && ic.rank == 1 && ic.id == ib.id);
+	CHECK(sched_batch_of(&a, &ia) && ia.rank == 2 && ia.id == ib.id);
+	CHECK(!sched_batch_of(&other, &io));
+
+	// The reservation goes with the last member
+	CHECK(complete(&b) == &b);
+	CHECK(complete(&a) == &a);
+	CHECK(gpu_memory_available == TEST_GPU_MEM_B - 2 * TEST_MODEL_MEM_B);
+	CHECK(!sched_batch_of(&a, &ia));
+	CHECK(complete(&c) == &c);
+	CHECK(gpu_memory_available == TEST_GPU_MEM_B - TEST_MODEL_MEM_B);
+	CHECK(complete(&other) == &other);
+	CHECK(gpu_memory_available == TEST_GPU_MEM_B);
+	CHECK(sched_batches.empty());
+
+	// A job due soon doesn't wait for peers
+	job_t urgent = make_job(5, "detect", TEST_WINDOW_US, TEST_MODEL_MEM_B);
+	sched_enqueue(&urgent);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 1);
+	CHECK(!sched_batch_of(&urgent, &io));
+	CHECK(complete(&urgent) == &urgent);
+
+	// Without a window every job runs alone
+	sched_set_batch(0);
+	job_t d = make_job(6, "detect", 100000, TEST_MODEL_MEM_B);
+	job_t e = make_job(7, "detect", 100000, TEST_MODEL_MEM_B);
+	sched_enqueue(&d);
+	sched_enqueue(&e);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 2);
+	CHECK(gpu_memory_available == TEST_GPU_MEM_B - 2 * TEST_MODEL_MEM_B);
+	CHECK(!sched_batch_of(&d, &io) && !sched_batch_of(&e, &io));
+}
+
+/* A batch recorded in mid_state shares one reservation after a restart */
+static void test_recover()
+{
+	shm_unlink(MID_STATE_NAME);
+	if (attach_mid_state() < 0) {
+		CHECK(false);
+		return;
+	}
+	init_mid_sched(TEST_GPU_MEM_B);
+	set_sched_policy("edf");
+	sched_set_batch(TEST_WINDOW_US);
+	int64_t now = 1000000;
+	sched_tick(now);
+
+	job_t a = make_job(1, "detect", 100000, TEST_MODEL_MEM_B);
+	job_t b = make_job(2, "detect", 100000, TEST_MODEL_MEM_B);
+	job_t c = make_job(3, "detect", 100000, TEST_MODEL_MEM_B);
+	job_t *jobs[] = {&a, &b, &c};
+	const char *names[] = {"test_batch_a", "test_batch_b", "test_batch_c"};
+	for (int i = 0; i < 3; i++) {
+		CHECK(mid_state_record_job(jobs[i], names[i], MID_Q_PQ) == 0);
+		sched_enqueue(jobs[i]);
+	}
+	sched_tick(now += TEST_WINDOW_US);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 3);
+	CHECK(gpu_memory_available == TEST_GPU_MEM_B - TEST_MODEL_MEM_B);
+
+	// Every member records the batch and its one reservation
+	mid_state_job_t recorded[3];
+	for (int i = 0; i < 3; i++) recorded[i] = MS->job[mid_state_slot[jobs[i]]];
+	for (int i = 0; i < 3; i++) {
+		CHECK(recorded[i].queue == MID_Q_EXEC);
+		CHECK(recorded[i].batch != 0 && recorded[i].batch == recorded[0].batch);
+		CHECK(recorded[i].batch_mem_b == TEST_MODEL_MEM_B);
+	}
+
+	// A restarted mid puts them back in any order, three of them would not
+	// fit on the GPU one by one
+	init_mid_sched(TEST_GPU_MEM_B);
+	for (int i : {2, 0, 1}) {
+		mid_state_job_t *sj = &(recorded[i]);
+		sched_restore_exec(jobs[i], sj->admit_pid, sj->ft_dup, sj->batch, sj->batch_mem_b);
+	}
+	CHECK(executing_jobs.size() == 3);
+	CHECK(gpu_memory_available == TEST_GPU_MEM_B - TEST_MODEL_MEM_B);
+	sched_batch_info_t info;
+	CHECK(sched_batch_of(&b, &info) && info.id == recorded[0].batch && info.size == 3);
+	CHECK(sched_batch_seq >= recorded[0].batch);
+
+	CHECK(complete(&a) == &a);
+	CHECK(complete(&c) == &c);
+	CHECK(gpu_memory_available == TEST_GPU_MEM_B - TEST_MODEL_MEM_B);
+	CHECK(complete(&b) == &b);
+	CHECK(gpu_memory_available == TEST_GPU_MEM_B);
+	CHECK(sched_batches.empty());
+
+	munmap(MS, MID_STATE_SIZE);
+	close(MS_fd);
+	MS = NULL;
+	shm_unlink(MID_STATE_NAME);
+}
+
+static void test_region()
+{
+	int fd, size, rank;
+	unsigned long long batch;
+	mid_batch_t *b;
+	if (init_mid_batch(&fd, &b, true) < 0) {
+		CHECK(false);
+		return;
+	}
+	close(fd);
+
+	CHECK(tag_job_batch(10, 11, "detect", &batch, &size, &rank) == 0);
+	CHECK(mid_batch_post(b, 10, 11, "detect", 7, 3, 2) == 0);
+	CHECK(mid_batch_post(b, 12, 12, "detect", 7, 3, 0) == 0);
+	CHECK(tag_job_batch(10, 11, "detect", &batch, &size, &rank) == 1);
+	CHECK(batch == 7 && size == 3 && rank == 2);
+	CHECK(tag_job_batch(10, 11, "plan", NULL, NULL, NULL) == 0);
+
+	mid_batch_clear(b, 10, 11, "detect");
+	CHECK(tag_job_batch(10, 11, "detect", NULL, NULL, NULL) == 0);
+	mid_batch_clear_pid(b, 12);
+	CHECK(tag_job_batch(12, 12, "detect", NULL, NULL, NULL) == 0);
+
+	// A restarted mid keeps the batches of live clients, not of dead ones
+	pid_t dead = fork();
+	if (dead == 0) _exit(0);
+	waitpid(dead, NULL, 0);
+	CHECK(mid_batch_post(b, getpid(), getpid(), "detect", 8, 2, 0) == 0);
+	CHECK(mid_batch_post(b, dead, dead, "detect", 8, 2, 1) == 0);
+	munmap(b, MID_BATCH_SIZE);
+	if (init_mid_batch(&fd, &b, false) < 0) {
+		CHECK(false);
+		return;
+	}
+	close(fd);
+	CHECK(mid_batch_clear_dead(b) == 1);
+	CHECK(tag_job_batch(getpid(), getpid(), "detect", &batch, NULL, &rank) == 1);
+	CHECK(batch == 8 && rank == 0);
+	CHECK(tag_job_batch(dead, dead, "detect", NULL, NULL, NULL) == 0);
+
+	munmap(b, MID_BATCH_SIZE);
+	shm_unlink(MID_BATCH_NAME);
+}
+
+int main()
+{
+	test_batch();
+	test_recover();
+	test_region();
+
+	if (failures) {
+		fprintf(stderr, "FAIL: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("PASS: batches share one reservation, also after a restart, urgent jobs don't wait\n");
+	return 0;
+}
@@ -0,0 +1,236 @@
+/*
+ * test_dag.cpp: frame pipelines declared as stage graphs
+ *
+ * Declares capture -> {detect, track} -> plan through the "mid_dag"
+ * region and drives mid_dag.cpp in-process: every stage job must get the
+ * deadline of its frame minus the WCETs after it on the critical path as
+ * its slack, and be held until the stages before it in the same frame
+ * completed. A restarted mid must go on with a pipeline at the frame it
+ * was at. Then checks that leaving, a dead client and bad declarations
+ * free the slot. It re-creates mid_dag, do not run it next to a live mid.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "../mid_dag.cpp"
+#include "test_sched.h"
+
+enum {CAPTURE, DETECT, TRACK, PLAN, N_STAGES};
+static const char *stage_names[N_STAGES] = {"capture", "detect", "track", "plan"};
+static const int64_t stage_wcet_us[N_STAGES] = {2000, 5000, 3000, 1000};
+// Latest finish of each stage, relative to the frame deadline
+static const int64_t stage_lft_us[N_STAGES] = {-6000, -1000, -1000, 0};
+
+static int declare_pipeline()
+{
+	mid_dag_stage_t st[N_STAGES];
+	memset(st, 0, sizeof(st));
+	for (int s = 0; s < N_STAGES; s++) {
+		strcpy(st[s].name, stage_names[s]);
+		st[s].wcet_us = stage_wcet_us[s];
+	}
+	st[DETECT].preds = 1u << CAPTURE;
+	st[TRACK].preds = 1u << CAPTURE;
+	st[PLAN].preds = 1u << DETECT | 1u << TRACK;
+	return mid_dag_declare(st, N_STAGES);
+}
+
+static bool released_only(std::vector<job_t*> &released, job_t *j)
+{
+	bool ok = released.size() == 1 && released[0] == j;
+	released.clear();
+	return ok;
+}
+
+static void test_pipeline(mid_dag_region_t *r)
+{
+	std::vector<job_t*> released;
+	std::vector<pid_t> pids;
+	pid_t pid = getpid();
+
+	int slot = declare_pipeline();
+	CHECK(slot >= 0);
+	dag_process(r, &released, &pids);
+	CHECK(pids.size() == 1 && pids[0] == pid);
+	CHECK(released.empty());
+
+	// Frames 0 and 1 are due 100 ms and 133 ms from now
+	CHECK(mid_dag_frame(slot, 100000) == 0);
+	CHECK(mid_dag_frame(slot, 133000) == 1);
+	sched_tick(mid_stats_now_ns() / 1000);
+	const int64_t *deadline = r->dag[slot].deadline_us;
+
+	job_t cap0 = make_job(pid, "capture", 1), det0 = make_job(pid, "detect", 1);
+	job_t trk0 = make_job(pid, "track", 1), plan0 = make_job(pid, "plan", 1);
+	job_t cap1 = make_job(pid, "capture", 1), det1 = make_job(pid, "detect", 1);
+	job_t cap2 = make_job(pid, "capture", 1), other = make_job(pid, "other", 7);
+
+	// A stage thread may tag before the stage it waits for
+	CHECK(dag_submit(r, &det0));
+	CHECK(!dag_submit(r, &cap0));
+	CHECK(cap0.slacktime_us == deadline[0] + stage_lft_us[CAPTURE] - sched_now_us);
+	CHECK(det0.slacktime_us == deadline[0] + stage_lft_us[DETECT] - sched_now_us);
+	CHECK(!dag_submit(r, &cap1));
+	CHECK(cap1.slacktime_us == deadline[1] + stage_lft_us[CAPTURE] - sched_now_us);
+	CHECK(dag_submit(r, &det1));
+	// Frame 2 is not published yet, the client's slack stays
+	CHECK(!dag_submit(r, &cap2));
+	CHECK(cap2.slacktime_us == 1);
+	// Not a stage, untouched
+	CHECK(!dag_submit(r, &other));
+	CHECK(other.slacktime_us == 7);
+
+	// capture of frame 0 completes: detect of frame 0 runs, frame 1's waits
+	sched_tick(sched_now_us + 4000);
+	dag_complete(r, &cap0, &released);
+	CHECK(released_only(released, &det0));
+	CHECK(det0.slacktime_us == deadline[0] + stage_lft_us[DETECT] - sched_now_us);
+	CHECK(!dag_submit(r, &trk0));
+	CHECK(dag_submit(r, &plan0));
+
+	// plan needs both detect and track
+	dag_complete(r, &det0, &released);
+	CHECK(released.empty());
+	dag_complete(r, &trk0, &released);
+	CHECK(released_only(released, &plan0));
+	CHECK(plan0.slacktime_us == deadline[0] - sched_now_us);
+	dag_complete(r, &plan0, &released);
+	dag_complete(r, &other, &released);
+	CHECK(released.empty());
+
+	// Past its deadline, a stage has no slack left
+	sched_tick(deadline[1] + 1);
+	dag_complete(r, &cap1, &released);
+	CHECK(released_only(released, &det1));
+	CHECK(det1.slacktime_us == 0);
+
+	// Leaving hands back what is still held and frees the slot
+	job_t det2 = make_job(pid, "detect", 1);
+	CHECK(dag_submit(r, &det2));
+	mid_dag_leave(slot);
+	dag_process(r, &released, &pids);
+	CHECK(released_only(released, &det2));
+	CHECK(r->dag[slot].status == DAG_FREE);
+	CHECK(mid_dag_frame(slot, 100000) == -1);
+	job_t det3 = make_job(pid, "detect", 1);
+	CHECK(!dag_submit(r, &det3));
+	CHECK(det3.slacktime_us == 1);
+}
+
+/* What a restarted mid has: the region, none of mid_dag.cpp's state */
+static void restart_mid()
+{
+	for (int i = 0; i < MID_DAG_MAX; i++) dag_pipes[i].active = false;
+	dag_stage_of.clear();
+}
+
+static void test_restart(mid_dag_region_t *r)
+{
+	std::vector<job_t*> released;
+	std::vector<pid_t> pids;
+	pid_t pid = getpid();
+
+	int slot = declare_pipeline();
+	dag_process(r, &released, &pids);
+	CHECK(mid_dag_frame(slot, 100000) == 0);
+	sched_tick(mid_stats_now_ns() / 1000);
+	const int64_t *deadline = r->dag[slot].deadline_us;
+
+	// mid restarts in frame 0, after capture completed
+	job_t cap0 = make_job(pid, "capture", 1), det0 = make_job(pid, "detect", 1);
+	CHECK(!dag_submit(r, &cap0));
+	dag_complete(r, &cap0, &released);
+	CHECK(!dag_submit(r, &det0));
+	restart_mid();
+	pids.clear();
+	dag_process(r, &released, &pids);
+	CHECK(pids.size() == 1 && pids[0] == pid);
+	CHECK(released.empty());
+
+	// The pipeline goes on in frame 0: track may run, plan waits for both
+	job_t trk0 = make_job(pid, "track", 1), plan0 = make_job(pid, "plan", 1);
+	CHECK(!dag_submit(r, &trk0));
+	CHECK(trk0.slacktime_us == deadline[0] + stage_lft_us[TRACK] - sched_now_us);
+	CHECK(dag_submit(r, &plan0));
+	dag_complete(r, &det0, &released);
+	CHECK(released.empty());
+	dag_complete(r, &trk0, &released);
+	CHECK(released_only(released, &plan0));
+	CHECK(mid_dag_frame(slot, 100000) == 1);
+
+	dag_drop_pid(r, pid, &released);
+	CHECK(r->dag[slot].status == DAG_FREE);
+}
+
+static void test_drop(mid_dag_region_t *r)
+{
+	std::vector<job_t*> released;
+	std::vector<pid_t> pids;
+	pid_t pid = getpid();
+
+	int slot = declare_pipeline();
+	dag_process(r, &released, &pids);
+	job_t plan = make_job(pid, "plan", 1);
+	CHECK(dag_submit(r, &plan));
+
+	// The same stages declared twice by one process are rejected
+	int dup = declare_pipeline();
+	CHECK(dup >= 0 && dup != slot);
+	dag_process(r, &released, &pids);
+	CHECK(r->dag[dup].status == DAG_FREE);
+
+	// A dead client's held jobs are handed back to be destroyed
+	dag_drop_pid(r, pid + 1, &released);
+	CHECK(released.empty());
+	dag_drop_pid(r, pid, &released);
+	CHECK(released_only(released, &plan));
+	CHECK(r->dag[slot].status == DAG_FREE);
+}
+
+static void test_invalid(mid_dag_region_t *r)
+{
+	std::vector<job_t*> released;
+	std::vector<pid_t> pids;
+	mid_dag_stage_t st[2];
+	memset(st, 0, sizeof(st));
+	strcpy(st[0].name, "a");
+	strcpy(st[1].name, "b");
+
+	// A stage can only follow stages declared before it
+	st[0].preds = 1u << 1;
+	CHECK(mid_dag_declare(st, 2) == -1);
+	st[0].preds = 0;
+	strcpy(st[1].name, "a");
+	CHECK(mid_dag_declare(st, 2) == -1);
+	CHECK(mid_dag_declare(st, 0) == -1);
+
+	// mid checks again what a client wrote by hand
+	mid_dag_decl_t *d = &(r->dag[0]);
+	d->pid = getpid();
+	d->n_stages = 2;
+	memcpy(d->stage, st, sizeof(st));
+	d->status = DAG_ACTIVE;
+	dag_process(r, &released, &pids);
+	CHECK(pids.empty());
+	CHECK(d->status == DAG_FREE);
+}
+
+int main()
+{
+	int fd;
+	mid_dag_region_t *r;
+	if (init_mid_dag(&fd, &r, true) < 0) return 1;
+	close(fd);
+
+	test_pipeline(r);
+	test_restart(r);
+	test_drop(r);
+	test_invalid(r);
+
+	shm_unlink(MID_DAG_NAME);
+	if (failures) {
+		fprintf(stderr, "FAIL: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("PASS: stage graphs, critical path slack, leave and drop\n");
+	return 0;
+}
@@ -0,0 +1,223 @@
+/*
+ * test_failover.cpp: GPU capacity and priority for promoted replicas
+ *
+ * Drives mid_sched.cpp in-process with a stub FT manager that reports some
+ * pids as replicas that took over a failed main. A held reservation must
+ * stay free of other jobs until its group's promoted replica is admitted,
+ * fifo jobs run before it included, a
+ * borrowable one must make its borrower yield, and a promoted replica's
+ * jobs must go first until one completes by its deadline.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "../mid_sched.cpp"
+#include "test_sched.h"
+
+#define TEST_GPU_MEM_B (1024ULL << 20)
+#define MB (1ULL << 20)
+
+enum {PID_NORMAL = 1, PID_OTHER = 2, PID_WHOLE = 3, PID_HELD = 9, PID_BORROW = 10, PID_NO_RESERVE = 11};
+
+/* What ft_promoted_replica answers once the replicas took over */
+static bool on_failover(pid_t pid, int *group)
+{
+	switch (pid) {
+	case PID_HELD: *group = 3; return true;
+	case PID_BORROW: *group = 4; return true;
+	case PID_NO_RESERVE: *group = 5; return true;
+	default: return false;
+	}
+}
+
+static void test_reserves()
+{
+	init_mid_sched(TEST_GPU_MEM_B);
+	CHECK(load_sched_reserves("3:300,4:300:borrow") == 2);
+	CHECK(sched_reserved_mem_b == 300 * MB);
+	CHECK(load_sched_reserves("3x") == -1);
+	// Held reservations can't take more than half of the GPU
+	CHECK(sched_set_reserve(7, 300 * MB, false) == -1);
+	CHECK(sched_set_reserve(7, 200 * MB, false) == 0);
+	CHECK(sched_set_reserve(7, 0, false) == 0);
+	CHECK(sched_reserved_mem_b == 300 * MB);
+}
+
+static void test_held()
+{
+	init_mid_sched(TEST_GPU_MEM_B);
+	set_sched_policy("edf");
+	sched_set_failover(on_failover);
+	admitted.clear();
+	int64_t now = 1000000;
+	sched_tick(now);
+
+	// Group 3's 300 MB stay free: a job that needs them waits
+	job_t big = make_job(PID_NORMAL, "detect", 100000, 800 * MB);
+	sched_enqueue(&big);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 0);
+	pq_jobs.pop();		// its client gave up
+	job_t fits = make_job(PID_NORMAL, "detect", 100000, 600 * MB);
+	sched_enqueue(&fits);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 1);
+	CHECK(gpu_memory_available == 424 * MB);
+
+	// Its promoted replica gets them, ahead of a job due earlier
+	job_t other = make_job(PID_OTHER, "plan", 1000, 200 * MB);
+	job_t replica = make_job(PID_HELD, "detect", 100000, 300 * MB);
+	sched_enqueue(&other);
+	sched_enqueue(&replica);
+	CHECK(sched_reserved_mem_b == 300 * MB);
+	CHECK(sched_boosted(PID_HELD));
+	CHECK(!sched_boosted(PID_OTHER));
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 1);
+	CHECK(admitted.size() == 2 && admitted[1] == &replica);
+	CHECK(gpu_memory_available == 124 * MB);
+	CHECK(sched_reserved_mem_b == 0);
+
+	// It caught up once its job ends by its deadline
+	sched_promoted_t p;
+	CHECK(sched_promoted_of(PID_HELD, &p) && p.group == 3 && p.frames == 0);
+	sched_tick(now += 5000);
+	CHECK(complete(&replica) == &replica);
+	CHECK(sched_promoted_of(PID_HELD, &p) && p.frames == 1 && !p.boosted);
+	CHECK(!sched_boosted(PID_HELD));
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 1);
+	CHECK(admitted.back() == &other);
+
+	// Once it exits, the reservation is kept for the next takeover
+	sched_failover_drop_pid(PID_HELD);
+	CHECK(!sched_promoted_of(PID_HELD, &p));
+	CHECK(sched_reserved_mem_b == 300 * MB);
+	CHECK(complete(&fits) == &fits);
+	CHECK(complete(&other) == &other);
+	CHECK(gpu_memory_available == TEST_GPU_MEM_B);
+}
+
+/* A whole-GPU job runs beside a held reservation, not into it */
+static void test_whole_gpu()
+{
+	init_mid_sched(TEST_GPU_MEM_B);
+	set_sched_policy("edf");
+	sched_set_failover(on_failover);
+	CHECK(sched_set_reserve(3, 300 * MB, false) == 0);
+	admitted.clear();
+	int64_t now = 1000000;
+	sched_tick(now);
+
+	// It doesn't hold up the fifo head while the reservation is unclaimed
+	job_t whole = make_job(PID_WHOLE, "train", 0, 0);
+	whole.noslack_flag = true;
+	sched_enqueue(&whole);
+	bool wait = false;
+	CHECK(sched_run_fifo(&wait, on_admitted, on_aborted) == 1 && !wait);
+	CHECK(gpu_memory_available == 300 * MB);
+
+	// The promoted replica still gets the reservation
+	job_t replica = make_job(PID_HELD, "detect", 100000, 200 * MB);
+	sched_enqueue(&replica);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 1);
+	CHECK(admitted.back() == &replica);
+	CHECK(gpu_memory_available == 100 * MB);
+	CHECK(complete(&whole) == &whole);
+	CHECK(complete(&replica) == &replica);
+	CHECK(gpu_memory_available == TEST_GPU_MEM_B);
+	sched_failover_drop_pid(PID_HELD);
+}
+
+/* The reservation waits for the replica, fifo jobs run first can't take it */
+static void test_fifo_first()
+{
+	init_mid_sched(TEST_GPU_MEM_B);
+	set_sched_policy("edf");
+	sched_set_failover(on_failover);
+	CHECK(sched_set_reserve(3, 300 * MB, false) == 0);
+	admitted.clear();
+	sched_tick(1000000);
+
+	job_t before = make_job(PID_NORMAL, "detect", 100000, 600 * MB);
+	sched_enqueue(&before);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 1);
+
+	// Queued in the same period, as run_period sees them
+	job_t replica = make_job(PID_HELD, "detect", 100000, 300 * MB);
+	job_t noslack = make_job(PID_OTHER, "plan", 0, 200 * MB);
+	noslack.noslack_flag = true;
+	sched_enqueue(&replica);
+	sched_enqueue(&noslack);
+	bool wait = false;
+	CHECK(sched_run_fifo(&wait, on_admitted, on_aborted) == 0 && wait);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 1);
+	CHECK(admitted.back() == &replica);
+	CHECK(gpu_memory_available == 124 * MB);
+
+	CHECK(complete(&before) == &before);
+	wait = false;
+	CHECK(sched_run_fifo(&wait, on_admitted, on_aborted) == 1);
+	CHECK(admitted.back() == &noslack);
+	CHECK(complete(&replica) == &replica);
+	CHECK(complete(&noslack) == &noslack);
+	CHECK(gpu_memory_available == TEST_GPU_MEM_B);
+	sched_failover_drop_pid(PID_HELD);
+}
+
+static void test_borrowed()
+{
+	init_mid_sched(TEST_GPU_MEM_B);
+	set_sched_policy("edf");
+	sched_set_failover(on_failover);
+	sched_set_preempt(on_preempt);
+	CHECK(sched_set_reserve(3, 0, false) == 0);
+	CHECK(sched_reserved_mem_b == 0);
+	admitted.clear();
+	n_preempted = 0;
+	int64_t now = 1000000;
+	sched_tick(now);
+
+	// Group 4's reservation is borrowed by a job with plenty of slack
+	job_t borrower = make_job(PID_NORMAL, "train", 10000000, 900 * MB);
+	sched_enqueue(&borrower);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 1);
+
+	// The promoted replica, not due for long, still makes it yield
+	job_t replica = make_job(PID_BORROW, "detect", 1000000, 300 * MB);
+	sched_enqueue(&replica);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 0);
+	CHECK(n_preempted == 1 && last_preempted == &borrower);
+	CHECK(complete(&borrower) == &borrower);
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 1);
+	CHECK(admitted.back() == &replica);
+	CHECK(complete(&replica) == &replica);
+
+	// A boost ends after SCHED_BOOST_MAX_US even if it never caught up
+	job_t late = make_job(PID_NO_RESERVE, "detect", 1000, 100 * MB);
+	sched_enqueue(&late);
+	CHECK(sched_boosted(PID_NO_RESERVE));
+	sched_tick(now += SCHED_BOOST_MAX_US);
+	CHECK(!sched_boosted(PID_NO_RESERVE));
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 1);
+	CHECK(complete(&late) == &late);
+
+	// Without a FT manager nobody is promoted
+	sched_set_failover(NULL);
+	sched_set_preempt(NULL);
+	init_mid_sched(TEST_GPU_MEM_B);
+	job_t plain = make_job(PID_BORROW, "detect", 1000, 100 * MB);
+	sched_enqueue(&plain);
+	CHECK(!sched_boosted(PID_BORROW));
+}
+
+int main()
+{
+	test_reserves();
+	test_held();
+	test_whole_gpu();
+	test_fifo_first();
+	test_borrowed();
+
+	if (failures) {
+		fprintf(stderr, "FAIL: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("PASS: promoted replicas get their reservation and go first until they catch up\n");
+	return 0;
+}
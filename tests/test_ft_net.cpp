@@ -0,0 +1,389 @@
+/*
+ * test_ft_net.cpp: loopback harness for the FT network transport
+ *
+ * Starts several ft_net instances on 127.0.0.1, one per simulated node.
+ * Node k runs the main of group k and beats it every 1 ms. Every node copies
+ * the remote beats it receives and checks them with ft_hb_missed, the same
+ * check ft_hb_thread uses. Node 0 is then stopped without a LEAVE (a node
+ * crash) and every other node must detect group 0, and only group 0.
+ *
+ * A node beating every group must keep its packets within one MTU, and a
+ * node must accept a restarted peer, seen by its new boot id, even when
+ * the peer's JOIN was lost.
+ *
+ * Then runs the FT manager's own hooks (ft_utils_server.cpp) against one
+ * more node: that node's main registers and beats, the node crashes, the
+ * local ft_hb_thread must wake the sleeping replica, publish its heartbeat
+ * to the node once it is back, and kill the replica when the main
+ * registers again. It re-creates ft_data, do not run it next to a live mid.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include "../ft_utils_server.cpp"
+
+#define TEST_NODES 3
+#define TEST_BASE_PORT 19100
+#define TEST_SERVER_PORT (TEST_BASE_PORT + TEST_NODES)
+#define TEST_REMOTE_PORT (TEST_BASE_PORT + TEST_NODES + 1)
+#define TEST_RAW_PORT (TEST_BASE_PORT + TEST_NODES + 2)
+#define TEST_GROUP 5
+#define TEST_REPLICA_NAME "test_ft_net_replica"
+
+typedef struct test_node {
+	ft_net_t net;
+	volatile unsigned long long beat;                  // own group's heartbeat
+	volatile unsigned long long remote[FT_HB_DATA_MAX_DATA];
+	volatile int remote_type[FT_HB_DATA_MAX_DATA];
+	ft_hb_monitor_t mon[FT_HB_DATA_MAX_DATA];
+	int detected[FT_HB_DATA_MAX_DATA];
+	int index;
+} test_node_t;
+
+static test_node_t nodes[TEST_NODES];
+
+// Checks of test_server, which counts failures in its local failed
+#define SERVER_CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failed = 1; \
+	} \
+} while (0)
+
+int test_collect(ft_net_t *net, ft_net_entry_t *out, int max)
+{
+	test_node_t *n = (test_node_t *)net->ctx;
+	if (max < 1) return 0;
+	out[0].index = n->index;
+	out[0].type = MAIN;
+	out[0].pid = getpid();
+	out[0].beat = n->beat;
+	return 1;
+}
+
+void test_deliver(ft_net_t *net, uint32_t node_id, const ft_net_entry_t *e)
+{
+	test_node_t *n = (test_node_t *)net->ctx;
+	n->remote[e->index] = e->beat;
+	n->remote_type[e->index] = e->type;
+}
+
+int test_collect_all(ft_net_t *net, ft_net_entry_t *out, int max)
+{
+	int i;
+	for (i = 0; i < max; i++) {
+		out[i].index = i;
+		out[i].type = MAIN;
+		out[i].pid = getpid();
+		out[i].beat = i + 1;
+	}
+	return max;
+}
+
+/* A plain UDP socket standing in for a peer, to see or forge raw packets */
+static int raw_socket(int port)
+{
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) return -1;
+	struct timeval tv = {0, 100000};
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return sock;
+}
+
+static int test_crash()
+{
+	int i, k, ms;
+	char peers[256];
+
+	/* Start every node with all other nodes as peers */
+	for (i = 0; i < TEST_NODES; i++) {
+		test_node_t *n = &nodes[i];
+		memset(n, 0, sizeof(*n));
+		n->index = i;
+
+		peers[0] = '\0';
+		for (k = 0; k < TEST_NODES; k++) {
+			if (k == i) continue;
+			sprintf(peers + strlen(peers), "%s127.0.0.1:%d",
+				peers[0] ? "," : "", TEST_BASE_PORT + k);
+		}
+		if (ft_net_parse_peers(&n->net, peers) != TEST_NODES - 1) {
+			fprintf(stderr, "FAIL: could not parse peers %s\n", peers);
+			return 1;
+		}
+		n->net.collect = test_collect;
+		n->net.deliver = test_deliver;
+		n->net.ctx = n;
+		if (ft_net_start(&n->net, i, TEST_BASE_PORT + i) < 0) {
+			fprintf(stderr, "FAIL: could not start node %d\n", i);
+			return 1;
+		}
+	}
+
+	/* Beat and check every 1 ms; crash node 0 after 200 ms */
+	int crash_ms = 200, detect_ms = -1;
+	bool alive0 = true;
+	for (ms = 0; ms < 1000; ms++) {
+		for (i = 0; i < TEST_NODES; i++) {
+			if (i == 0 && !alive0) continue;
+			nodes[i].beat = nodes[i].beat > 100 ? 1 : nodes[i].beat + 1;
+		}
+		if (ms == crash_ms) {
+			ft_net_stop(&nodes[0].net, false);
+			alive0 = false;
+		}
+		for (i = 1; i < TEST_NODES; i++) {
+			for (k = 0; k < TEST_NODES; k++) {
+				if (k == i) continue;
+				if (ft_hb_missed(&nodes[i].mon[k], nodes[i].remote[k])) {
+					nodes[i].detected[k]++;
+					if (k == 0 && detect_ms < 0) detect_ms = ms;
+				}
+			}
+		}
+		usleep(1000);
+	}
+
+	for (i = 1; i < TEST_NODES; i++) ft_net_stop(&nodes[i].net, true);
+
+	/* Check results */
+	int failed = 0;
+	for (i = 1; i < TEST_NODES; i++) {
+		for (k = 0; k < TEST_NODES; k++) {
+			if (k == i) continue;
+			if (k == 0 && nodes[i].detected[k] == 0) {
+				fprintf(stderr, "FAIL: node %d missed the crash of node 0\n", i);
+				failed = 1;
+			}
+			if (k != 0 && nodes[i].detected[k] != 0) {
+				fprintf(stderr, "FAIL: node %d falsely detected group %d\n", i, k);
+				failed = 1;
+			}
+		}
+	}
+	if (!failed)
+		printf("PASS: node 0 crash detected after %d ms\n", detect_ms - crash_ms);
+	return failed;
+}
+
+/* A node running the main of TEST_GROUP, peer of the FT manager */
+static int start_remote(test_node_t *n)
+{
+	char peers[64];
+	memset(n, 0, sizeof(*n));
+	n->index = TEST_GROUP;
+	sprintf(peers, "127.0.0.1:%d", TEST_SERVER_PORT);
+	if (ft_net_parse_peers(&n->net, peers) != 1) return -1;
+	n->net.collect = test_collect;
+	n->net.deliver = test_deliver;
+	n->net.ctx = n;
+	return ft_net_start(&n->net, 100, TEST_REMOTE_PORT);
+}
+
+static int test_server()
+{
+	int fd, ms, status, failed = 0;
+	char peers[64];
+	static int index = TEST_GROUP;
+	static test_node_t remote;
+	pthread_t hb;
+
+	/* The FT manager's state, as launch_ft_man leaves it */
+	pthread_mutex_init(&lock, NULL);
+	if (init_ft_data_shard(&fd, &FT_shards[0], true, 0) < 0) return 1;
+	close(fd);
+	FT_data = FT_shards[0];
+
+	/* A local replica of the remote main, sleeping until it takes over */
+	pid_t replica_pid = fork();
+	if (replica_pid == 0) {
+		pause();
+		_exit(0);
+	}
+	ft_job_t *r;
+	if (get_ft_job(TEST_REPLICA_NAME, &r) < 0) return 1;
+	memset(r, 0, sizeof(*r));
+	sem_init(&(r->client_wake), 1, 0);
+	strcpy(r->job_name, TEST_REPLICA_NAME);
+	r->pid = replica_pid;
+	r->tid = replica_pid;
+	r->num = TEST_GROUP;
+	r->req_type = REPLICA;
+	sleeping_ft_jobs["replica_5"] = r;
+
+	sprintf(peers, "127.0.0.1:%d", TEST_REMOTE_PORT);
+	if (ft_net_parse_peers(&FT_net, peers) != 1) return 1;
+	FT_net.collect = ft_net_collect;
+	FT_net.deliver = ft_net_deliver;
+	FT_net.on_register = ft_net_on_register;
+	FT_net.on_member = ft_net_on_member;
+	if (ft_net_start(&FT_net, 99, TEST_SERVER_PORT) < 0) return 1;
+	pthread_create(&hb, NULL, ft_hb_thread, &index);
+
+	/* The remote main registers and beats, then its node crashes */
+	if (start_remote(&remote) < 0) return 1;
+	ft_net_announce(&remote.net, MAIN, TEST_GROUP, 4242);
+	for (ms = 0; ms < 200; ms++) {
+		remote.beat = remote.beat > 100 ? 1 : remote.beat + 1;
+		usleep(1000);
+	}
+	SERVER_CHECK(FT_data->heart_beat[TEST_GROUP] != 0);
+	ft_net_stop(&remote.net, false);
+
+	/* The replica takes over */
+	for (ms = 0; ms < 500 && !r->client_exec_allowed; ms++) usleep(1000);
+	SERVER_CHECK(r->client_exec_allowed);
+	pthread_mutex_lock(&lock);
+	auto it_r = running_ft_jobs.find("replica_5");
+	SERVER_CHECK(it_r != running_ft_jobs.end() && it_r->second == r);
+	SERVER_CHECK(sleeping_ft_jobs.empty());
+	pthread_mutex_unlock(&lock);
+	SERVER_CHECK(r->is_executed == 1);
+	int group;
+	SERVER_CHECK(ft_promoted_replica(replica_pid, &group) && group == TEST_GROUP);
+
+	/* The replica beats now, the node learns it once it is back */
+	if (start_remote(&remote) < 0) return 1;
+	for (ms = 0; ms < 200 && remote.remote_type[TEST_GROUP] != REPLICA; ms++) {
+		FT_data->heart_beat[TEST_GROUP]++;
+		usleep(1000);
+	}
+	SERVER_CHECK(remote.remote_type[TEST_GROUP] == REPLICA);
+	SERVER_CHECK(remote.remote[TEST_GROUP] != 0);
+
+	/* The main registers again: the group is its own, the replica goes */
+	ft_net_announce(&remote.net, MAIN, TEST_GROUP, 4243);
+	pid_t gone = 0;
+	for (ms = 0; ms < 500 && gone == 0; ms++) {
+		gone = waitpid(replica_pid, &status, WNOHANG);
+		usleep(1000);
+	}
+	SERVER_CHECK(gone == replica_pid);
+	if (gone == replica_pid) {
+		SERVER_CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGINT);
+	} else {
+		kill(replica_pid, SIGKILL);
+		waitpid(replica_pid, NULL, 0);
+	}
+	pthread_mutex_lock(&lock);
+	SERVER_CHECK(running_ft_jobs.find("replica_5") == running_ft_jobs.end());
+	pthread_mutex_unlock(&lock);
+	SERVER_CHECK(!ft_promoted_replica(replica_pid, &group));
+
+	ft_net_stop(&remote.net, true);
+	ft_net_stop(&FT_net, true);
+	munmap(FT_data, FT_DATA_SIZE);
+	shm_unlink(FT_DATA_NAME);
+	if (!failed)
+		printf("PASS: remote main failed over to the local replica and reclaimed its group\n");
+	return failed;
+}
+
+static int test_mtu()
+{
+	int i, k, failed = 0;
+	char peers[64];
+	bool seen[FT_HB_DATA_MAX_DATA] = {false};
+	test_node_t *n = &nodes[0];
+
+	int sock = raw_socket(TEST_RAW_PORT);
+	if (sock < 0) return 1;
+	memset(n, 0, sizeof(*n));
+	sprintf(peers, "127.0.0.1:%d", TEST_RAW_PORT);
+	if (ft_net_parse_peers(&n->net, peers) != 1) return 1;
+	n->net.collect = test_collect_all;
+	n->net.ctx = n;
+	if (ft_net_start(&n->net, 0, TEST_BASE_PORT) < 0) return 1;
+
+	/* Every group is beaten, in packets no larger than the MTU allows */
+	ft_net_msg_t msg;
+	char buf[2 * sizeof(msg)];
+	for (k = 0; k < 50; k++) {
+		ssize_t len = recv(sock, buf, sizeof(buf), 0);
+		if (len < (ssize_t)FT_NET_MSG_HDR_SIZE) continue;
+		SERVER_CHECK(len <= FT_NET_MAX_PAYLOAD);
+		memcpy(&msg, buf, len < (ssize_t)sizeof(msg) ? len : sizeof(msg));
+		if (ntohs(msg.hdr.type) != FT_NET_HB) continue;
+		for (i = 0; i < ntohs(msg.hdr.count) && i < (int)FT_NET_MAX_ENTRIES; i++)
+			seen[ntohs(msg.entry[i].index) % FT_HB_DATA_MAX_DATA] = true;
+	}
+	for (i = 0; i < FT_HB_DATA_MAX_DATA; i++) SERVER_CHECK(seen[i]);
+
+	ft_net_stop(&n->net, true);
+	close(sock);
+	if (!failed)
+		printf("PASS: %d heartbeats sent in packets of at most %d bytes\n",
+			FT_HB_DATA_MAX_DATA, FT_NET_MAX_PAYLOAD);
+	return failed;
+}
+
+/* Forge a heartbeat of group index from the raw peer */
+static void raw_beat(int sock, uint64_t boot, uint64_t seq, int index,
+	unsigned long long beat)
+{
+	ft_net_msg_t msg;
+	struct sockaddr_in to;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	to.sin_port = htons(TEST_BASE_PORT);
+
+	msg.hdr.magic = htonl(FT_NET_MAGIC);
+	msg.hdr.type = htons(FT_NET_HB);
+	msg.hdr.count = htons(1);
+	msg.hdr.node_id = htonl(7);
+	msg.hdr.boot = htobe64(boot);
+	msg.hdr.seq = htobe64(seq);
+	ft_net_fill_entry(&(msg.entry[0]), index, MAIN, 4242, beat);
+	sendto(sock, &msg, FT_NET_MSG_HDR_SIZE + sizeof(ft_net_entry_t), 0,
+		(const struct sockaddr *)&to, sizeof(to));
+}
+
+static int test_restart()
+{
+	int ms, failed = 0;
+	char peers[64];
+	test_node_t *n = &nodes[0];
+
+	int sock = raw_socket(TEST_RAW_PORT);
+	if (sock < 0) return 1;
+	memset(n, 0, sizeof(*n));
+	sprintf(peers, "127.0.0.1:%d", TEST_RAW_PORT);
+	if (ft_net_parse_peers(&n->net, peers) != 1) return 1;
+	n->net.deliver = test_deliver;
+	n->net.ctx = n;
+	if (ft_net_start(&n->net, 0, TEST_BASE_PORT) < 0) return 1;
+
+	/* The peer has sent a while, a replayed old sequence number is dropped */
+	raw_beat(sock, 1, 1000, TEST_GROUP, 1);
+	for (ms = 0; ms < 100 && n->remote[TEST_GROUP] != 1; ms++) usleep(1000);
+	SERVER_CHECK(n->remote[TEST_GROUP] == 1);
+	raw_beat(sock, 1, 10, TEST_GROUP, 2);
+	usleep(20000);
+	SERVER_CHECK(n->remote[TEST_GROUP] == 1);
+
+	/* It restarts, its JOIN is lost: it counts from 1 under a new boot id */
+	raw_beat(sock, 2, 1, TEST_GROUP, 3);
+	for (ms = 0; ms < 100 && n->remote[TEST_GROUP] != 3; ms++) usleep(1000);
+	SERVER_CHECK(n->remote[TEST_GROUP] == 3);
+
+	ft_net_stop(&n->net, true);
+	close(sock);
+	if (!failed)
+		printf("PASS: a restarted peer is heard without its JOIN\n");
+	return failed;
+}
+
+int main()
+{
+	int failed = test_crash();
+	failed |= test_mtu();
+	failed |= test_restart();
+	failed |= test_server();
+	return failed;
+}
@@ -0,0 +1,205 @@
+/*
+ * test_ft_robust.c: stress test for the robust requests_q_lock
+ *
+ * Several submitter processes keep calling submit_ft_job on a shared ft-jobs
+ * list while a drain thread empties it the way ft_jobs_thread does. The
+ * parent SIGKILLs random submitters (respawning them), and now and then
+ * starts a process that dies holding the lock in the middle of writing a
+ * name. The drain thread must keep making progress and must never see a
+ * malformed name.
+ *
+ * Before that, a burst of TEST_BURST submissions with nobody draining must
+ * spill into the overflow segments and come back complete and in order.
+ */
+#define _GNU_SOURCE
+#include <sys/wait.h>
+#include <stdlib.h>
+#include "../ft_utils_client.c"
+
+#define TEST_SUBMITTERS 4
+#define TEST_ROUNDS 100
+#define TEST_BURST (FT_JOBS_MAX_JOBS + 3 * FT_JOBS_SEG_JOBS + 50)
+#define TEST_SEG_BASE "test_ft_robust_jobs"
+
+static ft_jobs_t *fj;
+static volatile bool draining = true;
+static volatile unsigned long long drained = 0;
+static volatile unsigned long long bad_names = 0;
+
+/* take_ft_jobs callback, checks every name */
+void check_name(const char *name, void *arg)
+{
+	if (strncmp(name, "job_", 4) != 0) bad_names++;
+	else drained++;
+}
+
+void *drain_thread(void *arg)
+{
+	while (draining) {
+		if (robust_mutex_lock(&(fj->requests_q_lock), repair_ft_jobs, fj, true) == 0) {
+			(void) take_ft_jobs(fj, check_name, NULL);
+			pthread_mutex_unlock(&(fj->requests_q_lock));
+		}
+		usleep(SLEEP_MICROSECONDS);
+	}
+	return NULL;
+}
+
+pid_t spawn_submitter(int id)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		char name[JOB_MEM_NAME_MAX_LEN];
+		int k = 0;
+		if (freopen("/dev/null", "w", stdout) == NULL) _exit(1);
+		if (freopen("/dev/null", "w", stderr) == NULL) _exit(1);
+		while (1) {
+			sprintf(name, "job_%d_%d", id, k++);
+			submit_ft_job(fj, NULL, name);
+		}
+	}
+	return pid;
+}
+
+/* Take the lock, count a half written name, then get killed holding it */
+void die_holding_lock()
+{
+	int p[2];
+	char c;
+	if (pipe(p) < 0) return;
+
+	pid_t pid = fork();
+	if (pid == 0) {
+		pthread_mutex_lock(&(fj->requests_q_lock));
+		if (fj->total_count < FT_JOBS_MAX_JOBS) {
+			memset(fj->job_names[fj->total_count], 'x', JOB_MEM_NAME_MAX_LEN);
+			fj->total_count++;
+		}
+		if (write(p[1], "1", 1) < 0) _exit(1);
+		pause();
+		_exit(0);
+	}
+	if (read(p[0], &c, 1) < 0) perror("read");
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+	close(p[0]);
+	close(p[1]);
+}
+
+/* take_ft_jobs callback, names must come back as burst_0, burst_1, ... */
+void check_burst(const char *name, void *arg)
+{
+	int *next = (int *)arg;
+	char want[JOB_MEM_NAME_MAX_LEN];
+	sprintf(want, "burst_%d", *next);
+	if (strcmp(name, want) == 0) (*next)++;
+	else bad_names++;
+}
+
+/*
+ * Name: test_burst
+ * Function: TEST_BURST submissions by another process with no drain, then
+ *           one drain
+ * Return: 0 if every submission succeeded and was drained in order
+ */
+int test_burst()
+{
+	int status, next = 0;
+	pid_t pid = fork();
+	if (pid == 0) {
+		char name[JOB_MEM_NAME_MAX_LEN];
+		int k;
+		if (freopen("/dev/null", "w", stdout) == NULL) _exit(1);
+		for (k = 0; k < TEST_BURST; k++) {
+			sprintf(name, "burst_%d", k);
+			if (submit_ft_job(fj, NULL, name) != 0) _exit(1);
+		}
+		_exit(0);
+	}
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "FAIL: burst submitter could not queue %d jobs\n", TEST_BURST);
+		return -1;
+	}
+
+	pthread_mutex_lock(&(fj->requests_q_lock));
+	int n = take_ft_jobs(fj, check_burst, &next);
+	pthread_mutex_unlock(&(fj->requests_q_lock));
+	if (n != TEST_BURST || next != TEST_BURST || fj->fill_seg != 0) {
+		fprintf(stderr, "FAIL: burst drained %d jobs, %d in order, of %d\n", n, next, TEST_BURST);
+		return -1;
+	}
+	printf("PASS: burst of %d jobs over %d overflow segments\n", TEST_BURST, fj->n_segs);
+	fflush(stdout);  // not again in every forked submitter
+	return 0;
+}
+
+/* Remove the overflow segments the test created */
+void unlink_segments()
+{
+	char name[JOB_MEM_NAME_MAX_LEN + 16];
+	int k;
+	for (k = 1; k <= fj->n_segs; k++) {
+		sprintf(name, "%s_seg%d", TEST_SEG_BASE, k);
+		shm_unlink(name);
+	}
+}
+
+int main()
+{
+	int i, round, stalls = 0;
+	pid_t submitters[TEST_SUBMITTERS];
+	pthread_t drain;
+
+	fj = (ft_jobs_t *)mmap(NULL, FT_JOBS_SIZE, PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (fj == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	memset(fj, 0, FT_JOBS_SIZE);
+	init_robust_mutex(&(fj->requests_q_lock));
+	strcpy(fj->seg_base, TEST_SEG_BASE);
+
+	if (test_burst() < 0) {
+		unlink_segments();
+		return 1;
+	}
+
+	pthread_create(&drain, NULL, drain_thread, NULL);
+	for (i = 0; i < TEST_SUBMITTERS; i++) submitters[i] = spawn_submitter(i);
+
+	srand(getpid());
+	for (round = 0; round < TEST_ROUNDS; round++) {
+		usleep(1000 + rand() % 10000);
+
+		/* Kill a random submitter, most likely somewhere in submit_ft_job */
+		int victim = rand() % TEST_SUBMITTERS;
+		kill(submitters[victim], SIGKILL);
+		waitpid(submitters[victim], NULL, 0);
+		submitters[victim] = spawn_submitter(victim);
+
+		if (round % 10 == 0) die_holding_lock();
+
+		/* The drain thread must keep going */
+		unsigned long long before = drained;
+		usleep(20000);
+		if (drained == before) stalls++;
+	}
+
+	for (i = 0; i < TEST_SUBMITTERS; i++) {
+		kill(submitters[i], SIGKILL);
+		waitpid(submitters[i], NULL, 0);
+	}
+	draining = false;
+	pthread_join(drain, NULL);
+	unlink_segments();
+
+	if (stalls || bad_names || !drained) {
+		fprintf(stderr, "FAIL: %d stalls, %llu bad names, %llu drained\n",
+			stalls, bad_names, drained);
+		return 1;
+	}
+	printf("PASS: drained %llu jobs across %d kills\n", drained, TEST_ROUNDS);
+	return 0;
+}
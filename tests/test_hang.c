@@ -0,0 +1,143 @@
+/*
+ * test_hang.c: hung clients caught by their frame progress, not heartbeats
+ *
+ * Forks clients that beat with init_ft_hb and count frames with
+ * ft_progress, and watches them once per ms the way ft_hb_thread does.
+ * One client hangs after some frames while its heartbeat thread beats on:
+ * its progress deadline must expire, about TEST_DEADLINE_MS after its last
+ * frame, with no heartbeat miss, and it must be gone once killed with
+ * ft_kill_hung, its heartbeat with it. A client that keeps making frames,
+ * one that never counts frames and one that hangs without a deadline must
+ * never be reported. It re-creates ft_data, do not run it next to a live
+ * mid.
+ */
+#define _GNU_SOURCE
+#include <sys/wait.h>
+#include <stdlib.h>
+#include "../ft_utils_client.c"
+
+#define TEST_DEADLINE_MS 100
+#define TEST_FRAME_US 5000
+#define TEST_HANG_AFTER 40          // frames before the hung client hangs
+#define TEST_WATCH_MS 600
+
+enum {HANG, STEADY, NO_FRAMES, HANG_UNWATCHED, N_CLIENTS};
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+static unsigned long long now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* A client of group index, behaving as told, until killed */
+static pid_t spawn_client(int index)
+{
+	pid_t pid = fork();
+	if (pid != 0) return pid;
+
+	int k;
+	if (freopen("/dev/null", "w", stdout) == NULL) _exit(1);
+	init_ft_hb(index);
+	if (index != HANG_UNWATCHED && ft_progress_deadline(index, TEST_DEADLINE_MS) < 0) _exit(1);
+	for (k = 0; ; k++) {
+		usleep(TEST_FRAME_US);
+		if ((index == HANG || index == HANG_UNWATCHED) && k == TEST_HANG_AFTER) {
+			// Stuck, say in a kernel or on a lock; the heartbeat thread runs on
+			pause();
+		}
+		if (index != NO_FRAMES) ft_progress();
+	}
+	return 0;
+}
+
+int main()
+{
+	int fd, i;
+	ft_data_t *data;
+	pid_t pids[N_CLIENTS];
+	ft_hb_monitor_t hb[N_CLIENTS];
+	ft_progress_monitor_t prog[N_CLIENTS];
+	unsigned long long last_frame_ms[N_CLIENTS], hung_ms[N_CLIENTS];
+	int missed[N_CLIENTS], hung[N_CLIENTS];
+	int status;
+
+	if (init_ft_data_shard(&fd, &data, true, 0) < 0) return 1;
+	close(fd);
+	memset(hb, 0, sizeof(hb));
+	memset(prog, 0, sizeof(prog));
+	memset(missed, 0, sizeof(missed));
+	memset(hung, 0, sizeof(hung));
+
+	unsigned long long start = now_ms();
+	for (i = 0; i < N_CLIENTS; i++) {
+		pids[i] = spawn_client(i);
+		last_frame_ms[i] = start;
+		hung_ms[i] = 0;
+	}
+
+	/* What ft_hb_thread does for each group, every ms */
+	while (now_ms() - start < TEST_WATCH_MS) {
+		for (i = 0; i < N_CLIENTS; i++) {
+			unsigned long long frames = __atomic_load_n(&(data->progress[i]), __ATOMIC_RELAXED);
+			unsigned int deadline_ms = __atomic_load_n(&(data->progress_deadline_ms[i]),
+				__ATOMIC_RELAXED);
+			if (frames != prog[i].pre_progress) last_frame_ms[i] = now_ms();
+			if (ft_hb_missed(&(hb[i]), data->heart_beat[i])) missed[i]++;
+			if (ft_progress_missed(&(prog[i]), frames, deadline_ms)) {
+				if (hung[i]++ == 0) {
+					hung_ms[i] = now_ms();
+					// Killed as the replica takes over
+					CHECK(ft_kill_hung(pids[i]) == 0);
+				}
+			}
+		}
+		usleep(1000);
+	}
+
+	// The hung one is gone, and so is its heartbeat
+	CHECK(waitpid(pids[HANG], &status, WNOHANG) == pids[HANG]);
+	CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+	CHECK(missed[HANG] >= 1);
+
+	for (i = 0; i < N_CLIENTS; i++) {
+		if (i == HANG) continue;
+		kill(pids[i], SIGKILL);
+		waitpid(pids[i], NULL, 0);
+	}
+
+	// Every other client beat the whole time
+	for (i = 0; i < N_CLIENTS; i++) if (i != HANG) CHECK(missed[i] == 0);
+
+	// The hung one is caught once its deadline is over, not before
+	CHECK(data->progress[HANG] == TEST_HANG_AFTER);
+	CHECK(hung[HANG] >= 1);
+	CHECK(hung_ms[HANG] >= last_frame_ms[HANG] + TEST_DEADLINE_MS);
+	CHECK(hung_ms[HANG] <= last_frame_ms[HANG] + 3 * TEST_DEADLINE_MS);
+
+	// The others never are
+	CHECK(data->progress[STEADY] > TEST_HANG_AFTER);
+	CHECK(hung[STEADY] == 0);
+	CHECK(data->progress[NO_FRAMES] == 0);
+	CHECK(hung[NO_FRAMES] == 0);
+	CHECK(data->progress[HANG_UNWATCHED] == TEST_HANG_AFTER);
+	CHECK(hung[HANG_UNWATCHED] == 0);
+
+	munmap(data, FT_DATA_SIZE);
+	shm_unlink(FT_DATA_NAME);
+	if (failures) {
+		fprintf(stderr, "FAIL: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("PASS: hung client failed by its progress deadline and killed, heartbeat alone missed it\n");
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * test_hang_failover.cpp: a hung main is killed only once it is replaced
+ *
+ * Runs the FT manager's threads (ft_utils_server.cpp) in-process against
+ * forked clients of one group. The main sets a progress deadline and
+ * hangs after some frames while its heartbeat thread beats on: with no
+ * replica or spare it must be left running, however often its deadline
+ * expires; once a replica registers, the next expiry must wake the replica
+ * and only then kill the main. A heartbeat thread started over a deadline
+ * a client already set, as after a mid restart, must keep it. It
+ * re-creates ft_data and ft_jobs, do not run it next to a live mid.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include "../ft_utils_server.cpp"
+#include "../ft_utils_client.c"
+
+#define TEST_GROUP 0
+#define TEST_RESTART_GROUP 1
+#define TEST_DEADLINE_MS 100
+#define TEST_HANG_AFTER 20          // frames before the main hangs
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/* A main that hangs after TEST_HANG_AFTER frames, or a replica that waits */
+static pid_t start_client(const char *name)
+{
+	pid_t pid = fork();
+	if (pid != 0) return pid;
+
+	int k;
+	if (freopen("/dev/null", "w", stdout) == NULL) _exit(1);
+	if (ft_init_wait(getpid(), getpid(), name, TEST_GROUP) != 0) _exit(1);
+	if (strcmp(name, "main") == 0) {
+		if (ft_progress_deadline(TEST_GROUP, TEST_DEADLINE_MS) < 0) _exit(1);
+		for (k = 0; k < TEST_HANG_AFTER; k++) {
+			usleep(5000);
+			ft_progress();
+		}
+	}
+	for (;;) pause();
+}
+
+static pid_t running(const char *type)
+{
+	char key[JOB_MEM_TYPE_MAX_LEN];
+	sprintf(key, "%s_%d", type, TEST_GROUP);
+	pthread_mutex_lock(&lock);
+	auto it = running_ft_jobs.find(key);
+	pid_t pid = it == running_ft_jobs.end() ? 0 : it->second->pid;
+	pthread_mutex_unlock(&lock);
+	return pid;
+}
+
+static unsigned long long hangs()
+{
+	return mid_stat_get(&(STATS->group[TEST_GROUP].hangs));
+}
+
+int main()
+{
+	int fd, status;
+	static int index = TEST_GROUP;
+	static int restart_index = TEST_RESTART_GROUP;
+	ft_jobs_t *FJ;
+	pthread_t jobs, hb, hb_restart;
+
+	/* The FT manager, as launch_ft_man starts it */
+	setenv("FT_NUMA", "0", 1);
+	pthread_mutex_init(&lock, NULL);
+	if (init_mid_stats(&fd, &STATS, true) < 0) return 1;
+	close(fd);
+	if (init_ft_jobs(&fd, &FJ, true) < 0) return 1;
+	close(fd);
+	if (init_ft_shards(FJ, false) < 0) return 1;
+	pthread_create(&jobs, NULL, ft_jobs_thread, FJ);
+	pthread_create(&hb, NULL, ft_hb_thread, &index);
+
+	// A deadline set before the heartbeat thread starts survives it
+	FT_data->progress_deadline_ms[TEST_RESTART_GROUP] = TEST_DEADLINE_MS;
+	pthread_create(&hb_restart, NULL, ft_hb_thread, &restart_index);
+
+	/* With nothing to take over, the hung main is left running */
+	pid_t main_pid = start_client("main");
+	usleep(TEST_HANG_AFTER * 5000 + 4 * TEST_DEADLINE_MS * 1000);
+	CHECK(running("main") == main_pid);
+	CHECK(hangs() >= 2);
+	CHECK(waitpid(main_pid, &status, WNOHANG) == 0);
+	CHECK(FT_data->progress_deadline_ms[TEST_RESTART_GROUP] == TEST_DEADLINE_MS);
+
+	/* A replica registers: the next expiry wakes it, then kills the main */
+	pid_t replica = start_client("replica");
+	pid_t gone = 0;
+	for (int ms = 0; ms < 3 * TEST_DEADLINE_MS && gone == 0; ms++) {
+		gone = waitpid(main_pid, &status, WNOHANG);
+		usleep(1000);
+	}
+	CHECK(gone == main_pid && WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+	if (gone != main_pid) {
+		kill(main_pid, SIGKILL);
+		waitpid(main_pid, NULL, 0);
+	}
+	CHECK(running("replica") == replica);
+	CHECK(running("main") == 0);
+
+	kill(replica, SIGKILL);
+	waitpid(replica, NULL, 0);
+	ft_continue_flag = false;
+	pthread_join(jobs, NULL);
+	const char *names[] = {FT_DATA_NAME, FT_JOBS_NAME, MID_STATS_NAME};
+	for (const char *name : names) shm_unlink(name);
+
+	if (failures) {
+		fprintf(stderr, "FAIL: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("PASS: a hung main is killed once a replica takes over, not before\n");
+	return 0;
+}
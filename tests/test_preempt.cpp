@@ -0,0 +1,141 @@
+/*
+ * test_preempt.cpp: cooperative preemption of executing jobs
+ *
+ * Drives mid_sched.cpp in-process: an urgent pq job that can't get the GPU
+ * must ask the executing job with the latest deadline to yield, once, and
+ * get the GPU when that job ends. Then checks the yield requests through
+ * the "mid_yield" region as a client polls them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "../mid_sched.cpp"
+#include "../mid_yield.h"
+#include "test_sched.h"
+
+#define TEST_GPU_MEM_B (1ULL << 20)
+
+static void test_sched(const char *policy)
+{
+	init_mid_sched(TEST_GPU_MEM_B);
+	set_sched_policy(policy);
+	sched_set_preempt(on_preempt);
+	n_preempted = 0;
+	admitted.clear();
+	int64_t now = 1000000;
+	sched_tick(now);
+
+	// A long job with plenty of slack holds most of the GPU
+	job_t lng = make_job(1, "long", 10000000, TEST_GPU_MEM_B * 3 / 4);
+	sched_enqueue(&lng);
+	// The slack policy holds jobs back until they are within its threshold
+	while (sched_run_pq(on_admitted, on_aborted) == 0) sched_tick(++now);
+	CHECK(admitted.size() == 1);
+
+	// A job that isn't due yet waits without preempting
+	job_t later = make_job(2, "later", 100 * PREEMPT_SLACK_US, TEST_GPU_MEM_B / 2);
+	sched_enqueue(&later);
+	sched_run_pq(on_admitted, on_aborted);
+	CHECK(n_preempted == 0);
+
+	// An urgent one asks the long job to yield, once
+	job_t urgent = make_job(3, "urgent", PREEMPT_SLACK_US / 2, TEST_GPU_MEM_B / 2);
+	sched_enqueue(&urgent);
+	sched_run_pq(on_admitted, on_aborted);
+	CHECK(n_preempted == 1 && last_preempted == &lng);
+	CHECK(last_deadline_us > now + 100 * PREEMPT_SLACK_US);
+	sched_tick(++now);
+	sched_run_pq(on_admitted, on_aborted);
+	CHECK(n_preempted == 1);
+
+	// The long job yields, the urgent job runs before the one queued earlier
+	job_t end = lng;
+	CHECK(sched_complete(&end) == &lng);
+	sched_run_pq(on_admitted, on_aborted);
+	CHECK(admitted.size() == 2);
+	CHECK(std::find(executing_jobs.begin(), executing_jobs.end(), &urgent) != executing_jobs.end());
+
+	// Nothing left to preempt: the urgent job is due itself
+	job_t urgent2 = make_job(4, "urgent2", 0, TEST_GPU_MEM_B / 2);
+	sched_enqueue(&urgent2);
+	sched_tick(now += PREEMPT_TIMEOUT_US);
+	sched_run_pq(on_admitted, on_aborted);
+	CHECK(n_preempted == 1);
+}
+
+static void test_sched_timeout()
+{
+	init_mid_sched(TEST_GPU_MEM_B);
+	set_sched_policy("edf");
+	sched_set_preempt(on_preempt);
+	n_preempted = 0;
+	admitted.clear();
+	int64_t now = 1000000;
+	sched_tick(now);
+
+	job_t a = make_job(1, "a", 10000000, TEST_GPU_MEM_B / 2);
+	job_t b = make_job(2, "b", 20000000, TEST_GPU_MEM_B / 3);
+	sched_enqueue(&a);
+	sched_enqueue(&b);
+	sched_run_pq(on_admitted, on_aborted);
+	CHECK(admitted.size() == 2);
+
+	// b (latest deadline) is asked first; when it doesn't yield in time, a is
+	job_t urgent = make_job(3, "urgent", 0, TEST_GPU_MEM_B / 2);
+	sched_enqueue(&urgent);
+	sched_run_pq(on_admitted, on_aborted);
+	CHECK(n_preempted == 1 && last_preempted == &b);
+	sched_tick(now += PREEMPT_TIMEOUT_US / 2);
+	sched_run_pq(on_admitted, on_aborted);
+	CHECK(n_preempted == 1);
+	sched_tick(now += PREEMPT_TIMEOUT_US);
+	sched_run_pq(on_admitted, on_aborted);
+	CHECK(n_preempted == 2 && last_preempted == &a);
+	sched_tick(now += 2 * PREEMPT_TIMEOUT_US);
+	sched_run_pq(on_admitted, on_aborted);
+	CHECK(n_preempted == 2);
+}
+
+static void test_yield_region()
+{
+	int fd;
+	mid_yield_t *y;
+	int64_t deadline_us = 0;
+	CHECK(init_mid_yield(&fd, &y, true) == 0);
+
+	CHECK(!tag_job_should_yield(1, 1, "long", NULL));
+	CHECK(mid_yield_ask(y, 1, 1, "long", 1234) == 0);
+	CHECK(tag_job_should_yield(1, 1, "long", &deadline_us) && deadline_us == 1234);
+	CHECK(!tag_job_should_yield(1, 1, "short", NULL));
+	// Until mid clears it, the request stays
+	CHECK(tag_job_should_yield(1, 1, "long", NULL));
+	mid_yield_clear(y, 1, 1, "long");
+	CHECK(!tag_job_should_yield(1, 1, "long", NULL));
+	CHECK(y->used == 0);
+
+	// Polls skip the scan by thread, so this one pretends to be another tid last
+	CHECK(mid_yield_ask(y, 1, 1, "long", 1234) == 0);
+	CHECK(!tag_job_should_yield(1, 2, "long", NULL));
+	mid_yield_clear(y, 1, 1, "long");
+
+	CHECK(mid_yield_ask(y, 5, 5, "a", 1) == 0 && mid_yield_ask(y, 5, 6, "b", 1) == 0);
+	mid_yield_clear_pid(y, 5);
+	CHECK(y->used == 0 && !tag_job_should_yield(5, 6, "b", NULL));
+
+	munmap(y, MID_YIELD_SIZE);
+	close(fd);
+	shm_unlink(MID_YIELD_NAME);
+}
+
+int main(int argc, char **argv)
+{
+	test_sched("slack");
+	test_sched("edf");
+	test_sched_timeout();
+	test_yield_region();
+	if (failures) {
+		fprintf(stderr, "FAIL: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("PASS\n");
+	return 0;
+}
@@ -0,0 +1,238 @@
+/*
+ * test_reap.cpp: GPU memory of a dead client is admitted into at once
+ *
+ * Runs the server periods of mymid.cpp in-process. A forked client holds
+ * an executing reservation that leaves no room for a job queued behind it;
+ * once the client is SIGKILLed, the next period must reclaim its job and
+ * admit the queued one, and the memory must be all back once that job
+ * completes; a release that failed must be tried again the next period. A
+ * completion mid took in but had not handled yet when it crashed must
+ * still release its job after the restart, and the shm names of jobs that
+ * found the mid_state table full must still be unlinked. It re-creates the
+ * regions of mid, do not run it next to a live mid.
+ */
+#include <sys/wait.h>
+
+// The test drives the periods itself
+#define main mid_main
+#include "../mymid.cpp"
+#undef main
+
+#define TEST_JOB_MEM_B (600ULL << 20)
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/* What the drain of the requests queue does with a job a client submitted */
+static job_t *submit(const char *name, pid_t pid, bool completed)
+{
+	job_t *j;
+	if (get_shared_job_by_name(name, &j) < 0) return NULL;
+	memset(j, 0, sizeof(*j));
+	j->pid = pid;
+	j->tid = pid;
+	strcpy(j->job_name, "detect");
+	j->req_type = completed ? COMPLETED : QUEUED;
+	j->noslack_flag = true;
+	j->shareable_flag = true;
+	j->required_mem_b = TEST_JOB_MEM_B;
+	if (completed) {
+		completed_jobs.push(j);
+		mid_state_record_job(j, name, MID_Q_DONE);
+	} else {
+		watch_client(pid);
+		enqueue_ns[j] = mid_stats_now_ns();
+		mid_state_record_job(j, name, sched_enqueue(j));
+	}
+	return j;
+}
+
+static int init_regions()
+{
+	init_mid_sched(1ULL << 30);
+	shm_unlink(MID_STATE_NAME);
+	if (init_mid_stats(&STATS_fd, &STATS, true) < 0) return -1;
+	if (init_mid_tasks(&TASKS_fd, &TASKS, true) < 0) return -1;
+	if (init_mid_yield(&YIELD_fd, &YIELD, true) < 0) return -1;
+	if (init_mid_bell(&BELL_fd, &BELL, true) < 0) return -1;
+	if (init_mid_batch(&BATCH_fd, &BATCH, true) < 0) return -1;
+	if (init_mid_shed(&SHED_fd, &SHED, true) < 0) return -1;
+	if (init_mid_dag(&DAG_fd, &DAG, true) < 0) return -1;
+	return attach_mid_state() < 0 ? -1 : 0;
+}
+
+static void unlink_regions()
+{
+	const char *names[] = {MID_STATS_NAME, MID_TASKS_NAME, MID_YIELD_NAME, MID_BELL_NAME,
+		MID_BATCH_NAME, MID_SHED_NAME, MID_DAG_NAME, MID_STATE_NAME};
+	for (const char *name : names) shm_unlink(name);
+}
+
+static bool shm_exists(const char *name)
+{
+	int fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0) return false;
+	close(fd);
+	return true;
+}
+
+static int n_recorded()
+{
+	int i, n = 0;
+	for (i = 0; i < MID_STATE_MAX_JOBS; i++) n += MS->job[i].queue != MID_Q_FREE;
+	return n;
+}
+
+/* A release that failed is tried again, the client stays watched */
+static void test_retry()
+{
+	bool wait_for_complete = false;
+	pid_t client = fork();
+	if (client == 0) {
+		pause();
+		_exit(0);
+	}
+	job_t *held = submit("test_reap_retry", client, false);
+	run_period(&wait_for_complete);
+	CHECK(held && held->client_exec_allowed);
+	job_t *queued = submit("test_reap_retry_q", client, false);
+	CHECK(queued && enqueue_ns.count(queued));
+	run_period(&wait_for_complete);
+	CHECK(pq_jobs.size() + fifo_jobs.size() == 1);
+
+	// The bookkeeping of the job is off for a period, its release fails
+	admitted_job_t adm = admitted_jobs[held];
+	admitted_jobs.erase(held);
+	kill(client, SIGKILL);
+	waitpid(client, NULL, 0);
+	unsigned long long reclaimed = mid_stat_get(&(STATS->reclaimed));
+	run_period(&wait_for_complete);
+	CHECK(mid_stat_get(&(STATS->reclaimed)) == reclaimed);
+	CHECK(executing_jobs.size() == 1 && client_pidfds.count(client));
+	CHECK(pq_jobs.empty() && fifo_jobs.empty());
+	CHECK(enqueue_ns.empty());
+
+	admitted_jobs[held] = adm;
+	run_period(&wait_for_complete);
+	CHECK(mid_stat_get(&(STATS->reclaimed)) == reclaimed + 1);
+	CHECK(executing_jobs.empty() && !client_pidfds.count(client));
+	CHECK(gpu_memory_available == (1ULL << 30));
+}
+
+/* A mid crashed after taking the completion of an executing job */
+static void test_restart()
+{
+	bool wait_for_complete = false;
+	job_t *held = submit("test_reap_exec", getpid(), false);
+	run_period(&wait_for_complete);
+	CHECK(held && held->client_exec_allowed);
+	job_t *end = submit("test_reap_end", getpid(), true);
+	CHECK(end != NULL);
+	job_t *client_end;
+	CHECK(get_shared_job_by_name("test_reap_end", &client_end) == 0);
+	sem_init(&(client_end->client_wake), 1, 0);
+
+	// The next mid finds both in mid_state
+	init_mid_sched(1ULL << 30);
+	munmap(MS, MID_STATE_SIZE);
+	close(MS_fd);
+	CHECK(attach_mid_state() == 1);
+	CHECK(recover_sched_jobs() == 2);
+	CHECK(executing_jobs.size() == 1 && completed_jobs.size() == 1);
+	CHECK(gpu_memory_available == (1ULL << 30) - TEST_JOB_MEM_B);
+
+	// And releases the job, waking its client
+	run_period(&wait_for_complete);
+	int woken = 0;
+	sem_getvalue(&(client_end->client_wake), &woken);
+	CHECK(woken == 1);
+	CHECK(executing_jobs.empty());
+	CHECK(gpu_memory_available == (1ULL << 30));
+	CHECK(n_recorded() == 0);
+	CHECK(!shm_exists("test_reap_exec") && !shm_exists("test_reap_end"));
+	munmap(client_end, sizeof(job_t));
+}
+
+/* Jobs that didn't fit in mid_state are unlinked all the same */
+static void test_table_full()
+{
+	bool wait_for_complete = false;
+	std::vector<int> free_slots;
+	std::swap(mid_state_free, free_slots);
+	job_t *j = submit("test_reap_full", getpid(), false);
+	run_period(&wait_for_complete);
+	CHECK(j && j->client_exec_allowed);
+	CHECK(submit("test_reap_full_end", getpid(), true) != NULL);
+	run_period(&wait_for_complete);
+	std::swap(mid_state_free, free_slots);
+	CHECK(executing_jobs.empty());
+	CHECK(!shm_exists("test_reap_full") && !shm_exists("test_reap_full_end"));
+}
+
+/* A client SIGKILLed while its job holds the GPU */
+static void test_reap()
+{
+	bool wait_for_complete = false;
+
+	pid_t client = fork();
+	if (client == 0) {
+		pause();
+		_exit(0);
+	}
+
+	// The client's job holds the GPU, the next one doesn't fit beside it
+	job_t *held = submit("test_reap_held", client, false);
+	CHECK(held != NULL);
+	run_period(&wait_for_complete);
+	CHECK(held && held->client_exec_allowed);
+	CHECK(gpu_memory_available == (1ULL << 30) - TEST_JOB_MEM_B);
+
+	job_t *next = submit("test_reap_next", getpid(), false);
+	CHECK(next != NULL);
+	run_period(&wait_for_complete);
+	CHECK(wait_for_complete && fifo_jobs.size() == 1);
+	CHECK(executing_jobs.size() == 1);
+
+	// The period after the client died reclaims its job and admits the next
+	kill(client, SIGKILL);
+	waitpid(client, NULL, 0);
+	run_period(&wait_for_complete);
+	CHECK(mid_stat_get(&(STATS->reclaimed)) == 1);
+	CHECK(fifo_jobs.empty());
+	CHECK(executing_jobs.size() == 1 && executing_jobs.front() == next);
+	CHECK(next && next->client_exec_allowed);
+	CHECK(gpu_memory_available == (1ULL << 30) - TEST_JOB_MEM_B);
+
+	// And the memory is all back once that one completes
+	CHECK(submit("test_reap_done", getpid(), true) != NULL);
+	run_period(&wait_for_complete);
+	CHECK(executing_jobs.empty());
+	CHECK(gpu_memory_available == (1ULL << 30));
+}
+
+int main()
+{
+	if (init_regions() < 0) {
+		fprintf(stderr, "FAIL: can't create the regions of mid\n");
+		unlink_regions();
+		return 1;
+	}
+	test_reap();
+	test_retry();
+	test_restart();
+	test_table_full();
+
+	unlink_regions();
+	if (failures) {
+		fprintf(stderr, "FAIL: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("PASS: a dead client's memory is admitted into the next period, completions survive a restart\n");
+	return 0;
+}
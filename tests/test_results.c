@@ -0,0 +1,134 @@
+/*
+ * test_results.c: result slots read back whole while frames recycle them
+ *
+ * A main and a replica thread publish every frame of one group as fast as
+ * they can, so each slot is reused every FT_RESULT_SLOTS frames, while
+ * reader threads copy results back with ft_last_result and ft_read_result.
+ * Every result a reader gets must be exactly the one published for its
+ * frame: a copy torn by the next frame of the slot must come back as -1,
+ * never as data, and the newest frame must not be lost to an older
+ * writer still copying. Runs under FT_FIRST_WRITER and FT_MAJORITY; tears
+ * need the threads on more than one core. It re-creates ft_results, do not
+ * run it next to a live mid.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include "../ft_utils_client.c"
+
+#define TEST_GROUP 5
+#define TEST_FRAMES 200000
+#define TEST_READERS 2
+
+static int failures = 0;
+static volatile int writing;
+static unsigned long long n_read[TEST_READERS];
+static unsigned long long n_torn[TEST_READERS];
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/* Each frame has its own length and fill byte */
+static size_t frame_len(unsigned long long frame)
+{
+	return 64 + (frame * 131) % (FT_RESULT_MAX_BYTES - 64);
+}
+
+static void fill_frame(unsigned long long frame, char *buf)
+{
+	memset(buf, (int)(frame % 251) + 1, frame_len(frame));
+}
+
+static int whole(unsigned long long frame, const char *buf, int len)
+{
+	int i;
+	if ((size_t)len != frame_len(frame)) return 0;
+	for (i = 0; i < len; i++) {
+		if (buf[i] != (char)(frame % 251 + 1)) return 0;
+	}
+	return 1;
+}
+
+static void *voter(void *arg)
+{
+	int v = (int)(long)arg;
+	static __thread char buf[FT_RESULT_MAX_BYTES];
+	unsigned long long frame;
+	for (frame = 0; frame < TEST_FRAMES; frame++) {
+		fill_frame(frame, buf);
+		ft_publish_result(TEST_GROUP, v, frame, buf, frame_len(frame));
+	}
+	return NULL;
+}
+
+static void *reader(void *arg)
+{
+	int r = (int)(long)arg;
+	static __thread char buf[FT_RESULT_MAX_BYTES];
+	unsigned long long frame = 0;
+	while (writing) {
+		int len = ft_last_result(TEST_GROUP, &frame, buf, sizeof(buf));
+		// The second reader reads that frame again, by now maybe recycled
+		if (r && len > 0) len = ft_read_result(TEST_GROUP, frame, buf, sizeof(buf));
+		if (len > 0) {
+			n_read[r]++;
+			if (!whole(frame, buf, len)) n_torn[r]++;
+		}
+	}
+	return NULL;
+}
+
+static void run(enum ft_vote_policy policy)
+{
+	pthread_t voters[2], readers[TEST_READERS];
+	long i;
+
+	// Clear slots left by the previous run
+	int fd;
+	ft_results_t *fr;
+	CHECK(init_ft_results(&fd, &fr, true) == 0);
+	close(fd);
+	CHECK(ft_set_result_policy(TEST_GROUP, policy, 2) == 0);
+
+	memset(n_read, 0, sizeof(n_read));
+	memset(n_torn, 0, sizeof(n_torn));
+	writing = 1;
+	for (i = 0; i < TEST_READERS; i++) pthread_create(&readers[i], NULL, reader, (void *)i);
+	for (i = 0; i < 2; i++) pthread_create(&voters[i], NULL, voter, (void *)i);
+	for (i = 0; i < 2; i++) pthread_join(voters[i], NULL);
+	writing = 0;
+	for (i = 0; i < TEST_READERS; i++) pthread_join(readers[i], NULL);
+
+	for (i = 0; i < TEST_READERS; i++) {
+		CHECK(n_torn[i] == 0);
+		if (n_torn[i]) {
+			fprintf(stderr, "policy %d, reader %ld: %llu of %llu results torn\n",
+				policy, i, n_torn[i], n_read[i]);
+		}
+	}
+
+	// The newest frame is the last one published
+	char buf[FT_RESULT_MAX_BYTES];
+	unsigned long long frame;
+	int len = ft_last_result(TEST_GROUP, &frame, buf, sizeof(buf));
+	CHECK(frame == TEST_FRAMES - 1 && whole(frame, buf, len));
+	CHECK(ft_read_result(TEST_GROUP, frame - FT_RESULT_SLOTS, buf, sizeof(buf)) == -1);
+	CHECK(ft_read_result(TEST_GROUP, frame, buf, 1) == -1);
+}
+
+int main()
+{
+	run(FT_FIRST_WRITER);
+	run(FT_MAJORITY);
+	shm_unlink(FT_RESULTS_NAME);
+
+	if (failures) {
+		fprintf(stderr, "FAIL: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("PASS: results read back whole while their slots are reused\n");
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*
+	Fixture of the tests that drive mid_sched.cpp in-process.
+
+	Included after the scheduler source the test drives (mid_sched.cpp, or
+	mid_dag.cpp or mid_admit.cpp that include it), so a test keeps only its
+	scenarios.
+
+	Provides:
+	- CHECK / failures            --- a failed check is counted, the test goes on
+	- ft_active_replica           --- no active replicas, tests with a FT
+	                                  manager stub sched_set_failover instead
+	- make_job / complete         --- a queued job, and its completion
+	- on_admitted / on_aborted / on_preempt --- callbacks recording in
+	                                  admitted, n_preempted, last_preempted
+	                                  and last_deadline_us
+*/
+#ifndef TEST_SCHED_H
+#define TEST_SCHED_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/* No FT manager in these tests */
+bool ft_active_replica(pid_t pid, pid_t *main_pid)
+{
+	return false;
+}
+
+static std::vector<job_t*> admitted;
+static int n_preempted = 0;
+static job_t *last_preempted = NULL;
+static int64_t last_deadline_us = 0;
+
+static inline void on_admitted(job_t *j)
+{
+	admitted.push_back(j);
+}
+
+static inline void on_aborted(job_t *j)
+{
+}
+
+static inline void on_preempt(job_t *j, int64_t deadline_us)
+{
+	n_preempted++;
+	last_preempted = j;
+	last_deadline_us = deadline_us;
+}
+
+/* A shareable queued job, mem_b 0 asks for the whole GPU */
+static inline job_t make_job(pid_t pid, const char *name, int64_t slack_us, uint64_t mem_b = 0)
+{
+	job_t j;
+	memset(&j, 0, sizeof(j));
+	j.pid = pid;
+	j.tid = pid;
+	strcpy(j.job_name, name);
+	j.req_type = QUEUED;
+	j.slacktime_us = slack_us;
+	j.shareable_flag = true;
+	j.required_mem_b = mem_b;
+	return j;
+}
+
+/* The job's tag_job_end as mid sees it */
+static inline job_t *complete(job_t *j)
+{
+	job_t c = *j;
+	c.req_type = COMPLETED;
+	return sched_complete(&c);
+}
+
+#endif
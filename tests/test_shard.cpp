@@ -0,0 +1,143 @@
+/*
+ * test_shard.cpp: FT clients on a NUMA node other than 0
+ *
+ * Forces two shards with FT_NUMA=2 and runs the FT manager's threads
+ * (ft_utils_server.cpp) in-process against forked clients of one group.
+ * The main submits to the ft-jobs list of node 1 and beats in its
+ * heartbeat region: the drain thread of node 1 must pick it up, and
+ * ft_hb_thread must read its beats there, not miss them in node 0's. Once
+ * the main is killed, its replica on node 0 takes over; a new main that
+ * starts on node 0 must get the group back, with its beats read from node
+ * 0 this time. It re-creates ft_data and ft_jobs (and their _1 shards),
+ * do not run it next to a live mid.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include "../ft_utils_server.cpp"
+#include "../ft_utils_client.c"
+
+// Above the size of the running list, ft_jobs_thread must trigger it all the same
+#define TEST_GROUP 5
+#define TEST_BEAT_MS 300
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "FAIL: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+		failures++; \
+	} \
+} while (0)
+
+/* A client started on node, as submit_ft_request would find it there */
+static pid_t start_client(const char *name, int node)
+{
+	pid_t pid = fork();
+	if (pid != 0) return pid;
+
+	int fd;
+	if (init_ft_jobs_shard(&fd, &ft_jobs, false, node) < 0) _exit(1);
+	close(fd);
+	client_ft_node = node;
+	if (ft_init_wait(getpid(), getpid(), name, TEST_GROUP) != 0) _exit(1);
+	for (;;) pause();
+}
+
+/* Whether the list has the job of type (main or replica) of the group */
+static pid_t listed(std::unordered_map<std::string, ft_job_t*> &list, const char *type)
+{
+	char key[JOB_MEM_TYPE_MAX_LEN];
+	sprintf(key, "%s_%d", type, TEST_GROUP);
+	pthread_mutex_lock(&lock);
+	auto it = list.find(key);
+	pid_t pid = it == list.end() ? 0 : it->second->pid;
+	pthread_mutex_unlock(&lock);
+	return pid;
+}
+
+static unsigned long long misses()
+{
+	return mid_stat_get(&(STATS->group[TEST_GROUP].hb_misses));
+}
+
+static void wait_listed(std::unordered_map<std::string, ft_job_t*> &list, const char *type,
+	pid_t pid)
+{
+	for (int ms = 0; ms < 1000 && listed(list, type) != pid; ms++) usleep(1000);
+}
+
+int main()
+{
+	int fd, status;
+	static int index = TEST_GROUP;
+	static int node1 = 1;
+	ft_jobs_t *FJ;
+	pthread_t jobs, shard, hb;
+
+	/* The FT manager, as launch_ft_man starts it, over two shards */
+	setenv("FT_NUMA", "2", 1);
+	pthread_mutex_init(&lock, NULL);
+	if (init_mid_stats(&fd, &STATS, true) < 0) return 1;
+	close(fd);
+	if (init_ft_jobs(&fd, &FJ, true) < 0) return 1;
+	close(fd);
+	if (init_ft_shards(FJ, false) < 0) return 1;
+	CHECK(FT_n_shards == 2 && FJ->n_shards == 2);
+	pthread_create(&jobs, NULL, ft_jobs_thread, FJ);
+	pthread_create(&shard, NULL, ft_jobs_shard_thread, &node1);
+	pthread_create(&hb, NULL, ft_hb_thread, &index);
+
+	/* The replica sleeps on node 0, the main runs and beats on node 1 */
+	pid_t replica = start_client("replica", 0);
+	wait_listed(sleeping_ft_jobs, "replica", replica);
+	CHECK(listed(sleeping_ft_jobs, "replica") == replica);
+	pid_t main1 = start_client("main", 1);
+	wait_listed(running_ft_jobs, "main", main1);
+	CHECK(listed(running_ft_jobs, "main") == main1);
+	usleep(TEST_BEAT_MS * 1000);
+	CHECK(FT_data->hb_node[TEST_GROUP] == 1);
+	CHECK(FT_shards[1]->heart_beat[TEST_GROUP] != 0);
+	CHECK(misses() == 0);
+	CHECK(listed(sleeping_ft_jobs, "replica") == replica);
+
+	/* Its death is seen in node 1's shard, the replica takes over */
+	kill(main1, SIGKILL);
+	waitpid(main1, NULL, 0);
+	wait_listed(running_ft_jobs, "replica", replica);
+	CHECK(listed(running_ft_jobs, "replica") == replica);
+	CHECK(misses() == 1);
+
+	/* A new main on node 0 gets the group back and beats there */
+	pid_t main0 = start_client("main", 0);
+	pid_t gone = 0;
+	for (int ms = 0; ms < 1000 && gone == 0; ms++) {
+		gone = waitpid(replica, &status, WNOHANG);
+		usleep(1000);
+	}
+	CHECK(gone == replica && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT);
+	if (gone != replica) {
+		kill(replica, SIGKILL);
+		waitpid(replica, NULL, 0);
+	}
+	CHECK(listed(running_ft_jobs, "main") == main0);
+	usleep(TEST_BEAT_MS * 1000);
+	CHECK(FT_data->hb_node[TEST_GROUP] == 0);
+	CHECK(misses() == 1);
+
+	kill(main0, SIGKILL);
+	waitpid(main0, NULL, 0);
+	ft_continue_flag = false;
+	pthread_join(jobs, NULL);
+	pthread_join(shard, NULL);
+	const char *names[] = {FT_DATA_NAME, FT_DATA_NAME "_1", FT_JOBS_NAME, FT_JOBS_NAME "_1",
+		MID_STATS_NAME};
+	for (const char *name : names) shm_unlink(name);
+
+	if (failures) {
+		fprintf(stderr, "FAIL: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("PASS: clients of node 1 drained and watched in their shards, and followed to node 0\n");
+	return 0;
+}
@@ -0,0 +1,155 @@
+/*
+ * test_shed.cpp: stale jobs dropped instead of run late
+ *
+ * Drives mid_sched.cpp in-process with the staleness policies of the
+ * "mid_shed" region, as mymid.cpp does: of the pq jobs that can't meet
+ * their deadline any more, those that declared SHED_DROP must be shed and
+ * see SHED_DROPPED, the others stay queued and run late, and jobs in time
+ * are never touched. A restarted mid keeps the slots of live clients and
+ * frees those of clients that died meanwhile; a fresh mid frees them all.
+ * It re-creates mid_shed, do not run it next to a live mid.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include "../mid_sched.cpp"
+#include "../mid_shed.h"
+#include "test_sched.h"
+
+#define TEST_GPU_MEM_B (1ULL << 30)
+#define TEST_WCET_US 3000
+#define TEST_JOB_MEM_B (1ULL << 20)
+
+static mid_shed_t *shed_region;
+static std::vector<job_t*> shed;
+
+static void on_shed(job_t *j)
+{
+	shed.push_back(j);
+}
+
+/* What mymid.cpp does in stale_job */
+static bool on_stale(job_t *j, int64_t late_us)
+{
+	if (mid_shed_policy(shed_region, j->pid, j->tid, j->job_name) != SHED_DROP) return false;
+	mid_shed_post(shed_region, j->pid, j->tid, j->job_name, SHED_DROPPED, late_us);
+	return true;
+}
+
+/* The client side of tag_job_begin_stale, without waiting for mid */
+static mid_shed_slot_t *declare(pid_t pid, const char *name, int policy)
+{
+	mid_shed_slot_t *e = tag_job_shed_slot(pid, pid);
+	if (e == NULL) return NULL;
+	e->result = SHED_NONE;
+	strcpy(e->job_name, name);
+	e->policy = policy;
+	return e;
+}
+
+static void test_shed()
+{
+	init_mid_sched(TEST_GPU_MEM_B);
+	set_sched_policy("edf");
+	sched_tasks["detect"] = {0, 0, TEST_WCET_US, 0, 1};
+	int64_t now = 1000000;
+	sched_tick(now);
+
+	// Every job but the first one is due within its WCET
+	job_t fresh = make_job(1, "detect", 10000, TEST_JOB_MEM_B);
+	job_t drop = make_job(2, "detect", 2000, TEST_JOB_MEM_B);
+	job_t run = make_job(3, "detect", 1000, TEST_JOB_MEM_B);
+	job_t degrade = make_job(4, "detect", 2500, TEST_JOB_MEM_B);
+	job_t undeclared = make_job(5, "detect", 500, TEST_JOB_MEM_B);
+	mid_shed_slot_t *e_fresh = declare(1, "detect", SHED_DROP);
+	mid_shed_slot_t *e_drop = declare(2, "detect", SHED_DROP);
+	mid_shed_slot_t *e_run = declare(3, "detect", SHED_RUN);
+	mid_shed_slot_t *e_degrade = declare(4, "detect", SHED_DEGRADE);
+	CHECK(e_fresh && e_drop && e_run && e_degrade);
+	CHECK(e_fresh != e_drop);
+	sched_enqueue(&fresh);
+	sched_enqueue(&drop);
+	sched_enqueue(&run);
+	sched_enqueue(&degrade);
+	sched_enqueue(&undeclared);
+
+	// Without a staleness callback nothing is shed
+	int n_late;
+	CHECK(sched_shed(on_shed, &n_late) == 0);
+	CHECK(n_late == 0);
+
+	sched_set_stale(on_stale);
+	CHECK(sched_shed(on_shed, &n_late) == 1);
+	CHECK(shed.size() == 1 && shed[0] == &drop);
+	CHECK(n_late == 3);
+	CHECK(pq_jobs.size() == 4);
+	CHECK(e_drop->result == SHED_DROPPED && e_drop->late_us == TEST_WCET_US - 2000);
+	CHECK(e_fresh->result == SHED_NONE);
+
+	// The rest still run, in deadline order, the stale ones late
+	CHECK(sched_run_pq(on_admitted, on_aborted) == 4);
+	CHECK(pq_jobs.empty());
+	CHECK(sched_late_us(&fresh) <= 0);
+	CHECK(sched_late_us(&run) == TEST_WCET_US - 1000);
+	CHECK(sched_late_us(&degrade) == TEST_WCET_US - 2500);
+	CHECK(sched_late_us(&drop) == 0);
+
+	// Nothing is stale any more
+	CHECK(sched_shed(on_shed, &n_late) == 0 && n_late == 0);
+
+	// Slots of a dead client are freed for others
+	mid_shed_clear_pid(shed_region, 3);
+	CHECK(mid_shed_policy(shed_region, 3, 3, "detect") == SHED_RUN);
+	CHECK(e_run->pid == 0);
+	sched_set_stale(NULL);
+	sched_tasks.clear();
+}
+
+static void test_restart()
+{
+	int fd;
+	memset(shed_region, 0, MID_SHED_SIZE);   // not the pids of test_shed
+	pid_t dead = fork();
+	if (dead == 0) _exit(0);
+	waitpid(dead, NULL, 0);
+	mid_shed_slot_t *e_live = declare(getpid(), "track", SHED_DEGRADE);
+	client_shed_slot = NULL;
+	mid_shed_slot_t *e_dead = declare(dead, "track", SHED_DROP);
+	CHECK(e_live && e_dead && e_live != e_dead);
+
+	// A restarted mid maps the region as it is
+	mid_shed_t *restarted;
+	CHECK(init_mid_shed(&fd, &restarted, false) == 0);
+	close(fd);
+	CHECK(mid_shed_clear_dead(restarted) == 1);
+	CHECK(mid_shed_policy(restarted, getpid(), getpid(), "track") == SHED_DEGRADE);
+	CHECK(mid_shed_policy(restarted, dead, dead, "track") == SHED_RUN);
+	munmap(restarted, MID_SHED_SIZE);
+
+	// A fresh mid starts without any
+	CHECK(init_mid_shed(&fd, &restarted, true) == 0);
+	close(fd);
+	CHECK(mid_shed_policy(restarted, getpid(), getpid(), "track") == SHED_RUN);
+	CHECK(e_live->pid == 0);
+	munmap(restarted, MID_SHED_SIZE);
+}
+
+int main()
+{
+	int fd;
+	shm_unlink(MID_SHED_NAME);
+	if (init_mid_shed(&fd, &shed_region, true) < 0) return 1;
+	close(fd);
+
+	test_shed();
+	test_restart();
+
+	munmap(shed_region, MID_SHED_SIZE);
+	shm_unlink(MID_SHED_NAME);
+	if (failures) {
+		fprintf(stderr, "FAIL: %d checks failed\n", failures);
+		return 1;
+	}
+	printf("PASS: stale jobs shed by policy, the others run late\n");
+	return 0;
+}